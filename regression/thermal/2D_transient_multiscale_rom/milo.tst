@@ -0,0 +1,82 @@
+#!/usr/bin/env python2.7
+#-------------------------------------------------------------------------------
+
+import sys, os
+import subprocess as sp
+import string
+import shutil
+from milo_test_support import *
+from numpy import isnan, isinf
+
+# ==============================================================================
+# Parsing input
+
+# No reason to format the description as it will be reformatted by optparse.
+desc = '''thermal verification: compares the subgrid option in input.yaml
+          against the default code path in input_ref.yaml
+       '''
+
+its = milo_test_support(desc)
+
+print 'Because of the diff test on the log file, this test needs '
+print 'to run with "-v".  There is a buffering issue.'
+print 'Setting the verbosity to True.'
+its.opts.verbose = True
+
+#-------------------------------------------------------------------------------
+# Problem Parameters
+
+root = 'milo'   # root filename for test
+aeps = 1.0e-12     # absolute error tolerance
+reps = 5.0e-2     # relative error tolerance
+
+# These comments are for testing with the runtest.py utility.
+#TESTING active
+#TESTING -n 1
+#TESTING -k medium
+
+# ==============================================================================
+status = 0
+
+def read_errors(flog):
+  errs = []
+  for line in open(flog):
+    if "L2 norm of the error" in line:
+      w = line.split()
+      errs.append(float(w[9]))
+  return errs
+
+# ------------------------------
+if its.opts.preprocess:
+  if its.opts.verbose != 'none': print '---> Preprocessing %s' % (root)
+  status += its.call('echo "  No preprocessing, yet."')
+
+status += its.call('./run.sh')
+
+# ------------------------------
+if its.opts.verbose != 'none': print '---> Diff %s' % (root)
+ref_errs = read_errors('%s_ref.log' % (root))
+errs = read_errors('%s.log' % (root))
+if len(errs) == 0 or len(errs) != len(ref_errs):
+  status += 1
+  print '  Failure: found %i errors, expected %i.' % (len(errs), len(ref_errs))
+else:
+  for err, ref in zip(errs, ref_errs):
+    if isnan(err) or isinf(err) or abs(err-ref) > aeps + reps*abs(ref):
+      status += 1
+      print '  Failure: error %g differs from the reference %g.' % (err, ref)
+
+# ------------------------------
+if its.opts.graphics and not status:
+  if its.opts.verbose != 'none': print '---> Graphics %s' % (root)
+  status += its.call('echo "  No graphics, yet."')
+
+# ------------------------------
+if its.opts.clean and not status:
+  if its.opts.verbose != 'none': print '---> Clean %s' % (root)
+  status += its.call('rm -f %s.log %s_ref.log' % (root, root))
+
+# ==============================================================================
+if status == 0: print 'Success.'
+else:           print 'Failure.'
+sys.exit(status)
@@ -0,0 +1,11 @@
+#!/bin/bash
+#module purge
+#module load sierra-devel/gcc-4.9.3-openmpi-1.8.8
+#module list >& env.out
+. ~/.bashrc
+rm -rf subgrid_data
+mkdir subgrid_data
+mpiexec -n 4 ../../milo input_ref.yaml >& milo_ref.log
+rm -f subgrid_data/*
+mpiexec -n 4 ../../milo >& milo.log
+exit
@@ -27,7 +27,13 @@ Bart van Bloemen Waanders (bartv@sandia.gov)
 int main(int argc,char * argv[]) {
   
 #ifdef HAVE_MPI
-  Teuchos::GlobalMPISession mpiSession(&argc, &argv,0);
+  // MPI_THREAD_MULTIPLE is requested for the threaded subgrid solves (see threadSupport.hpp)
+  // Teuchos::GlobalMPISession cannot be used since it calls MPI_Init
+  int mpi_thread_support;
+  MPI_Init_thread(&argc, &argv, MPI_THREAD_MULTIPLE, &mpi_thread_support);
+  struct MPIFinalizer {
+    ~MPIFinalizer() { MPI_Finalize(); }
+  } mpiFinalizer;
   LA_MpiComm Comm(MPI_COMM_WORLD);
 #else
   EPIC_FAIL // MILO requires MPI for HostDevice
@@ -81,11 +87,20 @@ int main(int argc,char * argv[]) {
     verbosity = settings->get<int>("verbosity",0);
     profile = settings->get<bool>("profile",false);
     
+    // the threaded subgrid solves need the level of thread support requested above
+    if (settings->isSublist("Subgrid") && mpi_thread_support < MPI_THREAD_MULTIPLE &&
+        settings->sublist("Subgrid").get<int>("Number of threads",1) > 1) {
+      if (Comm.MyPID() == 0) {
+        cout << "**** Warning: MPI was not initialized with MPI_THREAD_MULTIPLE, so the subgrid problems will be solved by one thread" << endl;
+      }
+      settings->sublist("Subgrid").set("Number of threads",1);
+    }
+    
     ////////////////////////////////////////////////////////////////////////////////
     // split comm for SOL or multiscale runs
     ////////////////////////////////////////////////////////////////////////////////
     
-    SplitComm(settings, Comm, tcomm_LA, tcomm_S);
+    SplitComm splitcomm(settings, Comm, tcomm_LA, tcomm_S);
     
     ////////////////////////////////////////////////////////////////////////////////
     // Create the mesh
@@ -148,6 +163,10 @@ int main(int argc,char * argv[]) {
     Teuchos::RCP<MultiScale> multiscale_manager = Teuchos::rcp( new MultiScale(tcomm_S, settings,
                                                                                cells, subgridModels,
                                                                                functionManager) );
+    if (!splitcomm.tcomm_MS.is_null()) {
+      multiscale_manager->setSubgridServers(splitcomm.tcomm_MS, splitcomm.is_subgrid_server,
+                                            splitcomm.macro_solves_subgrids);
+    }
     
     ////////////////////////////////////////////////////////////////////////////////
     // Create the solver object
@@ -197,7 +216,13 @@ int main(int argc,char * argv[]) {
     
     {
       Teuchos::TimeMonitor rtimer(*runTimer);
-      analys->run();
+      if (splitcomm.is_subgrid_server) {
+        multiscale_manager->serveSubgrids();
+      }
+      else {
+        analys->run();
+        multiscale_manager->stopSubgridServers();
+      }
     }
     
   }
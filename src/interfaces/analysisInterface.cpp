@@ -90,23 +90,32 @@ void analysis::run() {
   }
   else if (analysis_type == "forward+adjoint") {
     vector_RCP F_soln = solve->forwardModel(objfun);
-    if (settings->sublist("Postprocess").get<bool>("compute response",false))
+    
+    // with adjoint checkpointing, the full time history is not available for postprocessing
+    bool have_history = solve->checkpoints->haveFullHistory();
+    if (!have_history && LA_Comm->MyPID() == 0) {
+      cout << "***** Adjoint checkpointing is enabled: skipping the postprocessing of the time history" << endl;
+    }
+    
+    if (have_history && settings->sublist("Postprocess").get<bool>("compute response",false))
       postproc->computeResponse(F_soln);
     
     //if (settings->sublist("Postprocess").get("compute objective",false))
     //  AD objfun = postproc->computeObjective(F_soln);
-    if (settings->sublist("Postprocess").get<bool>("verification",false))
+    if (have_history && settings->sublist("Postprocess").get<bool>("verification",false))
       postproc->computeError(F_soln);
     
     vector_RCP A_soln = solve->adjointModel(F_soln, gradient);
     //if (settings->sublist("Postprocess").get<bool>("compute sensitivities",false))
     //  gradient = postproc->computeSensitivities(F_soln, A_soln);
-    if (settings->sublist("Postprocess").get<bool>("error estimate",false))
+    if (!solve->checkpoints->isActive() && settings->sublist("Postprocess").get<bool>("error estimate",false))
       double errorest = solve->computeError(F_soln, A_soln);
     
-    if (settings->sublist("Postprocess").get("write solution",true)) {
+    if (have_history && settings->sublist("Postprocess").get("write solution",true)) {
       postproc->writeSolution(F_soln, settings->sublist("Postprocess").get<string>("Output File","output"));
-      postproc->writeSolution(A_soln, settings->sublist("Postprocess").get<string>("Adjoint Output File","adj_output"));
+      if (!solve->checkpoints->isActive()) { // the adjoint history is only kept in memory
+        postproc->writeSolution(A_soln, settings->sublist("Postprocess").get<string>("Adjoint Output File","adj_output"));
+      }
     }
   }
   else if (analysis_type == "dakota") {
@@ -430,6 +430,7 @@ void meshInterface::createCells(Teuchos::RCP<physics> & phys, vector<vector<Teuc
       }
       blockcells.push_back(Teuchos::rcp(new cell(settings, LocalComm, cellTopo, phys, currnodes, b, eIndex, 0, memeff)));
       blockcells[blockcells.size()-1]->nodepert = currnodepert;
+      blockcells[blockcells.size()-1]->cellID = blockcells.size()-1;
       prog += elemPerCell;
     }
     cells.push_back(blockcells);
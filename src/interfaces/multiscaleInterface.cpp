@@ -11,6 +11,58 @@
 
 #include "multiscaleInterface.hpp"
 
+#include <algorithm>
+
+////////////////////////////////////////////////////////////////////////////////
+// Exchange variable-length buffers with every rank (collective)
+////////////////////////////////////////////////////////////////////////////////
+
+template<class T>
+static void exchangeBuffers(const Teuchos::RCP<Epetra_MpiComm> & MacroComm, MPI_Datatype datatype,
+                            vector<vector<T> > & sendbuf, vector<vector<T> > & recvbuf) {
+  int numProcs = MacroComm->NumProc();
+  vector<int> sendcounts(numProcs,0), recvcounts(numProcs,0);
+  vector<int> senddispl(numProcs,0), recvdispl(numProcs,0);
+  for (int p=0; p<numProcs; p++) {
+    sendcounts[p] = sendbuf[p].size();
+  }
+  MPI_Alltoall(&sendcounts[0], 1, MPI_INT, &recvcounts[0], 1, MPI_INT, MacroComm->Comm());
+  
+  int sendtotal = 0, recvtotal = 0;
+  for (int p=0; p<numProcs; p++) {
+    senddispl[p] = sendtotal;
+    recvdispl[p] = recvtotal;
+    sendtotal += sendcounts[p];
+    recvtotal += recvcounts[p];
+  }
+  vector<T> sendall(std::max(sendtotal,1)), recvall(std::max(recvtotal,1));
+  for (int p=0; p<numProcs; p++) {
+    std::copy(sendbuf[p].begin(), sendbuf[p].end(), sendall.begin()+senddispl[p]);
+  }
+  MPI_Alltoallv(&sendall[0], &sendcounts[0], &senddispl[0], datatype,
+                &recvall[0], &recvcounts[0], &recvdispl[0], datatype, MacroComm->Comm());
+  
+  recvbuf = vector<vector<T> >(numProcs);
+  for (int p=0; p<numProcs; p++) {
+    recvbuf[p] = vector<T>(recvall.begin()+recvdispl[p], recvall.begin()+recvdispl[p]+recvcounts[p]);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Broadcast a variable-length buffer from rank 0 (collective)
+////////////////////////////////////////////////////////////////////////////////
+
+template<class T>
+static void broadcastBuffer(const Teuchos::RCP<Epetra_MpiComm> & Comm, MPI_Datatype datatype,
+                            vector<T> & buf) {
+  int len = buf.size();
+  MPI_Bcast(&len, 1, MPI_INT, 0, Comm->Comm());
+  buf.resize(len);
+  if (len > 0) {
+    MPI_Bcast(&buf[0], len, datatype, 0, Comm->Comm());
+  }
+}
+
 // ========================================================================================
 /* Constructor to set up the problem */
 // ========================================================================================
@@ -23,6 +75,8 @@ MultiScale::MultiScale(const Teuchos::RCP<Epetra_MpiComm> & Comm_,
 Comm(Comm_), settings(settings_), cells(cells_), subgridModels(subgridModels_),
 macro_functionManager(macro_functionManager_) {
   
+  verbosity = settings->get<int>("verbosity",0);
+  
   if (settings->isSublist("Subgrid")) {
     
     ////////////////////////////////////////////////////////////////////////////////
@@ -32,8 +86,30 @@ macro_functionManager(macro_functionManager_) {
     int nummodels = settings->sublist("Subgrid").get<int>("Number of Models",1);
     subgrid_static = settings->sublist("Subgrid").get<bool>("Static Subgrids",true);
     
-    
+    // the copies of the models for the other threads follow the models for thread 0
+    num_model_types = 0;
     for (size_t n=0; n<subgridModels.size(); n++) {
+      if (subgridModels[n]->thread_id == 0) {
+        num_model_types++;
+      }
+    }
+    num_threads = 1;
+    if (num_model_types > 0) {
+      num_threads = subgridModels.size()/num_model_types;
+    }
+    
+    lb_threshold = settings->sublist("Subgrid").get<double>("Load balancing threshold",0.0); // 0.0 turns it off
+    lb_interval = settings->sublist("Subgrid").get<int>("Load balancing interval",10);
+    TEUCHOS_TEST_FOR_EXCEPTION(lb_threshold > 0.0 && !subgrid_static,std::runtime_error,"Error: load balancing requires static subgrid models");
+    
+    // the subgrid models are ordered from coarse to fine (model n+1 refines model n) and
+    // the macro-elements move up this hierarchy based on an error indicator
+    adaptive_refinement = settings->sublist("Subgrid").get<bool>("Adaptive refinement",false);
+    refinement_tol = settings->sublist("Subgrid").get<double>("Refinement tolerance",1.0e-2);
+    TEUCHOS_TEST_FOR_EXCEPTION(adaptive_refinement && subgrid_static,std::runtime_error,"Error: adaptive subgrid refinement requires dynamic subgrid models (Static Subgrids = false)");
+    is_transient = settings->sublist("Solver").get<string>("solver","steady-state") == "transient";
+    
+    for (size_t n=0; n<num_model_types; n++) {
       stringstream ss;
       ss << n;
       macro_functionManager->addFunction("Subgrid " + ss.str() + " usage",subgridModels[n]->usage,
@@ -43,7 +119,27 @@ macro_functionManager(macro_functionManager_) {
   }
   else {
     subgrid_static = true;
+    num_model_types = 0;
+    num_threads = 1;
+    lb_threshold = 0.0;
+    lb_interval = 1;
+    adaptive_refinement = false;
+    refinement_tol = 0.0;
+    is_transient = false;
   }
+  refinement_time = -1.0e300;
+  
+  // subgrid output written during the run (one file per rank and subgrid model)
+  incremental_output = settings->sublist("Postprocess").get<bool>("Incremental subgrid output",false) &&
+                       settings->sublist("Postprocess").get<bool>("write solution",true);
+  output_stride = settings->sublist("Postprocess").get<int>("Subgrid output stride",1);
+  output_file = settings->sublist("Postprocess").get<string>("Output File","output");
+  TEUCHOS_TEST_FOR_EXCEPTION(output_stride < 1,std::runtime_error,"Error: the subgrid output stride must be positive");
+  output_time = -1.0e300;
+  lb_steps = lb_interval; // allow balancing at the first time step
+  lb_active = false;
+  is_server = false;
+  macro_solves_subgrids = true;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -58,6 +154,7 @@ void MultiScale::setMacroInfo(vector<vector<basis_RCP> > & macro_basis_pointers,
                               vector<string> & macro_paramnames,
                               vector<string> & macro_disc_paramnames) {
   
+  this->macro_paramnames = macro_paramnames;
   for (int j=0; j<subgridModels.size(); j++) {
     int mblock = subgridModels[j]->macro_block;
     subgridModels[j]->macro_basis_pointers = macro_basis_pointers[mblock];
@@ -76,6 +173,11 @@ void MultiScale::setMacroInfo(vector<vector<basis_RCP> > & macro_basis_pointers,
 ////////////////////////////////////////////////////////////////////////////////
 
 double MultiScale::initialize() {
+  // the subgrid ranks only get the problems moved to them by their macro rank
+  if (is_server) {
+    return 1.0;
+  }
+  
   double my_cost = 0.0;
   for (size_t b=0; b<cells.size(); b++) {
     for (size_t e=0; e<cells[b].size(); e++) {
@@ -89,12 +191,12 @@ double MultiScale::initialize() {
       vector<size_t> sgnum(numElem,0);
       
       
-      macro_wkset[b]->update(cells[b][e]->ip,cells[b][e]->ijac,cells[b][e]->orientation);
+      macro_wkset[b]->update(cells[b][e]->ip,cells[b][e]->ijac,cells[b][e]->orientation,cells[b][e]->cellID);
       macro_wkset[b]->computeSolnVolIP(cells[b][e]->u, cells[b][e]->u_dot, false, false);
       macro_wkset[b]->computeParamVolIP(cells[b][e]->param, false);
       
       
-      for (size_t s=0; s<subgridModels.size(); s++) {
+      for (size_t s=0; s<num_model_types; s++) {
         stringstream ss;
         ss << s;
         FDATA usagecheck = macro_functionManager->evaluate("Subgrid " + ss.str() + " usage","ip",0);
@@ -108,6 +210,11 @@ double MultiScale::initialize() {
         }
       }
       
+      // the elements in a workset are dealt to the thread copies of their model
+      for (int p=0; p<numElem; p++) {
+        sgnum[p] += (p%num_threads)*num_model_types;
+      }
+      
       if (subgrid_static) { // only add each cell to one subgrid model
         DRV cellnodes = cells[b][e]->nodes;
         Kokkos::View<int****,HostDevice> cellsideinfo = cells[b][e]->sideinfo;
@@ -167,6 +274,7 @@ double MultiScale::initialize() {
       cells[b][e]->subgridModels = subgridModels;
       cells[b][e]->subgrid_model_index.push_back(sgnum);
       cells[b][e]->subgrid_usernum = usernum;
+      cells[b][e]->subgrid_remote = vector<bool>(numElem,false);
       cells[b][e]->multiscale = true;
       for (int c=0; c<numElem; c++) {
         my_cost += subgridModels[sgnum[c]]->cost_estimate;
@@ -193,21 +301,24 @@ double MultiScale::initialize() {
         matrix_RCP map_over = Teuchos::rcp(new Epetra_CrsMatrix(Copy, *(subgridModels[i]->overlapped_map), -1)); // reset Jacobian
         matrix_RCP map = Teuchos::rcp(new Epetra_CrsMatrix(Copy, *(subgridModels[i]->owned_map), -1)); // reset Jacobian
         
+        // each row of the contribution from an integration point is inserted at once
+        size_t numjgids = basisinfo_j.first.dimension(1)-1;
+        vector<int> jgids(numjgids);
+        vector<double> vals(numjgids);
         for (size_t k=0; k<ip.dimension(1); k++) {
-          int icell = basisinfo_i.first(k,0);
-          int jcell = basisinfo_j.first(k,0);
+          for (size_t q=0; q<numjgids; q++) {
+            jgids[q] = basisinfo_j.first(k,q+1);
+          }
           for (size_t r=0; r<basisinfo_i.second[k].dimension(0);r++) {
+            if (r >= basisinfo_j.second[k].dimension(0)) {
+              continue;
+            }
             for (size_t p=0; p<basisinfo_i.second[k].dimension(1);p++) {
               int igid = basisinfo_i.first(k,p+1);
-              for (size_t s=0; s<basisinfo_j.second[k].dimension(0);s++) {
-                for (size_t q=0; q<basisinfo_j.second[k].dimension(1);q++) {
-                  int jgid = basisinfo_j.first(k,q+1);
-                  if (r == s) {
-                    double val = basisinfo_i.second[k](r,p) * basisinfo_j.second[k](s,q) * wts(0,k);
-                    map_over->InsertGlobalValues(igid, 1, &val, &jgid);
-                  }
-                }
+              for (size_t q=0; q<basisinfo_j.second[k].dimension(1);q++) {
+                vals[q] = basisinfo_i.second[k](r,p) * basisinfo_j.second[k](r,q) * wts(0,k);
               }
+              map_over->InsertGlobalValues(igid, basisinfo_j.second[k].dimension(1), &vals[0], &jgids[0]);
             }
           }
         }
@@ -258,6 +369,10 @@ double MultiScale::initialize() {
     subgridModels[s]->addMeshData();
   }
   
+  if (this->haveSubgridServers()) {
+    this->distributeToServers();
+  }
+  
   //subgrid_static = true;
   return my_cost;
 }
@@ -278,13 +393,27 @@ double MultiScale::update() {
             int nummod = cells[b][e]->subgrid_model_index[c].size();
             int oldmodel = cells[b][e]->subgrid_model_index[c][nummod-1];
             cells[b][e]->subgrid_model_index[c].push_back(oldmodel);
-            my_cost += subgridModels[oldmodel]->cost_estimate;
+            if (!cells[b][e]->subgrid_remote[c]) {
+              my_cost += subgridModels[oldmodel]->cost_estimate;
+            }
           }
         }
       }
     }
+    // subgrid problems moved to this rank
+    for (size_t k=0; k<subgrid_imports.size(); k++) {
+      my_cost += subgridModels[subgrid_imports[k][4]]->cost_estimate;
+    }
   }
   else {
+    vector<bool> refine;
+    if (adaptive_refinement) {
+      refine = this->getRefinementFlags();
+    }
+    
+    // elements that switch models, grouped by (new model, old model) so that the
+    // state of each group is transferred with one multi-vector apply/solve
+    std::map<pair<size_t,size_t>, vector<int> > switches;
     for (size_t b=0; b<cells.size(); b++) {
       for (size_t e=0; e<cells[b].size(); e++) {
         if (cells[b][e]->multiscale) {
@@ -295,11 +424,11 @@ double MultiScale::update() {
           int numElem = cells[b][e]->numElem;
           vector<size_t> newmodel(numElem,0);
           
-          macro_wkset[b]->update(cells[b][e]->ip,cells[b][e]->ijac,cells[b][e]->orientation);
+          macro_wkset[b]->update(cells[b][e]->ip,cells[b][e]->ijac,cells[b][e]->orientation,cells[b][e]->cellID);
           macro_wkset[b]->computeSolnVolIP(cells[b][e]->u, cells[b][e]->u_dot, false, false);
           macro_wkset[b]->computeParamVolIP(cells[b][e]->param, false);
           
-          for (size_t s=0; s<subgridModels.size(); s++) {
+          for (size_t s=0; s<num_model_types; s++) {
             stringstream ss;
             ss << s;
             FDATA usagecheck = macro_functionManager->evaluate("Subgrid " + ss.str() + " usage","ip",0);
@@ -317,27 +446,16 @@ double MultiScale::update() {
             
             int nummod = cells[b][e]->subgrid_model_index[c].size();
             int oldmodel = cells[b][e]->subgrid_model_index[c][nummod-1];
+            if (adaptive_refinement) {
+              // the usage functions give the coarsest model, and elements are never coarsened
+              size_t level = oldmodel;
+              if (refine[cells[b][e]->subgrid_usernum[c]]) {
+                level++;
+              }
+              newmodel[c] = std::max(newmodel[c], level);
+            }
             if (newmodel[c] != oldmodel) {
-              
-              int usernum = cells[b][e]->subgrid_usernum[c];
-              // get the time/solution from old subgrid model at last time step
-              int lastindex = subgridModels[oldmodel]->soln[usernum].size()-1;
-              pair<double, vector_RCP> lastsol = subgridModels[oldmodel]->soln[usernum][lastindex];
-              
-              vector_RCP projvec = Teuchos::rcp(new Epetra_MultiVector(*(subgridModels[newmodel[c]]->owned_map),1));
-              subgrid_projection_maps[newmodel[c]][oldmodel]->Apply(*(lastsol.second), *projvec);
-              
-              vector_RCP newvec = Teuchos::rcp(new Epetra_MultiVector(*(subgridModels[newmodel[c]]->owned_map),1));
-              subgrid_projection_linsys[newmodel[c]]->SetRHS(projvec.get());
-              subgrid_projection_linsys[newmodel[c]]->SetLHS(newvec.get());
-              
-              subgrid_projection_solvers[newmodel[c]]->Solve();
-              
-              subgridModels[newmodel[c]]->solutionStorage(newvec, lastsol.first, false, usernum);
-              
-              // update the cell
-              //cells[b][e]->subgridModel = subgridModels[newmodel];
-              
+              switches[pair<size_t,size_t>(newmodel[c],oldmodel)].push_back(cells[b][e]->subgrid_usernum[c]);
             }
             my_cost += subgridModels[newmodel[c]]->cost_estimate;
             cells[b][e]->subgrid_model_index[c].push_back(newmodel[c]);
@@ -345,11 +463,140 @@ double MultiScale::update() {
         }
       }
     }
+    
+    std::map<pair<size_t,size_t>, vector<int> >::iterator sw;
+    for (sw = switches.begin(); sw != switches.end(); sw++) {
+      this->projectSubgridStates(sw->first.first, sw->first.second, sw->second);
+    }
   }
   
   return my_cost;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// Error indicators for adaptive refinement (flags indexed by usernum)
+// The last solution of each macro-element is projected onto the next finer model,
+// where the subgrid residual of the projected state is the indicator.  A macro-element
+// is flagged when the indicator is above the refinement tolerance.  The indicators are
+// only computed once per macro time step, so nothing is refined during the adjoint solve.
+////////////////////////////////////////////////////////////////////////////////
+
+vector<bool> MultiScale::getRefinementFlags() {
+  
+  size_t numusers = 0;
+  if (subgridModels.size() > 0) {
+    numusers = subgridModels[0]->soln.size();
+  }
+  vector<bool> refine(numusers,false);
+  
+  // macro-elements (block, cell, element) grouped by their current model
+  std::map<size_t, vector<vector<size_t> > > candidates;
+  double newtime = refinement_time;
+  for (size_t b=0; b<cells.size(); b++) {
+    for (size_t e=0; e<cells[b].size(); e++) {
+      if (cells[b][e]->multiscale) {
+        for (int c=0; c<cells[b][e]->numElem; c++) {
+          int nummod = cells[b][e]->subgrid_model_index[c].size();
+          size_t model = cells[b][e]->subgrid_model_index[c][nummod-1];
+          int usernum = cells[b][e]->subgrid_usernum[c];
+          size_t numsol = subgridModels[model]->soln[usernum].size();
+          size_t minsol = is_transient ? 2 : 1;
+          if (model+1 < num_model_types && numsol >= minsol) {
+            double soltime = subgridModels[model]->soln[usernum].back().first;
+            if (soltime > refinement_time) {
+              vector<size_t> ce = {b, e, (size_t)c};
+              candidates[model].push_back(ce);
+              newtime = std::max(newtime, soltime);
+            }
+          }
+        }
+      }
+    }
+  }
+  refinement_time = newtime;
+  
+  std::map<size_t, vector<vector<size_t> > >::iterator cd;
+  for (cd = candidates.begin(); cd != candidates.end(); cd++) {
+    size_t model = cd->first;
+    size_t finer = model+1;
+    vector<vector<size_t> > & elems = cd->second;
+    int numel = elems.size();
+    
+    // columns [0,numel) hold the last states and [numel,2*numel) the previous ones
+    int numcols = is_transient ? 2*numel : numel;
+    Epetra_MultiVector oldvecs(*(subgridModels[model]->owned_map),numcols);
+    Epetra_MultiVector projvecs(*(subgridModels[finer]->owned_map),numcols);
+    Epetra_MultiVector newvecs(*(subgridModels[finer]->owned_map),numcols);
+    vector<double> times(numel);
+    for (int k=0; k<numel; k++) {
+      int usernum = cells[elems[k][0]][elems[k][1]]->subgrid_usernum[elems[k][2]];
+      SubGridSolutionHistory & hist = subgridModels[model]->soln[usernum];
+      times[k] = hist.back().first;
+      *(oldvecs(k)) = *((*(hist.back().second))(0));
+      if (is_transient) {
+        *(oldvecs(numel+k)) = *((*(hist[hist.size()-2].second))(0));
+      }
+    }
+    
+    subgrid_projection_maps[finer][model]->Apply(oldvecs, projvecs);
+    subgrid_projection_linsys[finer]->SetRHS(&projvecs);
+    subgrid_projection_linsys[finer]->SetLHS(&newvecs);
+    subgrid_projection_solvers[finer]->Solve();
+    
+    for (int k=0; k<numel; k++) {
+      Teuchos::RCP<cell> & mcell = cells[elems[k][0]][elems[k][1]];
+      int usernum = mcell->subgrid_usernum[elems[k][2]];
+      vector_RCP proj_u = Teuchos::rcp(new Epetra_MultiVector(Copy, newvecs, k, 1));
+      vector_RCP proj_u_prev = proj_u;
+      if (is_transient) {
+        proj_u_prev = Teuchos::rcp(new Epetra_MultiVector(Copy, newvecs, numel+k, 1));
+      }
+      double indicator = subgridModels[finer]->computeResidualIndicator(proj_u, proj_u_prev, mcell->u,
+                                                                        elems[k][2], times[k],
+                                                                        is_transient, usernum);
+      if (indicator > refinement_tol) {
+        refine[usernum] = true;
+      }
+    }
+  }
+  
+  return refine;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Transfer the last states of a set of macro-elements from one subgrid model to
+// another (L2 projection, one column per macro-element)
+////////////////////////////////////////////////////////////////////////////////
+
+void MultiScale::projectSubgridStates(const size_t & newmodel, const size_t & oldmodel,
+                                      const vector<int> & usernums) {
+  
+  int numsw = usernums.size();
+  Epetra_MultiVector oldvecs(*(subgridModels[oldmodel]->owned_map),numsw);
+  Epetra_MultiVector projvecs(*(subgridModels[newmodel]->owned_map),numsw);
+  Epetra_MultiVector newvecs(*(subgridModels[newmodel]->owned_map),numsw);
+  vector<double> times(numsw);
+  
+  // get the time/solution from old subgrid model at last time step
+  for (int k=0; k<numsw; k++) {
+    int usernum = usernums[k];
+    int lastindex = subgridModels[oldmodel]->soln[usernum].size()-1;
+    pair<double, vector_RCP> & lastsol = subgridModels[oldmodel]->soln[usernum][lastindex];
+    times[k] = lastsol.first;
+    *(oldvecs(k)) = *((*(lastsol.second))(0));
+  }
+  
+  subgrid_projection_maps[newmodel][oldmodel]->Apply(oldvecs, projvecs);
+  subgrid_projection_linsys[newmodel]->SetRHS(&projvecs);
+  subgrid_projection_linsys[newmodel]->SetLHS(&newvecs);
+  subgrid_projection_solvers[newmodel]->Solve();
+  
+  for (int k=0; k<numsw; k++) {
+    vector_RCP newvec = Teuchos::rcp(new Epetra_MultiVector(Copy, newvecs, k, 1));
+    subgridModels[newmodel]->solutionStorage(newvec, times[k], false, usernums[k]);
+  }
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // Post-processing
 ////////////////////////////////////////////////////////////////////////////////
@@ -357,6 +604,13 @@ double MultiScale::update() {
 void MultiScale::writeSolution(const string & macrofilename, const vector<double> & solvetimes,
                                const int & globalPID) {
   
+  if (incremental_output) {
+    // the steps were written during the run (steady problems have not written anything yet)
+    if (output_time == -1.0e300 && solvetimes.size() > 0) {
+      this->writeSubgridStep(solvetimes[solvetimes.size()-1], 0, true);
+    }
+    return;
+  }
   
   //vector<FC> subgrid_cell_fields;
   if (subgridModels.size() > 0) {
@@ -417,6 +671,66 @@ void MultiScale::writeSolution(const string & macrofilename, const vector<double
   
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// Incremental output: the subgrid states of every macro-element on this rank that uses
+// a subgrid model go to one file per model, every output_stride macro steps (and at
+// the last step).  The files are (re)started when the time goes back, i.e., at the
+// beginning of a new forward solve.
+// The thread copies of a model hold their own macro-elements, so each copy writes
+// its own file (named by the model type and the thread).
+////////////////////////////////////////////////////////////////////////////////
+
+void MultiScale::writeSubgridStep(const double & time, const int & step, const bool & is_last) {
+  
+  if (!incremental_output || num_model_types == 0 || is_server) {
+    return;
+  }
+  if (step % output_stride != 0 && !is_last) {
+    return;
+  }
+  
+  if (time <= output_time) {
+    output_time = -1.0e300;
+  }
+  if (output_time == -1.0e300) {
+    for (size_t s=0; s<subgridModels.size(); s++) {
+      vector<int> usernums;
+      if (subgrid_static) {
+        for (size_t b=0; b<cells.size(); b++) {
+          for (size_t e=0; e<cells[b].size(); e++) {
+            if (cells[b][e]->multiscale) {
+              for (int c=0; c<cells[b][e]->numElem; c++) {
+                if (cells[b][e]->subgrid_model_index[c][0] == s) {
+                  usernums.push_back(cells[b][e]->subgrid_usernum[c]);
+                }
+              }
+            }
+          }
+        }
+      }
+      else {
+        // every model has every macro-element
+        for (size_t u=0; u<subgridModels[s]->soln.size(); u++) {
+          usernums.push_back(u);
+        }
+      }
+      stringstream ss;
+      ss << s % num_model_types;
+      if (subgridModels[s]->thread_id > 0) {
+        ss << "_t" << subgridModels[s]->thread_id;
+      }
+      ss << ".exo." << Comm->MyPID();
+      string filename = "subgrid_data/subgrid_" + output_file + "." + ss.str();
+      subgridModels[s]->setupOutput(filename, usernums);
+    }
+  }
+  
+  for (size_t s=0; s<subgridModels.size(); s++) {
+    subgridModels[s]->writeOutputStep(time);
+  }
+  output_time = time;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // Update parameters
 ////////////////////////////////////////////////////////////////////////////////
@@ -463,3 +777,825 @@ void MultiScale::updateMeshData(Kokkos::View<double**,HostDevice> & rotation_dat
     subgridModels[i]->updateMeshData(rotation_data);
   }
 }
+
+////////////////////////////////////////////////////////////////////////////////
+// Cost-driven load balancing of the subgrid problems
+// The macro-elements stay on their ranks; only the subgrid problems are moved
+////////////////////////////////////////////////////////////////////////////////
+
+void MultiScale::balanceLoad(const Teuchos::RCP<Epetra_MpiComm> & MacroComm, const double & gmin,
+                             const double & gmax, const bool & isAdjoint) {
+
+  if (lb_threshold <= 0.0 || subgridModels.size() == 0) {
+    return;
+  }
+
+  lb_steps++;
+
+  // the adjoint needs the subgrid problems where the forward solve left them
+  if (isAdjoint) {
+    return;
+  }
+
+  if (gmin > 0.0 && gmax/gmin > lb_threshold && lb_steps >= lb_interval) {
+    this->migrateSubgrids(MacroComm);
+    lb_steps = 0;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Move the subgrid problems back to their owners
+// The owners already have the current states (see syncSubgridStates)
+////////////////////////////////////////////////////////////////////////////////
+
+void MultiScale::restoreSubgrids() {
+  for (size_t b=0; b<cells.size(); b++) {
+    for (size_t e=0; e<cells[b].size(); e++) {
+      for (size_t c=0; c<cells[b][e]->subgrid_remote.size(); c++) {
+        cells[b][e]->subgrid_remote[c] = false;
+      }
+    }
+  }
+  subgrid_exports.clear();
+  subgrid_imports.clear();
+  lb_active = false;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Compute a migration plan from the subgrid cost estimates and move the subgrid
+// problems (macro-element data and solution history) to their new ranks
+////////////////////////////////////////////////////////////////////////////////
+
+void MultiScale::migrateSubgrids(const Teuchos::RCP<Epetra_MpiComm> & MacroComm) {
+
+  this->restoreSubgrids();
+
+  int numProcs = MacroComm->NumProc();
+  int myPID = MacroComm->MyPID();
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // Cost of the local subgrid problems
+  ////////////////////////////////////////////////////////////////////////////////
+
+  vector<pair<double, vector<int> > > local_work; // (cost, (block, cell, element))
+  double my_cost = 0.0;
+  for (size_t b=0; b<cells.size(); b++) {
+    for (size_t e=0; e<cells[b].size(); e++) {
+      if (cells[b][e]->multiscale) {
+        for (int c=0; c<cells[b][e]->numElem; c++) {
+          int model = cells[b][e]->subgrid_model_index[c].back();
+          double cost = subgridModels[model]->cost_estimate;
+          vector<int> loc = {(int)b, (int)e, c};
+          local_work.push_back(make_pair(cost, loc));
+          my_cost += cost;
+        }
+      }
+    }
+  }
+
+  vector<double> all_costs(numProcs,0.0);
+  MacroComm->GatherAll(&my_cost, &all_costs[0], 1);
+
+  double mean_cost = 0.0;
+  for (int p=0; p<numProcs; p++) {
+    mean_cost += all_costs[p]/(double)numProcs;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // Greedy matching of the overloaded and underloaded ranks
+  // Every rank computes the same plan from the gathered costs
+  ////////////////////////////////////////////////////////////////////////////////
+
+  vector<pair<double,int> > senders, receivers;
+  for (int p=0; p<numProcs; p++) {
+    if (all_costs[p] > mean_cost) {
+      senders.push_back(make_pair(all_costs[p]-mean_cost, p));
+    }
+    else if (all_costs[p] < mean_cost) {
+      receivers.push_back(make_pair(mean_cost-all_costs[p], p));
+    }
+  }
+  std::sort(senders.rbegin(), senders.rend());
+  std::sort(receivers.rbegin(), receivers.rend());
+
+  vector<pair<int,double> > my_quotas; // (destination, cost to move)
+  size_t r = 0;
+  for (size_t s=0; s<senders.size(); s++) {
+    double excess = senders[s].first;
+    while (excess > 0.0 && r < receivers.size()) {
+      double amount = std::min(excess, receivers[r].first);
+      if (senders[s].second == myPID) {
+        my_quotas.push_back(make_pair(receivers[r].second, amount));
+      }
+      excess -= amount;
+      receivers[r].first -= amount;
+      if (receivers[r].first <= 0.0) {
+        r++;
+      }
+    }
+  }
+
+  // fill the quotas with the most expensive problems first
+  std::stable_sort(local_work.begin(), local_work.end(),
+                   [](const pair<double, vector<int> > & a, const pair<double, vector<int> > & b) {
+                     return a.first > b.first;
+                   });
+  vector<bool> assigned(local_work.size(), false);
+  for (size_t q=0; q<my_quotas.size(); q++) {
+    double remaining = my_quotas[q].second;
+    for (size_t k=0; k<local_work.size(); k++) {
+      if (!assigned[k] && local_work[k].first <= remaining + 0.5*local_work[k].first) {
+        vector<int> exp = {my_quotas[q].first, local_work[k].second[0],
+                           local_work[k].second[1], local_work[k].second[2]};
+        subgrid_exports.push_back(exp);
+        assigned[k] = true;
+        remaining -= local_work[k].first;
+      }
+    }
+  }
+
+  int gl_moved = this->moveSubgrids(MacroComm);
+  if (myPID == 0 && verbosity > 0) {
+    cout << "***** Subgrid load balancing moved " << gl_moved << " subgrid problems" << endl;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Move the subgrid problems in subgrid_exports (macro-element data and solution
+// history) and set up the ones moved to this rank (collective)
+// Returns the number of problems moved on all ranks of Comm_move
+////////////////////////////////////////////////////////////////////////////////
+
+int MultiScale::moveSubgrids(const Teuchos::RCP<Epetra_MpiComm> & Comm_move) {
+
+  int numProcs = Comm_move->NumProc();
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // Pack the macro-element data and the subgrid solution history
+  ////////////////////////////////////////////////////////////////////////////////
+
+  vector<vector<int> > send_ints(numProcs), recv_ints;
+  vector<vector<double> > send_dbls(numProcs), recv_dbls;
+
+  for (size_t k=0; k<subgrid_exports.size(); k++) {
+    int dest = subgrid_exports[k][0];
+    int b = subgrid_exports[k][1];
+    int e = subgrid_exports[k][2];
+    int c = subgrid_exports[k][3];
+    Teuchos::RCP<cell> mcell = cells[b][e];
+    int model = mcell->subgrid_model_index[c].back();
+    int usernum = mcell->subgrid_usernum[c];
+
+    vector<int> & ints = send_ints[dest];
+    vector<double> & dbls = send_dbls[dest];
+
+    ints.push_back(b);
+    ints.push_back(e);
+    ints.push_back(c);
+    ints.push_back(model);
+
+    DRV nodes = mcell->nodes;
+    ints.push_back(nodes.dimension(1));
+    ints.push_back(nodes.dimension(2));
+    for (size_t i=0; i<nodes.dimension(1); i++) {
+      for (size_t j=0; j<nodes.dimension(2); j++) {
+        dbls.push_back(nodes(c,i,j));
+      }
+    }
+
+    Kokkos::View<int****,HostDevice> sideinfo = mcell->sideinfo;
+    ints.push_back(sideinfo.dimension(1));
+    ints.push_back(sideinfo.dimension(2));
+    ints.push_back(sideinfo.dimension(3));
+    for (size_t i=0; i<sideinfo.dimension(1); i++) {
+      for (size_t j=0; j<sideinfo.dimension(2); j++) {
+        for (size_t m=0; m<sideinfo.dimension(3); m++) {
+          ints.push_back(sideinfo(c,i,j,m));
+        }
+      }
+    }
+
+    ints.push_back(mcell->GIDs[c].size());
+    ints.insert(ints.end(), mcell->GIDs[c].begin(), mcell->GIDs[c].end());
+
+    ints.push_back(mcell->index[c].size());
+    for (size_t n=0; n<mcell->index[c].size(); n++) {
+      ints.push_back(mcell->index[c][n].size());
+      ints.insert(ints.end(), mcell->index[c][n].begin(), mcell->index[c][n].end());
+    }
+
+    ints.push_back(mcell->sidenames.size());
+    for (size_t n=0; n<mcell->sidenames.size(); n++) {
+      ints.push_back(mcell->sidenames[n].size());
+      for (size_t i=0; i<mcell->sidenames[n].size(); i++) {
+        ints.push_back((int)mcell->sidenames[n][i]);
+      }
+    }
+
+    SubGridSolutionHistory & soln = subgridModels[model]->soln[usernum];
+    SubGridSolutionHistory & adjsoln = subgridModels[model]->adjsoln[usernum];
+    int veclen = subgridModels[model]->overlapped_map->NumMyElements();
+    ints.push_back(soln.size());
+    ints.push_back(adjsoln.size());
+    ints.push_back(veclen);
+    for (size_t t=0; t<soln.size(); t++) {
+      dbls.push_back(soln[t].first);
+      dbls.insert(dbls.end(), (*soln[t].second)[0], (*soln[t].second)[0]+veclen);
+    }
+    for (size_t t=0; t<adjsoln.size(); t++) {
+      dbls.push_back(adjsoln[t].first);
+      dbls.insert(dbls.end(), (*adjsoln[t].second)[0], (*adjsoln[t].second)[0]+veclen);
+    }
+
+    mcell->subgrid_remote[c] = true;
+  }
+
+  exchangeBuffers(Comm_move, MPI_INT, send_ints, recv_ints);
+  exchangeBuffers(Comm_move, MPI_DOUBLE, send_dbls, recv_dbls);
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // Set up the subgrid problems moved to this rank
+  // A problem that was here before keeps its subgrid mesh and only takes the new states
+  ////////////////////////////////////////////////////////////////////////////////
+
+  vector<bool> new_macros(subgridModels.size(), false);
+  for (int src=0; src<numProcs; src++) {
+    size_t ip = 0, dp = 0;
+    vector<int> & ints = recv_ints[src];
+    vector<double> & dbls = recv_dbls[src];
+    while (ip < ints.size()) {
+      int b = ints[ip++];
+      int e = ints[ip++];
+      int c = ints[ip++];
+      int model = ints[ip++];
+
+      int nnodes = ints[ip++];
+      int dim = ints[ip++];
+      DRV cnodes("cnodes",1,nnodes,dim);
+      for (int i=0; i<nnodes; i++) {
+        for (int j=0; j<dim; j++) {
+          cnodes(0,i,j) = dbls[dp++];
+        }
+      }
+
+      int sd1 = ints[ip++];
+      int sd2 = ints[ip++];
+      int sd3 = ints[ip++];
+      Kokkos::View<int****,HostDevice> csideinfo("csideinfo",1,sd1,sd2,sd3);
+      for (int i=0; i<sd1; i++) {
+        for (int j=0; j<sd2; j++) {
+          for (int m=0; m<sd3; m++) {
+            csideinfo(0,i,j,m) = ints[ip++];
+          }
+        }
+      }
+
+      int numGIDs = ints[ip++];
+      vector<int> cGIDs(ints.begin()+ip, ints.begin()+ip+numGIDs);
+      ip += numGIDs;
+
+      int numvars = ints[ip++];
+      vector<vector<int> > cindex(numvars);
+      for (int n=0; n<numvars; n++) {
+        int len = ints[ip++];
+        cindex[n] = vector<int>(ints.begin()+ip, ints.begin()+ip+len);
+        ip += len;
+      }
+
+      int numsides = ints[ip++];
+      vector<string> csidenames(numsides);
+      for (int n=0; n<numsides; n++) {
+        int len = ints[ip++];
+        for (int i=0; i<len; i++) {
+          csidenames[n].push_back((char)ints[ip++]);
+        }
+      }
+
+      int nsoln = ints[ip++];
+      int nadjsoln = ints[ip++];
+      int veclen = ints[ip++];
+
+      vector<int> key = {src, b, e, c, model};
+      int usernum;
+      if (subgrid_import_pool.find(key) == subgrid_import_pool.end()) {
+        usernum = subgridModels[model]->addMacro(cnodes, csideinfo, csidenames, cGIDs, cindex);
+        subgrid_import_pool[key] = usernum;
+        new_macros[model] = true;
+      }
+      else {
+        usernum = subgrid_import_pool[key];
+      }
+
+      Teuchos::RCP<Epetra_Map> vmap = subgridModels[model]->overlapped_map;
+      TEUCHOS_TEST_FOR_EXCEPTION(vmap->NumMyElements() != veclen,std::runtime_error,"Error: the migrated subgrid state does not match the local subgrid model");
+
+      SubGridSolutionHistory & newsoln = subgridModels[model]->soln[usernum];
+      SubGridSolutionHistory & newadjsoln = subgridModels[model]->adjsoln[usernum];
+      newsoln.clear();
+      newadjsoln.clear();
+      for (int t=0; t<nsoln; t++) {
+        double time = dbls[dp++];
+        vector_RCP vec = Teuchos::rcp(new Epetra_MultiVector(*vmap,1));
+        std::copy(dbls.begin()+dp, dbls.begin()+dp+veclen, (*vec)[0]);
+        dp += veclen;
+        newsoln.push_back(make_pair(time, vec));
+      }
+      for (int t=0; t<nadjsoln; t++) {
+        double time = dbls[dp++];
+        vector_RCP vec = Teuchos::rcp(new Epetra_MultiVector(*vmap,1));
+        std::copy(dbls.begin()+dp, dbls.begin()+dp+veclen, (*vec)[0]);
+        dp += veclen;
+        newadjsoln.push_back(make_pair(time, vec));
+      }
+
+      vector<int> imp = {src, b, e, c, model, usernum};
+      subgrid_imports.push_back(imp);
+    }
+  }
+
+  for (size_t s=0; s<subgridModels.size(); s++) {
+    if (new_macros[s]) {
+      subgridModels[s]->addMeshData();
+    }
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // Storage for the contributions returned by the other ranks
+  ////////////////////////////////////////////////////////////////////////////////
+
+  for (size_t b=0; b<cells.size(); b++) {
+    int numres = macro_wkset[b]->res.dimension(1);
+    for (size_t e=0; e<cells[b].size(); e++) {
+      int numElem = cells[b][e]->numElem;
+      cells[b][e]->subgrid_remote_res = Kokkos::View<AD**,AssemblyDevice>("remote subgrid residual",numElem,numres);
+      cells[b][e]->subgrid_remote_grad = Kokkos::View<double***,AssemblyDevice>("remote subgrid gradient",numElem,
+                                                                                cells[b][e]->subgradient.dimension(0),
+                                                                                cells[b][e]->subgradient.dimension(1));
+    }
+  }
+
+  int my_moved = subgrid_exports.size();
+  int gl_moved = 0;
+  Comm_move->SumAll(&my_moved, &gl_moved, 1);
+  lb_active = (gl_moved > 0);
+  return gl_moved;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Dedicated subgrid ranks (multiscale split comm)
+// Every macro rank has a group of subgrid ranks.  The macro rank hands its subgrid
+// problems to the group at setup and keeps a copy of them (as with load balancing).
+// In each assembly, it sends the macro solution of the moved problems and receives
+// the contributions to the macro residual and Jacobian.  The subgrid ranks wait
+// for the commands of their macro rank in serveSubgrids.
+////////////////////////////////////////////////////////////////////////////////
+
+void MultiScale::setSubgridServers(const Teuchos::RCP<Epetra_MpiComm> & GroupComm,
+                                   const bool & is_server_, const bool & macro_solves_subgrids_) {
+  TEUCHOS_TEST_FOR_EXCEPTION(!subgrid_static,std::runtime_error,"Error: dedicated subgrid ranks require static subgrid models");
+  TEUCHOS_TEST_FOR_EXCEPTION(lb_threshold > 0.0,std::runtime_error,"Error: dedicated subgrid ranks can not be combined with subgrid load balancing");
+  server_comm = GroupComm;
+  is_server = is_server_;
+  macro_solves_subgrids = macro_solves_subgrids_;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Deal the local subgrid problems to the ranks of the group (most expensive first,
+// to the least loaded rank)
+////////////////////////////////////////////////////////////////////////////////
+
+void MultiScale::distributeToServers() {
+  
+  this->sendServerCommand(SG_SETUP);
+  
+  vector<pair<double, vector<int> > > local_work; // (cost, (block, cell, element))
+  for (size_t b=0; b<cells.size(); b++) {
+    for (size_t e=0; e<cells[b].size(); e++) {
+      if (cells[b][e]->multiscale) {
+        for (int c=0; c<cells[b][e]->numElem; c++) {
+          int model = cells[b][e]->subgrid_model_index[c].back();
+          vector<int> loc = {(int)b, (int)e, c};
+          local_work.push_back(make_pair(subgridModels[model]->cost_estimate, loc));
+        }
+      }
+    }
+  }
+  std::stable_sort(local_work.begin(), local_work.end(),
+                   [](const pair<double, vector<int> > & a, const pair<double, vector<int> > & b) {
+                     return a.first > b.first;
+                   });
+  
+  int numProcs = server_comm->NumProc();
+  int first = macro_solves_subgrids ? 0 : 1;
+  vector<double> load(numProcs,0.0);
+  subgrid_exports.clear();
+  for (size_t k=0; k<local_work.size(); k++) {
+    int dest = first;
+    for (int p=first; p<numProcs; p++) {
+      if (load[p] < load[dest]) {
+        dest = p;
+      }
+    }
+    load[dest] += local_work[k].first;
+    if (dest > 0) {
+      vector<int> exp = {dest, local_work[k].second[0], local_work[k].second[1], local_work[k].second[2]};
+      subgrid_exports.push_back(exp);
+    }
+  }
+  
+  this->moveSubgrids(server_comm);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Command loop of a subgrid rank (returns when the macro rank is finished)
+////////////////////////////////////////////////////////////////////////////////
+
+void MultiScale::serveSubgrids() {
+  
+  while (true) {
+    int cmd = SG_STOP;
+    server_comm->Broadcast(&cmd, 1, 0);
+    
+    if (cmd == SG_STOP) {
+      break;
+    }
+    else if (cmd == SG_SETUP) {
+      subgrid_exports.clear();
+      this->moveSubgrids(server_comm);
+    }
+    else if (cmd == SG_WORK) {
+      vector<int> ints;
+      vector<double> dbls;
+      broadcastBuffer(server_comm, MPI_INT, ints);
+      broadcastBuffer(server_comm, MPI_DOUBLE, dbls);
+      size_t ip = 0, dp = 0;
+      size_t block = ints[ip++];
+      bool isTransient = ints[ip++];
+      bool isAdjoint = ints[ip++];
+      bool compute_jacobian = ints[ip++];
+      bool compute_sens = ints[ip++];
+      int num_active_params = ints[ip++];
+      bool compute_disc_sens = ints[ip++];
+      bool compute_aux_sens = ints[ip++];
+      bool store_adjPrev = ints[ip++];
+      double time = dbls[dp++];
+      
+      int numparams = ints[ip++];
+      vector<int> paramtypes(numparams);
+      vector<vector<double> > paramvals(numparams);
+      for (int i=0; i<numparams; i++) {
+        paramtypes[i] = ints[ip++];
+        int len = ints[ip++];
+        paramvals[i] = vector<double>(dbls.begin()+dp, dbls.begin()+dp+len);
+        dp += len;
+      }
+      
+      // the macro-scale parameters (with the seeding of the macro rank)
+      int nrows = ints[ip++];
+      int ncols = ints[ip++];
+      if (subgridModels.size() > 0) {
+        Kokkos::View<AD**,AssemblyDevice> mparams = subgridModels[0]->macro_paramvals_KVAD;
+        for (int i=0; i<nrows; i++) {
+          for (int j=0; j<ncols; j++) {
+            AD val = dbls[dp++];
+            for (int d=0; d<maxDerivs; d++) {
+              val.fastAccessDx(d) = dbls[dp++];
+            }
+            if (i < (int)mparams.dimension(0) && j < (int)mparams.dimension(1)) {
+              mparams(i,j) = val;
+            }
+          }
+        }
+        for (size_t s=0; s<subgridModels.size(); s++) {
+          if (subgridModels[s]->thread_id > 0) {
+            Kokkos::View<AD**,AssemblyDevice> sparams = subgridModels[s]->paramvals_KVAD;
+            for (size_t i=0; i<sparams.dimension(0); i++) {
+              for (size_t j=0; j<sparams.dimension(1); j++) {
+                sparams(i,j) = mparams(i,j);
+              }
+            }
+          }
+        }
+      }
+      
+      this->exchangeSubgridWork(server_comm, block, paramvals, paramtypes, macro_paramnames,
+                                time, isTransient, isAdjoint, compute_jacobian, compute_sens,
+                                num_active_params, compute_disc_sens, compute_aux_sens, store_adjPrev);
+    }
+    else if (cmd == SG_SYNC) {
+      vector<int> ints;
+      vector<double> dbls;
+      broadcastBuffer(server_comm, MPI_INT, ints);
+      broadcastBuffer(server_comm, MPI_DOUBLE, dbls);
+      this->syncSubgridStates(server_comm, dbls[0], dbls[1], ints[0]);
+    }
+    else if (cmd == SG_RELEASE) {
+      vector<double> dbls;
+      broadcastBuffer(server_comm, MPI_DOUBLE, dbls);
+      this->releaseSubgridStates(dbls[0]);
+    }
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Release the subgrid ranks of this group (called by the macro rank at the end)
+////////////////////////////////////////////////////////////////////////////////
+
+void MultiScale::stopSubgridServers() {
+  this->sendServerCommand(SG_STOP);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+bool MultiScale::haveSubgridServers() {
+  return !server_comm.is_null() && !is_server && server_comm->NumProc() > 1;
+}
+
+void MultiScale::sendServerCommand(int cmd) {
+  if (this->haveSubgridServers()) {
+    server_comm->Broadcast(&cmd, 1, 0);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Solve the imported subgrid problems for one block and send the contributions
+// to the macro residual (and the subgrid gradients) back to the owners
+////////////////////////////////////////////////////////////////////////////////
+
+void MultiScale::exchangeSubgridWork(const Teuchos::RCP<Epetra_MpiComm> & MacroComm, const size_t & block,
+                                     const vector<vector<double> > & paramvals,
+                                     const vector<int> & paramtypes, const vector<string> & paramnames,
+                                     const double & time, const bool & isTransient, const bool & isAdjoint,
+                                     const bool & compute_jacobian, const bool & compute_sens,
+                                     const int & num_active_params, const bool & compute_disc_sens,
+                                     const bool & compute_aux_sens, const bool & store_adjPrev) {
+
+  if (!lb_active) {
+    return;
+  }
+
+  Teuchos::RCP<Epetra_MpiComm> Comm_work = MacroComm;
+  if (!server_comm.is_null()) {
+    Comm_work = server_comm;
+    if (this->haveSubgridServers()) {
+      this->sendServerCommand(SG_WORK);
+      vector<int> ints = {(int)block, isTransient, isAdjoint, compute_jacobian, compute_sens,
+                          num_active_params, compute_disc_sens, compute_aux_sens, store_adjPrev};
+      vector<double> dbls = {time};
+      ints.push_back(paramvals.size());
+      for (size_t i=0; i<paramvals.size(); i++) {
+        ints.push_back(paramtypes[i]);
+        ints.push_back(paramvals[i].size());
+        dbls.insert(dbls.end(), paramvals[i].begin(), paramvals[i].end());
+      }
+      Kokkos::View<AD**,AssemblyDevice> mparams;
+      if (subgridModels.size() > 0) {
+        mparams = subgridModels[0]->macro_paramvals_KVAD;
+      }
+      ints.push_back(mparams.dimension(0));
+      ints.push_back(mparams.dimension(1));
+      for (size_t i=0; i<mparams.dimension(0); i++) {
+        for (size_t j=0; j<mparams.dimension(1); j++) {
+          dbls.push_back(mparams(i,j).val());
+          for (int d=0; d<maxDerivs; d++) {
+            dbls.push_back(mparams(i,j).fastAccessDx(d));
+          }
+        }
+      }
+      broadcastBuffer(server_comm, MPI_INT, ints);
+      broadcastBuffer(server_comm, MPI_DOUBLE, dbls);
+    }
+  }
+
+  int numProcs = Comm_work->NumProc();
+  int b = block;
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // Send the gathered macro solution of the exported elements
+  ////////////////////////////////////////////////////////////////////////////////
+
+  vector<vector<int> > send_ints(numProcs), recv_ints;
+  vector<vector<double> > send_dbls(numProcs), recv_dbls;
+
+  for (size_t k=0; k<subgrid_exports.size(); k++) {
+    if (subgrid_exports[k][1] == b) {
+      int dest = subgrid_exports[k][0];
+      int e = subgrid_exports[k][2];
+      int c = subgrid_exports[k][3];
+      Teuchos::RCP<cell> mcell = cells[b][e];
+      send_ints[dest].push_back(e);
+      send_ints[dest].push_back(c);
+      send_ints[dest].push_back(mcell->u.dimension(1));
+      send_ints[dest].push_back(mcell->u.dimension(2));
+      send_ints[dest].push_back(mcell->phi.dimension(1));
+      send_ints[dest].push_back(mcell->phi.dimension(2));
+      send_ints[dest].push_back(mcell->subgradient.dimension(0));
+      send_ints[dest].push_back(mcell->subgradient.dimension(1));
+      for (size_t i=0; i<mcell->u.dimension(1); i++) {
+        for (size_t j=0; j<mcell->u.dimension(2); j++) {
+          send_dbls[dest].push_back(mcell->u(c,i,j));
+        }
+      }
+      for (size_t i=0; i<mcell->phi.dimension(1); i++) {
+        for (size_t j=0; j<mcell->phi.dimension(2); j++) {
+          send_dbls[dest].push_back(mcell->phi(c,i,j));
+        }
+      }
+    }
+  }
+
+  exchangeBuffers(Comm_work, MPI_INT, send_ints, recv_ints);
+  exchangeBuffers(Comm_work, MPI_DOUBLE, send_dbls, recv_dbls);
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // Solve the imported problems
+  // The macro workset residual is reset before each one, so row 0 only holds the
+  // contribution of the current problem
+  ////////////////////////////////////////////////////////////////////////////////
+
+  vector<vector<int> > ret_ints(numProcs), ret_ints_recv;
+  vector<vector<double> > ret_dbls(numProcs), ret_dbls_recv;
+
+  for (int src=0; src<numProcs; src++) {
+    size_t ip = 0, dp = 0;
+    vector<int> & ints = recv_ints[src];
+    vector<double> & dbls = recv_dbls[src];
+    while (ip < ints.size()) {
+      int e = ints[ip++];
+      int c = ints[ip++];
+      int nv = ints[ip++];
+      int nb = ints[ip++];
+      int nvphi = ints[ip++];
+      int nbphi = ints[ip++];
+      int gd0 = ints[ip++];
+      int gd1 = ints[ip++];
+
+      Kokkos::View<double***,AssemblyDevice> gl_u("remote macro solution",1,nv,nb);
+      Kokkos::View<double***,AssemblyDevice> gl_phi("remote macro adjoint",1,nvphi,nbphi);
+      for (int i=0; i<nv; i++) {
+        for (int j=0; j<nb; j++) {
+          gl_u(0,i,j) = dbls[dp++];
+        }
+      }
+      for (int i=0; i<nvphi; i++) {
+        for (int j=0; j<nbphi; j++) {
+          gl_phi(0,i,j) = dbls[dp++];
+        }
+      }
+
+      int model = -1, usernum = -1;
+      for (size_t k=0; k<subgrid_imports.size(); k++) {
+        if (subgrid_imports[k][0] == src && subgrid_imports[k][1] == b &&
+            subgrid_imports[k][2] == e && subgrid_imports[k][3] == c) {
+          model = subgrid_imports[k][4];
+          usernum = subgrid_imports[k][5];
+        }
+      }
+      TEUCHOS_TEST_FOR_EXCEPTION(model < 0,std::runtime_error,"Error: received work for a subgrid problem that was not moved to this rank");
+
+      Kokkos::View<double**,AssemblyDevice> tempgrad("remote subgrid gradient",gd0,gd1);
+      macro_wkset[b]->resetResidual();
+      subgridModels[model]->subgridSolver(gl_u, gl_phi, paramvals, paramtypes, paramnames,
+                                          time, isTransient, isAdjoint, compute_jacobian, compute_sens,
+                                          num_active_params, compute_disc_sens, compute_aux_sens,
+                                          *(macro_wkset[b]), usernum, 0, tempgrad, store_adjPrev);
+
+      ret_ints[src].push_back(e);
+      ret_ints[src].push_back(c);
+      int numres = macro_wkset[b]->res.dimension(1);
+      for (int n=0; n<numres; n++) {
+        AD rval = macro_wkset[b]->res(0,n);
+        ret_dbls[src].push_back(rval.val());
+        for (int d=0; d<maxDerivs; d++) {
+          ret_dbls[src].push_back(rval.fastAccessDx(d));
+        }
+      }
+      for (int i=0; i<gd0; i++) {
+        for (int j=0; j<gd1; j++) {
+          ret_dbls[src].push_back(tempgrad(i,j));
+        }
+      }
+    }
+  }
+  macro_wkset[b]->resetResidual();
+
+  exchangeBuffers(Comm_work, MPI_INT, ret_ints, ret_ints_recv);
+  exchangeBuffers(Comm_work, MPI_DOUBLE, ret_dbls, ret_dbls_recv);
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // Store the returned contributions on the owning cells
+  ////////////////////////////////////////////////////////////////////////////////
+
+  for (int dest=0; dest<numProcs; dest++) {
+    size_t ip = 0, dp = 0;
+    vector<int> & ints = ret_ints_recv[dest];
+    vector<double> & dbls = ret_dbls_recv[dest];
+    while (ip < ints.size()) {
+      int e = ints[ip++];
+      int c = ints[ip++];
+      Teuchos::RCP<cell> mcell = cells[b][e];
+      for (size_t n=0; n<mcell->subgrid_remote_res.dimension(1); n++) {
+        AD rval = dbls[dp++];
+        for (int d=0; d<maxDerivs; d++) {
+          rval.fastAccessDx(d) = dbls[dp++];
+        }
+        mcell->subgrid_remote_res(c,n) = rval;
+      }
+      for (size_t i=0; i<mcell->subgrid_remote_grad.dimension(1); i++) {
+        for (size_t j=0; j<mcell->subgrid_remote_grad.dimension(2); j++) {
+          mcell->subgrid_remote_grad(c,i,j) = dbls[dp++];
+        }
+      }
+    }
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// The thread copies of the models keep their own states, so all of them are released
+////////////////////////////////////////////////////////////////////////////////
+
+void MultiScale::releaseSubgridStates(const double & time) {
+  if (this->haveSubgridServers()) {
+    this->sendServerCommand(SG_RELEASE);
+    vector<double> dbls = {time};
+    broadcastBuffer(server_comm, MPI_DOUBLE, dbls);
+  }
+  for (size_t s=0; s<subgridModels.size(); s++) {
+    subgridModels[s]->releaseStates(time);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Copy the subgrid states of the current step from the ranks that solved the
+// moved problems to the owners, so the owners can compute responses, write the
+// solution and take the problems back at any time
+////////////////////////////////////////////////////////////////////////////////
+
+void MultiScale::syncSubgridStates(const Teuchos::RCP<Epetra_MpiComm> & MacroComm, const double & time,
+                                   const double & deltat, const bool & isAdjoint) {
+
+  if (!lb_active) {
+    return;
+  }
+
+  Teuchos::RCP<Epetra_MpiComm> Comm_sync = MacroComm;
+  if (!server_comm.is_null()) {
+    Comm_sync = server_comm;
+    if (this->haveSubgridServers()) {
+      this->sendServerCommand(SG_SYNC);
+      vector<int> ints = {isAdjoint};
+      vector<double> dbls = {time, deltat};
+      broadcastBuffer(server_comm, MPI_INT, ints);
+      broadcastBuffer(server_comm, MPI_DOUBLE, dbls);
+    }
+  }
+
+  int numProcs = Comm_sync->NumProc();
+  vector<vector<int> > send_ints(numProcs), recv_ints;
+  vector<vector<double> > send_dbls(numProcs), recv_dbls;
+
+  // the adjoint states are stored at the beginning of the macro step
+  double stime = time;
+  if (isAdjoint) {
+    stime = time - deltat;
+  }
+
+  for (size_t k=0; k<subgrid_imports.size(); k++) {
+    int src = subgrid_imports[k][0];
+    int model = subgrid_imports[k][4];
+    int usernum = subgrid_imports[k][5];
+    SubGridSolutionHistory & states = isAdjoint ? subgridModels[model]->adjsoln[usernum] :
+                                                  subgridModels[model]->soln[usernum];
+    int t = states.find(stime);
+    if (t >= 0) {
+      int veclen = states[t].second->MyLength();
+      send_ints[src].push_back(subgrid_imports[k][1]);
+      send_ints[src].push_back(subgrid_imports[k][2]);
+      send_ints[src].push_back(subgrid_imports[k][3]);
+      send_ints[src].push_back(veclen);
+      send_dbls[src].insert(send_dbls[src].end(), (*states[t].second)[0], (*states[t].second)[0]+veclen);
+    }
+  }
+
+  exchangeBuffers(Comm_sync, MPI_INT, send_ints, recv_ints);
+  exchangeBuffers(Comm_sync, MPI_DOUBLE, send_dbls, recv_dbls);
+
+  for (int dest=0; dest<numProcs; dest++) {
+    size_t ip = 0, dp = 0;
+    vector<int> & ints = recv_ints[dest];
+    vector<double> & dbls = recv_dbls[dest];
+    while (ip < ints.size()) {
+      int b = ints[ip++];
+      int e = ints[ip++];
+      int c = ints[ip++];
+      int veclen = ints[ip++];
+      int model = cells[b][e]->subgrid_model_index[c].back();
+      int usernum = cells[b][e]->subgrid_usernum[c];
+      vector_RCP vec = Teuchos::rcp(new Epetra_MultiVector(*(subgridModels[model]->overlapped_map),1));
+      std::copy(dbls.begin()+dp, dbls.begin()+dp+veclen, (*vec)[0]);
+      dp += veclen;
+      subgridModels[model]->solutionStorage(vec, time, isAdjoint, usernum);
+    }
+  }
+}
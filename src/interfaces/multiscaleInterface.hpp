@@ -68,6 +68,8 @@ class MultiScale {
   void writeSolution(const string & macrofilename, const vector<double> & solvetimes,
                      const int & globalPID);
   
+  void writeSubgridStep(const double & time, const int & step, const bool & is_last);
+  
   ////////////////////////////////////////////////////////////////////////////////
   // Update parameters
   ////////////////////////////////////////////////////////////////////////////////
@@ -89,10 +91,83 @@ class MultiScale {
   
   void updateMeshData(Kokkos::View<double**,HostDevice> & rotation_data);
 
+  ////////////////////////////////////////////////////////////////////////////////
+  // Cost-driven load balancing: move subgrid problems from the ranks with the most
+  // subgrid work to the ranks with the least when the imbalance exceeds a threshold
+  ////////////////////////////////////////////////////////////////////////////////
+  
+  void balanceLoad(const Teuchos::RCP<Epetra_MpiComm> & MacroComm, const double & gmin,
+                   const double & gmax, const bool & isAdjoint);
+  
+  ////////////////////////////////////////////////////////////////////////////////
+  // Transfer the states of macro-elements that switch subgrid models
+  ////////////////////////////////////////////////////////////////////////////////
+  
+  void projectSubgridStates(const size_t & newmodel, const size_t & oldmodel,
+                            const vector<int> & usernums);
+  
+  ////////////////////////////////////////////////////////////////////////////////
+  // Flag the macro-elements whose subgrid models need to be refined
+  ////////////////////////////////////////////////////////////////////////////////
+  
+  vector<bool> getRefinementFlags();
+  
+  void migrateSubgrids(const Teuchos::RCP<Epetra_MpiComm> & MacroComm);
+  
+  int moveSubgrids(const Teuchos::RCP<Epetra_MpiComm> & Comm_move);
+  
+  void restoreSubgrids();
+  
+  ////////////////////////////////////////////////////////////////////////////////
+  // Solve the subgrid problems that were moved to this rank and return the
+  // contributions to the macro residual to the owning ranks (collective)
+  ////////////////////////////////////////////////////////////////////////////////
+  
+  void exchangeSubgridWork(const Teuchos::RCP<Epetra_MpiComm> & MacroComm, const size_t & block,
+                           const vector<vector<double> > & paramvals,
+                           const vector<int> & paramtypes, const vector<string> & paramnames,
+                           const double & time, const bool & isTransient, const bool & isAdjoint,
+                           const bool & compute_jacobian, const bool & compute_sens,
+                           const int & num_active_params, const bool & compute_disc_sens,
+                           const bool & compute_aux_sens, const bool & store_adjPrev);
+  
+  ////////////////////////////////////////////////////////////////////////////////
+  // Send the new subgrid states back to the owning ranks after a time step (collective)
+  ////////////////////////////////////////////////////////////////////////////////
+  
+  void syncSubgridStates(const Teuchos::RCP<Epetra_MpiComm> & MacroComm, const double & time,
+                         const double & deltat, const bool & isAdjoint);
+  
+  ////////////////////////////////////////////////////////////////////////////////
+  // Free the stored forward subgrid states of a macro step once the adjoint is done with it
+  ////////////////////////////////////////////////////////////////////////////////
+  
+  void releaseSubgridStates(const double & time);
+  
+  ////////////////////////////////////////////////////////////////////////////////
+  // Dedicated subgrid ranks: the macro rank of a group moves its subgrid problems
+  // to the other ranks of the group, which run serveSubgrids until stopSubgridServers
+  ////////////////////////////////////////////////////////////////////////////////
+  
+  void setSubgridServers(const Teuchos::RCP<Epetra_MpiComm> & GroupComm,
+                         const bool & is_server_, const bool & macro_solves_subgrids_);
+  
+  void distributeToServers();
+  
+  void serveSubgrids();
+  
+  void stopSubgridServers();
+  
+  bool haveSubgridServers();
+  
+  void sendServerCommand(int cmd);
+  
   ////////////////////////////////////////////////////////////////////////////////
   ////////////////////////////////////////////////////////////////////////////////
   
   bool subgrid_static;
+  int verbosity;
+  int num_model_types, num_threads; // subgridModels holds num_threads copies of each model type
   vector<Teuchos::RCP<SubGridModel> > subgridModels;
   Teuchos::RCP<Epetra_MpiComm> Comm;
   Teuchos::RCP<Teuchos::ParameterList> settings;
@@ -105,6 +180,30 @@ class MultiScale {
   vector<Amesos_BaseSolver*> subgrid_projection_solvers;
   vector<Teuchos::RCP<Epetra_LinearProblem> > subgrid_projection_linsys;
   Teuchos::RCP<FunctionInterface> macro_functionManager;
+  
+  // load balancing
+  double lb_threshold;
+  int lb_interval, lb_steps;
+  bool lb_active;
+  vector<vector<int> > subgrid_exports; // (destination rank, block, cell, element)
+  vector<vector<int> > subgrid_imports; // (source rank, block, cell, element, model, usernum)
+  std::map<vector<int>, int> subgrid_import_pool; // (source rank, block, cell, element, model) -> usernum
+  
+  // dedicated subgrid ranks
+  enum ServerCommand {SG_STOP, SG_SETUP, SG_WORK, SG_SYNC, SG_RELEASE};
+  Teuchos::RCP<Epetra_MpiComm> server_comm; // macro rank and its subgrid ranks (macro rank is 0)
+  bool is_server, macro_solves_subgrids;
+  vector<string> macro_paramnames;
+  
+  // adaptive refinement
+  bool adaptive_refinement, is_transient;
+  double refinement_tol, refinement_time; // time of the last states checked
+  
+  // incremental output
+  bool incremental_output;
+  int output_stride;
+  string output_file;
+  double output_time; // time of the last step written
 };
 
 #endif
@@ -144,12 +144,17 @@ void postprocess::computeError(const vector_RCP & F_soln) {
   
   int numSteps = F_soln->NumVectors();
   vector<double> solvetimes = solve->solvetimes;
+  if (solve->checkpoints->storage == "disk") { // F_soln does not hold the time history
+    numSteps = solvetimes.size();
+  }
   
   
   for (size_t b=0; b<cells.size(); b++) {
     Kokkos::View<double**,AssemblyDevice> localerror("error",numSteps,numVars[b]);
     for (size_t t=0; t<solvetimes.size(); t++) {
-      solve->performGather(b,F_soln,0,t);
+      size_t col = t;
+      vector_RCP F_step = this->getSolutionStep(F_soln, t, col);
+      solve->performGather(b,F_step,0,col);
       for (size_t e=0; e<cells[b].size(); e++) {
         int numElem = cells[b][e]->numElem;
         Kokkos::View<double**,AssemblyDevice> localerrs = cells[b][e]->computeError(solvetimes[t], t, compute_subgrid_error, error_type);
@@ -223,7 +228,9 @@ AD postprocess::computeObjective(const vector_RCP & F_soln) {
   for (size_t tt=0; tt<solvetimes.size(); tt++) {
     for (size_t b=0; b<cells.size(); b++) {
       
-      solve->performGather(b,F_soln,0,tt);
+      size_t col = tt;
+      vector_RCP F_step = this->getSolutionStep(F_soln, tt, col);
+      solve->performGather(b,F_step,0,col);
       solve->performGather(b,P_soln,4,0);
       
       for (size_t e=0; e<cells[b].size(); e++) {
@@ -367,11 +374,13 @@ Kokkos::View<double***,HostDevice> postprocess::computeResponse(const vector_RCP
   
   for (size_t tt=0; tt<solvetimes.size(); tt++) {
     
-    solve->performGather(b,F_soln,0,tt);
+    size_t col = tt;
+    vector_RCP F_step = this->getSolutionStep(F_soln, tt, col);
+    solve->performGather(b,F_step,0,col);
     solve->performGather(b,P_soln,4,0);
     
     for (size_t e=0; e<cells[b].size(); e++) {
-      wkset[b]->update(cells[b][e]->ip, cells[b][e]->ijac, cells[b][e]->orientation);
+      wkset[b]->update(cells[b][e]->ip, cells[b][e]->ijac, cells[b][e]->orientation, cells[b][e]->cellID);
       
       Kokkos::View<AD***,AssemblyDevice> responsevals = cells[b][e]->computeResponse(solvetimes[tt], tt, 0);
       
@@ -579,11 +588,16 @@ void postprocess::writeSolution(const vector_RCP & E_soln, const std::string & f
     mesh->setupExodusFile(filename);
   }
   
-  int numSteps = E_soln->NumVectors();
   vector<double> solvetimes = solve->solvetimes;
+  int numSteps = E_soln->NumVectors();
+  if (solve->checkpoints->isActive()) {
+    numSteps = solvetimes.size();
+  }
   
   Kokkos::View<double**,HostDevice> dispz("dispz",cells[0].size(), numNodesPerElem);
   for(int m=0; m<numSteps; m++) {
+    size_t col = m;
+    vector_RCP E_step = this->getSolutionStep(E_soln, m, col);
     for (size_t b=0; b<cells.size(); b++) {
       std::string blockID = blocknames[b];
       vector<vector<int> > curroffsets = phys->offsets[b];
@@ -606,11 +620,11 @@ void postprocess::writeSolution(const vector_RCP & E_soln, const std::string & f
               int pindex = E_overlapped_map->LID(GIDs[curroffsets[n][i]]);
               if (numBasis[b][n] == 1) {
                 for( int j=0; j<numNodesPerElem; j++ ) {
-                  soln_computed(eprog,j) = (*E_soln)[m][pindex];
+                  soln_computed(eprog,j) = (*E_step)[col][pindex];
                 }
               }
               else {
-                soln_computed(eprog,i) = (*E_soln)[m][pindex];
+                soln_computed(eprog,i) = (*E_step)[col][pindex];
               }
               if (use_sol_mod_mesh && sol_to_mod_mesh == n) {
                 if (abs(soln_computed(e,i)) >= meshmod_TOL) {
@@ -839,7 +853,7 @@ void postprocess::writeSolution(const vector_RCP & E_soln, const std::string & f
             }
           }
         }
-        cells[b][k]->updateSolnWorkset(E_soln, m); // also updates ip, ijac
+        cells[b][k]->updateSolnWorkset(E_step, col); // also updates ip, ijac
         cells[b][k]->updateData();
         wkset[b]->time = solvetimes[m];
         Kokkos::View<double***,HostDevice> cfields = phys->getExtraCellFields(b, cells[b][k]->numElem);
@@ -926,7 +940,8 @@ void postprocess::writeSolution(const vector_RCP & E_soln, const std::string & f
   if (save_height_file) {
     ofstream hOUT("meshpert.dat");
     hOUT.precision(10);
-    int numsteps = E_soln->NumVectors();
+    size_t col = numSteps-1;
+    vector_RCP E_final = this->getSolutionStep(E_soln, numSteps-1, col);
     for (size_t b=0; b<numBlocks; b++) {
       std::string blockID = blocknames[b];
       vector<vector<int> > curroffsets = phys->offsets[b];
@@ -938,7 +953,7 @@ void postprocess::writeSolution(const vector_RCP & E_soln, const std::string & f
             vector<int> GIDs = cells[b][e]->GIDs[p];
             for( int i=0; i<numBasis[b][n]; i++ ) {
               int pindex = E_overlapped_map->LID(GIDs[curroffsets[n][i]]);
-              double soln = (*E_soln)[numsteps-1][pindex];
+              double soln = (*E_final)[col][pindex];
               hOUT << nodes(p,i,0) << "  " << nodes(p,i,1) << "  " << soln << endl;
             }
           }
@@ -966,6 +981,22 @@ void postprocess::writeSolution(const vector_RCP & E_soln, const std::string & f
 }
 
 
+// ========================================================================================
+// Return the vector holding the forward solution at time index tindex and its column
+// When the solver keeps the time history outside of F_soln (e.g., on disk), the state
+// is read back from the solver one step at a time
+// ========================================================================================
+
+vector_RCP postprocess::getSolutionStep(const vector_RCP & F_soln, const size_t & tindex, size_t & col) {
+  if (solve->checkpoints->isActive()) {
+    TEUCHOS_TEST_FOR_EXCEPTION(!solve->checkpoints->haveFullHistory(),std::runtime_error,"Error: the forward time history is not available for postprocessing when adjoint checkpointing is used");
+    col = 0;
+    return solve->checkpoints->retrieve(tindex);
+  }
+  col = tindex;
+  return F_soln;
+}
+
 // ========================================================================================
 // ========================================================================================
 
@@ -72,6 +72,11 @@ public:
   // ========================================================================================
   // ========================================================================================
   
+  vector_RCP getSolutionStep(const vector_RCP & F_soln, const size_t & tindex, size_t & col);
+  
+  // ========================================================================================
+  // ========================================================================================
+  
   double makeSomeNoise(double stdev);
   
 protected:
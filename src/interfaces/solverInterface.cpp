@@ -13,6 +13,7 @@
 #include "solverInterface.hpp"
 #include "discretizationTools.hpp"
 #include "workset.hpp"
+#include "threadSupport.hpp"
 #include <boost/algorithm/string.hpp>
 
 
@@ -85,6 +86,23 @@ Comm(Comm_), mesh(mesh_), disc(disc_), phys(phys_), DOF(DOF_), cells(cells_) {
   usePrec = settings->sublist("Solver").get<bool>("use preconditioner",true);
   dropTol = settings->sublist("Solver").get<double>("ILU drop tol",0.0); //defaults to AztecOO default
   fillParam = settings->sublist("Solver").get<double>("ILU fill param",3.0); //defaults to AztecOO default
+  // The stored factors are those of the Jacobian at the converged state of each step: for linear
+  // problems these are the factors of the Newton correction, and otherwise the converged Jacobian
+  // is factored once more.  The factors are only used if the adjoint Dirichlet values are zero
+  // (see linearSolver).
+  reuse_factorization = settings->sublist("Solver").get<bool>("Reuse forward factorization for adjoint",false);
+  max_stored_factorizations = settings->sublist("Solver").get<int>("Max stored factorizations",-1); // -1 means every time step
+  pipeline_subgrids = settings->sublist("Solver").get<bool>("Pipeline subgrid solves",false);
+  if (pipeline_subgrids) {
+    string reason;
+    if (!threadedSolvesSupported(reason)) {
+      if (Comm->MyPID() == 0) {
+        cout << "**** Warning: " << reason << ", so the subgrid solves will not be pipelined" << endl;
+      }
+      pipeline_subgrids = false;
+    }
+  }
+  current_step = 0;
   
   use_custom_initial_param_guess= settings->sublist("Physics").get<bool>("use custom initial param guess",false);
   
@@ -142,6 +160,21 @@ Comm(Comm_), mesh(mesh_), disc(disc_), phys(phys_), DOF(DOF_), cells(cells_) {
   globalNumUnknowns = 0;
   Comm->SumAll(&localNumUnknowns, &globalNumUnknowns, 1);
   
+  // Checkpointing and out-of-core storage of the forward states
+  checkpoints = Teuchos::rcp(new CheckpointManager(settings, numsteps, numUnknownsOS, isTransient, Comm->MyPID()));
+  if (checkpoints->isActive()) {
+    TEUCHOS_TEST_FOR_EXCEPTION(time_order != 1,std::runtime_error,"Error: adjoint checkpointing and disk storage are only implemented for time order 1");
+    TEUCHOS_TEST_FOR_EXCEPTION(allow_remesh,std::runtime_error,"Error: adjoint checkpointing and disk storage can not be used with remeshing");
+    if (Comm->MyPID() == 0 && verbosity > 0) {
+      if (checkpoints->haveFullHistory()) {
+        cout << "***** Storing the forward states on disk" << endl;
+      }
+      else {
+        cout << "***** Using " << checkpoints->type << " adjoint checkpointing with a budget of " << checkpoints->budget << " states (" << checkpoints->storage << ")" << endl;
+      }
+    }
+  }
+  
   // needed information from the disc interface
   vector<vector<int> > cards = disc->cards;
   
@@ -964,6 +997,7 @@ vector<double> solver::getDiscretizedParamsVector() {
 
 vector_RCP solver::forwardModel(DFAD & obj) {
   useadjoint = false;
+  this->releaseFactorization(-1);
   
   this->sacadoizeParams(false);
   
@@ -974,7 +1008,7 @@ vector_RCP solver::forwardModel(DFAD & obj) {
   
   vector_RCP I_soln = Teuchos::rcp(new LA_MultiVector(*LA_overlapped_map,1)); // empty solution
   int numsols = 1;
-  if (solver_type == "transient") {
+  if (solver_type == "transient" && !checkpoints->isActive()) {
     numsols = numsteps+1;
   }
   
@@ -984,6 +1018,10 @@ vector_RCP solver::forwardModel(DFAD & obj) {
     for( size_t i=0; i<LA_ownedAndShared.size(); i++ ) {
       (*F_soln)[0][i] = (*initial)[0][i];
     }
+    if (checkpoints->isActive()) {
+      checkpoints->clear();
+      checkpoints->store(0, initial);
+    }
   }
   if (solver_type == "steady-state") {
     
@@ -992,6 +1030,7 @@ vector_RCP solver::forwardModel(DFAD & obj) {
       (*SS_soln)[0][i] = (*initial)[0][i];
     }
     
+    current_step = 0;
     this->nonlinearSolver(SS_soln, zero_soln, zero_soln, zero_soln, 0.0, 1.0);
     for( size_t i=0; i<LA_ownedAndShared.size(); i++ ) {
       (*F_soln)[0][i] = (*SS_soln)[0][i];
@@ -1030,7 +1069,7 @@ vector_RCP solver::forwardModel_fr(DFAD & obj, double yt, double st) {
   
   vector_RCP I_soln = Teuchos::rcp(new LA_MultiVector(*LA_overlapped_map,1)); // empty solution
   int numsols = 1;
-  if (solver_type == "transient") {
+  if (solver_type == "transient" && !checkpoints->isActive()) {
     numsols = numsteps+1;
   }
   
@@ -1040,6 +1079,10 @@ vector_RCP solver::forwardModel_fr(DFAD & obj, double yt, double st) {
     for( size_t i=0; i<LA_ownedAndShared.size(); i++ ) {
       (*F_soln)[0][i] = (*initial)[0][i];
     }
+    if (checkpoints->isActive()) {
+      checkpoints->clear();
+      checkpoints->store(0, initial);
+    }
   }
   if (solver_type == "steady-state") {
     
@@ -1048,6 +1091,7 @@ vector_RCP solver::forwardModel_fr(DFAD & obj, double yt, double st) {
       (*SS_soln)[0][i] = (*initial)[0][i];
     }
     
+    current_step = 0;
     this->nonlinearSolver(SS_soln, zero_soln, zero_soln, zero_soln, 0.0, 1.0);
     for( size_t i=0; i<LA_ownedAndShared.size(); i++ ) {
       (*F_soln)[0][i] = (*SS_soln)[0][i];
@@ -1083,10 +1127,18 @@ vector_RCP solver::adjointModel(vector_RCP & F_soln, vector<double> & gradient)
   
   // Solve the forward problem
   int numsols = 1;
-  if (solver_type == "transient") {
+  if (solver_type == "transient" && !checkpoints->isActive()) {
     numsols = numsteps+1;
   }
   
+  if (checkpoints->isActive()) {
+    TEUCHOS_TEST_FOR_EXCEPTION(cells[0][0]->multiscale,std::runtime_error,"Error: adjoint checkpointing and disk storage are not implemented for multiscale problems");
+  }
+  
+  if (!reuse_factorization) {
+    this->releaseFactorization(-1);
+  }
+  
   vector_RCP zero_soln = Teuchos::rcp(new LA_MultiVector(*LA_overlapped_map,1)); // empty solution
   vector_RCP A_soln = Teuchos::rcp(new LA_MultiVector(*LA_overlapped_map,numsols)); // empty solution
   for( size_t i=0; i<ownedAndShared.size(); i++ ) {
@@ -1099,6 +1151,7 @@ vector_RCP solver::adjointModel(vector_RCP & F_soln, vector<double> & gradient)
     for( size_t i=0; i<ownedAndShared.size(); i++ ) {
       (*L_soln)[0][i] = (*F_soln)[0][i];
     }
+    current_step = 0;
     this->nonlinearSolver(L_soln, zero_soln, SS_soln, zero_soln, 0.0, 1.0);
     for( size_t i=0; i<ownedAndShared.size(); i++ ) {
       (*A_soln)[0][i] = (*SS_soln)[0][i];
@@ -1129,6 +1182,7 @@ void solver::transientSolver(vector_RCP & initial, vector_RCP & L_soln,
   vector_RCP u_dot = Teuchos::rcp(new LA_MultiVector(*LA_overlapped_map,1));
   vector_RCP phi = Teuchos::rcp(new LA_MultiVector(*LA_overlapped_map,1));
   vector_RCP phi_dot = Teuchos::rcp(new LA_MultiVector(*LA_overlapped_map,1));
+  vector_RCP u_prev = Teuchos::rcp(new LA_MultiVector(*LA_overlapped_map,1));
   
   //int numSteps = 1;
   //double finaltime = 0.0;
@@ -1177,10 +1231,36 @@ void solver::transientSolver(vector_RCP & initial, vector_RCP & L_soln,
       if(Comm->MyPID() == 0 && verbosity>0) {
         cout << "***** Load Balancing Factor " << gmax/gmin <<  endl;
       }
+      multiscale_manager->balanceLoad(Comm, gmin, gmax, useadjoint);
+      
+      // hit rate of the subgrid response caches (cumulative)
+      double my_cache[2] = {0.0, 0.0};
+      for (size_t k=0; k<multiscale_manager->subgridModels.size(); k++) {
+        if (!multiscale_manager->subgridModels[k]->response_cache.is_null()) {
+          my_cache[0] += multiscale_manager->subgridModels[k]->response_cache->hits;
+          my_cache[1] += multiscale_manager->subgridModels[k]->response_cache->lookups;
+        }
+      }
+      double gl_cache[2] = {0.0, 0.0};
+      Comm->SumAll(my_cache, gl_cache, 2);
+      if(Comm->MyPID() == 0 && verbosity>0 && gl_cache[1] > 0.0) {
+        cout << "***** Subgrid Cache Hit Rate " << gl_cache[0]/gl_cache[1] << " (" << gl_cache[0] << " of " << gl_cache[1] << " solves)" << endl;
+      }
     }
     
     if (!useadjoint) {
       current_time += deltat;
+      current_step = timeiter+1;
+    }
+    else {
+      current_step = numsteps-timeiter;
+    }
+    
+    // with checkpointing or disk storage, only the most recent state is kept in SolMat
+    int prevcol = timeiter, nextcol = timeiter+1;
+    if (checkpoints->isActive()) {
+      prevcol = 0;
+      nextcol = 0;
     }
     
     if(Comm->MyPID() == 0 && verbosity > 0) {
@@ -1190,7 +1270,16 @@ void solver::transientSolver(vector_RCP & initial, vector_RCP & L_soln,
       cout << "*******************************************************" << endl << endl << endl;
     }
     
-    if (useadjoint) {
+    if (useadjoint && checkpoints->isActive()) {
+      // the forward states are recovered from the checkpoints
+      this->recoverForwardStates(numsteps-timeiter, u, u_prev);
+      current_step = numsteps-timeiter;
+      for( size_t i=0; i<LA_ownedAndShared.size(); i++ ) {
+        (*u_dot)[0][i] = alpha*(*u)[0][i] - alpha*(*u_prev)[0][i];
+      }
+      phi_dot->PutScalar(0.0);
+    }
+    else if (useadjoint) {
       // phi is updated automatically
       // need to update phi_dot, u, u_dot
       for( size_t i=0; i<LA_ownedAndShared.size(); i++ ) {
@@ -1215,7 +1304,7 @@ void solver::transientSolver(vector_RCP & initial, vector_RCP & L_soln,
       // need to update u_dot (no need to update phi or phi_dot)
       if (time_order == 1 || timeiter == 0) {
         for( size_t i=0; i<LA_ownedAndShared.size(); i++ ) {
-          (*u_dot)[0][i] = alpha*(*u)[0][i] - alpha*(*SolMat)[timeiter][i];
+          (*u_dot)[0][i] = alpha*(*u)[0][i] - alpha*(*SolMat)[prevcol][i];
         }
       }
       else if (time_order == 2) {
@@ -1227,14 +1316,20 @@ void solver::transientSolver(vector_RCP & initial, vector_RCP & L_soln,
     
     this->nonlinearSolver(u, u_dot, phi, phi_dot, alpha, beta);
     
+    multiscale_manager->syncSubgridStates(Comm, current_time, deltat, useadjoint);
+    
     if (!useadjoint) {
+      multiscale_manager->writeSubgridStep(current_time, timeiter+1, timeiter+1 == numsteps);
       for( int i=0; i<LA_ownedAndShared.size(); i++ ) {
-        (*SolMat)[timeiter+1][i] = (*u)[0][i];
+        (*SolMat)[nextcol][i] = (*u)[0][i];
+      }
+      if (checkpoints->isActive() && checkpoints->storeForward(timeiter+1)) {
+        checkpoints->store(timeiter+1, u);
       }
     }
     else {
       for( int i=0; i<LA_ownedAndShared.size(); i++ ) {
-        (*SolMat)[timeiter+1][i] = (*phi)[0][i];
+        (*SolMat)[nextcol][i] = (*phi)[0][i];
       }
     }
     
@@ -1246,8 +1341,13 @@ void solver::transientSolver(vector_RCP & initial, vector_RCP & L_soln,
     }
     
     if (useadjoint) { // fill in the gradient
+      this->releaseFactorization(numsteps-timeiter);
       this->computeSensitivities(u,u_dot,phi,gradient,alpha,beta);
       this->sacadoizeParams(false);
+      if (checkpoints->isActive() && !checkpoints->haveFullHistory()) {
+        checkpoints->release(numsteps-timeiter);
+      }
+      multiscale_manager->releaseSubgridStates(current_time);
     }
     else if (compute_objective) { // fill in the objective function
       DFAD cobj = this->computeObjective(u, current_time, timeiter);
@@ -1272,6 +1372,66 @@ void solver::transientSolver(vector_RCP & initial, vector_RCP & L_soln,
   }
 }
 
+// ========================================================================================
+// Advance a forward state by one time step (used to recompute states between checkpoints)
+// ========================================================================================
+
+void solver::forwardStep(vector_RCP & u, const int & step) {
+  
+  bool curradjstatus = useadjoint;
+  bool currfinal = is_final_time;
+  double currtime = current_time;
+  int currstep = current_step;
+  
+  useadjoint = false;
+  is_final_time = false;
+  current_time = solvetimes[step+1];
+  current_step = step+1;
+  
+  double alpha = 1.0/(solvetimes[step+1] - solvetimes[step]);
+  double beta = 1.0;
+  
+  // u_dot = alpha*(u - u_prev) vanishes for the initial guess u = u_prev
+  vector_RCP u_dot = Teuchos::rcp(new LA_MultiVector(*LA_overlapped_map,1));
+  vector_RCP phi = Teuchos::rcp(new LA_MultiVector(*LA_overlapped_map,1));
+  vector_RCP phi_dot = Teuchos::rcp(new LA_MultiVector(*LA_overlapped_map,1));
+  
+  this->nonlinearSolver(u, u_dot, phi, phi_dot, alpha, beta);
+  
+  useadjoint = curradjstatus;
+  is_final_time = currfinal;
+  current_time = currtime;
+  current_step = currstep;
+}
+
+// ========================================================================================
+// Recover the forward states at step and step-1 for the adjoint sweep
+// The state at step is always stored since the adjoint sweeps backwards in time
+// ========================================================================================
+
+void solver::recoverForwardStates(const int & step, vector_RCP & u_curr, vector_RCP & u_prev) {
+  
+  if (!checkpoints->isStored(step-1)) {
+    int from = checkpoints->nearestStored(step-1);
+    vector<int> keep = checkpoints->getRecomputeSteps(from, step-1);
+    
+    if(Comm->MyPID() == 0 && verbosity > 1) {
+      cout << "***** Recomputing forward states " << from+1 << " to " << step-1 << " from checkpoint " << from << endl;
+    }
+    
+    vector_RCP u = Teuchos::rcp(new LA_MultiVector(*(checkpoints->retrieve(from))));
+    for (int s=from; s<step-1; s++) {
+      this->forwardStep(u, s);
+      if (s+1 == step-1 || std::find(keep.begin(), keep.end(), s+1) != keep.end()) {
+        checkpoints->store(s+1, u);
+      }
+    }
+  }
+  
+  u_curr->Update(1.0, *(checkpoints->retrieve(step)), 0.0);
+  u_prev->Update(1.0, *(checkpoints->retrieve(step-1)), 0.0);
+}
+
 // ========================================================================================
 // ========================================================================================
 
@@ -1418,6 +1578,9 @@ void solver::nonlinearSolver(vector_RCP & u, vector_RCP & u_dot,
        }*/
       
     }
+    else if (!useadjoint && reuse_factorization) {
+      this->storeConvergedFactorization(J);
+    }
     
     NLiter++; // increment number of iterations
   } // while loop
@@ -1494,6 +1657,9 @@ void solver::remesh(const vector_RCP & u) {
       }
     }
   }
+  
+  // the cached function values depend on the geometry
+  phys->functionManager->clearCache();
 }
 
 // ========================================================================================
@@ -2051,6 +2217,7 @@ void solver::updateJacDBC(matrix_RCP & J, size_t & e, size_t & block, int & fiel
       }
       double val = 1.0; // set diagonal entry to 1
       J->ReplaceGlobalValues(row, 1, &val, &row);
+      dbc_rows.push_back(row);
     }
   }
 }
@@ -2077,6 +2244,7 @@ void solver::updateJacDBC(matrix_RCP & J, const vector<int> & dofs, const bool &
       }
       double val = 1.0; // set diagonal entry to 1
       J->ReplaceGlobalValues(dofs[i], 1, &val, &dofs[i]);
+      dbc_rows.push_back(dofs[i]);
     }
   }
 }
@@ -2406,14 +2574,43 @@ void solver::computeJacRes(vector_RCP & u, vector_RCP & u_dot,
       }
     }
     
+    // subgrid problems that were moved to other ranks are solved there
+    if (cells[0][0]->multiscale) {
+      multiscale_manager->exchangeSubgridWork(Comm, b, paramvals, paramtypes, paramnames,
+                                              current_time, isTransient, useadjoint, compute_jacobian,
+                                              compute_sens, num_active_params, compute_disc_sens,
+                                              false, store_adjPrev);
+    }
+    
     /////////////////////////////////////////////////////////////////////////////
     // Volume contribution
     /////////////////////////////////////////////////////////////////////////////
     
+    bool pipelined = pipeline_subgrids && cells[b][0]->multiscale;
+    
+    // wait for the subgrid thread if anything below throws
+    // (destroying or reassigning a joinable std::thread calls std::terminate)
+    struct JoinGuard {
+      std::thread & thread;
+      ~JoinGuard() {
+        if (thread.joinable()) {
+          thread.join();
+        }
+      }
+    } subgrid_join_guard = {subgrid_thread};
+    
+    if (pipelined) {
+      wkset[b]->localEID = 0;
+      cells[b][0]->updateData();
+      this->launchSubgridSolves(b, 0, compute_jacobian, compute_sens, compute_disc_sens);
+    }
+    
     for (size_t e=0; e < cells[b].size(); e++) {
       
-      wkset[b]->localEID = e;
-      cells[b][e]->updateData();
+      if (!pipelined) { // otherwise, this is done before the subgrid solves of the cell are launched
+        wkset[b]->localEID = e;
+        cells[b][e]->updateData();
+      }
       
       
       if (isTransient && useadjoint && !cells[0][0]->multiscale) {
@@ -2449,10 +2646,23 @@ void solver::computeJacRes(vector_RCP & u, vector_RCP & u_dot,
           }
         }
         
-        cells[b][e]->computeJacRes(paramvals, paramtypes, paramnames,
-                                   current_time, isTransient, useadjoint, compute_jacobian, compute_sens,
-                                   num_active_params, compute_disc_sens, false, store_adjPrev,
-                                   local_res, local_J, local_Jdot);
+        if (pipelined) {
+          this->finishSubgridSolves();
+          if (e+1 < cells[b].size()) {
+            wkset[b]->localEID = e+1;
+            cells[b][e+1]->updateData();
+            this->launchSubgridSolves(b, e+1, compute_jacobian, compute_sens, compute_disc_sens);
+          }
+          // only the stored contributions and the (fixed) offsets of the workset are used here
+          cells[b][e]->fillSubgridJacRes(cells[b][e]->subgrid_res, compute_jacobian, compute_sens,
+                                         local_res, local_J);
+        }
+        else {
+          cells[b][e]->computeJacRes(paramvals, paramtypes, paramnames,
+                                     current_time, isTransient, useadjoint, compute_jacobian, compute_sens,
+                                     num_active_params, compute_disc_sens, false, store_adjPrev,
+                                     local_res, local_J, local_Jdot);
+        }
         
       }
       
@@ -2523,6 +2733,9 @@ void solver::computeJacRes(vector_RCP & u, vector_RCP & u_dot,
   if (usestrongDBCs) {
     Teuchos::TimeMonitor localtimer(*dbctimer);
     vector<vector<int> > fixedDOFs = phys->dbc_dofs;
+    if (compute_jacobian && !compute_disc_sens) {
+      dbc_rows.clear(); // filled by updateJacDBC
+    }
     for (size_t b=0; b<cells.size(); b++) {
       vector<size_t> boundDirichletElemIDs;   // list of elements on the Dirichlet boundary
       vector<size_t> localDirichletSideIDs;   // local side numbers for Dirichlet boundary sides
@@ -2560,6 +2773,42 @@ void solver::computeJacRes(vector_RCP & u, vector_RCP & u_dot,
 }
 
 
+// ========================================================================================
+// The subgrid problems of one cell (and the copy of their contributions) on a
+// separate thread.  The cell data must already be in the macro workset (updateData).
+// Until the thread is joined, the main thread does not write to the workset: it only
+// fills the previous cell from its stored contributions and inserts them.
+// ========================================================================================
+
+void solver::launchSubgridSolves(const size_t & block, const size_t & cellnum,
+                                 const bool & compute_jacobian, const bool & compute_sens,
+                                 const bool & compute_disc_sens) {
+  Teuchos::RCP<cell> sgcell = cells[block][cellnum];
+  subgrid_error = nullptr;
+  subgrid_thread = std::thread([=]() {
+    try {
+      sgcell->solveSubgrids(paramvals, paramtypes, paramnames, current_time, isTransient, useadjoint,
+                            compute_jacobian, compute_sens, num_active_params, compute_disc_sens,
+                            false, store_adjPrev);
+      sgcell->storeSubgridResidual();
+    }
+    catch (...) {
+      subgrid_error = std::current_exception();
+    }
+  });
+}
+
+void solver::finishSubgridSolves() {
+  if (subgrid_thread.joinable()) {
+    subgrid_thread.join();
+  }
+  if (subgrid_error) {
+    std::exception_ptr error = subgrid_error;
+    subgrid_error = nullptr;
+    std::rethrow_exception(error);
+  }
+}
+
 // ========================================================================================
 // ========================================================================================
 
@@ -2568,21 +2817,76 @@ void solver::linearSolver(matrix_RCP & J, vector_RCP & r, vector_RCP & soln)  {
   
   LA_LinearProblem LinSys(J.get(), soln.get(), r.get());
   
+  // The adjoint operator is the transpose of the forward Jacobian at the same state,
+  // so a factorization stored during the forward solve can be reused
+  bool have_stored = useadjoint && reuse_factorization &&
+                     stored_problems.find(current_step) != stored_problems.end();
+  bool store_factorization = !useadjoint && reuse_factorization;
+  
+  // The strong Dirichlet conditions replace rows, so they become columns in the transposed
+  // forward operator.  The transpose leaves out the coupling of the other rows to the Dirichlet
+  // values, which is only exact if the adjoint Dirichlet values are zero.
+  if (have_stored && useDirect) {
+    vector<int> & rows = stored_dbc_rows[current_step];
+    double localmax = 0.0, globalmax = 0.0;
+    for (size_t k=0; k<rows.size(); k++) {
+      int lid = J->LRID(rows[k]);
+      if (lid >= 0) {
+        localmax = std::max(localmax, std::abs((*r)[0][lid]));
+      }
+    }
+    Comm->MaxAll(&localmax, &globalmax, 1);
+    if (globalmax > 0.0) {
+      have_stored = false;
+    }
+  }
+  
   // SOLVE ....
   if (useDirect) {
-    Amesos AmFactory;
-    char* SolverType = "Amesos_Klu";
-    Amesos_BaseSolver * AmSolver = AmFactory.Create(SolverType, LinSys);
-    AmSolver->SymbolicFactorization();
-    AmSolver->NumericFactorization();
-    AmSolver->Solve();
-    delete AmSolver;
+    if (have_stored) {
+      Teuchos::RCP<LA_LinearProblem> storedSys = stored_problems[current_step];
+      storedSys->SetLHS(soln.get());
+      storedSys->SetRHS(r.get());
+      Teuchos::RCP<Amesos_BaseSolver> AmSolver = stored_direct[current_step];
+      AmSolver->SetUseTranspose(true);
+      AmSolver->Solve();
+      AmSolver->SetUseTranspose(false);
+      
+      // the Dirichlet values are not given by the transposed rows (they are zero, see above)
+      vector<int> & rows = stored_dbc_rows[current_step];
+      for (size_t k=0; k<rows.size(); k++) {
+        int lid = J->LRID(rows[k]);
+        if (lid >= 0) {
+          (*soln)[0][lid] = (*r)[0][lid];
+        }
+      }
+    }
+    else if (store_factorization) {
+      Teuchos::RCP<LA_LinearProblem> storedSys = Teuchos::rcp(new LA_LinearProblem(J.get(), soln.get(), r.get()));
+      Amesos AmFactory;
+      char* SolverType = "Amesos_Klu";
+      Teuchos::RCP<Amesos_BaseSolver> AmSolver = Teuchos::rcp(AmFactory.Create(SolverType, *storedSys));
+      AmSolver->SymbolicFactorization();
+      AmSolver->NumericFactorization();
+      AmSolver->Solve();
+      this->storeFactorization(J, storedSys, AmSolver, Teuchos::null);
+    }
+    else {
+      Amesos AmFactory;
+      char* SolverType = "Amesos_Klu";
+      Amesos_BaseSolver * AmSolver = AmFactory.Create(SolverType, LinSys);
+      AmSolver->SymbolicFactorization();
+      AmSolver->NumericFactorization();
+      AmSolver->Solve();
+      delete AmSolver;
+    }
   }
   else {
     AztecOO linsolver(LinSys);
     
     // Set up the preconditioner
     ML_Epetra::MultiLevelPreconditioner* MLPrec;
+    bool delete_prec = true;
     
     linsolver.SetAztecOption(AZ_solver,AZ_gmres);
     if(useDomDecomp){ //domain decomposition preconditioner, specific to Helmholtz at high frequencies
@@ -2626,7 +2930,19 @@ void solver::linearSolver(matrix_RCP & J, vector_RCP & r, vector_RCP & soln)  {
     }
     
     else if (usePrec) { //multi-level preconditioner
-      MLPrec = buildPreconditioner(J);
+      if (have_stored && stored_prec[current_step] != Teuchos::null) {
+        // the forward hierarchy is exact for symmetric operators and still a
+        // useful preconditioner otherwise
+        MLPrec = stored_prec[current_step].get();
+        delete_prec = false;
+      }
+      else {
+        MLPrec = buildPreconditioner(J);
+        if (store_factorization) {
+          this->storeFactorization(J, Teuchos::null, Teuchos::null, Teuchos::rcp(MLPrec));
+          delete_prec = false;
+        }
+      }
       linsolver.SetPrecOperator(MLPrec);
     }
     else {
@@ -2641,7 +2957,7 @@ void solver::linearSolver(matrix_RCP & J, vector_RCP & r, vector_RCP & soln)  {
     
     linsolver.Iterate(liniter,lintol);
     
-    if(!useDomDecomp && usePrec)
+    if(!useDomDecomp && usePrec && delete_prec)
     delete MLPrec;
   }
   
@@ -2649,6 +2965,107 @@ void solver::linearSolver(matrix_RCP & J, vector_RCP & r, vector_RCP & soln)  {
 }
 
 
+// ========================================================================================
+// Keep the forward factorization/preconditioner of the current step for the adjoint
+// Only the most recent max_stored_factorizations steps are kept
+// ========================================================================================
+
+void solver::storeFactorization(const matrix_RCP & J, const Teuchos::RCP<LA_LinearProblem> & problem,
+                                const Teuchos::RCP<Amesos_BaseSolver> & direct,
+                                const Teuchos::RCP<ML_Epetra::MultiLevelPreconditioner> & prec) {
+  
+  // later Newton iterations overwrite the earlier ones
+  stored_J[current_step] = J;
+  stored_problems[current_step] = problem;
+  stored_direct[current_step] = direct;
+  stored_prec[current_step] = prec;
+  stored_dbc_rows[current_step] = dbc_rows;
+  
+  if (max_stored_factorizations >= 0) {
+    while ((int)stored_problems.size() > max_stored_factorizations) {
+      // the adjoint sweeps backwards, so drop the earliest step unless it was just stored
+      int evict = stored_problems.begin()->first;
+      if (evict == current_step) {
+        evict = stored_problems.rbegin()->first;
+      }
+      this->releaseFactorization(evict);
+    }
+  }
+}
+
+// ========================================================================================
+// The adjoint needs the factors of the Jacobian at the converged state of the step
+// The factors of the last Newton correction are kept if that Jacobian has not changed
+// (linear problems), and the converged Jacobian is factored otherwise
+// ========================================================================================
+
+void solver::storeConvergedFactorization(const matrix_RCP & J) {
+  if (stored_J.find(current_step) != stored_J.end() && this->sameJacobian(stored_J[current_step], J)) {
+    return;
+  }
+  if (useDirect) {
+    vector_RCP r = Teuchos::rcp(new LA_MultiVector(*LA_owned_map,1));
+    vector_RCP soln = Teuchos::rcp(new LA_MultiVector(*LA_owned_map,1));
+    Teuchos::RCP<LA_LinearProblem> storedSys = Teuchos::rcp(new LA_LinearProblem(J.get(), soln.get(), r.get()));
+    Amesos AmFactory;
+    char* SolverType = "Amesos_Klu";
+    Teuchos::RCP<Amesos_BaseSolver> AmSolver = Teuchos::rcp(AmFactory.Create(SolverType, *storedSys));
+    AmSolver->SymbolicFactorization();
+    AmSolver->NumericFactorization();
+    this->storeFactorization(J, storedSys, AmSolver, Teuchos::null);
+  }
+  else if (!useDomDecomp && usePrec) {
+    this->storeFactorization(J, Teuchos::null, Teuchos::null, Teuchos::rcp(buildPreconditioner(J)));
+  }
+}
+
+// ========================================================================================
+// Check if two Jacobians have the same entries (up to round-off) on every rank
+// ========================================================================================
+
+bool solver::sameJacobian(const matrix_RCP & A, const matrix_RCP & B) {
+  int localdiff = (A->NumMyRows() != B->NumMyRows()) ? 1 : 0;
+  for (int i=0; i<A->NumMyRows() && localdiff == 0; i++) {
+    int numA, numB;
+    double *valsA, *valsB;
+    int *indA, *indB;
+    A->ExtractMyRowView(i, numA, valsA, indA);
+    B->ExtractMyRowView(i, numB, valsB, indB);
+    if (numA != numB) {
+      localdiff = 1;
+    }
+    for (int k=0; k<numA && localdiff == 0; k++) {
+      if (indA[k] != indB[k] || std::abs(valsA[k]-valsB[k]) > 1.0e-14*std::max(std::abs(valsA[k]),std::abs(valsB[k]))) {
+        localdiff = 1;
+      }
+    }
+  }
+  int globaldiff = 0;
+  Comm->MaxAll(&localdiff, &globaldiff, 1);
+  return globaldiff == 0;
+}
+
+// ========================================================================================
+// Release the stored factorization for a step (or all of them if step < 0)
+// ========================================================================================
+
+void solver::releaseFactorization(const int & step) {
+  if (step < 0) {
+    stored_direct.clear(); // solvers before the problems and matrices they reference
+    stored_prec.clear();
+    stored_problems.clear();
+    stored_J.clear();
+    stored_dbc_rows.clear();
+  }
+  else {
+    stored_direct.erase(step);
+    stored_prec.erase(step);
+    stored_problems.erase(step);
+    stored_J.erase(step);
+    stored_dbc_rows.erase(step);
+  }
+}
+
 // ========================================================================================
 // ========================================================================================
 
@@ -3106,7 +3523,15 @@ DRV solver::getElemNodes(const int & block, const int & elemID) {
 void solver::finalizeMultiscale() {
   if (multiscale_manager->subgridModels.size() > 0 ) {
     for (size_t k=0; k<multiscale_manager->subgridModels.size(); k++) {
-      multiscale_manager->subgridModels[k]->paramvals_KVAD = paramvals_KVAD;
+      multiscale_manager->subgridModels[k]->macro_paramvals_KVAD = paramvals_KVAD;
+      if (multiscale_manager->subgridModels[k]->thread_id == 0) {
+        multiscale_manager->subgridModels[k]->paramvals_KVAD = paramvals_KVAD;
+      }
+      else { // the thread copies seed their own parameters
+        multiscale_manager->subgridModels[k]->paramvals_KVAD = Kokkos::View<AD**,AssemblyDevice>("subgrid parameters",
+                                                                                                 paramvals_KVAD.dimension(0),
+                                                                                                 paramvals_KVAD.dimension(1));
+      }
     //  multiscale_manager->subgridModels[k]->wkset[0]->paramnames = paramnames;
     }
     
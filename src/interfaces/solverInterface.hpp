@@ -19,6 +19,8 @@
 #include "discretizationInterface.hpp"
 #include "discretizationTools.hpp"
 #include "cell.hpp"
+#include "checkpointManager.hpp"
+#include <thread>
 
 void static solverHelp(const string & details) {
   cout << "********** Help and Documentation for the Solver Interface **********" << endl;
@@ -102,6 +104,18 @@ public:
   void transientSolver(vector_RCP & initial, vector_RCP & L_soln,
                        vector_RCP & SolMat, DFAD & obj, vector<double> & gradient);
   
+  // ========================================================================================
+  // Advance a forward state by one time step (used to recompute states between checkpoints)
+  // ========================================================================================
+  
+  void forwardStep(vector_RCP & u, const int & step);
+  
+  // ========================================================================================
+  // Recover the forward states at step and step-1 for the adjoint sweep
+  // ========================================================================================
+  
+  void recoverForwardStates(const int & step, vector_RCP & u_curr, vector_RCP & u_prev);
+  
   // ========================================================================================
   // ========================================================================================
   
@@ -202,6 +216,17 @@ public:
                      const bool & compute_disc_sens,
                      vector_RCP & res, matrix_RCP & J);
   
+  // ========================================================================================
+  // Pipelined multiscale assembly: solve the subgrid problems of a cell on a separate
+  // thread while the previous cell is filled and inserted into the global res/J
+  // ========================================================================================
+  
+  void launchSubgridSolves(const size_t & block, const size_t & cellnum,
+                           const bool & compute_jacobian, const bool & compute_sens,
+                           const bool & compute_disc_sens);
+  
+  void finishSubgridSolves();
+  
   
   // ========================================================================================
   // ========================================================================================
@@ -214,6 +239,20 @@ public:
   
   ML_Epetra::MultiLevelPreconditioner* buildPreconditioner(const matrix_RCP & J);
   
+  // ========================================================================================
+  // Storage of the forward factorizations/preconditioners for reuse in the adjoint
+  // ========================================================================================
+  
+  void storeFactorization(const matrix_RCP & J, const Teuchos::RCP<LA_LinearProblem> & problem,
+                          const Teuchos::RCP<Amesos_BaseSolver> & direct,
+                          const Teuchos::RCP<ML_Epetra::MultiLevelPreconditioner> & prec);
+  
+  void storeConvergedFactorization(const matrix_RCP & J);
+  
+  bool sameJacobian(const matrix_RCP & A, const matrix_RCP & B);
+  
+  void releaseFactorization(const int & step);
+  
   
   // ========================================================================================
   // ========================================================================================
@@ -342,6 +381,16 @@ public:
   int liniter, kspace;
   bool useDomDecomp, useDirect, usePrec;
   
+  // forward factorizations kept for the adjoint (indexed by time step)
+  bool reuse_factorization;
+  int max_stored_factorizations, current_step;
+  std::map<int, matrix_RCP> stored_J;
+  std::map<int, Teuchos::RCP<LA_LinearProblem> > stored_problems;
+  std::map<int, Teuchos::RCP<Amesos_BaseSolver> > stored_direct;
+  std::map<int, Teuchos::RCP<ML_Epetra::MultiLevelPreconditioner> > stored_prec;
+  std::map<int, vector<int> > stored_dbc_rows;
+  vector<int> dbc_rows; // global rows replaced by the strong Dirichlet conditions (last Jacobian)
+  
   vector<Kokkos::View<double**,HostDevice> > sensor_data;
   Kokkos::View<double**,HostDevice> sensor_points;
   //FCint sensor_locations;
@@ -421,10 +470,15 @@ public:
   vector<vector<string> > varlist;
   
   Teuchos::RCP<MultiScale> multiscale_manager;
+  Teuchos::RCP<CheckpointManager> checkpoints;
   
   bool compute_objective, compute_sensitivity;
   bool use_custom_initial_param_guess;
   bool store_adjPrev;
+  
+  bool pipeline_subgrids;
+  std::thread subgrid_thread;
+  std::exception_ptr subgrid_error;
   int gNLiter;
   
   //vector<Teuchos::RCP<SubGridModel> > subgridModels;
@@ -55,36 +55,36 @@ public:
     
     // Functions
     Teuchos::ParameterList fs = settings->sublist("Functions");
-    functionManager->addFunction("c2r_x",fs.get<string>("c2r_x","0.0"),numElem,numip,"ip",blocknum);
-    functionManager->addFunction("c2i_x",fs.get<string>("c2i_x","0.0"),numElem,numip,"ip",blocknum);
-    functionManager->addFunction("c2r_y",fs.get<string>("c2r_y","0.0"),numElem,numip,"ip",blocknum);
-    functionManager->addFunction("c2i_y",fs.get<string>("c2i_y","0.0"),numElem,numip,"ip",blocknum);
-    functionManager->addFunction("c2r_z",fs.get<string>("c2r_z","0.0"),numElem,numip,"ip",blocknum);
-    functionManager->addFunction("c2i_z",fs.get<string>("c2i_z","0.0"),numElem,numip,"ip",blocknum);
-    functionManager->addFunction("omega2r",fs.get<string>("omega2r","0.0"),numElem,numip,"ip",blocknum);
-    functionManager->addFunction("omega2i",fs.get<string>("omega2i","0.0"),numElem,numip,"ip",blocknum);
-    functionManager->addFunction("omega2r",fs.get<string>("omega2r","0.0"),numElem,numip_side,"side ip",blocknum);
-    functionManager->addFunction("omega2i",fs.get<string>("omega2i","0.0"),numElem,numip_side,"side ip",blocknum);
+    c2r_x_func = functionManager->addFunction("c2r_x",fs.get<string>("c2r_x","0.0"),numElem,numip,"ip",blocknum);
+    c2i_x_func = functionManager->addFunction("c2i_x",fs.get<string>("c2i_x","0.0"),numElem,numip,"ip",blocknum);
+    c2r_y_func = functionManager->addFunction("c2r_y",fs.get<string>("c2r_y","0.0"),numElem,numip,"ip",blocknum);
+    c2i_y_func = functionManager->addFunction("c2i_y",fs.get<string>("c2i_y","0.0"),numElem,numip,"ip",blocknum);
+    c2r_z_func = functionManager->addFunction("c2r_z",fs.get<string>("c2r_z","0.0"),numElem,numip,"ip",blocknum);
+    c2i_z_func = functionManager->addFunction("c2i_z",fs.get<string>("c2i_z","0.0"),numElem,numip,"ip",blocknum);
+    omega2r_func = functionManager->addFunction("omega2r",fs.get<string>("omega2r","0.0"),numElem,numip,"ip",blocknum);
+    omega2i_func = functionManager->addFunction("omega2i",fs.get<string>("omega2i","0.0"),numElem,numip,"ip",blocknum);
+    omega2r_side_func = functionManager->addFunction("omega2r",fs.get<string>("omega2r","0.0"),numElem,numip_side,"side ip",blocknum);
+    omega2i_side_func = functionManager->addFunction("omega2i",fs.get<string>("omega2i","0.0"),numElem,numip_side,"side ip",blocknum);
     functionManager->addFunction("omegar",fs.get<string>("omegar","0.0"),numElem,numip,"ip",blocknum);
     functionManager->addFunction("omegai",fs.get<string>("omegai","0.0"),numElem,numip,"ip",blocknum);
-    functionManager->addFunction("source_r",fs.get<string>("source_r","0.0"),numElem,numip,"ip",blocknum);
-    functionManager->addFunction("source_i",fs.get<string>("source_i","0.0"),numElem,numip,"ip",blocknum);
-    functionManager->addFunction("source_r_side",fs.get<string>("source_r_side","0.0"),numElem,numip_side,"side ip",blocknum);
-    functionManager->addFunction("source_i_side",fs.get<string>("source_i_side","0.0"),numElem,numip_side,"side ip",blocknum);
-    functionManager->addFunction("robin_alpha_r",fs.get<string>("robin_alpha_r","0.0"),numElem,numip_side,"side ip",blocknum);
-    functionManager->addFunction("robin_alpha_i",fs.get<string>("robin_alpha_i","0.0"),numElem,numip_side,"side ip",blocknum);
-    functionManager->addFunction("c2r_x",fs.get<string>("c2r_x","0.0"),numElem,numip_side,"side ip",blocknum);
-    functionManager->addFunction("c2i_x",fs.get<string>("c2i_x","0.0"),numElem,numip_side,"side ip",blocknum);
-    functionManager->addFunction("c2r_y",fs.get<string>("c2r_y","0.0"),numElem,numip_side,"side ip",blocknum);
-    functionManager->addFunction("c2i_y",fs.get<string>("c2i_y","0.0"),numElem,numip_side,"side ip",blocknum);
-    functionManager->addFunction("c2r_z",fs.get<string>("c2r_z","0.0"),numElem,numip_side,"side ip",blocknum);
-    functionManager->addFunction("c2i_z",fs.get<string>("c2i_z","0.0"),numElem,numip_side,"side ip",blocknum);
-    functionManager->addFunction("alphaHr",fs.get<string>("alphaHr","0.0"),numElem,numip,"ip",blocknum);
-    functionManager->addFunction("alphaHi",fs.get<string>("alphaHi","0.0"),numElem,numip,"ip",blocknum);
-    functionManager->addFunction("alphaTr",fs.get<string>("alphaTr","0.0"),numElem,numip,"ip",blocknum);
-    functionManager->addFunction("alphaTi",fs.get<string>("alphaTi","0.0"),numElem,numip,"ip",blocknum);
-    functionManager->addFunction("freqExp",fs.get<string>("freqExp","0.0"),numElem,numip,"ip",blocknum);
-    functionManager->addFunction("freqExp",fs.get<string>("freqExp","0.0"),numElem,numip_side,"side ip",blocknum);
+    source_r_func = functionManager->addFunction("source_r",fs.get<string>("source_r","0.0"),numElem,numip,"ip",blocknum);
+    source_i_func = functionManager->addFunction("source_i",fs.get<string>("source_i","0.0"),numElem,numip,"ip",blocknum);
+    source_r_side_func = functionManager->addFunction("source_r_side",fs.get<string>("source_r_side","0.0"),numElem,numip_side,"side ip",blocknum);
+    source_i_side_func = functionManager->addFunction("source_i_side",fs.get<string>("source_i_side","0.0"),numElem,numip_side,"side ip",blocknum);
+    robin_alpha_r_side_func = functionManager->addFunction("robin_alpha_r",fs.get<string>("robin_alpha_r","0.0"),numElem,numip_side,"side ip",blocknum);
+    robin_alpha_i_side_func = functionManager->addFunction("robin_alpha_i",fs.get<string>("robin_alpha_i","0.0"),numElem,numip_side,"side ip",blocknum);
+    c2r_side_x_func = functionManager->addFunction("c2r_x",fs.get<string>("c2r_x","0.0"),numElem,numip_side,"side ip",blocknum);
+    c2i_side_x_func = functionManager->addFunction("c2i_x",fs.get<string>("c2i_x","0.0"),numElem,numip_side,"side ip",blocknum);
+    c2r_side_y_func = functionManager->addFunction("c2r_y",fs.get<string>("c2r_y","0.0"),numElem,numip_side,"side ip",blocknum);
+    c2i_side_y_func = functionManager->addFunction("c2i_y",fs.get<string>("c2i_y","0.0"),numElem,numip_side,"side ip",blocknum);
+    c2r_side_z_func = functionManager->addFunction("c2r_z",fs.get<string>("c2r_z","0.0"),numElem,numip_side,"side ip",blocknum);
+    c2i_side_z_func = functionManager->addFunction("c2i_z",fs.get<string>("c2i_z","0.0"),numElem,numip_side,"side ip",blocknum);
+    alphaHr_func = functionManager->addFunction("alphaHr",fs.get<string>("alphaHr","0.0"),numElem,numip,"ip",blocknum);
+    alphaHi_func = functionManager->addFunction("alphaHi",fs.get<string>("alphaHi","0.0"),numElem,numip,"ip",blocknum);
+    alphaTr_func = functionManager->addFunction("alphaTr",fs.get<string>("alphaTr","0.0"),numElem,numip,"ip",blocknum);
+    alphaTi_func = functionManager->addFunction("alphaTi",fs.get<string>("alphaTi","0.0"),numElem,numip,"ip",blocknum);
+    freqExp_func = functionManager->addFunction("freqExp",fs.get<string>("freqExp","0.0"),numElem,numip,"ip",blocknum);
+    freqExp_side_func = functionManager->addFunction("freqExp",fs.get<string>("freqExp","0.0"),numElem,numip_side,"side ip",blocknum);
   }
   
   // ========================================================================================
@@ -98,24 +98,24 @@ public:
     int ur_basis_num = wkset->usebasis[ur_num];
     int ui_basis_num = wkset->usebasis[ui_num];
     
-    c2r_x = functionManager->evaluate("c2r_x","ip",blocknum);
-    c2i_x = functionManager->evaluate("c2i_x","ip",blocknum);
-    c2r_y = functionManager->evaluate("c2r_y","ip",blocknum);
-    c2i_y = functionManager->evaluate("c2i_y","ip",blocknum);
-    c2r_z = functionManager->evaluate("c2r_z","ip",blocknum);
-    c2i_z = functionManager->evaluate("c2i_z","ip",blocknum);
-    omega2r = functionManager->evaluate("omega2r","ip",blocknum);
-    omega2i = functionManager->evaluate("omega2i","ip",blocknum);
+    c2r_x = functionManager->evaluate(c2r_x_func,blocknum);
+    c2i_x = functionManager->evaluate(c2i_x_func,blocknum);
+    c2r_y = functionManager->evaluate(c2r_y_func,blocknum);
+    c2i_y = functionManager->evaluate(c2i_y_func,blocknum);
+    c2r_z = functionManager->evaluate(c2r_z_func,blocknum);
+    c2i_z = functionManager->evaluate(c2i_z_func,blocknum);
+    omega2r = functionManager->evaluate(omega2r_func,blocknum);
+    omega2i = functionManager->evaluate(omega2i_func,blocknum);
     
     if (fractional) {
-      alphaHr = functionManager->evaluate("alphaHr","ip",blocknum);
-      alphaHi = functionManager->evaluate("alphaHi","ip",blocknum);
-      alphaTr = functionManager->evaluate("alphaTr","ip",blocknum);
-      alphaTi = functionManager->evaluate("alphaTi","ip",blocknum);
-      freqExp = functionManager->evaluate("freqExp","ip",blocknum);
+      alphaHr = functionManager->evaluate(alphaHr_func,blocknum);
+      alphaHi = functionManager->evaluate(alphaHi_func,blocknum);
+      alphaTr = functionManager->evaluate(alphaTr_func,blocknum);
+      alphaTi = functionManager->evaluate(alphaTi_func,blocknum);
+      freqExp = functionManager->evaluate(freqExp_func,blocknum);
     }
-    source_r = functionManager->evaluate("source_r","ip",blocknum);
-    source_i = functionManager->evaluate("source_i","ip",blocknum);
+    source_r = functionManager->evaluate(source_r_func,blocknum);
+    source_i = functionManager->evaluate(source_i_func,blocknum);
     
     sol = wkset->local_soln;
     sol_dot = wkset->local_soln_dot;
@@ -261,22 +261,22 @@ public:
     
     // Set the parameters
     
-    c2r_side_x = functionManager->evaluate("c2r_x","side ip",blocknum);
-    c2i_side_x = functionManager->evaluate("c2i_x","side ip",blocknum);
-    c2r_side_y = functionManager->evaluate("c2r_y","side ip",blocknum);
-    c2i_side_y = functionManager->evaluate("c2i_y","side ip",blocknum);
-    c2r_side_z = functionManager->evaluate("c2r_z","side ip",blocknum);
-    c2i_side_z = functionManager->evaluate("c2i_z","side ip",blocknum);
+    c2r_side_x = functionManager->evaluate(c2r_side_x_func,blocknum);
+    c2i_side_x = functionManager->evaluate(c2i_side_x_func,blocknum);
+    c2r_side_y = functionManager->evaluate(c2r_side_y_func,blocknum);
+    c2i_side_y = functionManager->evaluate(c2i_side_y_func,blocknum);
+    c2r_side_z = functionManager->evaluate(c2r_side_z_func,blocknum);
+    c2i_side_z = functionManager->evaluate(c2i_side_z_func,blocknum);
     
-    robin_alpha_r = functionManager->evaluate("robin_alpha_r","side ip",blocknum);
-    robin_alpha_i = functionManager->evaluate("robin_alpha_i","side ip",blocknum);
+    robin_alpha_r = functionManager->evaluate(robin_alpha_r_side_func,blocknum);
+    robin_alpha_i = functionManager->evaluate(robin_alpha_i_side_func,blocknum);
     
-    source_r_side = functionManager->evaluate("source_r_side","side ip",blocknum);
-    source_i_side = functionManager->evaluate("source_i_side","side ip",blocknum);
+    source_r_side = functionManager->evaluate(source_r_side_func,blocknum);
+    source_i_side = functionManager->evaluate(source_i_side_func,blocknum);
     
-    omega2r = functionManager->evaluate("omega2r","side ip",blocknum);
-    omega2i = functionManager->evaluate("omega2i","side ip",blocknum);
-    freqExp = functionManager->evaluate("freqExp","side ip",blocknum);
+    omega2r = functionManager->evaluate(omega2r_side_func,blocknum);
+    omega2i = functionManager->evaluate(omega2i_side_func,blocknum);
+    freqExp = functionManager->evaluate(freqExp_side_func,blocknum);
     
     sideinfo = wkset->sideinfo;
     sol = wkset->local_soln_side;
@@ -459,6 +459,13 @@ private:
   FDATA alphaHr, alphaHi,alphaTr, alphaTi, freqExp; //fractional
   FDATA c2r_side_x, c2i_side_x, c2r_side_y, c2i_side_y, c2r_side_z, c2i_side_z;
   FDATA robin_alpha_r, robin_alpha_i;
+  // function indices (from addFunction)
+  int c2r_x_func, c2i_x_func, c2r_y_func, c2i_y_func, c2r_z_func, c2i_z_func, omega2r_func,
+      omega2i_func, alphaHr_func, alphaHi_func, alphaTr_func, alphaTi_func, freqExp_func,
+      source_r_func, source_i_func, c2r_side_x_func, c2i_side_x_func, c2r_side_y_func,
+      c2i_side_y_func, c2r_side_z_func, c2i_side_z_func, robin_alpha_r_side_func,
+      robin_alpha_i_side_func, source_r_side_func, source_i_side_func, omega2r_side_func,
+      omega2i_side_func, freqExp_side_func;
   
   bool useScalarRespFx;
   bool fractional;
@@ -87,13 +87,13 @@ public:
     
     Teuchos::ParameterList fs = settings->sublist("Functions");
     
-    functionManager->addFunction("lambda",fs.get<string>("lambda","1.0"),numElem,numip,"ip",blocknum);
-    functionManager->addFunction("mu",fs.get<string>("mu","0.5"),numElem,numip,"ip",blocknum);
-    functionManager->addFunction("source dx",fs.get<string>("source dx","0.0"),numElem,numip,"ip",blocknum);
-    functionManager->addFunction("source dy",fs.get<string>("source dy","0.0"),numElem,numip,"ip",blocknum);
-    functionManager->addFunction("source dz",fs.get<string>("source dz","0.0"),numElem,numip,"ip",blocknum);
-    functionManager->addFunction("lambda",fs.get<string>("lambda","1.0"),numElem,numip_side,"side ip",blocknum);
-    functionManager->addFunction("mu",fs.get<string>("mu","0.5"),numElem,numip_side,"side ip",blocknum);
+    lambda_func = functionManager->addFunction("lambda",fs.get<string>("lambda","1.0"),numElem,numip,"ip",blocknum);
+    mu_func = functionManager->addFunction("mu",fs.get<string>("mu","0.5"),numElem,numip,"ip",blocknum);
+    source_dx_func = functionManager->addFunction("source dx",fs.get<string>("source dx","0.0"),numElem,numip,"ip",blocknum);
+    source_dy_func = functionManager->addFunction("source dy",fs.get<string>("source dy","0.0"),numElem,numip,"ip",blocknum);
+    source_dz_func = functionManager->addFunction("source dz",fs.get<string>("source dz","0.0"),numElem,numip,"ip",blocknum);
+    lambda_side_func = functionManager->addFunction("lambda",fs.get<string>("lambda","1.0"),numElem,numip_side,"side ip",blocknum);
+    mu_side_func = functionManager->addFunction("mu",fs.get<string>("mu","0.5"),numElem,numip_side,"side ip",blocknum);
     //functionManager->addFunction("Neumann source dx",fs.get<string>("Neumann source dx","0.0"),numElem,numip_side,"side ip",blocknum);
     //functionManager->addFunction("Neumann source dy",fs.get<string>("Neumann source dy","0.0"),numElem,numip_side,"side ip",blocknum);
     //functionManager->addFunction("Neumann source dz",fs.get<string>("Neumann source dz","0.0"),numElem,numip_side,"side ip",blocknum);
@@ -111,15 +111,15 @@ public:
     
     {
       Teuchos::TimeMonitor funceval(*volumeResidualFunc);
-      source_dx = functionManager->evaluate("source dx","ip",blocknum);
+      source_dx = functionManager->evaluate(source_dx_func,blocknum);
       if (spaceDim > 1) {
-        source_dy = functionManager->evaluate("source dy","ip",blocknum);
+        source_dy = functionManager->evaluate(source_dy_func,blocknum);
       }
       if (spaceDim > 2) {
-        source_dz = functionManager->evaluate("source dz","ip",blocknum);
+        source_dz = functionManager->evaluate(source_dz_func,blocknum);
       }
-      lambda = functionManager->evaluate("lambda","ip",blocknum);
-      mu = functionManager->evaluate("mu","ip",blocknum);
+      lambda = functionManager->evaluate(lambda_func,blocknum);
+      mu = functionManager->evaluate(mu_func,blocknum);
     }
     
     this->computeStress(false);
@@ -316,8 +316,8 @@ public:
           sourceN_dz = functionManager->evaluate("Neumann dz " + sname,"side ip",blocknum);
         }
       }
-      lambda_side = functionManager->evaluate("lambda","side ip",blocknum);
-      mu_side = functionManager->evaluate("mu","side ip",blocknum);
+      lambda_side = functionManager->evaluate(lambda_side_func,blocknum);
+      mu_side = functionManager->evaluate(mu_side_func,blocknum);
       
     }
     
@@ -803,8 +803,8 @@ public:
     {
       Teuchos::TimeMonitor localtime(*fluxFunc);
       
-      lambda_side = functionManager->evaluate("lambda","side ip",blocknum);
-      mu_side = functionManager->evaluate("mu","side ip",blocknum);
+      lambda_side = functionManager->evaluate(lambda_side_func,blocknum);
+      mu_side = functionManager->evaluate(mu_side_func,blocknum);
     }
     
     Kokkos::View<AD***,AssemblyDevice> flux = wkset->flux;
@@ -1249,6 +1249,9 @@ private:
   
   FDATA lambda, mu, source_dx, source_dy, source_dz;
   FDATA lambda_side, mu_side, sourceN_dx, sourceN_dy, sourceN_dz;
+  // function indices (from addFunction)
+  int source_dx_func, source_dy_func, source_dz_func, lambda_func, mu_func, lambda_side_func,
+      mu_side_func;
   
   Kokkos::View<AD****,AssemblyDevice> stress;
   
@@ -88,12 +88,12 @@ public:
     
     Teuchos::ParameterList fs = settings->sublist("Functions");
     
-    functionManager->addFunction("source ux",fs.get<string>("source ux","0.0"),numElem,numip,"ip",blocknum);
-    functionManager->addFunction("source pr",fs.get<string>("source pr","0.0"),numElem,numip,"ip",blocknum);
-    functionManager->addFunction("source uy",fs.get<string>("source uy","0.0"),numElem,numip,"ip",blocknum);
-    functionManager->addFunction("source uz",fs.get<string>("source uz","0.0"),numElem,numip,"ip",blocknum);
-    functionManager->addFunction("density",fs.get<string>("density","1.0"),numElem,numip,"ip",blocknum);
-    functionManager->addFunction("viscosity",fs.get<string>("viscosity","1.0"),numElem,numip,"ip",blocknum);
+    source_ux_func = functionManager->addFunction("source ux",fs.get<string>("source ux","0.0"),numElem,numip,"ip",blocknum);
+    source_pr_func = functionManager->addFunction("source pr",fs.get<string>("source pr","0.0"),numElem,numip,"ip",blocknum);
+    source_uy_func = functionManager->addFunction("source uy",fs.get<string>("source uy","0.0"),numElem,numip,"ip",blocknum);
+    source_uz_func = functionManager->addFunction("source uz",fs.get<string>("source uz","0.0"),numElem,numip,"ip",blocknum);
+    dens_func = functionManager->addFunction("density",fs.get<string>("density","1.0"),numElem,numip,"ip",blocknum);
+    visc_func = functionManager->addFunction("viscosity",fs.get<string>("viscosity","1.0"),numElem,numip,"ip",blocknum);
 
     
   }
@@ -111,16 +111,16 @@ public:
     
     {
       Teuchos::TimeMonitor funceval(*volumeResidualFunc);
-      source_ux = functionManager->evaluate("source ux","ip",blocknum);
-      source_pr = functionManager->evaluate("source pr","ip",blocknum);
+      source_ux = functionManager->evaluate(source_ux_func,blocknum);
+      source_pr = functionManager->evaluate(source_pr_func,blocknum);
       if (spaceDim > 1) {
-        source_uy = functionManager->evaluate("source uy","ip",blocknum);
+        source_uy = functionManager->evaluate(source_uy_func,blocknum);
       }
       if (spaceDim > 2) {
-        source_uz = functionManager->evaluate("source uz","ip",blocknum);
+        source_uz = functionManager->evaluate(source_uz_func,blocknum);
       }
-      dens = functionManager->evaluate("density","ip",blocknum);
-      visc = functionManager->evaluate("viscosity","ip",blocknum);
+      dens = functionManager->evaluate(dens_func,blocknum);
+      visc = functionManager->evaluate(visc_func,blocknum);
     }
     
     sol = wkset->local_soln;
@@ -576,6 +576,8 @@ private:
   bool useScalarRespFx;
   
   FDATA dens, visc, source_ux, source_pr, source_uy, source_uz;
+  // function indices (from addFunction)
+  int source_ux_func, source_pr_func, source_uy_func, source_uz_func, dens_func, visc_func;
   
   //Kokkos::View<AD**,AssemblyDevice> dens, visc, source_ux, source_pr, source_uy, source_uz;
   Kokkos::View<AD****,AssemblyDevice> sol, sol_dot, sol_grad;
@@ -67,11 +67,11 @@ public:
     
     
     Teuchos::ParameterList fs = settings->sublist("Functions");
-    functionManager->addFunction("source Hu",fs.get<string>("source Hu","0.0"),numElem,numip,"ip",blocknum);
-    functionManager->addFunction("source Hv",fs.get<string>("source Hv","0.0"),numElem,numip,"ip",blocknum);
-    functionManager->addFunction("Neumann source H",fs.get<string>("Neumann source H","0.0"),numElem,numip_side,"side ip",blocknum);
-    functionManager->addFunction("Neumann source Hu",fs.get<string>("Neumann source Hu","0.0"),numElem,numip_side,"side ip",blocknum);
-    functionManager->addFunction("Neumann source Hv",fs.get<string>("Neumann source Hv","0.0"),numElem,numip_side,"side ip",blocknum);
+    source_Hu_func = functionManager->addFunction("source Hu",fs.get<string>("source Hu","0.0"),numElem,numip,"ip",blocknum);
+    source_Hv_func = functionManager->addFunction("source Hv",fs.get<string>("source Hv","0.0"),numElem,numip,"ip",blocknum);
+    nsource_H_side_func = functionManager->addFunction("Neumann source H",fs.get<string>("Neumann source H","0.0"),numElem,numip_side,"side ip",blocknum);
+    nsource_Hu_side_func = functionManager->addFunction("Neumann source Hu",fs.get<string>("Neumann source Hu","0.0"),numElem,numip_side,"side ip",blocknum);
+    nsource_Hv_side_func = functionManager->addFunction("Neumann source Hv",fs.get<string>("Neumann source Hv","0.0"),numElem,numip_side,"side ip",blocknum);
     
   }
   
@@ -86,8 +86,8 @@ public:
     
     {
       Teuchos::TimeMonitor funceval(*volumeResidualFunc);
-      source_Hu = functionManager->evaluate("source Hu","ip",blocknum);
-      source_Hv = functionManager->evaluate("source Hv","ip",blocknum);
+      source_Hu = functionManager->evaluate(source_Hu_func,blocknum);
+      source_Hv = functionManager->evaluate(source_Hv_func,blocknum);
     }
     
     sol = wkset->local_soln;
@@ -180,9 +180,9 @@ public:
     
     {
       Teuchos::TimeMonitor localtime(*boundaryResidualFunc);
-      nsource_H = functionManager->evaluate("Neumann source H","side ip",blocknum);
-      nsource_Hu = functionManager->evaluate("Neumann source Hu","side ip",blocknum);
-      nsource_Hv = functionManager->evaluate("Neumann source Hv","side ip",blocknum);
+      nsource_H = functionManager->evaluate(nsource_H_side_func,blocknum);
+      nsource_Hu = functionManager->evaluate(nsource_Hu_side_func,blocknum);
+      nsource_Hv = functionManager->evaluate(nsource_Hv_side_func,blocknum);
     }
     
     sideinfo = wkset->sideinfo;
@@ -284,6 +284,9 @@ private:
   //string simName;
   
   FDATA source_Hu, source_Hv, nsource_H, nsource_Hu, nsource_Hv;
+  // function indices (from addFunction)
+  int source_Hu_func, source_Hv_func, nsource_H_side_func, nsource_Hu_side_func,
+      nsource_Hv_side_func;
   Kokkos::View<AD****,AssemblyDevice> sol, sol_dot, sol_grad;
   Kokkos::View<AD***,AssemblyDevice> aux;
   Kokkos::View<AD**,AssemblyDevice> res;
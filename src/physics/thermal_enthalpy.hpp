@@ -65,13 +65,13 @@ public:
     // Functions
     Teuchos::ParameterList fs = settings->sublist("Functions");
     
-    functionManager->addFunction("thermal source",fs.get<string>("thermal source","0.0"),numElem,numip,"ip",blocknum);
-    functionManager->addFunction("thermal diffusion",fs.get<string>("thermal diffusion","1.0"),numElem,numip,"ip",blocknum);
-    functionManager->addFunction("specific heat",fs.get<string>("specific heat","1.0"),numElem,numip,"ip",blocknum);
-    functionManager->addFunction("density",fs.get<string>("density","1.0"),numElem,numip,"ip",blocknum);
-    functionManager->addFunction("thermal Neumann source",fs.get<string>("thermal Neumann source","0.0"),numElem,numip_side,"side ip",blocknum);
-    functionManager->addFunction("thermal diffusion",fs.get<string>("thermal diffusion","1.0"),numElem,numip_side,"side ip",blocknum);
-    functionManager->addFunction("robin alpha",fs.get<string>("robin alpha","0.0"),numElem,numip_side,"side ip",blocknum);
+    source_func = functionManager->addFunction("thermal source",fs.get<string>("thermal source","0.0"),numElem,numip,"ip",blocknum);
+    diff_func = functionManager->addFunction("thermal diffusion",fs.get<string>("thermal diffusion","1.0"),numElem,numip,"ip",blocknum);
+    cp_func = functionManager->addFunction("specific heat",fs.get<string>("specific heat","1.0"),numElem,numip,"ip",blocknum);
+    rho_func = functionManager->addFunction("density",fs.get<string>("density","1.0"),numElem,numip,"ip",blocknum);
+    nsource_side_func = functionManager->addFunction("thermal Neumann source",fs.get<string>("thermal Neumann source","0.0"),numElem,numip_side,"side ip",blocknum);
+    diff_side_func = functionManager->addFunction("thermal diffusion",fs.get<string>("thermal diffusion","1.0"),numElem,numip_side,"side ip",blocknum);
+    robin_alpha_side_func = functionManager->addFunction("robin alpha",fs.get<string>("robin alpha","0.0"),numElem,numip_side,"side ip",blocknum);
   }
   
   // ========================================================================================
@@ -88,10 +88,10 @@ public:
     
     {
       Teuchos::TimeMonitor funceval(*volumeResidualFunc);
-      source = functionManager->evaluate("thermal source","ip",blocknum);
-      diff = functionManager->evaluate("thermal diffusion","ip",blocknum);
-      cp = functionManager->evaluate("specific heat","ip",blocknum);
-      rho = functionManager->evaluate("density","ip",blocknum);
+      source = functionManager->evaluate(source_func,blocknum);
+      diff = functionManager->evaluate(diff_func,blocknum);
+      cp = functionManager->evaluate(cp_func,blocknum);
+      rho = functionManager->evaluate(rho_func,blocknum);
     }
 
 
@@ -217,9 +217,9 @@ public:
     
     {
       Teuchos::TimeMonitor localtime(*boundaryResidualFunc);
-      nsource = functionManager->evaluate("thermal Neumann source","side ip",blocknum);
-      diff_side = functionManager->evaluate("thermal diffusion","side ip",blocknum);
-      robin_alpha = functionManager->evaluate("robin alpha","side ip",blocknum);
+      nsource = functionManager->evaluate(nsource_side_func,blocknum);
+      diff_side = functionManager->evaluate(diff_side_func,blocknum);
+      robin_alpha = functionManager->evaluate(robin_alpha_side_func,blocknum);
     }
     
     double sf = formparam;
@@ -326,7 +326,7 @@ public:
     
     {
       Teuchos::TimeMonitor localtime(*fluxFunc);
-      diff_side = functionManager->evaluate("thermal diffusion","side ip",blocknum);
+      diff_side = functionManager->evaluate(diff_side_func,blocknum);
     }
     
     
@@ -401,6 +401,9 @@ private:
   int resindex;
   
   FDATA diff, rho, cp, source, nsource, diff_side, robin_alpha;
+  // function indices (from addFunction)
+  int source_func, diff_func, cp_func, rho_func, nsource_side_func, diff_side_func,
+      robin_alpha_side_func;
   
   Kokkos::View<AD****,AssemblyDevice> sol, sol_dot, sol_grad;
   Kokkos::View<AD***,AssemblyDevice> aux;
@@ -7,6 +7,68 @@
 
 using namespace std;
 
+// Compare the values of a function with the exact values at all of the elements and ip
+template<class F>
+int checkFunction(const string & name, FDATA data, F exact) {
+  int numfails = 0;
+  for (size_t e=0; e<data.dimension(0); e++) {
+    for (size_t n=0; n<data.dimension(1); n++) {
+      double val = exact(e,n);
+      if (abs(data(e,n).val() - val) > 1.0e-12*max(1.0,abs(val))) {
+        numfails++;
+      }
+    }
+  }
+  if (numfails > 0) {
+    cout << "Failed: " << name << " at " << numfails << " points" << endl;
+  }
+  return numfails;
+}
+
+// Compare the first numderivs derivatives of a function with the exact derivatives
+template<class F>
+int checkDerivatives(const string & name, FDATA data, const int & numderivs, F exact) {
+  int numfails = 0;
+  for (size_t e=0; e<data.dimension(0); e++) {
+    for (size_t n=0; n<data.dimension(1); n++) {
+      for (int d=0; d<numderivs; d++) {
+        double val = exact(e,n,d);
+        if (abs(data(e,n).fastAccessDx(d) - val) > 1.0e-12*max(1.0,abs(val))) {
+          numfails++;
+        }
+      }
+    }
+  }
+  if (numfails > 0) {
+    cout << "Failed: derivatives of " << name << " at " << numfails << " points" << endl;
+  }
+  return numfails;
+}
+
+// A kernel in the form that functions_to_cpp generates (see tools/functions_to_cpp.cpp)
+// kern = a*b+sin(c)*x+t*mu
+static void kernel_kern(const vector<FDATA> & ad_inputs, const vector<FDATAd> & double_inputs,
+                        FDATA result) {
+  FDATA a0 = ad_inputs[0]; // a
+  FDATA a1 = ad_inputs[1]; // b
+  FDATA a2 = ad_inputs[2]; // c
+  FDATA a3 = ad_inputs[3]; // mu
+  FDATAd d0 = double_inputs[0]; // x
+  FDATAd d1 = double_inputs[1]; // t
+  for (int e=0; e<result.dimension(0); e++) {
+    for (int n=0; n<result.dimension(1); n++) {
+      result(e,n) = a0(e,n)*a1(e,n) + sin(a2(e,n))*d0(e,n) + d1(e,n)*a3(e,n);
+    }
+  }
+}
+
+static const char * kern_ad_inputs[] = {"a", "b", "c", "mu"};
+static const char * kern_double_inputs[] = {"x", "t"};
+
+static FunctionKernel test_kernels[] = {
+  {"kern", "a*b+sin(c)*x+t*mu", 4, kern_ad_inputs, 2, kern_double_inputs, 0, NULL, kernel_kern}
+};
+
 int main(int argc, char * argv[]) {
 
   Teuchos::GlobalMPISession mpiSession(&argc, &argv,0);
@@ -15,6 +77,7 @@ int main(int argc, char * argv[]) {
   Kokkos::initialize();
   
   Teuchos::RCP<FunctionInterface> functionManager = Teuchos::rcp(new FunctionInterface());
+  functionManager->cache_functions = true; // off by default
   
   vector<string> variables = {"a","b","c","d"};
   vector<string> parameters = {"mu"};
@@ -52,6 +115,9 @@ int main(int argc, char * argv[]) {
   
   functionManager->wkset = wkset;
   
+  Kokkos::View<AD**,AssemblyDevice> params("parameters",parameters.size(),1);
+  wkset->params_AD = params;
+  
   string test1 = "sin(a+b+c)";
   functionManager->addFunction("test1",test1,numElem,numip,"ip",0);
   
@@ -61,6 +127,31 @@ int main(int argc, char * argv[]) {
   string test3 = "8*(pi^2)*sin(2*pi*x+1)*sin(2*pi*y+1)";
   functionManager->addFunction("g",test3,numElem,numip,"ip",0);
   
+  // Functions with closed-form values (checked below)
+  functionManager->addFunction("folded","2.0*pi*3.0",numElem,numip,"ip",0);
+  functionManager->addFunction("shared1","sin(a+b)*c",numElem,numip,"ip",0);
+  functionManager->addFunction("shared2","sin(a+b)+d",numElem,numip,"ip",0);
+  functionManager->addFunction("dmax","max(d)",numElem,numip,"ip",0);
+  functionManager->addFunction("dmin","min(d)",numElem,numip,"ip",0);
+  functionManager->addFunction("dmean","mean(d)",numElem,numip,"ip",0);
+  functionManager->addFunction("timefn","sin(t)*2.0",numElem,numip,"ip",0);
+  functionManager->addFunction("timeparamfn","t*mu+2.0*t",numElem,numip,"ip",0);
+  functionManager->addFunction("geomfn","x*y+t",numElem,numip,"ip",0);
+  
+  // Sums and products of active and passive operands (the passive ones are combined first)
+  vector<pair<string,string> > mixed = {{"mixed1","a - x*y + t"}, {"mixed2","t - a + x*y"},
+                                        {"mixed3","a - x + y - b - t"}, {"mixed4","x/a*y"},
+                                        {"mixed5","a/x*b/y"}};
+  for (size_t k=0; k<mixed.size(); k++) {
+    functionManager->addFunction(mixed[k].first,mixed[k].second,numElem,numip,"ip",0);
+  }
+  
+  // The same expression with a compiled kernel and with the interpreter
+  // (the kernel table is bound in-process, as loadKernels does after opening a library)
+  functionManager->addFunction("kern","a*b+sin(c)*x+t*mu",numElem,numip,"ip",0);
+  functionManager->addFunction("kernref","a*b+sin(c)*x+t*mu",numElem,numip,"ip",0);
+  functionManager->kernels.push_back(test_kernels[0]);
+  
   functionManager->validateFunctions();
   functionManager->decomposeFunctions();
   
@@ -88,11 +179,159 @@ int main(int argc, char * argv[]) {
     data2 = functionManager->evaluate("test2","ip",0);
     data3 = functionManager->evaluate("g","ip",0);
   }
+  
+  //////////////////////////////////////////////////////////////////////////////////////
+  // Check the values against the closed-form values
+  //////////////////////////////////////////////////////////////////////////////////////
+  
+  auto aval = [](const int e, const int j) { return 1.0 + 0.1*e + 0.5*j; };
+  auto bval = [](const int e, const int j) { return 2.0 - 0.2*j; };
+  auto cval = [](const int e, const int j) { return 0.5 + 0.01*e; };
+  vector<double> dpts = {1.0, 3.0, 2.0, 0.5}; // max and min are not at the first or last ip
+  auto dval = [&dpts](const int e, const int j) { return dpts[j] + 0.01*e; };
+  
+  for (size_t i=0; i<numElem; i++) {
+    for (size_t j=0; j<numip; j++) {
+      wkset->local_soln(i,0,j,0) = AD(maxDerivs,0,aval(i,j)); // seeded as derivatives 0-3
+      wkset->local_soln(i,1,j,0) = AD(maxDerivs,1,bval(i,j));
+      wkset->local_soln(i,2,j,0) = AD(maxDerivs,2,cval(i,j));
+      wkset->local_soln(i,3,j,0) = AD(maxDerivs,3,dval(i,j));
+    }
+  }
+  auto xval = [](const int e, const int j) { return 0.25 + 0.5*j + 0.01*e; };
+  auto yval = [](const int e, const int j) { return 1.5 - 0.25*j; };
+  for (size_t i=0; i<numElem; i++) {
+    for (size_t j=0; j<numip; j++) {
+      wkset->ip_KV(i,j,0) = xval(i,j);
+      wkset->ip_KV(i,j,1) = yval(i,j);
+    }
+  }
+  wkset->cellID = 0; // keys the cached values of the functions of x and y
+  functionManager->clearCache(); // the geometry changed
+  
+  double time = 0.5, mu = 3.0;
+  wkset->time_KV(0) = time;
+  wkset->params_AD(0,0) = mu;
+  
+  int numfails = 0;
+  numfails += checkFunction("folded", functionManager->evaluate("folded","ip",0),
+                            [&](const int e, const int j) { return 6.0*PI; });
+  numfails += checkFunction("shared1", functionManager->evaluate("shared1","ip",0),
+                            [&](const int e, const int j) { return sin(aval(e,j)+bval(e,j))*cval(e,j); });
+  numfails += checkFunction("shared2", functionManager->evaluate("shared2","ip",0),
+                            [&](const int e, const int j) { return sin(aval(e,j)+bval(e,j))+dval(e,j); });
+  numfails += checkFunction("dmax", functionManager->evaluate("dmax","ip",0),
+                            [&](const int e, const int j) { return 3.0 + 0.01*e; });
+  numfails += checkFunction("dmin", functionManager->evaluate("dmin","ip",0),
+                            [&](const int e, const int j) { return 0.5 + 0.01*e; });
+  numfails += checkFunction("dmean", functionManager->evaluate("dmean","ip",0),
+                            [&](const int e, const int j) { return 1.625 + 0.01*e; });
+  numfails += checkFunction("timefn", functionManager->evaluate("timefn","ip",0),
+                            [&](const int e, const int j) { return sin(time)*2.0; });
+  numfails += checkFunction("timeparamfn", functionManager->evaluate("timeparamfn","ip",0),
+                            [&](const int e, const int j) { return time*mu + 2.0*time; });
+  
+  // the cached values are recomputed when the time or the parameters change
+  time = 0.75;
+  wkset->time_KV(0) = time;
+  numfails += checkFunction("timefn (new time)", functionManager->evaluate("timefn","ip",0),
+                            [&](const int e, const int j) { return sin(time)*2.0; });
+  mu = 4.0;
+  wkset->params_AD(0,0) = mu;
+  numfails += checkFunction("timeparamfn (new parameter)", functionManager->evaluate("timeparamfn","ip",0),
+                            [&](const int e, const int j) { return time*mu + 2.0*time; });
+  numfails += checkFunction("mixed1", functionManager->evaluate("mixed1","ip",0),
+                            [&](const int e, const int j) { return aval(e,j) - xval(e,j)*yval(e,j) + time; });
+  numfails += checkFunction("mixed2", functionManager->evaluate("mixed2","ip",0),
+                            [&](const int e, const int j) { return time - aval(e,j) + xval(e,j)*yval(e,j); });
+  numfails += checkFunction("mixed3", functionManager->evaluate("mixed3","ip",0),
+                            [&](const int e, const int j) { return aval(e,j) - xval(e,j) + yval(e,j) - bval(e,j) - time; });
+  numfails += checkFunction("mixed4", functionManager->evaluate("mixed4","ip",0),
+                            [&](const int e, const int j) { return xval(e,j)/aval(e,j)*yval(e,j); });
+  numfails += checkFunction("mixed5", functionManager->evaluate("mixed5","ip",0),
+                            [&](const int e, const int j) { return aval(e,j)/xval(e,j)*bval(e,j)/yval(e,j); });
+  
+  // the cached values belong to the cells in the workset
+  numfails += checkFunction("geomfn", functionManager->evaluate("geomfn","ip",0),
+                            [&](const int e, const int j) { return xval(e,j)*yval(e,j) + time; });
+  for (size_t i=0; i<numElem; i++) {
+    for (size_t j=0; j<numip; j++) {
+      wkset->ip_KV(i,j,0) = xval(i,j) + 1.0;
+    }
+  }
+  wkset->cellID = 1;
+  numfails += checkFunction("geomfn (other cells)", functionManager->evaluate("geomfn","ip",0),
+                            [&](const int e, const int j) { return (xval(e,j)+1.0)*yval(e,j) + time; });
+  for (size_t i=0; i<numElem; i++) {
+    for (size_t j=0; j<numip; j++) {
+      wkset->ip_KV(i,j,0) = xval(i,j);
+    }
+  }
+  wkset->cellID = 0;
+  numfails += checkFunction("geomfn (first cells)", functionManager->evaluate("geomfn","ip",0),
+                            [&](const int e, const int j) { return xval(e,j)*yval(e,j) + time; });
+  
+  int kindex = functionManager->getFunctionIndex("kern","ip",0);
+  if (functionManager->functions[0][kindex].kernel == NULL) {
+    cout << "Failed: the kernel for kern was not bound" << endl;
+    numfails++;
+  }
+  FDATA kernref = functionManager->evaluate("kernref","ip",0);
+  numfails += checkFunction("kernref", kernref,
+                            [&](const int e, const int j) { return aval(e,j)*bval(e,j) + sin(cval(e,j))*xval(e,j) + time*mu; });
+  numfails += checkFunction("kern", functionManager->evaluate("kern","ip",0),
+                            [&](const int e, const int j) { return kernref(e,j).val(); });
+  
+  //////////////////////////////////////////////////////////////////////////////////////
+  // Check the derivatives (a, b, c, d and mu are seeded as derivatives 0-4)
+  // The mixed terms are compared with the same functions evaluated without combining
+  // the passive operands, and the kernel is compared with the interpreter.
+  //////////////////////////////////////////////////////////////////////////////////////
+  
+  wkset->params_AD(0,0) = AD(maxDerivs,4,mu);
+  int numderivs = 5;
+  
+  Teuchos::RCP<FunctionInterface> refManager = Teuchos::rcp(new FunctionInterface());
+  refManager->combine_passive = false;
+  refManager->setupLists(variables, parameters, disc_parameters);
+  refManager->wkset = wkset;
+  for (size_t k=0; k<mixed.size(); k++) {
+    refManager->addFunction(mixed[k].first,mixed[k].second,numElem,numip,"ip",0);
+  }
+  refManager->validateFunctions();
+  refManager->decomposeFunctions();
+  
+  for (size_t k=0; k<mixed.size(); k++) {
+    FDATA mixedref = refManager->evaluate(mixed[k].first,"ip",0);
+    numfails += checkDerivatives(mixed[k].first, functionManager->evaluate(mixed[k].first,"ip",0), numderivs,
+                                 [&](const int e, const int j, const int d) { return mixedref(e,j).fastAccessDx(d); });
+  }
+  
+  kernref = functionManager->evaluate("kernref","ip",0);
+  numfails += checkDerivatives("kern", functionManager->evaluate("kern","ip",0), numderivs,
+                               [&](const int e, const int j, const int d) { return kernref(e,j).fastAccessDx(d); });
+  
+  numfails += checkDerivatives("folded", functionManager->evaluate("folded","ip",0), numderivs,
+                               [&](const int e, const int j, const int d) { return 0.0; });
+  numfails += checkDerivatives("shared1", functionManager->evaluate("shared1","ip",0), numderivs,
+                               [&](const int e, const int j, const int d) {
+                                 double ab = aval(e,j)+bval(e,j);
+                                 vector<double> dx = {cos(ab)*cval(e,j), cos(ab)*cval(e,j), sin(ab), 0.0, 0.0};
+                                 return dx[d]; });
+  numfails += checkDerivatives("shared2", functionManager->evaluate("shared2","ip",0), numderivs,
+                               [&](const int e, const int j, const int d) {
+                                 double ab = aval(e,j)+bval(e,j);
+                                 vector<double> dx = {cos(ab), cos(ab), 0.0, 1.0, 0.0};
+                                 return dx[d]; });
+  
   Teuchos::TimeMonitor::summarize();
   
   Kokkos::finalize();
   
-  
+  if (numfails > 0) {
+    cout << "Function checks failed" << endl;
+    return 1;
+  }
   return 0;
 }
 
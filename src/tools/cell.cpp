@@ -18,6 +18,8 @@
 
 #include <iostream>
 #include <iterator>
+#include <thread>
+#include <exception>
 
 ///////////////////////////////////////////////////////////////////////////////////////
 // Add the aux basis functions at the integration points.
@@ -210,7 +212,7 @@ void cell::computeSolnVolIP(const bool & seedu, const bool & seedudot, const boo
   
   Teuchos::TimeMonitor localtimer(*computeSolnVolTimer);
   
-  wkset->update(ip,ijac,orientation);
+  wkset->update(ip,ijac,orientation,cellID);
   wkset->computeSolnVolIP(u, u_dot, seedu, seedudot);
   wkset->computeParamVolIP(param, seedparams);
   
@@ -255,7 +257,7 @@ void cell::computeSolnSideIP(const int & side,
   
   Teuchos::TimeMonitor localtimer(*computeSolnSideTimer);
   
-  wkset->updateSide(nodes, sideip[side], sidewts[side],normals[side],sideijac[side], side);
+  wkset->updateSide(nodes, sideip[side], sidewts[side],normals[side],sideijac[side], side, cellID);
   wkset->computeSolnSideIP(side, u, u_dot, seedu, seedudot);
   wkset->computeParamSideIP(side, param, seedparams);
   
@@ -300,34 +302,153 @@ void cell::updateSolnWorkset(const vector_RCP & gl_u, int tindex) {
       }
     }
   }
-  wkset->update(ip,ijac,orientation);
+  wkset->update(ip,ijac,orientation,cellID);
   wkset->computeSolnVolIP(ulocal);
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////
-// Compute the contribution from this cell to the global res, J, Jdot
+// Solve the subgrid problems for the groups of elements concurrently
+// Every element only adds to its own entries of the macro workset residual, so the
+// result does not depend on the order the threads finish in
+///////////////////////////////////////////////////////////////////////////////////////
+
+void cell::threadedSubgridSolve(std::map<int, vector<int> > & sggroups,
+                                const vector<vector<double> > & paramvals,
+                                const vector<int> & paramtypes, const vector<string> & paramnames,
+                                const double & time, const bool & isTransient, const bool & isAdjoint,
+                                const bool & compute_jacobian, const bool & compute_sens,
+                                const int & num_active_params, const bool & compute_disc_sens,
+                                const bool & compute_aux_sens, const bool & store_adjPrev) {
+  
+  vector<int> sgindices;
+  vector<vector<int> > elements;
+  vector<Kokkos::View<double**,AssemblyDevice> > subgradients;
+  int lastgroup = 0;
+  for (std::map<int, vector<int> >::iterator it = sggroups.begin(); it != sggroups.end(); ++it) {
+    sgindices.push_back(it->first);
+    elements.push_back(it->second);
+    subgradients.push_back(Kokkos::View<double**,AssemblyDevice>("subgrid gradient",subgradient.dimension(0),
+                                                                 subgradient.dimension(1)));
+    if (it->second[it->second.size()-1] == numElem-1) {
+      lastgroup = sgindices.size()-1;
+    }
+    
+    // the thread copies of the models need the current macro-scale parameters
+    Teuchos::RCP<SubGridModel> sgmodel = subgridModels[it->first];
+    if (sgmodel->thread_id > 0) {
+      for (size_t i=0; i<sgmodel->paramvals_KVAD.dimension(0); i++) {
+        for (size_t j=0; j<sgmodel->paramvals_KVAD.dimension(1); j++) {
+          sgmodel->paramvals_KVAD(i,j) = sgmodel->macro_paramvals_KVAD(i,j);
+        }
+      }
+    }
+  }
+  
+  vector<std::exception_ptr> errors(sgindices.size());
+  vector<std::thread> threads;
+  for (size_t g=0; g<sgindices.size(); g++) {
+    threads.push_back(std::thread([&,g]() {
+      try {
+        Teuchos::RCP<SubGridModel> sgmodel = subgridModels[sgindices[g]];
+        if (sgmodel->useBatchSolver(isAdjoint, compute_sens, compute_disc_sens, compute_aux_sens)) {
+          vector<int> usernums;
+          for (size_t k=0; k<elements[g].size(); k++) {
+            usernums.push_back(subgrid_usernum[elements[g][k]]);
+          }
+          sgmodel->subgridBatchSolver(u, paramvals, paramtypes, paramnames, time, isTransient,
+                                      num_active_params, *wkset, usernums, elements[g]);
+        }
+        else {
+          for (size_t k=0; k<elements[g].size(); k++) {
+            int e = elements[g][k];
+            sgmodel->subgridSolver(u, phi,
+                                   paramvals, paramtypes, paramnames,time, isTransient, isAdjoint,
+                                   compute_jacobian, compute_sens,num_active_params,
+                                   compute_disc_sens, compute_aux_sens,
+                                   *wkset, subgrid_usernum[e], e,
+                                   subgradients[g], store_adjPrev);
+          }
+        }
+      }
+      catch (...) {
+        errors[g] = std::current_exception();
+      }
+    }));
+  }
+  for (size_t g=0; g<threads.size(); g++) {
+    threads[g].join();
+  }
+  for (size_t g=0; g<errors.size(); g++) {
+    if (errors[g]) {
+      std::rethrow_exception(errors[g]);
+    }
+  }
+  
+  // each subgrid solve overwrites the gradient, so keep the one from the last element
+  for (size_t i=0; i<subgradient.dimension(0); i++) {
+    for (size_t j=0; j<subgradient.dimension(1); j++) {
+      subgradient(i,j) = subgradients[lastgroup](i,j);
+    }
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////////////
+// Solve the subgrid problems of this cell (multiscale only)
+// The contributions to the macro residual are left in the workset residual
 ///////////////////////////////////////////////////////////////////////////////////////
 
-void cell::computeJacRes(const vector<vector<double> > & paramvals,
+void cell::solveSubgrids(const vector<vector<double> > & paramvals,
                          const vector<int> & paramtypes, const vector<string> & paramnames,
                          const double & time, const bool & isTransient, const bool & isAdjoint,
                          const bool & compute_jacobian, const bool & compute_sens,
                          const int & num_active_params, const bool & compute_disc_sens,
-                         const bool & compute_aux_sens, const bool & store_adjPrev,
-                         Kokkos::View<double***,AssemblyDevice> local_res,
-                         Kokkos::View<double***,AssemblyDevice> local_J,
-                         Kokkos::View<double***,AssemblyDevice> local_Jdot) {
+                         const bool & compute_aux_sens, const bool & store_adjPrev) {
   current_time = time;
   
-  /////////////////////////////////////////////////////////////////////////////////////
-  // Compute the local contribution to the global residual and Jacobians
-  /////////////////////////////////////////////////////////////////////////////////////
+  wkset->resetResidual();
   
-  if (multiscale) {
-    
-    wkset->resetResidual();
-    
+  // Group the elements by subgrid model.  Each model (or thread copy of a model)
+  // has its own workset and solver, so different groups can be solved concurrently.
+  std::map<int, vector<int> > sggroups;
+  // (the subgrid problems moved to other ranks are solved there)
+  for (int e=0; e<numElem; e++) {
+    if (!subgrid_remote[e]) {
+      int sgindex = subgrid_model_index[e][subgrid_model_index.size()-1];
+      sggroups[sgindex].push_back(e);
+    }
+  }
+  
+  bool threaded = false;
+  for (std::map<int, vector<int> >::iterator it = sggroups.begin(); it != sggroups.end(); ++it) {
+    if (subgridModels[it->first]->thread_id > 0) {
+      threaded = true;
+    }
+  }
+  
+  if (!threaded) {
+    // forward solves of the models that batch them (no subgradient is needed)
+    for (size_t i=0; i<subgradient.dimension(0); i++) {
+      for (size_t j=0; j<subgradient.dimension(1); j++) {
+        subgradient(i,j) = 0.0;
+      }
+    }
+    vector<bool> batched(numElem,false);
+    for (std::map<int, vector<int> >::iterator it = sggroups.begin(); it != sggroups.end(); ++it) {
+      Teuchos::RCP<SubGridModel> sgmodel = subgridModels[it->first];
+      if (sgmodel->useBatchSolver(isAdjoint, compute_sens, compute_disc_sens, compute_aux_sens)) {
+        vector<int> usernums;
+        for (size_t k=0; k<it->second.size(); k++) {
+          usernums.push_back(subgrid_usernum[it->second[k]]);
+          batched[it->second[k]] = true;
+        }
+        sgmodel->subgridBatchSolver(u, paramvals, paramtypes, paramnames, time, isTransient,
+                                    num_active_params, *wkset, usernums, it->second);
+      }
+    }
     for (int e=0; e<numElem; e++) {
+      if (subgrid_remote[e] || batched[e]) {
+        continue;
+      }
       int sgindex = subgrid_model_index[e][subgrid_model_index.size()-1];
       
       subgridModels[sgindex]->subgridSolver(u, phi,
@@ -339,49 +460,119 @@ void cell::computeJacRes(const vector<vector<double> > & paramvals,
                                             subgradient, store_adjPrev);
       
     }
-    
-    //////////////////////////////////////////////////////////////
-    // Fill in the coarse scale res and J
-    //////////////////////////////////////////////////////////////
-    
-    this->updateRes(compute_sens, local_res);
-    if (compute_jacobian) {
-      if (isAdjoint) { // && !useSubGridAdjoint) {
-        this->updateJac(false, local_J);
+  }
+  else {
+    this->threadedSubgridSolve(sggroups, paramvals, paramtypes, paramnames, time, isTransient, isAdjoint,
+                               compute_jacobian, compute_sens, num_active_params,
+                               compute_disc_sens, compute_aux_sens, store_adjPrev);
+  }
+  
+  // contributions returned by the ranks that solved the moved subgrid problems
+  for (int e=0; e<numElem; e++) {
+    if (subgrid_remote[e]) {
+      for (size_t n=0; n<subgrid_remote_res.dimension(1); n++) {
+        wkset->res(e,n) = subgrid_remote_res(e,n);
       }
-      else {
-        this->updateJac(false, local_J);
+    }
+  }
+  if (subgrid_remote[numElem-1]) {
+    for (size_t i=0; i<subgradient.dimension(0); i++) {
+      for (size_t j=0; j<subgradient.dimension(1); j++) {
+        subgradient(i,j) = subgrid_remote_grad(numElem-1,i,j);
       }
     }
-    
-    if (compute_jacobian) {
-      bool fixJacDiag = true;
-      if (fixJacDiag) {
-        double JTOL = 1.0E-8;
-        
-        for (int e=0; e<numElem; e++) {
-          for (size_t n=0; n<wkset->offsets.dimension(0); n++) {
-            for (size_t i=0; i<wkset->offsets.dimension(1); i++) {
-              if (abs(local_J(e,wkset->offsets(n,i),wkset->offsets(n,i))) < JTOL) {
-                local_res(e,wkset->offsets(n,i),0) = -u(e,n,i);
-                
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////////////
+// Copy the subgrid contributions out of the workset, so the workset can be used for
+// the subgrid problems of the next cell while this cell is assembled
+///////////////////////////////////////////////////////////////////////////////////////
+
+void cell::storeSubgridResidual() {
+  if (subgrid_res.dimension(0) != wkset->res.dimension(0) || subgrid_res.dimension(1) != wkset->res.dimension(1)) {
+    subgrid_res = Kokkos::View<AD**,AssemblyDevice>("subgrid residual",wkset->res.dimension(0),wkset->res.dimension(1));
+  }
+  for (size_t i=0; i<wkset->res.dimension(0); i++) {
+    for (size_t j=0; j<wkset->res.dimension(1); j++) {
+      subgrid_res(i,j) = wkset->res(i,j);
+    }
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////////////
+// Fill the local res and J from the subgrid contributions (multiscale only)
+///////////////////////////////////////////////////////////////////////////////////////
+
+void cell::fillSubgridJacRes(Kokkos::View<AD**,AssemblyDevice> res_AD,
+                             const bool & compute_jacobian, const bool & compute_sens,
+                             Kokkos::View<double***,AssemblyDevice> local_res,
+                             Kokkos::View<double***,AssemblyDevice> local_J) {
+  
+  //////////////////////////////////////////////////////////////
+  // Fill in the coarse scale res and J
+  //////////////////////////////////////////////////////////////
+  
+  this->updateRes(res_AD, compute_sens, local_res);
+  if (compute_jacobian) {
+    this->updateJac(res_AD, false, local_J);
+  }
+  
+  if (compute_jacobian) {
+    bool fixJacDiag = true;
+    if (fixJacDiag) {
+      double JTOL = 1.0E-8;
+      
+      for (int e=0; e<numElem; e++) {
+        for (size_t n=0; n<wkset->offsets.dimension(0); n++) {
+          for (size_t i=0; i<wkset->offsets.dimension(1); i++) {
+            if (abs(local_J(e,wkset->offsets(n,i),wkset->offsets(n,i))) < JTOL) {
+              local_res(e,wkset->offsets(n,i),0) = -u(e,n,i);
+              
+              
+              for (size_t j=0; j<wkset->offsets.dimension(0); j++) {
+                double scale = 1.0/((double)wkset->offsets.dimension(1)-1.0);
+                local_J(e,wkset->offsets(n,i),wkset->offsets(n,j)) = -scale;
+                //local_J(wkset->offsets[n][j],wkset->offsets[n][i]) = 0.0;
                 
-                for (size_t j=0; j<wkset->offsets.dimension(0); j++) {
-                  double scale = 1.0/((double)wkset->offsets.dimension(1)-1.0);
-                  local_J(e,wkset->offsets(n,i),wkset->offsets(n,j)) = -scale;
-                  //local_J(wkset->offsets[n][j],wkset->offsets[n][i]) = 0.0;
-                  
-                  if (j!=i)
-                    local_res(e,wkset->offsets(n,i),0) += scale*u(e,n,j);
-                }
-                local_J(e,wkset->offsets(n,i),wkset->offsets(n,i)) = 1.0;
+                if (j!=i)
+                  local_res(e,wkset->offsets(n,i),0) += scale*u(e,n,j);
               }
+              local_J(e,wkset->offsets(n,i),wkset->offsets(n,i)) = 1.0;
             }
           }
         }
-        
       }
+      
     }
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////////////
+// Compute the contribution from this cell to the global res, J, Jdot
+///////////////////////////////////////////////////////////////////////////////////////
+
+void cell::computeJacRes(const vector<vector<double> > & paramvals,
+                         const vector<int> & paramtypes, const vector<string> & paramnames,
+                         const double & time, const bool & isTransient, const bool & isAdjoint,
+                         const bool & compute_jacobian, const bool & compute_sens,
+                         const int & num_active_params, const bool & compute_disc_sens,
+                         const bool & compute_aux_sens, const bool & store_adjPrev,
+                         Kokkos::View<double***,AssemblyDevice> local_res,
+                         Kokkos::View<double***,AssemblyDevice> local_J,
+                         Kokkos::View<double***,AssemblyDevice> local_Jdot) {
+  current_time = time;
+  
+  /////////////////////////////////////////////////////////////////////////////////////
+  // Compute the local contribution to the global residual and Jacobians
+  /////////////////////////////////////////////////////////////////////////////////////
+  
+  if (multiscale) {
+    
+    this->solveSubgrids(paramvals, paramtypes, paramnames, time, isTransient, isAdjoint,
+                        compute_jacobian, compute_sens, num_active_params,
+                        compute_disc_sens, compute_aux_sens, store_adjPrev);
+    this->fillSubgridJacRes(wkset->res, compute_jacobian, compute_sens, local_res, local_J);
     
     //timers[5]->stop();
     
@@ -753,7 +944,11 @@ void cell::computeJacRes(const vector<vector<double> > & paramvals,
 ///////////////////////////////////////////////////////////////////////////////////////
 
 void cell::updateRes(const bool & compute_sens, Kokkos::View<double***,AssemblyDevice> local_res) {
-  Kokkos::View<AD**,AssemblyDevice> res_AD = wkset->res;
+  this->updateRes(wkset->res, compute_sens, local_res);
+}
+
+void cell::updateRes(Kokkos::View<AD**,AssemblyDevice> res_AD, const bool & compute_sens,
+                     Kokkos::View<double***,AssemblyDevice> local_res) {
   Kokkos::View<int**,AssemblyDevice> offsets = wkset->offsets;
   if (compute_sens) {
     for (int e=0; e<numElem; e++) {
@@ -812,8 +1007,12 @@ void cell::updateAdjointRes(const bool & compute_sens, Kokkos::View<double***,As
 ///////////////////////////////////////////////////////////////////////////////////////
 
 void cell::updateJac(const bool & useadjoint, Kokkos::View<double***,AssemblyDevice> local_J) {
+  this->updateJac(wkset->res, useadjoint, local_J);
+}
+
+void cell::updateJac(Kokkos::View<AD**,AssemblyDevice> res_AD, const bool & useadjoint,
+                     Kokkos::View<double***,AssemblyDevice> local_J) {
   
-  Kokkos::View<AD**,AssemblyDevice> res_AD = wkset->res;
   Kokkos::View<int**,AssemblyDevice> offsets = wkset->offsets;
   
   if (useadjoint) {
@@ -991,7 +1190,7 @@ void cell::updateAuxJacDot(Kokkos::View<double***,AssemblyDevice> local_Jdot) {
 
 Kokkos::View<double**,AssemblyDevice> cell::getInitial(const bool & project, const bool & isAdjoint) {
   Kokkos::View<double**,AssemblyDevice> initialvals("initial values",numElem,GIDs[0].size());
-  wkset->update(ip,ijac,orientation);
+  wkset->update(ip,ijac,orientation,cellID);
   if (project) { // works for any basis
     for (int n=0; n<wkset->varlist.size(); n++) {
       Kokkos::View<double**,AssemblyDevice> initialip = physics_RCP->getInitial(wkset->ip,
@@ -1031,7 +1230,7 @@ Kokkos::View<double**,AssemblyDevice> cell::getInitial(const bool & project, con
 
 Kokkos::View<double***,AssemblyDevice> cell::getMass() {
   Kokkos::View<double***,AssemblyDevice> mass("local mass",numElem,GIDs[0].size(), GIDs[0].size());
-  wkset->update(ip,ijac,orientation);
+  wkset->update(ip,ijac,orientation,cellID);
   vector<string> basis_types = wkset->basis_types;
   
   for (int e=0; e<numElem; e++) {
@@ -1067,7 +1266,7 @@ Kokkos::View<double**,AssemblyDevice> cell::computeError(const double & solvetim
   
   Kokkos::View<double**,AssemblyDevice> errors("errors",numElem,index[0].size());
   if (!compute_subgrid) {
-    wkset->update(ip,ijac,orientation);
+    wkset->update(ip,ijac,orientation,cellID);
     wkset->computeSolnVolIP(u, u_dot, false, false);
     size_t numip = wkset->numip;
     
@@ -1163,7 +1362,7 @@ Kokkos::View<AD***,AssemblyDevice> cell::computeResponseAtNodes(const DRV & node
   // TMW: this whole function needs to be rewritten to use worksets properly
   /*
    size_t numip = nodes.dimension(1);
-   wkset->update(ip,ijac,orientation);
+   wkset->update(ip,ijac,orientation,cellID);
    
    // Map the local solution to the solution and gradient at ip
    FCAD u_ip(numElem,index[0].size(),numip);
@@ -1225,7 +1424,7 @@ Kokkos::View<AD***,AssemblyDevice> cell::computeResponse(const double & solvetim
     numip = sensorLocations.size();
   }
   
-  wkset->update(ip,ijac,orientation);
+  wkset->update(ip,ijac,orientation,cellID);
   
   //KokkosTools::print(u);
   if (numip > 0) {
@@ -1554,7 +1753,7 @@ AD cell::computeBoundaryRegularization(const vector<double> reg_constants, const
       //if (sidetype > 0) {
       //wkset->updateSide(nodes, sideip[side], sideijac[side], side);
       
-      wkset->updateSide(nodes, sideip[side], sidewts[side],normals[side],sideijac[side], side);
+      wkset->updateSide(nodes, sideip[side], sidewts[side],normals[side],sideijac[side], side, cellID);
       
       int numip = wkset->numsideip;
       //int gside = sideinfo[e](side,1); // =-1 if is an interior edge
@@ -1649,7 +1848,7 @@ AD cell::computeDomainRegularization(const vector<double> reg_constants, const v
   //}
   //this->setLocalADParams(param_AD,seedParams);
   int numip = wkset->numip;
-  wkset->update(ip,ijac,orientation);
+  wkset->update(ip,ijac,orientation,cellID);
   wkset->computeParamVolIP(param, seedParams);
   
   AD p, dpdx, dpdy, dpdz; // parameters
@@ -22,6 +22,7 @@
 
 #include <iostream>     
 #include <iterator>     
+#include <map>
 
 static void cellHelp(const string & details) {
   cout << "********** Help and Documentation for the cells **********" << endl;
@@ -53,6 +54,7 @@ public:
     
     active = true;
     multiscale = false;
+    cellID = -1;
     numElem = nodes_.dimension(0);
     numnodes = nodes_.dimension(1);
     dimension = nodes_.dimension(2);
@@ -314,6 +316,39 @@ public:
                      Kokkos::View<double***,AssemblyDevice> local_J,
                      Kokkos::View<double***,AssemblyDevice> local_Jdot);
   
+  ///////////////////////////////////////////////////////////////////////////////////////
+  // The two stages of computeJacRes for multiscale cells: solve the subgrid problems
+  // (the contributions are left in the workset residual) and fill the local res and J
+  // from the contributions.  storeSubgridResidual keeps a copy of the contributions so
+  // the stages of different cells can overlap.
+  ///////////////////////////////////////////////////////////////////////////////////////
+  
+  void solveSubgrids(const vector<vector<double > > & paramvals,
+                     const vector<int> & paramtypes, const vector<string> & paramnames,
+                     const double & time, const bool & isTransient, const bool & isAdjoint,
+                     const bool & compute_jacobian, const bool & compute_sens,
+                     const int & num_active_params, const bool & compute_disc_sens,
+                     const bool & compute_aux_sens, const bool & store_adjPrev);
+  
+  void storeSubgridResidual();
+  
+  void fillSubgridJacRes(Kokkos::View<AD**,AssemblyDevice> res_AD,
+                         const bool & compute_jacobian, const bool & compute_sens,
+                         Kokkos::View<double***,AssemblyDevice> local_res,
+                         Kokkos::View<double***,AssemblyDevice> local_J);
+  
+  ///////////////////////////////////////////////////////////////////////////////////////
+  // Solve the subgrid problems for groups of elements concurrently (multiscale only)
+  ///////////////////////////////////////////////////////////////////////////////////////
+  
+  void threadedSubgridSolve(std::map<int, vector<int> > & sggroups,
+                            const vector<vector<double> > & paramvals,
+                            const vector<int> & paramtypes, const vector<string> & paramnames,
+                            const double & time, const bool & isTransient, const bool & isAdjoint,
+                            const bool & compute_jacobian, const bool & compute_sens,
+                            const int & num_active_params, const bool & compute_disc_sens,
+                            const bool & compute_aux_sens, const bool & store_adjPrev);
+  
   ///////////////////////////////////////////////////////////////////////////////////////
   // Update the solution variables in the workset
   ///////////////////////////////////////////////////////////////////////////////////////
@@ -325,6 +360,9 @@ public:
   ///////////////////////////////////////////////////////////////////////////////////////
   
   void updateRes(const bool & compute_sens, Kokkos::View<double***,AssemblyDevice> local_res);
+  
+  void updateRes(Kokkos::View<AD**,AssemblyDevice> res_AD, const bool & compute_sens,
+                 Kokkos::View<double***,AssemblyDevice> local_res);
 
   ///////////////////////////////////////////////////////////////////////////////////////
   // Update the adjoint res
@@ -338,6 +376,9 @@ public:
   
   void updateJac(const bool & useadjoint, Kokkos::View<double***,AssemblyDevice> local_J);
   
+  void updateJac(Kokkos::View<AD**,AssemblyDevice> res_AD, const bool & useadjoint,
+                 Kokkos::View<double***,AssemblyDevice> local_J);
+  
   ///////////////////////////////////////////////////////////////////////////////////////
   // Use the AD res to update the scalarT Jdot
   ///////////////////////////////////////////////////////////////////////////////////////
@@ -554,6 +595,7 @@ public:
   Teuchos::RCP<Epetra_MpiComm> LocalComm;
   bool active, memory_efficient;
   size_t myBlock, myLevel;
+  int cellID; // index of the cells in their block (-1 if not set)
   Kokkos::View<int*> globalElemID;
   //size_t globalElemID;
   Teuchos::RCP<physics> physics_RCP;
@@ -633,6 +675,10 @@ public:
   vector<Teuchos::RCP<SubGridModel> > subgridModels;
   bool multiscale, have_cell_phi, have_cell_rotation;
   vector<size_t> subgrid_usernum, cell_data_seed, cell_data_seedindex;
+  vector<bool> subgrid_remote; // subgrid problem is solved on another rank
+  Kokkos::View<AD**,AssemblyDevice> subgrid_remote_res;
+  Kokkos::View<AD**,AssemblyDevice> subgrid_res; // copy of the subgrid contributions (pipelined assembly)
+  Kokkos::View<double***,AssemblyDevice> subgrid_remote_grad;
   vector<vector<size_t> > subgrid_model_index;
   
   Teuchos::RCP<workset> wkset;
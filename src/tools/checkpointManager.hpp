@@ -0,0 +1,281 @@
+/***********************************************************************
+ Multiscale/Multiphysics Interfaces for Large-scale Optimization (MILO)
+
+ Copyright 2018 National Technology & Engineering Solutions of Sandia,
+ LLC (NTESS). Under the terms of Contract DE-NA0003525 with NTESS, the
+ U.S. Government retains certain rights in this software.”
+
+ Questions? Contact Tim Wildey (tmwilde@sandia.gov) and/or
+ Bart van Bloemen Waanders (bartv@sandia.gov)
+ ************************************************************************/
+
+#ifndef CHECKPOINTMANAGER_H
+#define CHECKPOINTMANAGER_H
+
+#include "trilinos.hpp"
+#include "preferences.hpp"
+#include "diskHistory.hpp"
+#include <map>
+#include <algorithm>
+
+// Stores a subset of the forward states for the transient adjoint.
+// The states that are not stored are recomputed from the nearest
+// checkpoint while sweeping backwards in time.
+//   "fixed":    every k-th state is kept during the forward solve, and the
+//               states in between are recomputed one segment at a time
+//   "binomial": the checkpoints are placed according to the binomial
+//               (revolve-style) schedule, which gives O(log N) memory
+//   "full":     every state is kept (used when the states are stored on disk
+//               without checkpointing)
+// The stored states live either in memory or in a per-rank file on disk.
+
+class CheckpointManager {
+public:
+
+  CheckpointManager() {} ;
+
+  ~CheckpointManager() {};
+
+  ///////////////////////////////////////////////////////////////////////////////////////
+  ///////////////////////////////////////////////////////////////////////////////////////
+
+  CheckpointManager(Teuchos::RCP<Teuchos::ParameterList> & settings, const int & numsteps_,
+                    const int & vecsize, const bool & isTransient, const int & rank) :
+  numsteps(numsteps_) {
+
+    type = settings->sublist("Solver").get<string>("Adjoint checkpointing","none"); // or "fixed" or "binomial"
+    budget = settings->sublist("Solver").get<int>("Number of checkpoints",-1);
+    double maxmem = settings->sublist("Solver").get<double>("Checkpoint memory (MB)",0.0);
+    storage = settings->sublist("Solver").get<string>("Forward state storage","memory"); // or "disk"
+
+    if (!isTransient) {
+      type = "none";
+      storage = "memory";
+    }
+
+    // the checkpoints only serve the adjoint, and the postprocessing of an analysis
+    // without an adjoint (write solution, response, error) needs every state.
+    // Sampling evaluates the objective from the full history, and the ROL analyses
+    // write the final solution from it when "Write Output" is set.
+    string analysis_type = settings->sublist("Analysis").get<string>("analysis type","forward");
+    bool have_adjoint = (analysis_type == "forward+adjoint" ||
+                         analysis_type == "ROL" || analysis_type == "ROL_SIMOPT");
+    bool write_output = ((analysis_type == "ROL" || analysis_type == "ROL_SIMOPT") &&
+                         settings->sublist("Analysis").get<bool>("Write Output",false));
+    if (have_adjoint && write_output && type != "none" && rank == 0) {
+      cout << "**** Warning: adjoint checkpointing is turned off since Write Output needs the full time history" << endl;
+    }
+    if (!have_adjoint || write_output) {
+      type = "none";
+    }
+
+    TEUCHOS_TEST_FOR_EXCEPTION(type != "none" && type != "fixed" && type != "binomial",std::runtime_error,"Error: unrecognized adjoint checkpointing type: " + type);
+    TEUCHOS_TEST_FOR_EXCEPTION(storage != "memory" && storage != "disk",std::runtime_error,"Error: unrecognized forward state storage: " + storage);
+
+    if (type == "none" && storage == "disk") {
+      type = "full";
+    }
+
+    if (budget < 0) {
+      if (maxmem > 0.0) {
+        // each stored state is one overlapped vector of doubles
+        budget = (int)(maxmem*1024.0*1024.0/(8.0*std::max(vecsize,1)));
+      }
+      else {
+        budget = (int)std::ceil(std::sqrt((double)numsteps));
+      }
+    }
+    budget = std::max(budget,1);
+
+    interval = 1;
+    if (type == "fixed") {
+      interval = (int)std::ceil((double)numsteps/(double)budget);
+      interval = std::max(interval,1);
+    }
+
+    // states kept during the forward solve (the initial and final states are always kept)
+    if (type == "fixed") {
+      for (int s=interval; s<numsteps; s+=interval) {
+        forward_steps.push_back(s);
+      }
+    }
+    else if (type == "binomial") {
+      int start = 0;
+      int snaps = budget;
+      while (snaps > 0 && numsteps-start > 1) {
+        start += this->binomialSplit(numsteps-start, snaps);
+        forward_steps.push_back(start);
+        snaps--;
+      }
+    }
+    else if (type == "full") {
+      for (int s=1; s<numsteps; s++) {
+        forward_steps.push_back(s);
+      }
+    }
+    forward_steps.push_back(numsteps);
+
+    if (storage == "disk") {
+      string directory = settings->sublist("Solver").get<string>("Storage directory","/tmp");
+      int depth = settings->sublist("Solver").get<int>("Prefetch depth",2);
+      // largest number of states held at once for each schedule
+      size_t maxslots = numsteps+1;
+      if (type == "fixed") {
+        maxslots = numsteps/interval + interval + 3;
+      }
+      else if (type == "binomial") {
+        maxslots = budget + 3;
+      }
+      maxslots = std::min(maxslots, (size_t)numsteps+1);
+      disk = Teuchos::rcp(new DiskHistory(directory, rank, vecsize, maxslots, depth));
+    }
+  }
+
+  ///////////////////////////////////////////////////////////////////////////////////////
+  ///////////////////////////////////////////////////////////////////////////////////////
+
+  bool isActive() {
+    return type != "none";
+  }
+
+  ///////////////////////////////////////////////////////////////////////////////////////
+  // Is this state kept during the forward solve
+  ///////////////////////////////////////////////////////////////////////////////////////
+
+  bool storeForward(const int & step) {
+    if (step == 0) {
+      return true;
+    }
+    return std::binary_search(forward_steps.begin(), forward_steps.end(), step);
+  }
+
+  ///////////////////////////////////////////////////////////////////////////////////////
+  // Intermediate states to keep while recomputing from a checkpoint up to the target
+  // (the target itself is always kept)
+  ///////////////////////////////////////////////////////////////////////////////////////
+
+  vector<int> getRecomputeSteps(const int & from, const int & target) {
+    vector<int> keep;
+    if (type == "fixed") {
+      for (int s=from+1; s<target; s++) {
+        keep.push_back(s);
+      }
+    }
+    else if (type == "binomial") {
+      // the initial state is never released, so it does not count against the budget
+      int snaps = budget - ((int)states.size() - 1);
+      int start = from;
+      while (snaps > 0 && target-start > 1) {
+        start += this->binomialSplit(target+1-start, snaps);
+        if (start >= target) {
+          break;
+        }
+        keep.push_back(start);
+        snaps--;
+      }
+    }
+    return keep;
+  }
+
+  ///////////////////////////////////////////////////////////////////////////////////////
+  // Position of the next checkpoint when reversing numsteps with snaps checkpoints
+  ///////////////////////////////////////////////////////////////////////////////////////
+
+  int binomialSplit(const int & nsteps, const int & snaps) {
+    if (nsteps <= 1 || snaps <= 0) {
+      return std::max(nsteps-1,1);
+    }
+    // smallest number of repetitions that can reverse nsteps
+    int reps = 1;
+    while (this->binomial(snaps+reps, snaps) < (double)nsteps) {
+      reps++;
+    }
+    int split = nsteps - (int)this->binomial(snaps-1+reps, snaps-1);
+    split = std::max(split,1);
+    split = std::min(split,nsteps-1);
+    return split;
+  }
+
+  double binomial(const int & n, const int & k) {
+    double val = 1.0;
+    for (int i=1; i<=k; i++) {
+      val *= (double)(n-k+i)/(double)i;
+    }
+    return val;
+  }
+
+  ///////////////////////////////////////////////////////////////////////////////////////
+  // Storage
+  ///////////////////////////////////////////////////////////////////////////////////////
+
+  void store(const int & step, const vector_RCP & u) {
+    if (storage == "disk") {
+      if (vecmap == Teuchos::null) {
+        vecmap = Teuchos::rcp(new Epetra_BlockMap(u->Map()));
+      }
+      disk->write(step, u);
+      states[step] = Teuchos::null; // the data lives in the file
+    }
+    else {
+      states[step] = Teuchos::rcp(new LA_MultiVector(*u));
+    }
+  }
+
+  bool isStored(const int & step) {
+    return states.find(step) != states.end();
+  }
+
+  vector_RCP retrieve(const int & step) {
+    TEUCHOS_TEST_FOR_EXCEPTION(!this->isStored(step),std::runtime_error,"Error: forward state is not available in the checkpoint manager");
+    if (storage == "disk") {
+      vector_RCP u = Teuchos::rcp(new LA_MultiVector(*vecmap,1));
+      disk->read(step, u);
+      return u;
+    }
+    return states[step];
+  }
+
+  ///////////////////////////////////////////////////////////////////////////////////////
+  // Is every state available (needed to postprocess the time history)
+  ///////////////////////////////////////////////////////////////////////////////////////
+
+  bool haveFullHistory() {
+    return type == "none" || type == "full";
+  }
+
+  int nearestStored(const int & step) {
+    // the initial state is always stored
+    std::map<int,vector_RCP>::iterator it = states.upper_bound(step);
+    --it;
+    return it->first;
+  }
+
+  void release(const int & step) {
+    if (step > 0) {
+      states.erase(step);
+      if (storage == "disk") {
+        disk->release(step);
+      }
+    }
+  }
+
+  void clear() {
+    states.clear();
+    if (storage == "disk") {
+      disk->clear();
+    }
+  }
+
+  ///////////////////////////////////////////////////////////////////////////////////////
+  // Public data
+  ///////////////////////////////////////////////////////////////////////////////////////
+
+  string type, storage;
+  int numsteps, budget, interval;
+  Teuchos::RCP<DiskHistory> disk;
+  Teuchos::RCP<Epetra_BlockMap> vecmap;
+  vector<int> forward_steps;
+  std::map<int,vector_RCP> states;
+
+};
+#endif
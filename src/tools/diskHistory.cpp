@@ -0,0 +1,241 @@
+/***********************************************************************
+ Multiscale/Multiphysics Interfaces for Large-scale Optimization (MILO)
+
+ Copyright 2018 National Technology & Engineering Solutions of Sandia,
+ LLC (NTESS). Under the terms of Contract DE-NA0003525 with NTESS, the
+ U.S. Government retains certain rights in this software.”
+
+ Questions? Contact Tim Wildey (tmwilde@sandia.gov) and/or
+ Bart van Bloemen Waanders (bartv@sandia.gov)
+ ************************************************************************/
+
+#include "diskHistory.hpp"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
+
+// ========================================================================================
+// ========================================================================================
+
+HistoryFile::~HistoryFile() {
+  if (fd >= 0) {
+    close(fd);
+    unlink(name.c_str());
+  }
+}
+
+HistoryMapping::~HistoryMapping() {
+  if (addr != NULL) {
+    munmap(addr, size);
+  }
+}
+
+// ========================================================================================
+// ========================================================================================
+
+DiskHistory::DiskHistory(const string & directory, const int & rank, const size_t & vecsize_,
+                         const size_t & maxslots_, const int & prefetch_depth_) :
+prefetch_depth(prefetch_depth_), vecsize(vecsize_), maxslots(maxslots_) {
+
+  stringstream ss;
+  ss << directory << "/milo_history." << rank << "." << getpid() << ".bin";
+  string filename = ss.str();
+
+  pagesize = (size_t)sysconf(_SC_PAGESIZE);
+  mapsize = std::max(maxslots*vecsize*sizeof(double), pagesize);
+
+  file.fd = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+  TEUCHOS_TEST_FOR_EXCEPTION(file.fd < 0,std::runtime_error,"Error: MILO could not create the time history file: " + filename);
+  file.name = filename;
+
+  // the file is sparse until the slots are written
+  int err = ftruncate(file.fd, (off_t)mapsize);
+  TEUCHOS_TEST_FOR_EXCEPTION(err != 0,std::runtime_error,"Error: MILO could not size the time history file: " + filename);
+
+  void * addr = mmap(NULL, mapsize, PROT_READ | PROT_WRITE, MAP_SHARED, file.fd, 0);
+  TEUCHOS_TEST_FOR_EXCEPTION(addr == MAP_FAILED,std::runtime_error,"Error: MILO could not map the time history file: " + filename);
+  mapping.addr = addr;
+  mapping.size = mapsize;
+  data = (double*)addr;
+
+  for (size_t s=maxslots; s>0; s--) {
+    freeslots.push_back(s-1);
+  }
+
+  finished = false;
+  writer = std::thread(&DiskHistory::writerLoop, this);
+}
+
+// ========================================================================================
+// ========================================================================================
+
+DiskHistory::~DiskHistory() {
+  {
+    std::unique_lock<std::mutex> lock(mtx);
+    finished = true;
+  }
+  cv.notify_all();
+  if (writer.joinable()) {
+    writer.join();
+  }
+}
+
+// ========================================================================================
+// ========================================================================================
+
+void DiskHistory::write(const int & step, const vector_RCP & u) {
+
+  size_t len = std::min((size_t)u->MyLength(), vecsize);
+  double * uval = (*u)[0];
+
+  size_t slot;
+  {
+    std::unique_lock<std::mutex> lock(mtx);
+    std::map<int,size_t>::iterator it = slots.find(step);
+    if (it != slots.end()) {
+      slot = it->second;
+    }
+    else {
+      TEUCHOS_TEST_FOR_EXCEPTION(freeslots.size() == 0,std::runtime_error,"Error: the time history file is full");
+      slot = freeslots.back();
+      freeslots.pop_back();
+      slots[step] = slot;
+    }
+
+    // bound the dirty pages held by pending write-backs
+    cv.wait(lock, [this]{ return queue.size() < (size_t)std::max(prefetch_depth,2); });
+  }
+
+  // the slot is reserved for this step, so the copy does not need the lock
+  memcpy(data + slot*vecsize, uval, len*sizeof(double));
+
+  {
+    std::unique_lock<std::mutex> lock(mtx);
+    queue.push_back(slot);
+    inflight[slot] += 1;
+  }
+  cv.notify_all();
+}
+
+// ========================================================================================
+// ========================================================================================
+
+void DiskHistory::read(const int & step, vector_RCP & u) {
+
+  // the mapping always holds the state (a pending write-back only moves it to disk)
+  size_t slot;
+  {
+    std::unique_lock<std::mutex> lock(mtx);
+    std::map<int,size_t>::iterator it = slots.find(step);
+    TEUCHOS_TEST_FOR_EXCEPTION(it == slots.end(),std::runtime_error,"Error: forward state is not available in the time history file");
+    slot = it->second;
+  }
+
+  size_t len = std::min((size_t)u->MyLength(), vecsize);
+  memcpy((*u)[0], data + slot*vecsize, len*sizeof(double));
+
+  for (int k=1; k<=prefetch_depth; k++) {
+    this->prefetch(step-k);
+  }
+}
+
+// ========================================================================================
+// ========================================================================================
+
+void DiskHistory::prefetch(const int & step) {
+  std::unique_lock<std::mutex> lock(mtx);
+  std::map<int,size_t>::iterator it = slots.find(step);
+  if (it != slots.end()) {
+    size_t start, length;
+    this->pageRange(it->second, start, length);
+    madvise((char*)data + start, length, MADV_WILLNEED);
+  }
+}
+
+// ========================================================================================
+// ========================================================================================
+
+void DiskHistory::release(const int & step) {
+  std::unique_lock<std::mutex> lock(mtx);
+  std::map<int,size_t>::iterator it = slots.find(step);
+  if (it != slots.end()) {
+    size_t slot = it->second;
+    cv.wait(lock, [this,slot]{ return inflight.find(slot) == inflight.end(); });
+    size_t start, length;
+    this->pageRange(slot, start, length);
+    madvise((char*)data + start, length, MADV_DONTNEED);
+    freeslots.push_back(slot);
+    slots.erase(it);
+  }
+}
+
+// ========================================================================================
+// ========================================================================================
+
+void DiskHistory::clear() {
+  this->flush();
+  std::unique_lock<std::mutex> lock(mtx);
+  slots.clear();
+  freeslots.clear();
+  for (size_t s=maxslots; s>0; s--) {
+    freeslots.push_back(s-1);
+  }
+}
+
+// ========================================================================================
+// ========================================================================================
+
+void DiskHistory::flush() {
+  std::unique_lock<std::mutex> lock(mtx);
+  cv.wait(lock, [this]{ return queue.size() == 0 && inflight.size() == 0; });
+}
+
+// ========================================================================================
+// Background thread that writes the pending slots back to disk
+// ========================================================================================
+
+void DiskHistory::writerLoop() {
+  while (true) {
+    size_t slot;
+    {
+      std::unique_lock<std::mutex> lock(mtx);
+      cv.wait(lock, [this]{ return finished || queue.size() > 0; });
+      if (queue.size() == 0) { // finished and nothing left to write
+        return;
+      }
+      slot = queue.front();
+      queue.pop_front();
+      cv.notify_all();
+    }
+
+    // write the slot back (MS_ASYNC does not start any I/O on Linux), so the clean
+    // pages can be dropped from this process and evicted from the page cache
+    size_t start, length;
+    this->pageRange(slot, start, length);
+    msync((char*)data + start, length, MS_SYNC);
+    madvise((char*)data + start, length, MADV_DONTNEED);
+
+    {
+      std::unique_lock<std::mutex> lock(mtx);
+      inflight[slot] -= 1;
+      if (inflight[slot] == 0) {
+        inflight.erase(slot);
+      }
+    }
+    cv.notify_all();
+  }
+}
+
+// ========================================================================================
+// Page aligned byte range covering a slot
+// ========================================================================================
+
+void DiskHistory::pageRange(const size_t & slot, size_t & start, size_t & length) {
+  size_t first = slot*vecsize*sizeof(double);
+  size_t last = std::min((slot+1)*vecsize*sizeof(double), mapsize);
+  start = (first/pagesize)*pagesize;
+  length = last - start;
+}
@@ -0,0 +1,111 @@
+/***********************************************************************
+ Multiscale/Multiphysics Interfaces for Large-scale Optimization (MILO)
+
+ Copyright 2018 National Technology & Engineering Solutions of Sandia,
+ LLC (NTESS). Under the terms of Contract DE-NA0003525 with NTESS, the
+ U.S. Government retains certain rights in this software.”
+
+ Questions? Contact Tim Wildey (tmwilde@sandia.gov) and/or
+ Bart van Bloemen Waanders (bartv@sandia.gov)
+ ************************************************************************/
+
+#ifndef DISKHISTORY_H
+#define DISKHISTORY_H
+
+#include "trilinos.hpp"
+#include "preferences.hpp"
+
+#include <map>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+// Out-of-core storage for the forward time history.
+// Each rank owns one binary file on node-local disk that is mapped into memory.
+// A state is copied straight into its slot of the mapping; a background thread
+// writes the slot back to disk and then drops its pages from the process.
+// Reads prefetch the slots of the preceding steps since the adjoint sweeps
+// backwards in time.
+
+// Owns the descriptor of the history file (closes and removes the file)
+struct HistoryFile {
+  HistoryFile() : fd(-1) {};
+  ~HistoryFile();
+  HistoryFile(const HistoryFile &) = delete;
+  HistoryFile & operator=(const HistoryFile &) = delete;
+  int fd;
+  string name;
+};
+
+// Owns the mapping of the history file
+struct HistoryMapping {
+  HistoryMapping() : addr(NULL), size(0) {};
+  ~HistoryMapping();
+  HistoryMapping(const HistoryMapping &) = delete;
+  HistoryMapping & operator=(const HistoryMapping &) = delete;
+  void * addr;
+  size_t size;
+};
+
+class DiskHistory {
+public:
+
+  DiskHistory() {} ;
+
+  ~DiskHistory();
+
+  DiskHistory(const string & directory, const int & rank, const size_t & vecsize_,
+              const size_t & maxslots_, const int & prefetch_depth_);
+
+  ///////////////////////////////////////////////////////////////////////////////////////
+  // Copy the (single column) state into the slot for this step
+  ///////////////////////////////////////////////////////////////////////////////////////
+
+  void write(const int & step, const vector_RCP & u);
+
+  ///////////////////////////////////////////////////////////////////////////////////////
+  // Copy the stored state into u and prefetch the previous steps
+  ///////////////////////////////////////////////////////////////////////////////////////
+
+  void read(const int & step, vector_RCP & u);
+
+  ///////////////////////////////////////////////////////////////////////////////////////
+  ///////////////////////////////////////////////////////////////////////////////////////
+
+  void prefetch(const int & step);
+
+  void release(const int & step);
+
+  void clear();
+
+  void flush();
+
+private:
+
+  void writerLoop();
+
+  void pageRange(const size_t & slot, size_t & start, size_t & length);
+
+  // declared before the writer thread, so they are released after it is joined
+  HistoryFile file;
+  HistoryMapping mapping;
+
+  int prefetch_depth;
+  size_t vecsize, maxslots, mapsize, pagesize;
+  double * data;
+
+  std::map<int,size_t> slots;
+  vector<size_t> freeslots;
+
+  // slots waiting to be written back to disk
+  std::deque<size_t> queue;
+  std::map<size_t,int> inflight;
+  std::mutex mtx;
+  std::condition_variable cv;
+  std::thread writer;
+  bool finished;
+
+};
+
+#endif
@@ -0,0 +1,401 @@
+/***********************************************************************
+ Multiscale/Multiphysics Interfaces for Large-scale Optimization (MILO)
+
+ Copyright 2018 National Technology & Engineering Solutions of Sandia,
+ LLC (NTESS). Under the terms of Contract DE-NA0003525 with NTESS, the
+ U.S. Government retains certain rights in this software.”
+
+ Questions? Contact Tim Wildey (tmwilde@sandia.gov) and/or
+ Bart van Bloemen Waanders (bartv@sandia.gov)
+ ************************************************************************/
+
+// Generates C++ kernels for the functions defined in an input file
+//
+// usage: functions_to_cpp [input file (default: input.yaml)] [output file (default: function_kernels.cpp)]
+//
+// The Functions sublist (and Functions->Side) of the input file is translated into
+// C++ kernels.  The output needs to be compiled into a shared library with the same
+// MILO and Trilinos headers (and flags) as milo, e.g.,
+//   c++ -O3 -fPIC -shared -I<MILO src dirs> -I<Trilinos include> function_kernels.cpp -o function_kernels.so
+// and is used by setting "Function kernel library" in the Solver sublist.
+// The expressions are parsed with the same interpreter as the FunctionInterface, so
+// the kernels apply the operators in the same order.  Functions that use the
+// reductions (max, min, mean) are left to the interpreter.
+
+#include "trilinos.hpp"
+#include "preferences.hpp"
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include "userInterface.hpp"
+#include "interpreter.hpp"
+#include "functionKernel.hpp"
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+// Generated code for one function
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+
+class KernelGenerator {
+public:
+
+  KernelGenerator(const std::map<string,string> & functions_) : functions(functions_), numtemps(0), valid(true) {
+    known_ops = {"sin","cos","exp","log","tan","abs","max","min","mean"};
+    double_vars = {"x","y","z","t","nx","ny","nz"};
+  }
+
+  //////////////////////////////////////////////////////////////////////////////////////////////////////
+  // Generate the statements for an expression and return the variable (or input) holding its value
+  //////////////////////////////////////////////////////////////////////////////////////////////////////
+
+  string generate(const string & expression, bool & isAD) {
+    vector<term> terms;
+    terms.push_back(term(expression));
+    std::map<size_t,pair<string,bool> > values;
+    return this->generateTerm(terms, 0, values, isAD);
+  }
+
+  //////////////////////////////////////////////////////////////////////////////////////////////////////
+  // Public data members
+  //////////////////////////////////////////////////////////////////////////////////////////////////////
+
+  std::map<string,string> functions;
+  vector<string> ad_inputs, double_inputs, known_ops, double_vars;
+  vector<pair<string,string> > calls;
+  std::ostringstream body;
+  int numtemps;
+  bool valid;
+  string message;
+
+private:
+
+  string generateTerm(vector<term> & terms, const size_t & index,
+                      std::map<size_t,pair<string,bool> > & values, bool & isAD) {
+
+    if (values.find(index) != values.end()) {
+      isAD = values[index].second;
+      return values[index].first;
+    }
+
+    string expr = terms[index].expression;
+    string value;
+    size_t tindex = index; // isOperator takes a non-const index
+    isAD = false;
+
+    if (expr == "pi") {
+      value = "PI";
+    }
+    else if (std::find(double_vars.begin(), double_vars.end(), expr) != double_vars.end()) {
+      value = this->getInput(double_inputs, expr, "d");
+    }
+    else if (expr == "h") {
+      valid = false;
+      message = "uses h";
+    }
+    else if (isOperator(terms, tindex, known_ops)) {
+      value = this->generateOps(terms, index, values, isAD);
+    }
+    else if (expr.length() > 0 && isScalar(expr)) {
+      std::ostringstream num;
+      num << std::scientific << std::setprecision(17) << std::stod(expr);
+      value = num.str();
+    }
+    else if (functions.find(expr) != functions.end()) { // inline the function
+      if (std::find(active.begin(), active.end(), expr) != active.end()) {
+        valid = false;
+        message = "recursive call to " + expr;
+      }
+      else {
+        active.push_back(expr);
+        bool have_call = false;
+        for (size_t k=0; k<calls.size(); k++) {
+          if (calls[k].first == expr) {
+            have_call = true;
+          }
+        }
+        if (!have_call) {
+          calls.push_back(pair<string,string>(expr, functions[expr]));
+        }
+        value = this->generate(functions[expr], isAD);
+        active.pop_back();
+      }
+    }
+    else if (this->isLeaf(expr)) { // variable or parameter
+      value = this->getInput(ad_inputs, expr, "a");
+      isAD = true;
+    }
+    else {
+      split(terms, index);
+      value = this->generateOps(terms, index, values, isAD);
+    }
+
+    values[index] = pair<string,bool>(value, isAD);
+    return value;
+  }
+
+  //////////////////////////////////////////////////////////////////////////////////////////////////////
+  // Apply the operators of a term to its dependencies (same order as FunctionInterface::evaluateOp)
+  //////////////////////////////////////////////////////////////////////////////////////////////////////
+
+  string generateOps(vector<term> & terms, const size_t & index,
+                     std::map<size_t,pair<string,bool> > & values, bool & isAD) {
+    vector<int> deps = terms[index].dep_list;
+    vector<string> ops = terms[index].dep_ops;
+    vector<string> depvals;
+    isAD = false;
+    for (size_t k=0; k<deps.size(); k++) {
+      bool depAD = false;
+      depvals.push_back(this->generateTerm(terms, deps[k], values, depAD));
+      if (depAD) {
+        isAD = true;
+      }
+    }
+
+    string type = isAD ? "AD" : "double";
+    string var = "v" + std::to_string(numtemps);
+    numtemps++;
+
+    if (deps.size() == 0) {
+      body << "      " << type << " " << var << " = 0.0;" << endl;
+    }
+    for (size_t k=0; k<deps.size(); k++) {
+      string op = ops[k];
+      string dv = depvals[k];
+      string init = (k == 0) ? (type + " ") : "";
+      if (isReduction(op)) {
+        valid = false;
+        message = "uses " + op;
+      }
+      else if (op == "" ) {
+        body << "      " << init << var << " = " << dv << ";" << endl;
+      }
+      else if (op == "sin" || op == "cos" || op == "tan" || op == "exp" || op == "log") {
+        body << "      " << init << var << " = " << op << "(" << dv << ");" << endl;
+      }
+      else if (op == "abs") {
+        body << "      " << init << var << " = (" << dv << " < 0.0) ? " << type << "(-(" << dv << ")) : " << type << "(" << dv << ");" << endl;
+      }
+      else if (op == "plus") {
+        body << "      " << var << " += " << dv << ";" << endl;
+      }
+      else if (op == "minus") {
+        body << "      " << var << " += -(" << dv << ");" << endl;
+      }
+      else if (op == "times") {
+        body << "      " << var << " *= " << dv << ";" << endl;
+      }
+      else if (op == "divide") {
+        body << "      " << var << " /= " << dv << ";" << endl;
+      }
+      else if (op == "power") {
+        body << "      " << var << " = pow(" << var << "," << dv << ");" << endl;
+      }
+      else if (op == "lt" || op == "lte" || op == "gt" || op == "gte") {
+        string cmp = (op == "lt") ? "<" : (op == "lte") ? "<=" : (op == "gt") ? ">" : ">=";
+        body << "      " << var << " = (" << var << " " << cmp << " " << dv << ") ? 1.0 : 0.0;" << endl;
+      }
+      else {
+        valid = false;
+        message = "unknown operator " + op;
+      }
+    }
+    return var;
+  }
+
+  //////////////////////////////////////////////////////////////////////////////////////////////////////
+  // Index of an input (added if needed)
+  //////////////////////////////////////////////////////////////////////////////////////////////////////
+
+  string getInput(vector<string> & inputs, const string & name, const string & prefix) {
+    size_t index = inputs.size();
+    for (size_t k=0; k<inputs.size(); k++) {
+      if (inputs[k] == name) {
+        index = k;
+      }
+    }
+    if (index == inputs.size()) {
+      inputs.push_back(name);
+    }
+    return prefix + std::to_string(index) + "(e,n)";
+  }
+
+  //////////////////////////////////////////////////////////////////////////////////////////////////////
+  // Is the expression a single name (variable, derivative, component or parameter)
+  //////////////////////////////////////////////////////////////////////////////////////////////////////
+
+  bool isLeaf(const string & expr) {
+    if (expr.length() == 0 || !(isalpha(expr[0]) || expr[0] == '_')) {
+      return false;
+    }
+    for (size_t k=0; k<expr.length(); k++) {
+      char c = expr[k];
+      if (!(isalnum(c) || c == '_' || c == '[' || c == ']' || c == '(' || c == ')')) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  vector<string> active; // functions being inlined
+
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+// Quote a string for the generated code
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static string quote(const string & s) {
+  string q = "\"";
+  for (size_t k=0; k<s.length(); k++) {
+    if (s[k] == '"' || s[k] == '\\') {
+      q += '\\';
+    }
+    q += s[k];
+  }
+  return q + "\"";
+}
+
+static string nameList(std::ostream & out, const string & listname, const vector<string> & names) {
+  if (names.size() == 0) {
+    return "NULL";
+  }
+  out << "static const char * " << listname << "[] = {";
+  for (size_t k=0; k<names.size(); k++) {
+    out << (k > 0 ? ", " : "") << quote(names[k]);
+  }
+  out << "};" << endl;
+  return listname;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+// Generate the kernels for a list of functions
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static void generateKernels(std::ostream & out, std::ostream & table, const std::map<string,string> & functions,
+                            const std::map<string,string> & targets, int & numkernels) {
+
+  std::map<string,string>::const_iterator f_itr = targets.begin();
+  while (f_itr != targets.end()) {
+    KernelGenerator gen(functions);
+    bool isAD = false;
+    string result = gen.generate(f_itr->second, isAD);
+    if (!gen.valid) {
+      cout << "  skipping " << f_itr->first << " (" << gen.message << ")" << endl;
+      f_itr++;
+      continue;
+    }
+
+    string kname = "kernel_" + std::to_string(numkernels);
+    out << "// " << f_itr->first << " = " << f_itr->second << endl;
+    out << "static void " << kname << "(const vector<FDATA> & ad_inputs, const vector<FDATAd> & double_inputs," << endl;
+    out << "                   FDATA result) {" << endl;
+    for (size_t k=0; k<gen.ad_inputs.size(); k++) {
+      out << "  FDATA a" << k << " = ad_inputs[" << k << "]; // " << gen.ad_inputs[k] << endl;
+    }
+    for (size_t k=0; k<gen.double_inputs.size(); k++) {
+      out << "  FDATAd d" << k << " = double_inputs[" << k << "]; // " << gen.double_inputs[k] << endl;
+    }
+    out << "  for (int e=0; e<result.dimension(0); e++) {" << endl;
+    out << "    for (int n=0; n<result.dimension(1); n++) {" << endl;
+    out << gen.body.str();
+    out << "      result(e,n) = " << result << ";" << endl;
+    out << "    }" << endl;
+    out << "  }" << endl;
+    out << "}" << endl;
+
+    vector<string> calls;
+    for (size_t k=0; k<gen.calls.size(); k++) {
+      calls.push_back(gen.calls[k].first);
+      calls.push_back(gen.calls[k].second);
+    }
+    string adlist = nameList(out, kname + "_ad_inputs", gen.ad_inputs);
+    string dlist = nameList(out, kname + "_double_inputs", gen.double_inputs);
+    string clist = nameList(out, kname + "_calls", calls);
+    out << endl;
+
+    table << "  {" << quote(f_itr->first) << ", " << quote(f_itr->second) << ", "
+          << gen.ad_inputs.size() << ", " << adlist << ", "
+          << gen.double_inputs.size() << ", " << dlist << ", "
+          << gen.calls.size() << ", " << clist << ", " << kname << "}," << endl;
+
+    numkernels++;
+    f_itr++;
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static void addFunctions(const Teuchos::ParameterList & list, std::map<string,string> & functions) {
+  Teuchos::ParameterList::ConstIterator fnc_itr = list.begin();
+  while (fnc_itr != list.end()) {
+    if (!list.isSublist(fnc_itr->first)) {
+      functions[fnc_itr->first] = list.get<string>(fnc_itr->first);
+    }
+    fnc_itr++;
+  }
+}
+
+int main(int argc, char * argv[]) {
+
+  TEUCHOS_TEST_FOR_EXCEPTION(argc > 3,std::runtime_error,"Error: usage: functions_to_cpp [input file] [output file]");
+
+  Kokkos::initialize();
+
+  string input_file_name = "input.yaml";
+  string output_file_name = "function_kernels.cpp";
+  if (argc > 1) {
+    input_file_name = argv[1];
+  }
+  if (argc > 2) {
+    output_file_name = argv[2];
+  }
+
+  {
+    Teuchos::RCP<Teuchos::ParameterList> settings = userInterface(input_file_name);
+
+    // Volumetric functions can call the other volumetric functions
+    // Side functions can call the volumetric functions and the other side functions
+    std::map<string,string> functions, side_functions, all_side_functions;
+    Teuchos::ParameterList fsettings = settings->sublist("Functions");
+    addFunctions(fsettings, functions);
+    all_side_functions = functions;
+    if (fsettings.isSublist("Side")) {
+      addFunctions(fsettings.sublist("Side"), side_functions);
+      addFunctions(fsettings.sublist("Side"), all_side_functions);
+    }
+
+    std::ostringstream kernels, table;
+    int numkernels = 0;
+    cout << "Generating kernels for " << input_file_name << endl;
+    generateKernels(kernels, table, functions, functions, numkernels);
+    generateKernels(kernels, table, all_side_functions, side_functions, numkernels);
+
+    std::ofstream out(output_file_name.c_str());
+    out << "// Generated by functions_to_cpp from " << input_file_name << " (do not edit)" << endl;
+    out << "// Compile into a shared library with the same MILO and Trilinos headers as milo" << endl;
+    out << endl;
+    out << "#include \"trilinos.hpp\"" << endl;
+    out << "#include \"preferences.hpp\"" << endl;
+    out << "#include \"functionKernel.hpp\"" << endl;
+    out << endl;
+    out << kernels.str();
+    out << "static FunctionKernel kernels[] = {" << endl;
+    out << table.str();
+    out << "  {NULL, NULL, 0, NULL, 0, NULL, 0, NULL, NULL}" << endl;
+    out << "};" << endl;
+    out << endl;
+    out << "extern \"C\" int " << MILO_FUNCTION_KERNELS << "(int * maxderivs, FunctionKernel ** list) {" << endl;
+    out << "  *maxderivs = maxDerivs;" << endl;
+    out << "  *list = kernels;" << endl;
+    out << "  return " << numkernels << ";" << endl;
+    out << "}" << endl;
+    out.close();
+
+    cout << "Wrote " << numkernels << " kernels to " << output_file_name << endl;
+  }
+
+  Kokkos::finalize();
+
+  return 0;
+}
@@ -18,11 +18,13 @@ SplitComm::SplitComm(Teuchos::RCP<Teuchos::ParameterList> & settings,
           Teuchos::RCP<LA_MpiComm> & tcomm_S) {
   
   
+  is_subgrid_server = false;
+  macro_solves_subgrids = true;
+  
   string analysis_type = settings->sublist("Analysis").get<string>("analysis type","forward");
   bool ms_split_comm = settings->sublist("Analysis").get<bool>("multiscale split comm",false);
   int numLA = Comm.NumProc();
   int numGroups = 1;
-  int procsPerGroup = numLA;
   if (analysis_type == "SOL"){
     numLA = settings->sublist("Analysis").get<int>("Number of LA processors",numLA);
     numGroups = Comm.NumProc()/numLA;
@@ -34,15 +36,13 @@ SplitComm::SplitComm(Teuchos::RCP<Teuchos::ParameterList> & settings,
   }
   else if (ms_split_comm) {
     numLA = settings->sublist("Analysis").get<int>("Number of macro processors",numLA);
-    numGroups = numLA;
-    procsPerGroup = Comm.NumProc()/numLA;
-    if (Comm.NumProc()%numLA != 0){
-      cout << "\n NUMBER OF MACRO PROCESSORS NEEDS TO BE A FACTOR OF TOTAL NUMBER OF PROCESSORS..." << endl;
-      numLA = Comm.NumProc();
-      procsPerGroup = 1;
-    }
-    bool include_main = true;
-    this->split_mpi_communicators(Comm, tcomm_LA, tcomm_S, Comm.MyPID(), numLA, include_main);
+    macro_solves_subgrids = settings->sublist("Analysis").get<bool>("macro ranks solve subgrids",false);
+    this->split_mpi_communicators(Comm, tcomm_LA, tcomm_MS, Comm.MyPID(), numLA, macro_solves_subgrids);
+    
+    // the subgrid models are serial on every rank
+    MPI_Comm self_comm;
+    MPI_Comm_split(Comm.Comm(), Comm.MyPID(), 0, &self_comm);
+    tcomm_S = Teuchos::rcp( new LA_MpiComm(self_comm) );
   }
   else {
     this->split_mpi_communicators(tcomm_LA, tcomm_S, Comm.MyPID(), numLA, numGroups);
@@ -93,58 +93,27 @@ void SplitComm::split_mpi_communicators(LA_MpiComm & Comm_orig,
                              Teuchos::RCP<LA_MpiComm> & Comm_ms,
                              int myrank, int Nmain , bool & include_main) {
   
-  int procsPerGroup = 1;
-  int numGroups = Nmain;
   int numOrigProcs = Comm_orig.NumProc();
-  if (numOrigProcs%Nmain != 0){
-    cout << "\n NUMBER OF MACRO PROCESSORS NEEDS TO BE A FACTOR OF TOTAL NUMBER OF PROCESSORS..." << endl;
-    Nmain = numOrigProcs;
-  }
-  else {
-    if (include_main) {
-      procsPerGroup = numOrigProcs/Nmain;
-    }
-    else {
-      procsPerGroup = numOrigProcs/Nmain - 1;
-    }
-  }
-  
-  // First, create main comm group
-  MPI_Group world_comm;
-  MPI_Comm_group(Comm_orig.Comm(),&world_comm);
-  MPI_Group main_group;
+  TEUCHOS_TEST_FOR_EXCEPTION(Nmain < 1 || numOrigProcs%Nmain != 0,std::runtime_error,"Error: the number of macro processors needs to be a factor of the total number of processors");
+  int procsPerGroup = numOrigProcs/Nmain;
   
-  Teuchos::Array<int> granks(Nmain);
-  int prog = 0;
-  for (int i=0;i<numOrigProcs;i++) {
-    if (i%procsPerGroup == 0) {
-      granks[prog] = i;
-      prog++;
-    }
-  }
-  MPI_Group_incl(world_comm,Nmain,&granks[0],&main_group);
+  // The ranks are split into Nmain groups of consecutive ranks.  The first rank of each
+  // group works on the macro problem and the others solve its subgrid problems.
+  // The subgrid ranks of each group get a communicator of their own for the (replicated)
+  // macro setup, so the groups never wait on each other in a collective.
+  is_subgrid_server = (myrank%procsPerGroup != 0);
+  int main_color = is_subgrid_server ? 1 + myrank/procsPerGroup : 0;
   MPI_Comm main_comm;
-  MPI_Comm_create(Comm_orig.Comm(), main_group, &main_comm);
+  MPI_Comm_split(Comm_orig.Comm(), main_color, myrank, &main_comm);
   Comm_main = Teuchos::rcp( new LA_MpiComm(main_comm) );
   
-  cout << "got to here" << endl;
-  
-  // Next, create Nmain smaller groups
-  MPI_Group ms_group;
-  
-  cout << myrank << endl;
-  cout << myrank%procsPerGroup << endl;
-  
-  /*
-   Teuchos::Array<int> msranks(procsPerGroup);
-  if (myrank%procsPerGroup == 0) {
-    for (int i=0;i<procsPerGroup;i++) {
-      msranks[i] = i;
-    }
-  }
-  MPI_Group_incl(world_comm,procsPerGroup,&msranks[0],&ms_group);
+  // One communicator per group (the macro rank is rank 0)
   MPI_Comm ms_comm;
-  MPI_Comm_create(Comm_orig.Comm(), ms_group, &ms_comm);
+  MPI_Comm_split(Comm_orig.Comm(), myrank/procsPerGroup, myrank, &ms_comm);
   Comm_ms = Teuchos::rcp( new LA_MpiComm(ms_comm) );
-  */
+  
+  // without subgrid ranks, the macro ranks solve all of their subgrid problems
+  if (procsPerGroup == 1) {
+    include_main = true;
+  }
 }
@@ -35,6 +35,10 @@ class SplitComm {
                                Teuchos::RCP<LA_MpiComm> & Comm_main,
                                Teuchos::RCP<LA_MpiComm> & Comm_ms,
                                int myrank, int Nmain , bool & include_main);
+  
+  // multiscale split: the group of a macro rank and its subgrid ranks
+  Teuchos::RCP<LA_MpiComm> tcomm_MS;
+  bool is_subgrid_server, macro_solves_subgrids;
 
 };
 
@@ -22,6 +22,7 @@
 #include "discretizationTools.hpp"
 #include "solverInterface.hpp"
 #include "subgridTools.hpp"
+#include "subgridStateHistory.hpp"
 
 class SubGridFEM : public SubGridModel {
 public:
@@ -51,6 +52,23 @@ public:
     initial_time = settings->sublist("Solver").get<double>("Initial time",0.0);
     final_time = settings->sublist("Solver").get<double>("finaltime",1.0);
     write_subgrid_state = settings->sublist("Solver").get<bool>("write subgrid state",true);
+    store_subgrid_states = settings->sublist("Solver").get<bool>("Store subgrid states",false);
+    // number of macro time steps kept in the subgrid solution history (0 keeps all of them)
+    // the adjoint and the solution output need the full history (see subgridGenerator)
+    history_window = settings->sublist("Solver").get<int>("Subgrid history window",0);
+    TEUCHOS_TEST_FOR_EXCEPTION(history_window == 1 || history_window < 0,std::runtime_error,"Error: the subgrid history window must be 0 or at least 2");
+    if (store_subgrid_states) {
+      state_history = Teuchos::rcp(new SubGridStateHistory(settings, initial_time, macro_deltat));
+    }
+    // number of macro-elements whose forward subgrid problems are solved together
+    batch_size = settings->sublist("Solver").get<int>("Subgrid batch size",1);
+    batch_blocks = 0;
+    // reuse the responses of subgrid solves with the same inputs
+    bool use_cache = settings->sublist("Solver").get<bool>("Subgrid response cache",false);
+    if (use_cache) {
+      response_cache = Teuchos::rcp(new SubGridResponseCache(settings));
+    }
+    position_dependent = true;
     error_type = settings->sublist("Postprocess").get<string>("Error type","L2"); // or "H1"
     
     string solver = settings->sublist("Solver").get<string>("solver","steady-state");
@@ -58,6 +76,12 @@ public:
       final_time = 0.0;
     }
     
+    // linear, steady subgrid physics: the macro response of each macro-element is affine in the
+    // macro DOFs, so it is computed once and then evaluated without solving the subgrid problem
+    use_condensation = settings->sublist("Solver").get<bool>("Subgrid static condensation",false);
+    condensation_tol = settings->sublist("Solver").get<double>("Static condensation tolerance",1.0e-8);
+    TEUCHOS_TEST_FOR_EXCEPTION(use_condensation && solver != "steady-state",std::runtime_error,"Error: subgrid static condensation requires steady-state subgrid problems");
+    
     // Solver settings
     useDirect = settings->sublist("Solver").get<bool>("use direct solver",true);
     use_amesos2 = settings->sublist("Solver").get<bool>("use amesos2",false);
@@ -67,8 +91,23 @@ public:
     
     Amesos AmFactory;
     char* SolverType = "Amesos_Klu";
-    AmSolver = AmFactory.Create(SolverType, LinSys);
+    AmSolver = Teuchos::rcp(AmFactory.Create(SolverType, LinSys));
     have_sym_factor = false;
+    have_numeric_factor = false;
+    factor_usernum = -1;
+    factor_contraction = 0.0;
+    // "none": refactor for every Newton correction
+    // "linear": the Jacobian only depends on the macro-element (linear subgrid physics), so
+    //           the factors are computed once per macro-element and reused (transposed for the adjoint);
+    //           the forward Jacobian is then not assembled, and a Newton correction that does not
+    //           converge with the stored factors is an error since the physics is not linear
+    // "modified": the last factors of a macro-element are reused across its Newton iterations
+    //             (and time steps, if no other macro-element was solved in between) until
+    //             the Newton contraction rate exceeds the refactor ratio
+    factor_reuse = settings->sublist("Solver").get<string>("Subgrid factorization reuse","none");
+    refactor_ratio = settings->sublist("Solver").get<double>("Subgrid refactor ratio",0.5);
+    TEUCHOS_TEST_FOR_EXCEPTION(factor_reuse != "none" && factor_reuse != "linear" && factor_reuse != "modified",std::runtime_error,"Error: unrecognized subgrid factorization reuse: " + factor_reuse);
+    TEUCHOS_TEST_FOR_EXCEPTION(factor_reuse != "none" && (!useDirect || use_amesos2),std::runtime_error,"Error: subgrid factorization reuse requires the Amesos direct solver");
     have_preconditioner = false;
     sub_NLtol = settings->sublist("Solver").get<double>("NLtol",1.0E-12);
     sub_maxNLiter = settings->sublist("Solver").get<int>("MaxNLiter",10);
@@ -138,37 +177,41 @@ public:
     macronodes.push_back(macronodes_);
     macrosideinfo.push_back(macrosideinfo_);
     
+    // All of the macro-elements share one reference sub-mesh.  Only the first
+    // macro-element builds an STK mesh (used to set up the DOF manager, the
+    // discretization and the graph); the others just map the reference nodes.
     vector<vector<double> > nodes;
-    vector<vector<int> > connectivity;
+    vector<vector<int> > & connectivity = ref_connectivity;
     Kokkos::View<int****,HostDevice> sideinfo;
     
-    vector<string> eBlocks;
-    
     {
       Teuchos::TimeMonitor localmeshtimer(*sgfemSubMeshTimer);
       
-      SubGridTools sgt(LocalComm, macroshape, shape, macronodes_, macrosideinfo_);
+      if (first_time) {
+        this->setReferenceSubMesh(macrosideinfo_);
+      }
       
-      sgt.createSubMesh(numrefine);
-    
-      nodes = sgt.getSubNodes();
-      connectivity = sgt.getSubConnectivity();
-      sideinfo = sgt.getSubSideinfo();
-    
-      panzer_stk::SubGridMeshFactory meshFactory(shape, nodes, connectivity, blockID);
-    
-      mesh = meshFactory.buildMesh(LocalComm->Comm());
+      nodes = this->getSubNodes(macronodes_);
+      sideinfo = this->getSubSideinfo(macrosideinfo_);
       
-      mesh->getElementBlockNames(eBlocks);
-    
-      meshFactory.completeMeshConstruction(*mesh,LocalComm->Comm());
+      if (first_time) {
+        vector<string> eBlocks;
+        panzer_stk::SubGridMeshFactory meshFactory(shape, nodes, connectivity, blockID);
+        
+        mesh = meshFactory.buildMesh(LocalComm->Comm());
+        
+        mesh->getElementBlockNames(eBlocks);
+        
+        meshFactory.completeMeshConstruction(*mesh,LocalComm->Comm());
+        
+        cellTopo = mesh->getCellTopology(eBlocks[0]);
+      }
     }
     
     /////////////////////////////////////////////////////////////////////////////////////
     // Set up the sub-cells
     /////////////////////////////////////////////////////////////////////////////////////
     
-    cellTopo = mesh->getCellTopology(eBlocks[0]);
     vector<vector<Teuchos::RCP<cell> > > currcells;
     vector<vector<int> > orders;
     vector<vector<string> > types;
@@ -333,6 +376,7 @@ public:
       
       functionManager->validateFunctions();
       functionManager->decomposeFunctions();
+      position_dependent = functionManager->dependsOnGeometry();
       
       cost_estimate = 1.0*currcells[0].size()*(currcells[0][0]->numElem)*time_steps;
       basis_pointers = disc->basis_pointers[0];
@@ -397,6 +441,14 @@ public:
     
     cells.push_back(currcells[0]);
     
+    // the cached function values are keyed by the cell IDs, which are unique over the
+    // macro-elements (the subgrid model has one block)
+    int numcells = currcells[0].size();
+    for (int e=0; e<numcells; e++) {
+      cells[cells.size()-1][e]->cellID = (cells.size()-1)*numcells + e;
+    }
+    functionManager->clearCache();
+    
     int block = cells.size()-1;
     
     //////////////////////////////////////////////////////////////
@@ -408,17 +460,20 @@ public:
       
       vector_RCP init = Teuchos::rcp(new Epetra_MultiVector(*(overlapped_map),1));
       this->setInitial(init, block, false);
-      vector<pair<double, vector_RCP> > initvec;
+      SubGridSolutionHistory initvec(initial_time, macro_deltat, history_window);
       pair<double, vector_RCP> initsol(initial_time, init);
       initvec.push_back(initsol);
       soln.push_back(initvec);
       
       vector_RCP inita = Teuchos::rcp(new Epetra_MultiVector(*(overlapped_map),1));
-      vector<pair<double, vector_RCP> > initadjvec;
+      SubGridSolutionHistory initadjvec(initial_time, macro_deltat, history_window);
       pair<double, vector_RCP> initadjsol(final_time, inita);
       initadjvec.push_back(initadjsol);
       adjsoln.push_back(initadjvec);
       
+      if (store_subgrid_states) {
+        state_history->addMacro();
+      }
     }
     ////////////////////////////////////////////////////////////////////////////////
     // The current macro-element will store the values of its own basis functions
@@ -936,63 +991,45 @@ public:
     // Set the initial conditions
     //////////////////////////////////////////////////////////////
     
-    double prev_time = 0.0;
+    double prev_time = this->getInitialState(usernum, current_time, isTransient, isAdjoint,
+                                             compute_sens, u, phi);
     
-    {
-      Teuchos::TimeMonitor localtimer(*sgfemInitialTimer);
-      
-      size_t numtimes = soln[usernum].size();
-      if (isAdjoint) {
-        if (isTransient) {
-          for (size_t i=0; i<soln[usernum].size(); i++) {
-            if (abs(current_time - soln[usernum][i].first) < 1.0e-12) {
-              *u = *(soln[usernum][i-1].second);
-              prev_time = soln[usernum][i-1].first;
-            }
-          }
-          for (size_t i=0; i<adjsoln[usernum].size(); i++) {
-            if (abs(current_time - adjsoln[usernum][i].first) < 1.0e-12) {
-              *phi = *(adjsoln[usernum][i].second);
-            }
-          }
-        }
-        else {
-          numtimes = soln[usernum].size();
-          *u = *(soln[usernum][numtimes-1].second);
-          prev_time = soln[usernum][numtimes-1].first;
-          numtimes = adjsoln[usernum].size();
-          *phi = *(adjsoln[usernum][numtimes-1].second);
-        }
-      }
-      else { // forward or compute sens
-        if (isTransient) {
-          bool found_time = false;
-          for (size_t i=0; i<soln[usernum].size(); i++) {
-            if (abs(current_time - soln[usernum][i].first) < 1.0e-12) {
-              *u = *(soln[usernum][i-1].second);
-              prev_time = soln[usernum][i-1].first;
-              found_time = true;
-            }
-          }
-          if (!found_time) {
-            *u = *(soln[usernum][numtimes-1].second);
-            prev_time = soln[usernum][numtimes-1].first;
-          }
-        }
-        else {
-          *u = *(soln[usernum][numtimes-1].second);
-          prev_time = soln[usernum][numtimes-1].first;
-        }
-        if (compute_sens) {
-          for (size_t i=0; i<adjsoln[usernum].size(); i++) {
-            if (abs(current_time - adjsoln[usernum][i].first) < 1.0e-12) {
-              *phi = *(adjsoln[usernum][i+1].second);
-            }
-          }
-        }
-      }
+    
+    //////////////////////////////////////////////////////////////
+    // Reuse a cached response if the same subgrid problem was already solved
+    //////////////////////////////////////////////////////////////
+    
+    bool use_cache = !response_cache.is_null() && !isAdjoint && !compute_sens && !compute_disc_sens && !compute_aux_sens;
+    bool use_condensed = use_condensation && !isAdjoint && !compute_sens && !compute_disc_sens && !compute_aux_sens;
+    if (use_condensed && this->applyCondensedResponse(lambda, macrowkset, macroelemindex, usernum, current_time)) {
+      return;
     }
     
+    const int numres = macrowkset.res.dimension(1);
+    vector<long> cache_signature;
+    if (use_cache) {
+      Teuchos::TimeMonitor localtimer(*sgfemCacheTimer);
+      cache_signature = this->getCacheSignature(lambda, paramvals, current_time, isTransient, u, usernum);
+      use_cache = (cache_signature.size() > 0);
+      int slot = use_cache ? response_cache->find(cache_signature) : -1;
+      if (slot >= 0) {
+        const vector<AD> & cres = response_cache->getResidual(slot);
+        for (int k=0; k<numres; k++) {
+          macrowkset.res(macroelemindex,k) += cres[k];
+        }
+        response_cache->getSolution(slot, u);
+        this->solutionStorage(u, current_time, isAdjoint, usernum);
+        return;
+      }
+    }
+    // the response is the change in the macro residual
+    vector<AD> response_res;
+    if (use_cache || use_condensed) {
+      response_res = vector<AD>(numres);
+      for (int k=0; k<numres; k++) {
+        response_res[k] = macrowkset.res(macroelemindex,k);
+      }
+    }
     
     //////////////////////////////////////////////////////////////
     // Use the coarse scale solution to solve local transient/nonlinear problem
@@ -1017,8 +1054,9 @@ public:
       vector<vector_RCP> curr_fsol_dot;
       vector<double> subsolvetimes;
       subsolvetimes.push_back(sgtime);
+      bool have_states = store_subgrid_states && state_history->have(usernum, current_time, time_steps);
       if (isAdjoint) {
-        // First, we need to resolve the forward problem
+        // First, we need the forward states (stored or re-solved)
         
         for (int tstep=0; tstep<time_steps; tstep++) {
           vector_RCP recu = Teuchos::rcp( new Epetra_MultiVector(*(overlapped_map),1)); // reset residual
@@ -1028,6 +1066,14 @@ public:
           sgtime += macro_deltat/(double)time_steps;
           subsolvetimes.push_back(sgtime);
           
+          if (have_states) {
+            Teuchos::TimeMonitor localtimer(*sgfemSolnStorageTimer);
+            state_history->retrieve(usernum, current_time, tstep, recu, recu_dot);
+            curr_fsol.push_back(recu);
+            curr_fsol_dot.push_back(recu_dot);
+            continue;
+          }
+          
           // set du/dt and \lambda
           alpha = (double)time_steps/macro_deltat;
           wkset[0]->alpha = alpha;
@@ -1096,9 +1142,20 @@ public:
             phi_dot->PutScalar(0.0);
           }
           
-          this->subGridNonlinearSolver(u, u_dot, phi, phi_dot, Psol[0], currlambda,
-                                       paramvals, paramtypes, paramnames, sgtime,
-                                       isTransient, isAdjoint, num_active_params, alpha, usernum, false);
+          if (compute_sens && have_states) {
+            // the sensitivities only need the forward states
+            Teuchos::TimeMonitor localtimer(*sgfemSolnStorageTimer);
+            state_history->retrieve(usernum, current_time, tstep, u, u_dot);
+          }
+          else {
+            this->subGridNonlinearSolver(u, u_dot, phi, phi_dot, Psol[0], currlambda,
+                                         paramvals, paramtypes, paramnames, sgtime,
+                                         isTransient, isAdjoint, num_active_params, alpha, usernum, false);
+            if (store_subgrid_states && !compute_sens) {
+              Teuchos::TimeMonitor localtimer(*sgfemSolnStorageTimer);
+              state_history->store(usernum, current_time, tstep, u, u_dot);
+            }
+          }
           
           this->computeSubGridSolnSens(d_u, compute_sens, u,
                                        u_dot, phi, phi_dot, Psol[0], currlambda,
@@ -1131,13 +1188,802 @@ public:
       
     }
     
-    if (isAdjoint) {
-      this->solutionStorage(phi, current_time, isAdjoint, usernum);
+    if (isAdjoint) {
+      this->solutionStorage(phi, current_time, isAdjoint, usernum);
+    }
+    else if (!compute_sens) {
+      for (size_t k=0; k<response_res.size(); k++) {
+        response_res[k] = macrowkset.res(macroelemindex,k) - response_res[k];
+      }
+      if (use_cache) {
+        Teuchos::TimeMonitor localtimer(*sgfemCacheTimer);
+        response_cache->insert(cache_signature, response_res, u);
+      }
+      if (use_condensed) {
+        this->recordCondensedResponse(lambda, response_res, u, d_u, usernum);
+      }
+      this->solutionStorage(u, current_time, isAdjoint, usernum);
+    }
+    
+  }
+  
+  ///////////////////////////////////////////////////////////////////////////////////////
+  // Static condensation (offline/online split for linear, steady subgrid physics)
+  // A full subgrid solve gives the macro response r and its derivatives K w.r.t. the macro
+  // DOFs, along with the subgrid solution u and du/dlambda.  For linear physics these are
+  // exact for any macro solution:
+  //    r(lambda) = r(lambda0) + K (lambda - lambda0),  u(lambda) = u(lambda0) + du/dlambda (lambda - lambda0)
+  // The second full solve for a macro-element checks the prediction.  If it does not match,
+  // the physics is treated as nonlinear and the condensation is switched off for this model.
+  ///////////////////////////////////////////////////////////////////////////////////////
+  
+  bool applyCondensedResponse(Kokkos::View<double***,AssemblyDevice> lambda, workset & macrowkset,
+                              const int & macroelemindex, const int & usernum, const double & time) {
+    if (usernum >= (int)condensed.size() || !condensed[usernum].verified) {
+      return false;
+    }
+    Teuchos::TimeMonitor localtimer(*sgfemCondensedTimer);
+    
+    CondensedResponse & cr = condensed[usernum];
+    vector<double> dlambda = this->getCondensedIncrement(lambda, cr, usernum);
+    for (size_t k=0; k<cr.res.size(); k++) {
+      AD val = cr.res[k];
+      for (size_t p=0; p<dlambda.size(); p++) {
+        val.val() += cr.res[k].fastAccessDx(p)*dlambda[p];
+      }
+      macrowkset.res(macroelemindex,k) += val;
+    }
+    *u = *(cr.u);
+    for (size_t p=0; p<dlambda.size(); p++) {
+      u->Update(dlambda[p], *((*(cr.d_u))(p)), 1.0);
+    }
+    this->solutionStorage(u, time, false, usernum);
+    return true;
+  }
+  
+  void recordCondensedResponse(Kokkos::View<double***,AssemblyDevice> lambda, const vector<AD> & res,
+                               const vector_RCP & sub_u, const vector_RCP & sub_d_u, const int & usernum) {
+    if ((int)condensed.size() <= usernum) {
+      condensed.resize(usernum+1);
+    }
+    CondensedResponse & cr = condensed[usernum];
+    if (cr.u.is_null()) {
+      this->storeCondensedResponse(lambda, res, sub_u, sub_d_u, cr);
+      return;
+    }
+    
+    vector<double> dlambda = this->getCondensedIncrement(lambda, cr, usernum);
+    double dnorm = 0.0;
+    for (size_t p=0; p<dlambda.size(); p++) {
+      dnorm = std::max(dnorm, std::abs(dlambda[p]));
+    }
+    if (dnorm == 0.0) { // need a different macro solution to check the prediction
+      this->storeCondensedResponse(lambda, res, sub_u, sub_d_u, cr);
+      return;
+    }
+    
+    double err = 0.0, scale = 0.0;
+    for (size_t k=0; k<res.size(); k++) {
+      double pred = cr.res[k].val();
+      for (size_t p=0; p<dlambda.size(); p++) {
+        pred += cr.res[k].fastAccessDx(p)*dlambda[p];
+      }
+      err = std::max(err, std::abs(pred - res[k].val()));
+      scale = std::max(scale, std::abs(res[k].val()));
+    }
+    if (err <= condensation_tol*std::max(scale,1.0)) {
+      this->storeCondensedResponse(lambda, res, sub_u, sub_d_u, cr);
+      cr.verified = true;
+    }
+    else {
+      use_condensation = false;
+      condensed.clear();
+      if (subgridverbose > 0) {
+        cout << "***** Subgrid response is not affine in the macro solution: static condensation is disabled" << endl;
+      }
+    }
+  }
+  
+  void storeCondensedResponse(Kokkos::View<double***,AssemblyDevice> lambda, const vector<AD> & res,
+                              const vector_RCP & sub_u, const vector_RCP & sub_d_u, CondensedResponse & cr) {
+    cr.lambda = Kokkos::View<double***,AssemblyDevice>("condensed lambda",1,lambda.dimension(1),lambda.dimension(2));
+    for (int i=0; i<lambda.dimension(1); i++) {
+      for (int j=0; j<lambda.dimension(2); j++) {
+        cr.lambda(0,i,j) = lambda(0,i,j);
+      }
+    }
+    cr.res = res;
+    cr.u = Teuchos::rcp(new Epetra_MultiVector(*sub_u));
+    cr.d_u = Teuchos::rcp(new Epetra_MultiVector(*sub_d_u));
+  }
+  
+  // change in the macro DOFs, ordered like the derivatives (the aux offsets)
+  vector<double> getCondensedIncrement(Kokkos::View<double***,AssemblyDevice> lambda,
+                                       CondensedResponse & cr, const int & usernum) {
+    vector<double> dlambda(cr.d_u->NumVectors(),0.0);
+    vector<vector<int> > & aoffsets = cells[usernum][0]->auxoffsets;
+    for (size_t k=0; k<aoffsets.size(); k++) {
+      for (size_t i=0; i<aoffsets[k].size(); i++) {
+        dlambda[aoffsets[k][i]] = lambda(0,k,i) - cr.lambda(0,k,i);
+      }
+    }
+    return dlambda;
+  }
+  
+  ///////////////////////////////////////////////////////////////////////////////////////
+  // Batched forward solves
+  // The subgrid problems of the macro-elements share the sub-mesh and the sparsity
+  // pattern, so the Newton iterations for up to batch_size macro-elements are run
+  // together on one block-diagonal system with a single (KLU) factorization.
+  // Only the forward solves without sensitivities are batched.
+  ///////////////////////////////////////////////////////////////////////////////////////
+  
+  bool useBatchSolver(const bool & isAdjoint, const bool & compute_sens,
+                      const bool & compute_disc_sens, const bool & compute_aux_sens) {
+    if (batch_size < 2 || !useDirect || use_amesos2 || use_condensation) {
+      return false;
+    }
+    if (isAdjoint || compute_sens || compute_disc_sens || compute_aux_sens) {
+      return false;
+    }
+    // the blocks are numbered by the local indices
+    return LocalComm->NumProc() == 1 && owned_map->NumMyElements() == overlapped_map->NumMyElements();
+  }
+  
+  void subgridBatchSolver(Kokkos::View<double***,AssemblyDevice> gl_u,
+                          const vector<vector<double> > & paramvals,
+                          const vector<int> & paramtypes, const vector<string> & paramnames,
+                          const double & time, const bool & isTransient,
+                          const int & num_active_params, workset & macrowkset,
+                          const vector<int> & usernums, const vector<int> & macroelemindices) {
+    for (size_t start=0; start<usernums.size(); start+=batch_size) {
+      size_t end = std::min(start+(size_t)batch_size, usernums.size());
+      vector<int> busers(usernums.begin()+start, usernums.begin()+end);
+      vector<int> belems(macroelemindices.begin()+start, macroelemindices.begin()+end);
+      this->solveBatch(gl_u, paramvals, paramtypes, paramnames, time, isTransient,
+                       num_active_params, macrowkset, busers, belems);
+    }
+  }
+  
+  ///////////////////////////////////////////////////////////////////////////////////////
+  ///////////////////////////////////////////////////////////////////////////////////////
+  
+  void solveBatch(Kokkos::View<double***,AssemblyDevice> gl_u,
+                  const vector<vector<double> > & paramvals,
+                  const vector<int> & paramtypes, const vector<string> & paramnames,
+                  const double & time, const bool & isTransient,
+                  const int & num_active_params, workset & macrowkset,
+                  const vector<int> & usernums, const vector<int> & macroelemindices) {
+    
+    Teuchos::TimeMonitor totalsolvertimer(*sgfemBatchSolverTimer);
+    
+    double current_time = time;
+    if (abs(current_time - final_time) < 1.0e-12)
+      is_final_time = true;
+    else
+      is_final_time = false;
+    
+    const int numres = macrowkset.res.dimension(1);
+    
+    // state of each subgrid problem in the batch (the cached ones are done here)
+    vector<int> busers, belems;
+    vector<Kokkos::View<double***,AssemblyDevice> > lambdas;
+    vector<vector_RCP> bu, bu_dot, bd_u;
+    vector<double> sgtimes;
+    vector<vector<long> > signatures;
+    vector<vector<AD> > cache_res;
+    
+    for (size_t k=0; k<usernums.size(); k++) {
+      int usernum = usernums[k];
+      int elem = macroelemindices[k];
+      Kokkos::View<double***,AssemblyDevice> lambda("local u",1,gl_u.dimension(1),gl_u.dimension(2));
+      for (int i=0; i<gl_u.dimension(1); i++) {
+        for (int j=0; j<gl_u.dimension(2); j++) {
+          lambda(0,i,j) = gl_u(elem,i,j);
+        }
+      }
+      vector_RCP cu = Teuchos::rcp(new Epetra_MultiVector(*(overlapped_map),1));
+      double prev_time = this->getInitialState(usernum, current_time, isTransient, false, false, cu, phi);
+      
+      if (!response_cache.is_null()) {
+        Teuchos::TimeMonitor localtimer(*sgfemCacheTimer);
+        vector<long> signature = this->getCacheSignature(lambda, paramvals, current_time, isTransient, cu, usernum);
+        int slot = (signature.size() > 0) ? response_cache->find(signature) : -1;
+        if (slot >= 0) {
+          const vector<AD> & cres = response_cache->getResidual(slot);
+          for (int r=0; r<numres; r++) {
+            macrowkset.res(elem,r) += cres[r];
+          }
+          response_cache->getSolution(slot, cu);
+          this->solutionStorage(cu, current_time, false, usernum);
+          continue;
+        }
+        vector<AD> res_before(numres);
+        for (int r=0; r<numres; r++) {
+          res_before[r] = macrowkset.res(elem,r);
+        }
+        signatures.push_back(signature);
+        cache_res.push_back(res_before);
+      }
+      
+      vector_RCP cu_dot = Teuchos::rcp(new Epetra_MultiVector(*(overlapped_map),1));
+      vector_RCP cd_u = Teuchos::rcp(new Epetra_MultiVector(*(owned_map),d_um->NumVectors()));
+      busers.push_back(usernum);
+      belems.push_back(elem);
+      lambdas.push_back(lambda);
+      bu.push_back(cu);
+      bu_dot.push_back(cu_dot);
+      bd_u.push_back(cd_u);
+      sgtimes.push_back(prev_time);
+    }
+    
+    int nb = busers.size();
+    if (nb == 0) {
+      return;
+    }
+    this->setupBatch(nb);
+    
+    wkset[0]->resetFlux();
+    
+    if (isTransient) {
+      double alpha = (double)time_steps/macro_deltat;
+      wkset[0]->alpha = alpha;
+      wkset[0]->deltat= 1.0/alpha;
+      for (int tstep=0; tstep<time_steps; tstep++) {
+        for (int b=0; b<nb; b++) {
+          sgtimes[b] += macro_deltat/(double)time_steps;
+          bu_dot[b]->PutScalar(0.0);
+        }
+        this->batchNonlinearSolver(bu, bu_dot, lambdas, busers, paramvals, paramtypes, paramnames,
+                                   sgtimes, isTransient, num_active_params, alpha);
+        if (store_subgrid_states) {
+          Teuchos::TimeMonitor localtimer(*sgfemSolnStorageTimer);
+          for (int b=0; b<nb; b++) {
+            state_history->store(busers[b], current_time, tstep, bu[b], bu_dot[b]);
+          }
+        }
+        this->batchSolnSens(bd_u, bu, bu_dot, lambdas, busers, paramvals, paramtypes, paramnames,
+                            sgtimes, isTransient, num_active_params, alpha);
+        for (int b=0; b<nb; b++) {
+          this->updateFlux(bu[b], bd_u[b], lambdas[b], false, belems[b], time, macrowkset, busers[b], 1.0/(double)time_steps);
+        }
+      }
+    }
+    else {
+      wkset[0]->deltat = 1.0;
+      for (int b=0; b<nb; b++) {
+        sgtimes[b] = current_time;
+      }
+      this->batchNonlinearSolver(bu, bu_dot, lambdas, busers, paramvals, paramtypes, paramnames,
+                                 sgtimes, isTransient, num_active_params, 0.0);
+      this->batchSolnSens(bd_u, bu, bu_dot, lambdas, busers, paramvals, paramtypes, paramnames,
+                          sgtimes, isTransient, num_active_params, 0.0);
+      for (int b=0; b<nb; b++) {
+        this->updateFlux(bu[b], bd_u[b], lambdas[b], false, belems[b], time, macrowkset, busers[b], 1.0);
+      }
+    }
+    
+    for (int b=0; b<nb; b++) {
+      if (!response_cache.is_null() && signatures[b].size() > 0) {
+        Teuchos::TimeMonitor localtimer(*sgfemCacheTimer);
+        for (int r=0; r<numres; r++) {
+          cache_res[b][r] = macrowkset.res(belems[b],r) - cache_res[b][r];
+        }
+        response_cache->insert(signatures[b], cache_res[b], bu[b]);
+      }
+      this->solutionStorage(bu[b], current_time, false, busers[b]);
+    }
+  }
+  
+  ///////////////////////////////////////////////////////////////////////////////////////
+  // Block-diagonal system for nb subgrid problems (rebuilt when nb changes)
+  ///////////////////////////////////////////////////////////////////////////////////////
+  
+  void setupBatch(const int & nb) {
+    if (nb == batch_blocks) {
+      return;
+    }
+    Teuchos::TimeMonitor localtimer(*sgfemBatchSetupTimer);
+    
+    int n = overlapped_map->NumMyElements();
+    batch_map = Teuchos::rcp(new Epetra_Map(nb*n, 0, *LocalComm));
+    Epetra_CrsGraph batch_graph(Copy, *batch_map, overlapped_graph->MaxNumIndices());
+    vector<int> cols(overlapped_graph->MaxNumIndices());
+    for (int b=0; b<nb; b++) {
+      for (int i=0; i<overlapped_graph->NumMyRows(); i++) {
+        int numind = 0;
+        int * ind;
+        overlapped_graph->ExtractMyRowView(i, numind, ind);
+        int row = b*n + overlapped_map->LID(overlapped_graph->RowMap().GID(i));
+        for (int k=0; k<numind; k++) {
+          cols[k] = b*n + overlapped_map->LID(overlapped_graph->ColMap().GID(ind[k]));
+        }
+        batch_graph.InsertGlobalIndices(row, numind, &cols[0]);
+      }
+    }
+    batch_graph.FillComplete();
+    
+    batch_J = Teuchos::rcp(new Epetra_CrsMatrix(Copy, batch_graph));
+    batch_M = Teuchos::rcp(new Epetra_CrsMatrix(Copy, batch_graph));
+    batch_res = Teuchos::rcp(new Epetra_MultiVector(*batch_map,1));
+    batch_du = Teuchos::rcp(new Epetra_MultiVector(*batch_map,1));
+    int nd = d_um->NumVectors();
+    batch_dres = Teuchos::rcp(new Epetra_MultiVector(*batch_map,nd));
+    batch_dsol = Teuchos::rcp(new Epetra_MultiVector(*batch_map,nd));
+    batch_dprev = Teuchos::rcp(new Epetra_MultiVector(*batch_map,nd));
+    
+    batch_LinSys.SetOperator(batch_J.get());
+    batch_LinSys.SetRHS(batch_res.get());
+    batch_LinSys.SetLHS(batch_du.get());
+    Amesos AmFactory;
+    batch_solver = Teuchos::rcp(AmFactory.Create("Amesos_Klu", batch_LinSys));
+    batch_solver->SymbolicFactorization();
+    batch_factored = false;
+    batch_blocks = nb;
+  }
+  
+  ///////////////////////////////////////////////////////////////////////////////////////
+  // Newton iterations for the whole batch (each problem stops updating once it is
+  // converged, but all of them are assembled so the factors stay valid)
+  ///////////////////////////////////////////////////////////////////////////////////////
+  
+  void batchNonlinearSolver(vector<vector_RCP> & bu, vector<vector_RCP> & bu_dot,
+                            vector<Kokkos::View<double***,AssemblyDevice> > & lambdas,
+                            const vector<int> & busers,
+                            const vector<vector<double> > & paramvals,
+                            const vector<int> & paramtypes, const vector<string> & paramnames,
+                            const vector<double> & times, const bool & isTransient,
+                            const int & num_active_params, const double & alpha) {
+    
+    Teuchos::TimeMonitor localtimer(*sgfemBatchNonlinearSolverTimer);
+    
+    int nb = busers.size();
+    int n = overlapped_map->NumMyElements();
+    vector<double> resnorm_initial(nb,0.0);
+    vector<bool> active(nb,true);
+    
+    int numElem = 1;
+    int numDOF = cells[busers[0]][0]->GIDs[0].size();
+    Kokkos::View<double***,AssemblyDevice> local_res("local residual",numElem,numDOF,1);
+    Kokkos::View<double***,AssemblyDevice> local_J("local Jacobian",numElem,numDOF,numDOF);
+    Kokkos::View<double***,AssemblyDevice> local_Jdot("local Jacobian dot",numElem,numDOF,numDOF);
+    vector<double> vals(numDOF), mvals(numDOF);
+    vector<int> bcols(numDOF);
+    
+    int iter = 0;
+    while (iter < sub_maxNLiter) {
+      
+      batch_J->PutScalar(0.0);
+      batch_M->PutScalar(0.0);
+      batch_res->PutScalar(0.0);
+      batch_factored = false;
+      
+      for (int b=0; b<nb; b++) {
+        int usernum = busers[b];
+        int offset = b*n;
+        wkset[0]->time = times[b];
+        wkset[0]->isTransient = isTransient;
+        wkset[0]->isAdjoint = false;
+        for (size_t e=0; e < cells[usernum].size(); e++) {
+          cells[usernum][e]->setLocalSoln(bu[b],0,0);
+          cells[usernum][e]->setLocalSoln(bu_dot[b],1,0);
+          cells[usernum][e]->setLocalSoln(Psol[0],4,0);
+          cells[usernum][e]->aux = lambdas[b];
+        }
+        for (size_t e=0; e<cells[usernum].size(); e++) {
+          if (!this->assembleSubCell(usernum, e, false)) {
+            continue;
+          }
+          wkset[0]->localEID = e;
+          cells[usernum][e]->updateData();
+          
+          for (int p=0; p<numElem; p++) {
+            for (int r=0; r<numDOF; r++) {
+              local_res(p,r,0) = 0.0;
+              for (int s=0; s<numDOF; s++) {
+                local_J(p,r,s) = 0.0;
+                local_Jdot(p,r,s) = 0.0;
+              }
+            }
+          }
+          
+          {
+            Teuchos::TimeMonitor localtimer(*sgfemNonlinearSolverJacResTimer);
+            cells[usernum][e]->computeJacRes(paramvals, paramtypes, paramnames,
+                                             times[b], isTransient, false,
+                                             true, false, num_active_params, false, false, false,
+                                             local_res, local_J, local_Jdot);
+          }
+          
+          vector<vector<int> > & GIDs = cells[usernum][e]->GIDs;
+          for (size_t i=0; i<GIDs.size(); i++) {
+            for (size_t col=0; col<GIDs[i].size(); col++) {
+              bcols[col] = offset + overlapped_map->LID(GIDs[i][col]);
+            }
+            for (size_t row=0; row<GIDs[i].size(); row++) {
+              (*batch_res)[0][bcols[row]] += local_res(i,row,0);
+              for (size_t col=0; col<GIDs[i].size(); col++) {
+                vals[col] = local_J(i,row,col) + alpha*local_Jdot(i,row,col);
+                mvals[col] = local_Jdot(i,row,col);
+              }
+              batch_J->SumIntoGlobalValues(bcols[row], GIDs[i].size(), &vals[0], &bcols[0]);
+              batch_M->SumIntoGlobalValues(bcols[row], GIDs[i].size(), &mvals[0], &bcols[0]);
+            }
+          }
+        }
+      }
+      
+      bool any_active = false;
+      for (int b=0; b<nb; b++) {
+        if (active[b]) {
+          double resnorm = 0.0;
+          for (int i=0; i<n; i++) {
+            resnorm = std::max(resnorm, std::abs((*batch_res)[0][b*n+i]));
+          }
+          if (iter == 0) {
+            resnorm_initial[b] = resnorm;
+          }
+          double resnorm_scaled = resnorm_initial[b] > 0.0 ? resnorm/resnorm_initial[b] : 0.0;
+          active[b] = resnorm_scaled > sub_NLtol;
+          any_active = any_active || active[b];
+        }
+      }
+      
+      if(LocalComm->MyPID() == 0 && subgridverbose>5) {
+        int numactive = 0;
+        for (int b=0; b<nb; b++) {
+          numactive += active[b] ? 1 : 0;
+        }
+        cout << "***** Subgrid Batch Nonlinear Iteration: " << iter << " (" << numactive << " of " << nb << " unconverged)" << endl;
+      }
+      
+      if (!any_active) {
+        break;
+      }
+      
+      {
+        Teuchos::TimeMonitor localtimer(*sgfemNonlinearSolverSolveTimer);
+        batch_du->PutScalar(0.0);
+        batch_LinSys.SetRHS(batch_res.get());
+        batch_LinSys.SetLHS(batch_du.get());
+        batch_solver->NumericFactorization();
+        batch_solver->Solve();
+        batch_factored = true;
+      }
+      
+      for (int b=0; b<nb; b++) {
+        if (active[b]) {
+          for (int i=0; i<n; i++) {
+            double du_val = (*batch_du)[0][b*n+i];
+            (*bu[b])[0][i] += du_val;
+            (*bu_dot[b])[0][i] += alpha*du_val;
+          }
+        }
+      }
+      iter++;
+    }
+  }
+  
+  ///////////////////////////////////////////////////////////////////////////////////////
+  // Derivatives of the subgrid solutions w.r.t. the macro DOFs for the whole batch
+  ///////////////////////////////////////////////////////////////////////////////////////
+  
+  void batchSolnSens(vector<vector_RCP> & bd_u, vector<vector_RCP> & bu, vector<vector_RCP> & bu_dot,
+                     vector<Kokkos::View<double***,AssemblyDevice> > & lambdas,
+                     const vector<int> & busers,
+                     const vector<vector<double> > & paramvals,
+                     const vector<int> & paramtypes, const vector<string> & paramnames,
+                     const vector<double> & times, const bool & isTransient,
+                     const int & num_active_params, const double & alpha) {
+    
+    Teuchos::TimeMonitor localtimer(*sgfemSolnSensTimer);
+    
+    int nb = busers.size();
+    int n = overlapped_map->NumMyElements();
+    int nd = batch_dres->NumVectors();
+    double scale = -1.0;
+    
+    batch_dres->PutScalar(0.0);
+    
+    for (int b=0; b<nb; b++) {
+      int usernum = busers[b];
+      int offset = b*n;
+      wkset[0]->time = times[b];
+      wkset[0]->isTransient = isTransient;
+      wkset[0]->isAdjoint = false;
+      for (size_t e=0; e < cells[usernum].size(); e++) {
+        cells[usernum][e]->setLocalSoln(bu[b],0,0);
+        cells[usernum][e]->setLocalSoln(bu_dot[b],1,0);
+        cells[usernum][e]->setLocalSoln(Psol[0],4,0);
+        cells[usernum][e]->aux = lambdas[b];
+      }
+      
+      int numElem = 1;
+      int snumDOF = cells[usernum][0]->GIDs[0].size();
+      int anumDOF = cells[usernum][0]->auxGIDs.size();
+      Kokkos::View<double***,AssemblyDevice> local_res("local residual",numElem,snumDOF,1);
+      Kokkos::View<double***,AssemblyDevice> local_J("local Jacobian",numElem,snumDOF,anumDOF);
+      Kokkos::View<double***,AssemblyDevice> local_Jdot("local Jacobian dot",numElem,snumDOF,anumDOF);
+      
+      for (size_t e=0; e<cells[usernum].size(); e++) {
+        wkset[0]->localEID = e;
+        cells[usernum][e]->updateData();
+        
+        for (int p=0; p<numElem; p++) {
+          for (int r=0; r<snumDOF; r++) {
+            local_res(p,r,0) = 0.0;
+            for (int s=0; s<anumDOF; s++) {
+              local_J(p,r,s) = 0.0;
+              local_Jdot(p,r,s) = 0.0;
+            }
+          }
+        }
+        
+        cells[usernum][e]->computeJacRes(paramvals, paramtypes, paramnames,
+                                         times[b], isTransient, false,
+                                         true, false, num_active_params, false, true, false,
+                                         local_res, local_J, local_Jdot);
+        
+        vector<vector<int> > & GIDs = cells[usernum][e]->GIDs;
+        size_t numaux = cells[usernum][e]->auxGIDs.size();
+        for (size_t i=0; i<GIDs.size(); i++) {
+          for (size_t row=0; row<GIDs[i].size(); row++) {
+            int brow = offset + overlapped_map->LID(GIDs[i][row]);
+            for (size_t col=0; col<numaux; col++) {
+              (*batch_dres)[col][brow] += scale*local_J(i,row,col);
+            }
+          }
+        }
+      }
+    }
+    
+    if (isTransient) {
+      for (int b=0; b<nb; b++) {
+        for (int c=0; c<nd; c++) {
+          for (int i=0; i<n; i++) {
+            (*batch_dsol)[c][b*n+i] = (*bd_u[b])[c][i];
+          }
+        }
+      }
+      batch_M->Apply(*batch_dsol, *batch_dprev);
+      batch_dres->Update(alpha, *batch_dprev, 1.0);
+    }
+    
+    batch_dsol->PutScalar(0.0);
+    batch_LinSys.SetRHS(batch_dres.get());
+    batch_LinSys.SetLHS(batch_dsol.get());
+    if (!batch_factored) {
+      batch_solver->NumericFactorization();
+      batch_factored = true;
+    }
+    batch_solver->Solve();
+    
+    for (int b=0; b<nb; b++) {
+      for (int c=0; c<nd; c++) {
+        for (int i=0; i<n; i++) {
+          (*bd_u[b])[c][i] = (*batch_dsol)[c][b*n+i];
+        }
+      }
+    }
+  }
+  
+  ///////////////////////////////////////////////////////////////////////////////////////
+  // Initial subgrid state (and adjoint) for a solve at current_time from the stored
+  // history.  Returns the time of the initial state.
+  ///////////////////////////////////////////////////////////////////////////////////////
+  
+  double getInitialState(const int & usernum, const double & current_time,
+                         const bool & isTransient, const bool & isAdjoint, const bool & compute_sens,
+                         vector_RCP & sub_u, vector_RCP & sub_phi) {
+    
+    Teuchos::TimeMonitor localtimer(*sgfemInitialTimer);
+    
+    double prev_time = 0.0;
+    
+    size_t numtimes = soln[usernum].size();
+    if (isAdjoint) {
+      if (isTransient) {
+        int tindex = soln[usernum].find(current_time);
+        if (tindex > 0) {
+          *sub_u = *(soln[usernum][tindex-1].second);
+          prev_time = soln[usernum][tindex-1].first;
+        }
+        int aindex = adjsoln[usernum].find(current_time);
+        if (aindex >= 0) {
+          *sub_phi = *(adjsoln[usernum][aindex].second);
+        }
+      }
+      else {
+        numtimes = soln[usernum].size();
+        *sub_u = *(soln[usernum][numtimes-1].second);
+        prev_time = soln[usernum][numtimes-1].first;
+        numtimes = adjsoln[usernum].size();
+        *sub_phi = *(adjsoln[usernum][numtimes-1].second);
+      }
+    }
+    else { // forward or compute sens
+      if (isTransient) {
+        int tindex = soln[usernum].find(current_time);
+        if (tindex > 0) {
+          *sub_u = *(soln[usernum][tindex-1].second);
+          prev_time = soln[usernum][tindex-1].first;
+        }
+        else {
+          *sub_u = *(soln[usernum][numtimes-1].second);
+          prev_time = soln[usernum][numtimes-1].first;
+        }
+      }
+      else {
+        *sub_u = *(soln[usernum][numtimes-1].second);
+        prev_time = soln[usernum][numtimes-1].first;
+      }
+      if (compute_sens) {
+        int aindex = adjsoln[usernum].find(current_time);
+        if (aindex >= 0 && aindex+1 < (int)adjsoln[usernum].size()) {
+          *sub_phi = *(adjsoln[usernum][aindex+1].second);
+        }
+      }
+    }
+    return prev_time;
+  }
+  
+  ///////////////////////////////////////////////////////////////////////////////////////
+  // Signature of the inputs to a forward subgrid solve: the macro solution, the
+  // parameters, the macro time step, the shape and boundary of the macro-element
+  // (relative to its first node), its position if the subgrid functions depend on
+  // the coordinates, and the previous subgrid state
+  // An empty signature means the solve can not be cached
+  ///////////////////////////////////////////////////////////////////////////////////////
+  
+  vector<long> getCacheSignature(Kokkos::View<double***,AssemblyDevice> lambda,
+                                 const vector<vector<double> > & paramvals,
+                                 const double & time, const bool & isTransient,
+                                 const vector_RCP & prev_u, const int & usernum) {
+    vector<long> signature;
+    bool valid = true;
+    for (int i=0; i<lambda.dimension(1); i++) {
+      for (int j=0; j<lambda.dimension(2); j++) {
+        valid = valid && response_cache->addValue(signature, lambda(0,i,j));
+      }
+    }
+    for (size_t i=0; i<paramvals.size(); i++) {
+      for (size_t j=0; j<paramvals[i].size(); j++) {
+        valid = valid && response_cache->addValue(signature, paramvals[i][j]);
+      }
+    }
+    if (macro_deltat > 0.0) {
+      response_cache->addInt(signature, lround(time/macro_deltat));
+    }
+    DRV & nodes = macronodes[usernum];
+    for (int n=0; n<nodes.dimension(1); n++) {
+      for (int d=0; d<nodes.dimension(2); d++) {
+        valid = valid && response_cache->addValue(signature, nodes(0,n,d) - nodes(0,0,d));
+      }
+    }
+    // the subgrid functions are evaluated at the absolute coordinates
+    if (position_dependent) {
+      for (int d=0; d<nodes.dimension(2); d++) {
+        valid = valid && response_cache->addValue(signature, nodes(0,0,d));
+      }
+    }
+    Kokkos::View<int****,HostDevice> & sideinfo = macrosideinfo[usernum];
+    for (int i=0; i<sideinfo.dimension(0); i++) {
+      for (int j=0; j<sideinfo.dimension(1); j++) {
+        for (int k=0; k<sideinfo.dimension(2); k++) {
+          for (int l=0; l<sideinfo.dimension(3); l++) {
+            response_cache->addInt(signature, sideinfo(i,j,k,l));
+          }
+        }
+      }
+    }
+    // the mesh data is attached to the individual macro-elements
+    if (have_mesh_data || have_rotations) {
+      response_cache->addInt(signature, usernum);
+    }
+    if (isTransient) {
+      for (int i=0; i<prev_u->MyLength(); i++) {
+        valid = valid && response_cache->addValue(signature, (*prev_u)[0][i]);
+      }
+    }
+    if (!valid) {
+      signature.clear();
+    }
+    return signature;
+  }
+  
+  ///////////////////////////////////////////////////////////////////////////////////////
+  // Build the reference sub-mesh on the reference macro-element
+  // The macro sides are tagged in the side info so the sub-cell sides on the macro
+  // boundary can be matched to the side info of each macro-element later
+  ///////////////////////////////////////////////////////////////////////////////////////
+  
+  void setReferenceSubMesh(Kokkos::View<int****,HostDevice> macrosideinfo_) {
+    
+    int numMacroNodes = macro_cellTopo->getNodeCount();
+    DRV refnodes("reference macro nodes",1,numMacroNodes,dimension);
+    for (int n=0; n<numMacroNodes; n++) {
+      DRV vertex("reference vertex",dimension);
+      CellTools<AssemblyDevice>::getReferenceVertex(vertex, *macro_cellTopo, n);
+      for (int m=0; m<dimension; m++) {
+        refnodes(0,n,m) = vertex(m);
+      }
+    }
+    
+    Kokkos::View<int****,HostDevice> tagsideinfo("reference side info",1,macrosideinfo_.dimension(1),
+                                                 macrosideinfo_.dimension(2),macrosideinfo_.dimension(3));
+    for (size_t i=0; i<tagsideinfo.dimension(1); i++) {
+      for (size_t j=0; j<tagsideinfo.dimension(2); j++) {
+        tagsideinfo(0,i,j,0) = 1;
+        tagsideinfo(0,i,j,1) = j;
+      }
+    }
+    
+    SubGridTools sgt(LocalComm, macroshape, shape, refnodes, tagsideinfo);
+    sgt.createSubMesh(numrefine);
+    
+    vector<vector<double> > refsubnodes = sgt.getSubNodes();
+    ref_connectivity = sgt.getSubConnectivity();
+    ref_sideinfo = sgt.getSubSideinfo();
+    
+    ref_subnodes = DRV("reference subgrid nodes",refsubnodes.size(),dimension);
+    for (size_t n=0; n<refsubnodes.size(); n++) {
+      for (int m=0; m<dimension; m++) {
+        ref_subnodes(n,m) = refsubnodes[n][m];
+      }
+    }
+  }
+  
+  ///////////////////////////////////////////////////////////////////////////////////////
+  // Map the reference sub-mesh nodes to a macro-element
+  ///////////////////////////////////////////////////////////////////////////////////////
+  
+  vector<vector<double> > getSubNodes(const DRV & macronodes_) {
+    
+    int numSubNodes = ref_subnodes.dimension(0);
+    DRV physnodes("subgrid nodes",1,numSubNodes,dimension);
+    CellTools<AssemblyDevice>::mapToPhysicalFrame(physnodes, ref_subnodes, macronodes_, *macro_cellTopo);
+    
+    vector<vector<double> > subnodes(numSubNodes, vector<double>(dimension));
+    for (int n=0; n<numSubNodes; n++) {
+      for (int m=0; m<dimension; m++) {
+        subnodes[n][m] = physnodes(0,n,m);
+      }
     }
-    else if (!compute_sens) {
-      this->solutionStorage(u, current_time, isAdjoint, usernum);
+    return subnodes;
+  }
+  
+  ///////////////////////////////////////////////////////////////////////////////////////
+  // Side info of the sub-cells for a macro-element (same rules as SubGridTools)
+  ///////////////////////////////////////////////////////////////////////////////////////
+  
+  Kokkos::View<int****,HostDevice> getSubSideinfo(Kokkos::View<int****,HostDevice> macrosideinfo_) {
+    
+    Kokkos::View<int****,HostDevice> subsideinfo("subgrid side info",ref_sideinfo.dimension(0),
+                                                 ref_sideinfo.dimension(1),ref_sideinfo.dimension(2),
+                                                 ref_sideinfo.dimension(3));
+    for (size_t e=0; e<ref_sideinfo.dimension(0); e++) {
+      for (size_t i=0; i<ref_sideinfo.dimension(1); i++) {
+        for (size_t j=0; j<ref_sideinfo.dimension(2); j++) {
+          if (ref_sideinfo(e,i,j,0) > 0) { // on macro side ref_sideinfo(e,i,j,1)
+            int mside = ref_sideinfo(e,i,j,1);
+            int mtype = macrosideinfo_(0,i,mside,0);
+            if (shape == macroshape && mtype > 0) {
+              subsideinfo(e,i,j,0) = mtype;
+            }
+            else {
+              subsideinfo(e,i,j,0) = 1;
+            }
+            if (mtype > 0) {
+              subsideinfo(e,i,j,1) = macrosideinfo_(0,i,mside,1);
+            }
+            else {
+              subsideinfo(e,i,j,1) = -1;
+            }
+          }
+        }
+      }
     }
-    
+    return subsideinfo;
   }
   
   ///////////////////////////////////////////////////////////////////////////////////////
@@ -1210,6 +2056,7 @@ public:
       int numDOF = cells[usernum][0]->GIDs[0].size();
       
       Kokkos::View<double***,AssemblyDevice> local_res, local_J, local_Jdot;
+      bool compute_jacobian = this->needSubGridJacobian(usernum, alpha, isAdjoint);
       
       {
         Teuchos::TimeMonitor localtimer2(*sgfemNonlinearSolverAllocateTimer);
@@ -1233,6 +2080,9 @@ public:
       // volume assembly
       
       for (size_t e=0; e<cells[usernum].size(); e++) {
+        if (!this->assembleSubCell(usernum, e, isAdjoint)) {
+          continue;
+        }
         if (isAdjoint) {
           aPrev = cells[usernum][e]->adjPrev;
           if (is_final_time) {
@@ -1264,7 +2114,7 @@ public:
         
           cells[usernum][e]->computeJacRes(paramvals, paramtypes, paramnames,
                                            time, isTransient, isAdjoint,
-                                           true, false, num_active_params, false, false, false,
+                                           compute_jacobian, false, num_active_params, false, false, false,
                                            local_res, local_J, local_Jdot);
         
         }
@@ -1277,6 +2127,9 @@ public:
               int rowIndex = GIDs[i][row];
               double val = local_res(i,row,0);
               res_over->SumIntoGlobalValue(rowIndex,0, val);
+              if (!compute_jacobian) {
+                continue;
+              }
               for( size_t col=0; col<GIDs[i].size(); col++ ) {
                 vals[col] = local_J(i,row,col) + alpha*local_Jdot(i,row,col);
               }
@@ -1291,24 +2144,25 @@ public:
         }
       }
       
-      
-      
-      sub_J_over->FillComplete();
-      sub_M_over->FillComplete();
-      
-      J->PutScalar(0.0);
-      J->Export(*sub_J_over, *(exporter), Add);
-      M->PutScalar(0.0);
-      M->Export(*sub_M_over, *(exporter), Add);
-      if (!filledJ) {
-        J->FillComplete();
-        filledJ = true;
-      }
-      if (!filledM) {
-        M->FillComplete();
-        filledM = true;
+      if (compute_jacobian) {
+        sub_J_over->FillComplete();
+        sub_M_over->FillComplete();
+        
+        J->PutScalar(0.0);
+        J->Export(*sub_J_over, *(exporter), Add);
+        M->PutScalar(0.0);
+        M->Export(*sub_M_over, *(exporter), Add);
+        if (!filledJ) {
+          J->FillComplete();
+          filledJ = true;
+        }
+        if (!filledM) {
+          M->FillComplete();
+          filledM = true;
+        }
+        LinSys.SetOperator(J.get());
+        have_numeric_factor = false;
       }
-      LinSys.SetOperator(J.get());
       
       if (useDirect && !have_sym_factor) {
         if (use_amesos2) {
@@ -1330,17 +2184,25 @@ public:
       res->PutScalar(0.0);
       res->Export(*res_over, *(exporter), Add);
       
+      double resnorm_scaled_prev = resnorm_scaled;
       if (iter == 0) {
-        res->NormInf(&resnorm_initial);
+        resnorm_initial = this->subGridResidualNorm(isAdjoint);
         if (resnorm_initial > 0.0)
           resnorm_scaled = 1.0;
         else
           resnorm_scaled = 0.0;
       }
       else {
-        res->NormInf(&resnorm);
+        resnorm = this->subGridResidualNorm(isAdjoint);
         resnorm_scaled = resnorm/resnorm_initial;
       }
+      factor_contraction = (iter > 0 && resnorm_scaled_prev > 0.0) ? resnorm_scaled/resnorm_scaled_prev : 0.0;
+      
+      // the stored factors are only those of the current Jacobian (and of its transpose for the
+      // adjoint) if the physics is linear, in which case one correction reaches round-off
+      TEUCHOS_TEST_FOR_EXCEPTION(factor_reuse == "linear" && resnorm_scaled > sub_NLtol &&
+                                 resnorm > 1.0e-12 && factor_contraction > refactor_ratio,std::runtime_error,
+                                 "Error: the subgrid Newton iteration does not converge with the stored factors, so Subgrid factorization reuse \"linear\" can not be used (the subgrid physics is nonlinear)");
       
       if(LocalComm->MyPID() == 0 && subgridverbose>5) {
         cout << endl << "*********************************************************" << endl;
@@ -1353,27 +2215,7 @@ public:
         
         Teuchos::TimeMonitor localtimer(*sgfemNonlinearSolverSolveTimer);
         
-        du_glob->PutScalar(0.0);
-        du->PutScalar(0.0);
-        
-        LinSys.SetRHS(res.get());
-        LinSys.SetLHS(du_glob.get());
-        if (useDirect) {
-          if (use_amesos2) {
-            Am2Solver->numericFactorization().solve();
-          }
-          else {
-            AmSolver->NumericFactorization();
-            AmSolver->Solve();
-          }
-        }
-        else {
-          AztecOO itersolver(LinSys);
-          itersolver.SetAztecOption(AZ_output,0);
-          itersolver.SetPrecOperator(MLPrec);
-          itersolver.Iterate(liniter,lintol);
-        }
-        du->Import(*du_glob, *(importer), Add);
+        this->solveNewtonCorrection(usernum, alpha, isAdjoint);
         
         if (isAdjoint) {
           
@@ -1391,6 +2233,213 @@ public:
     }
   }
   
+  ///////////////////////////////////////////////////////////////////////////////////////
+  // Pieces of the subgrid Newton solve that a reduced-order model replaces
+  // (the FEM model assembles on every sub-cell and solves the full system)
+  ///////////////////////////////////////////////////////////////////////////////////////
+  
+  virtual bool assembleSubCell(const int & usernum, const size_t & e, const bool & isAdjoint) {
+    return true;
+  }
+  
+  // the forward residual does not need the Jacobian once the "linear" factors are stored
+  // (the adjoint residual does)
+  virtual bool needSubGridJacobian(const int & usernum, const double & alpha, const bool & isAdjoint) {
+    return isAdjoint || factor_reuse != "linear" || !this->haveStoredFactor(usernum, alpha);
+  }
+  
+  virtual double subGridResidualNorm(const bool & isAdjoint) {
+    double resnorm = 0.0;
+    res->NormInf(&resnorm);
+    return resnorm;
+  }
+  
+  virtual void solveNewtonCorrection(const int & usernum, const double & alpha, const bool & isAdjoint) {
+    du_glob->PutScalar(0.0);
+    du->PutScalar(0.0);
+    
+    LinSys.SetRHS(res.get());
+    LinSys.SetLHS(du_glob.get());
+    if (useDirect) {
+      if (use_amesos2) {
+        Am2Solver->numericFactorization().solve();
+      }
+      else if (factor_reuse == "linear") {
+        this->solveStoredFactor(usernum, alpha, isAdjoint, res, du_glob);
+      }
+      else {
+        bool refactor = !have_numeric_factor;
+        if (factor_reuse == "modified") {
+          // the factors are only reused for the macro-element they were computed for
+          refactor = factor_usernum != usernum || factor_isAdjoint != isAdjoint || factor_contraction > refactor_ratio;
+        }
+        if (refactor) {
+          Teuchos::TimeMonitor localtimer(*sgfemFactorTimer);
+          AmSolver->NumericFactorization();
+          have_numeric_factor = true;
+          factor_usernum = usernum;
+          factor_isAdjoint = isAdjoint;
+        }
+        AmSolver->Solve();
+      }
+    }
+    else {
+      AztecOO itersolver(LinSys);
+      itersolver.SetAztecOption(AZ_output,0);
+      itersolver.SetPrecOperator(MLPrec);
+      itersolver.Iterate(liniter,lintol);
+    }
+    du->Import(*du_glob, *(importer), Add);
+  }
+  
+  virtual void solveSubGridSensitivities(vector_RCP & d_sub_res, vector_RCP & d_sub_u_over,
+                                         const int & usernum, const double & alpha, const bool & isAdjoint) {
+    LinSys.SetOperator(J.get());
+    if (useDirect) {
+      LinSys.SetRHS(d_sub_res.get());
+      LinSys.SetLHS(d_sub_u_over.get());
+      
+      if (use_amesos2) {
+        Am2Solver->setX(d_sub_u_over);
+        Am2Solver->setB(d_sub_res);
+        Am2Solver->solve();
+      }
+      else if (factor_reuse == "linear") {
+        this->solveStoredFactor(usernum, alpha, isAdjoint, d_sub_res, d_sub_u_over);
+      }
+      else {
+        // the factors from the last Newton correction are used if J has not changed since
+        // (the sensitivities always need the factors of the current J)
+        if (!have_numeric_factor) {
+          Teuchos::TimeMonitor localtimer(*sgfemFactorTimer);
+          AmSolver->NumericFactorization();
+          have_numeric_factor = true;
+          factor_usernum = usernum;
+          factor_isAdjoint = isAdjoint;
+        }
+        AmSolver->Solve();
+      }
+    }
+    else {
+      vector_RCP cd_sub_res = Teuchos::rcp(new Epetra_MultiVector(*(owned_map),1));
+      vector_RCP cd_sub_u_over = Teuchos::rcp(new Epetra_MultiVector(*(overlapped_map),1));
+      
+      for (size_t i=0; i<d_sub_res->NumVectors(); i++) {
+        for (int j=0; j<d_sub_res->MyLength(); j++) {
+          (*cd_sub_res)[0][j] = (*d_sub_res)[i][j];
+        }
+        cd_sub_u_over->PutScalar(0.0);
+        LinSys.SetRHS(cd_sub_res.get());
+        LinSys.SetLHS(cd_sub_u_over.get());
+        
+        AztecOO itersolver(LinSys);
+        itersolver.SetAztecOption(AZ_output,0);
+        itersolver.SetPrecOperator(MLPrec);
+        itersolver.Iterate(liniter,lintol);
+        for (int j=0; j<d_sub_u_over->MyLength(); j++) {
+          (*d_sub_u_over)[i][j] = (*cd_sub_u_over)[0][j];
+        }
+      }
+    }
+  }
+  
+  ///////////////////////////////////////////////////////////////////////////////////////
+  // Residual-based error indicator
+  // The subgrid residual of this model at a given state, usually the solution of a coarser
+  // model projected onto this subgrid.  The norm is scaled by the residual at zero, which
+  // holds the forcing and the macro boundary data.  For transient problems, the time
+  // derivative is the difference with the (projected) state at the previous macro time.
+  ///////////////////////////////////////////////////////////////////////////////////////
+  
+  double computeResidualIndicator(const vector_RCP & sub_u, const vector_RCP & sub_u_prev,
+                                  Kokkos::View<double***,AssemblyDevice> gl_u,
+                                  const int & macroelemindex, const double & time,
+                                  const bool & isTransient, const int & usernum) {
+    
+    Teuchos::TimeMonitor localtimer(*sgfemIndicatorTimer);
+    
+    Kokkos::View<double***,AssemblyDevice> lambda("local u",1,gl_u.dimension(1),gl_u.dimension(2));
+    for (int i=0; i<gl_u.dimension(1); i++) {
+      for (int j=0; j<gl_u.dimension(2); j++) {
+        lambda(0,i,j) = gl_u(macroelemindex,i,j);
+      }
+    }
+    
+    vector_RCP ind_u_dot = Teuchos::rcp(new Epetra_MultiVector(*(overlapped_map),1));
+    if (isTransient) {
+      ind_u_dot->Update(1.0/macro_deltat, *sub_u, -1.0/macro_deltat, *sub_u_prev, 0.0);
+      wkset[0]->alpha = 1.0/macro_deltat;
+      wkset[0]->deltat = macro_deltat;
+    }
+    else {
+      wkset[0]->deltat = 1.0;
+    }
+    
+    double resnorm = this->assembleResidualNorm(sub_u, ind_u_dot, lambda, time, isTransient, usernum);
+    
+    vector_RCP zero = Teuchos::rcp(new Epetra_MultiVector(*(overlapped_map),1));
+    double scale = this->assembleResidualNorm(zero, zero, lambda, time, isTransient, usernum);
+    
+    if (scale > 0.0) {
+      return resnorm/scale;
+    }
+    return resnorm;
+  }
+  
+  ///////////////////////////////////////////////////////////////////////////////////////
+  // 2-norm of the subgrid residual (no Jacobian) at a given state
+  ///////////////////////////////////////////////////////////////////////////////////////
+  
+  double assembleResidualNorm(const vector_RCP & sub_u, const vector_RCP & sub_u_dot,
+                              Kokkos::View<double***,AssemblyDevice> lambda,
+                              const double & time, const bool & isTransient, const int & usernum) {
+    
+    res_over->PutScalar(0.0);
+    
+    wkset[0]->time = time;
+    wkset[0]->isTransient = isTransient;
+    wkset[0]->isAdjoint = false;
+    
+    int numDOF = cells[usernum][0]->GIDs[0].size();
+    Kokkos::View<double***,AssemblyDevice> local_res("local residual",1,numDOF,1);
+    Kokkos::View<double***,AssemblyDevice> local_J("local Jacobian",1,numDOF,numDOF);
+    Kokkos::View<double***,AssemblyDevice> local_Jdot("local Jacobian dot",1,numDOF,numDOF);
+    
+    // the parameters are taken from the subgrid parameter views, not from paramvals
+    vector<vector<double> > paramvals;
+    vector<int> paramtypes;
+    vector<string> paramnames;
+    
+    for (size_t e=0; e<cells[usernum].size(); e++) {
+      cells[usernum][e]->setLocalSoln(sub_u,0,0);
+      cells[usernum][e]->setLocalSoln(sub_u_dot,1,0);
+      cells[usernum][e]->setLocalSoln(Psol[0],4,0);
+      cells[usernum][e]->aux = lambda;
+      
+      wkset[0]->localEID = e;
+      cells[usernum][e]->updateData();
+      
+      for (int n=0; n<numDOF; n++) {
+        local_res(0,n,0) = 0.0;
+      }
+      cells[usernum][e]->computeJacRes(paramvals, paramtypes, paramnames,
+                                       time, isTransient, false,
+                                       false, false, 0, false, false, false,
+                                       local_res, local_J, local_Jdot);
+      
+      vector<vector<int> > GIDs = cells[usernum][e]->GIDs;
+      for (size_t row=0; row<GIDs[0].size(); row++) {
+        res_over->SumIntoGlobalValue(GIDs[0][row], 0, local_res(0,row,0));
+      }
+    }
+    
+    res->PutScalar(0.0);
+    res->Export(*res_over, *(exporter), Add);
+    double resnorm = 0.0;
+    res->Norm2(&resnorm);
+    return resnorm;
+  }
+  
   //////////////////////////////////////////////////////////////
   // Decide if we need to save the current solution
   //////////////////////////////////////////////////////////////
@@ -1401,43 +2450,13 @@ public:
     
     Teuchos::TimeMonitor localtimer(*sgfemSolnStorageTimer);
     
-    vector_RCP vectostore = Teuchos::rcp( new Epetra_MultiVector(*(overlapped_map),1));
-    *vectostore = *newvec;
+    // the history takes newvec and hands back the storage it no longer needs
     if (isAdjoint) {
-      size_t findex;
-      bool foundtime = false;
       double adjtime = time - macro_deltat;
-      for (size_t j=0; j<adjsoln[usernum].size(); j++) {
-        if (abs(adjsoln[usernum][j].first - adjtime) < 1.0e-13) {
-          foundtime = true;
-          findex = j;
-        }
-      }
-      pair<double, vector_RCP> time_u(adjtime,vectostore);
-      if (foundtime) {
-        adjsoln[usernum][findex] = time_u;
-      }
-      else {
-        adjsoln[usernum].push_back(time_u);
-      }
-      
+      adjsoln[usernum].store(adjtime, newvec);
     }
     else {
-      size_t findex;
-      bool foundtime = false;
-      for (size_t j=0; j<soln[usernum].size(); j++) {
-        if (abs(soln[usernum][j].first - time) < 1.0e-13) {
-          foundtime = true;
-          findex = j;
-        }
-      }
-      pair<double, vector_RCP> time_u(time,vectostore);
-      if (foundtime) {
-        soln[usernum][findex] = time_u;
-      }
-      else {
-        soln[usernum].push_back(time_u);
-      }
+      soln[usernum].store(time, newvec);
     }
   }
   
@@ -1599,46 +2618,11 @@ public:
         }
       }
       
-      M->Apply(*d_sub_u,*d_sub_u_prev);
+      this->subGridMass(usernum, alpha)->Apply(*d_sub_u,*d_sub_u_prev);
       d_sub_res->Export(*d_sub_res_over, *(exporter), Add);
       d_sub_res->Update(1.0*alpha, *d_sub_u_prev, 1.0);
       
-      LinSys.SetOperator(J.get());
-      if (useDirect) {
-        LinSys.SetRHS(d_sub_res.get());
-        LinSys.SetLHS(d_sub_u_over.get());
-        
-        if (use_amesos2) {
-          Am2Solver->setX(d_sub_u_over);
-          Am2Solver->setB(d_sub_res);
-          Am2Solver->solve();
-        }
-        else {
-          AmSolver->NumericFactorization();
-          AmSolver->Solve();
-        }
-      }
-      else {
-        vector_RCP cd_sub_res = Teuchos::rcp(new Epetra_MultiVector(*(owned_map),1));
-        vector_RCP cd_sub_u_over = Teuchos::rcp(new Epetra_MultiVector(*(overlapped_map),1));
-        
-        for (size_t i=0; i<d_sub_u->NumVectors(); i++) {
-          for (int j=0; j<d_sub_u->MyLength(); j++) {
-            (*cd_sub_res)[0][j] = (*d_sub_res)[i][j];
-          }
-          cd_sub_u_over->PutScalar(0.0);
-          LinSys.SetRHS(cd_sub_res.get());
-          LinSys.SetLHS(cd_sub_u_over.get());
-          
-          AztecOO itersolver(LinSys);
-          itersolver.SetAztecOption(AZ_output,0);
-          itersolver.SetPrecOperator(MLPrec);
-          itersolver.Iterate(liniter,lintol);
-          for (int j=0; j<d_sub_u_over->MyLength(); j++) {
-            (*d_sub_u_over)[i][j] = (*cd_sub_u_over)[0][j];
-          }
-        }
-      }
+      this->solveSubGridSensitivities(d_sub_res, d_sub_u_over, usernum, alpha, isAdjoint);
       d_sub_u->PutScalar(0.0);
       d_sub_u->Import(*d_sub_u_over, *(importer), Add);
     }
@@ -1666,7 +2650,7 @@ public:
             wkset[0]->updateSide(cells[usernum][e]->nodes, cells[usernum][e]->sideip[s],
                                  cells[usernum][e]->sidewts[s],
                                  cells[usernum][e]->normals[s],
-                                 cells[usernum][e]->sideijac[s], s);
+                                 cells[usernum][e]->sideijac[s], s, cells[usernum][e]->cellID);
           }
           DRV cwts = wkset[0]->wts_side;
           double h = 0.0;
@@ -1777,18 +2761,54 @@ public:
   }
   
   ///////////////////////////////////////////////////////////////////////////////////////
-  // Subgrid Linear Solver
+  // Solve with the factors stored for this macro-element (factorization reuse "linear")
+  // The adjoint Jacobian is the transpose of the forward Jacobian, so both use the same factors
   ///////////////////////////////////////////////////////////////////////////////////////
   
-  void linearSolver(matrix_RCP & M, vector_RCP & r, vector_RCP & sol) {
-    Epetra_LinearProblem cLinSys(M.get(), sol.get(), r.get());
-    Amesos_BaseSolver * AmSolverT;
-    Amesos AmFactoryT;
-    char* SolverType = "Amesos_Klu";
-    AmSolverT = AmFactoryT.Create(SolverType, cLinSys);
-    AmSolverT->SymbolicFactorization();
-    AmSolverT->NumericFactorization();
-    AmSolverT->Solve();
+  void solveStoredFactor(const int & usernum, const double & alpha, const bool & isAdjoint,
+                         vector_RCP & rhs, vector_RCP & lhs) {
+    if ((int)stored_factors.size() <= usernum) {
+      stored_factors.resize(usernum+1);
+    }
+    StoredFactor & sf = stored_factors[usernum];
+    if (sf.solver.is_null() || sf.alpha != alpha) {
+      Teuchos::TimeMonitor localtimer(*sgfemFactorTimer);
+      sf.J = Teuchos::rcp(new Epetra_CrsMatrix(*J));
+      sf.M = Teuchos::rcp(new Epetra_CrsMatrix(*M));
+      sf.LinSys = Teuchos::rcp(new Epetra_LinearProblem());
+      sf.LinSys->SetOperator(sf.J.get());
+      sf.LinSys->SetRHS(rhs.get());
+      sf.LinSys->SetLHS(lhs.get());
+      Amesos AmFactory;
+      sf.solver = Teuchos::rcp(AmFactory.Create("Amesos_Klu", *(sf.LinSys)));
+      sf.solver->SymbolicFactorization();
+      sf.solver->NumericFactorization();
+      sf.alpha = alpha;
+      sf.isAdjoint = isAdjoint;
+    }
+    sf.LinSys->SetRHS(rhs.get());
+    sf.LinSys->SetLHS(lhs.get());
+    sf.solver->SetUseTranspose(isAdjoint != sf.isAdjoint);
+    sf.solver->Solve();
+  }
+  
+  bool haveStoredFactor(const int & usernum, const double & alpha) {
+    return (int)stored_factors.size() > usernum && !stored_factors[usernum].solver.is_null() &&
+           stored_factors[usernum].alpha == alpha;
+  }
+  
+  // the mass matrix of the last assembly (the stored one if the assembly was skipped)
+  matrix_RCP subGridMass(const int & usernum, const double & alpha) {
+    if (factor_reuse == "linear" && this->haveStoredFactor(usernum, alpha)) {
+      return stored_factors[usernum].M;
+    }
+    return M;
+  }
+  
+  void clearStoredFactors() {
+    stored_factors.clear();
+    factor_usernum = -1;
+    have_numeric_factor = false;
   }
   
   ///////////////////////////////////////////////////////////////////////////////////////
@@ -1798,12 +2818,7 @@ public:
   Kokkos::View<double**,AssemblyDevice> computeError(const double & time, const int & usernum) {
     
     size_t numVars = varlist.size();
-    int tindex = -1;
-    for (int tt=0; tt<soln[usernum].size(); tt++) {
-      if (abs(soln[usernum][tt].first - time)<1.0e-10) {
-        tindex = tt;
-      }
-    }
+    int tindex = soln[usernum].find(time);
     
     Kokkos::View<double**,AssemblyDevice> errors("error",cells[usernum].size(), numVars);
     if (tindex != -1) {
@@ -1828,12 +2843,7 @@ public:
   Kokkos::View<AD*,AssemblyDevice> computeObjective(const string & response_type, const int & seedwhat,
                                                     const double & time, const int & usernum) {
     
-    int tindex = -1;
-    for (int tt=0; tt<soln[usernum].size(); tt++) {
-      if (abs(soln[usernum][tt].first - time)<1.0e-10) {
-        tindex = tt;
-      }
-    }
+    int tindex = soln[usernum].find(time);
     
     Kokkos::View<AD*,AssemblyDevice> objective;
     bool beensized = false;
@@ -1873,13 +2883,9 @@ public:
     // Re-create the subgrid mesh
     //////////////////////////////////////////////////////////////
     
-    SubGridTools sgt(LocalComm, macroshape, shape, macronodes[usernum], macrosideinfo[usernum]);
-    sgt.createSubMesh(numrefine);
-    vector<vector<double> > nodes = sgt.getSubNodes();
-    vector<vector<int> > connectivity = sgt.getSubConnectivity();
-    Kokkos::View<int****,HostDevice> sideinfo = sgt.getSubSideinfo();
+    vector<vector<double> > nodes = this->getSubNodes(macronodes[usernum]);
     
-    panzer_stk::SubGridMeshFactory submeshFactory(shape, nodes, connectivity, blockID);
+    panzer_stk::SubGridMeshFactory submeshFactory(shape, nodes, ref_connectivity, blockID);
     Teuchos::RCP<panzer_stk::STK_Interface> submesh = submeshFactory.buildMesh(LocalComm->Comm());
     
     //////////////////////////////////////////////////////////////
@@ -2121,149 +3127,156 @@ public:
   
   void writeSolution(const string & filename) {
     
+    vector<int> usernums;
+    for (size_t u=0; u<soln.size(); u++) {
+      usernums.push_back(u);
+    }
+    this->setupOutput(filename, usernums);
     
-    bool isTD = false;
-    if (soln[0].size() > 1) {
-      isTD = true;
+    int numSteps = soln[0].size();
+    for (int m=0; m<numSteps; m++) {
+      this->writeOutputStep(soln[0][m].first);
     }
+  }
+  
+  ///////////////////////////////////////////////////////////////////////////////////////
+  // Aggregated output: one mesh with the subgrids of a set of macro-elements, so the
+  // states of all of them are written to one file per step (while the simulation runs)
+  ///////////////////////////////////////////////////////////////////////////////////////
+  
+  void setupOutput(const string & filename, const vector<int> & usernums) {
+    
+    Teuchos::TimeMonitor localtimer(*sgfemOutputTimer);
     
     string blockID = "eblock";
+    output_usernums = usernums;
     
     panzer_stk::SubGridMeshFactory submeshFactory(shape);
-    
-    //////////////////////////////////////////////////////////////
-    // Re-create the subgrid mesh
-    //////////////////////////////////////////////////////////////
-    
-    for (size_t e=0; e<macronodes.size(); e++) {
-      SubGridTools sgt(LocalComm, macroshape, shape, macronodes[e], macrosideinfo[e]);
-      sgt.createSubMesh(numrefine);
-      vector<vector<double> > nodes = sgt.getSubNodes();
-      vector<vector<int> > connectivity = sgt.getSubConnectivity();
-      Kokkos::View<int****,HostDevice> sideinfo = sgt.getSubSideinfo();
-      
-      submeshFactory.addElems(nodes, connectivity);
+    for (size_t k=0; k<output_usernums.size(); k++) {
+      vector<vector<double> > nodes = this->getSubNodes(macronodes[output_usernums[k]]);
+      submeshFactory.addElems(nodes, ref_connectivity);
     }
     
-    Teuchos::RCP<panzer_stk::STK_Interface> submesh = submeshFactory.buildMesh(LocalComm->Comm());
+    output_mesh = submeshFactory.buildMesh(LocalComm->Comm());
     
     //////////////////////////////////////////////////////////////
     // Add in the necessary fields for plotting
     //////////////////////////////////////////////////////////////
     
     vector<string> subeBlocks;
-    submesh->getElementBlockNames(subeBlocks);
+    output_mesh->getElementBlockNames(subeBlocks);
     
     for (size_t b=0; b<subeBlocks.size(); b++) {
       for (size_t j=0; j<varlist.size(); j++) {
-        submesh->addSolutionField(varlist[j], subeBlocks[b]);
+        output_mesh->addSolutionField(varlist[j], subeBlocks[b]);
       }
       vector<string> subextrafieldnames = physics_RCP->getExtraFieldNames(0);
       for (size_t j=0; j<subextrafieldnames.size(); j++) {
-        submesh->addSolutionField(subextrafieldnames[j], subeBlocks[b]);
+        output_mesh->addSolutionField(subextrafieldnames[j], subeBlocks[b]);
       }
       vector<string> subextracellfields = physics_RCP->getExtraCellFieldNames(0);
       for (size_t j=0; j<subextracellfields.size(); j++) {
-        submesh->addCellField(subextracellfields[j], subeBlocks[b]);
+        output_mesh->addCellField(subextracellfields[j], subeBlocks[b]);
       }
-      if (cells[b][0]->have_cell_phi || cells[b][0]->have_cell_rotation) {
-        submesh->addCellField("mesh_data_seed", subeBlocks[b]);
+      if (cells[0][0]->have_cell_phi || cells[0][0]->have_cell_rotation) {
+        output_mesh->addCellField("mesh_data_seed", subeBlocks[b]);
       }
       
       if (discparamnames.size() > 0) {
         for (size_t n=0; n<discparamnames.size(); n++) {
           int paramnumbasis = cells[0][0]->paramindex[n].size();
           if (paramnumbasis==1) {
-            submesh->addCellField(discparamnames[n], subeBlocks[b]);
+            output_mesh->addCellField(discparamnames[n], subeBlocks[b]);
           }
           else {
-            submesh->addSolutionField(discparamnames[n], subeBlocks[b]);
+            output_mesh->addSolutionField(discparamnames[n], subeBlocks[b]);
           }
         }
       }
     }
-    submeshFactory.completeMeshConstruction(*submesh,LocalComm->Comm());
+    submeshFactory.completeMeshConstruction(*output_mesh,LocalComm->Comm());
     
-    //////////////////////////////////////////////////////////////
-    // Add fields to mesh
-    //////////////////////////////////////////////////////////////
+    output_elements.clear();
+    size_t eprog = 0;
+    for (size_t k=0; k<output_usernums.size(); k++) {
+      int usernum = output_usernums[k];
+      for (size_t e=0; e<cells[usernum].size(); e++) {
+        for (size_t p=0; p<cells[usernum][e]->numElem; p++) {
+          output_elements.push_back(eprog);
+          eprog++;
+        }
+      }
+    }
     
+    output_mesh->setupExodusFile(filename);
+  }
+  
+  ///////////////////////////////////////////////////////////////////////////////////////
+  // Add the states at this time to the aggregated output (zero for the macro-elements
+  // that do not have a state at this time, e.g., they use another subgrid model)
+  ///////////////////////////////////////////////////////////////////////////////////////
+  
+  void writeOutputStep(const double & time) {
     
-    if(isTD)
-      submesh->setupExodusFile(filename);
+    Teuchos::TimeMonitor localtimer(*sgfemOutputTimer);
     
-    int numSteps = soln[0].size();
+    string blockID = "eblock";
     
-    vector<size_t> myElements;
-    size_t eprog = 0;
-    for (size_t b=0; b<cells.size(); b++) {
-      for (size_t e=0; e<cells[b].size(); e++) {
-        for (size_t p=0; p<cells[b][e]->numElem; p++) {
-          myElements.push_back(eprog);
-          eprog++;
-        }
+    vector<int> timeindex(output_usernums.size());
+    for (size_t k=0; k<output_usernums.size(); k++) {
+      if (write_subgrid_state) {
+        timeindex[k] = soln[output_usernums[k]].find(time);
+      }
+      else {
+        timeindex[k] = adjsoln[output_usernums[k]].find(time);
       }
     }
     
-    for (int m=0; m<numSteps; m++) {
-      
-      
-      //for (size_t b=0; b<cells.size(); b++) {
-      
-      vector<vector<int> > suboffsets = physics_RCP->offsets[0];
-      // Collect the subgrid solution
-      for (int n = 0; n<varlist.size(); n++) { // change to subgrid numVars
-        size_t numsb = cells[0][0]->index[0][n].size();
-        Kokkos::View<double**,HostDevice> soln_computed("soln",myElements.size(), numsb); // TMW temp. fix
-        string var = varlist[n];
-        size_t eprog = 0;
-        for (size_t b=0; b<cells.size(); b++) {
-          
-          for( size_t e=0; e<cells[b].size(); e++ ) {
-            int numElem = cells[b][e]->numElem;
-            for (int p=0; p<numElem; p++) {
-              vector<int> GIDs = cells[b][e]->GIDs[p];
-              
+    vector<vector<int> > suboffsets = physics_RCP->offsets[0];
+    // Collect the subgrid solution
+    for (int n = 0; n<varlist.size(); n++) { // change to subgrid numVars
+      size_t numsb = cells[0][0]->index[0][n].size();
+      Kokkos::View<double**,HostDevice> soln_computed("soln",output_elements.size(), numsb);
+      string var = varlist[n];
+      size_t eprog = 0;
+      for (size_t k=0; k<output_usernums.size(); k++) {
+        int usernum = output_usernums[k];
+        for( size_t e=0; e<cells[usernum].size(); e++ ) {
+          int numElem = cells[usernum][e]->numElem;
+          for (int p=0; p<numElem; p++) {
+            if (timeindex[k] >= 0) {
+              vector_RCP & state = write_subgrid_state ? soln[usernum][timeindex[k]].second : adjsoln[usernum][timeindex[k]].second;
+              vector<int> GIDs = cells[usernum][e]->GIDs[p];
               for( int i=0; i<numsb; i++ ) {
                 int pindex = overlapped_map->LID(GIDs[suboffsets[n][i]]);
-                if (write_subgrid_state)
-                  soln_computed(eprog,i) = (*(soln[b][m].second))[0][pindex];
-                else
-                  soln_computed(eprog,i) = (*(adjsoln[b][m].second))[0][pindex];
+                soln_computed(eprog,i) = (*state)[0][pindex];
               }
-              eprog++;
             }
+            eprog++;
           }
         }
-        submesh->setSolutionFieldData(var, blockID, myElements, soln_computed);
       }
-      
-      if (cells[0][0]->have_cell_phi || cells[0][0]->have_cell_rotation) {
-        Kokkos::View<double**,HostDevice> cdata("cell data",myElements.size(), 1);
-        int eprog = 0;
-        for (size_t b=0; b<cells.size(); b++) {
-          for (size_t k=0; k<cells[b].size(); k++) {
-            vector<size_t> cell_data_seed = cells[b][k]->cell_data_seed;
-            for (int p=0; p<cells[b][k]->numElem; p++) {
-              cdata(eprog,0) = cell_data_seed[p];
-              eprog++;
-            }
+      output_mesh->setSolutionFieldData(var, blockID, output_elements, soln_computed);
+    }
+    
+    if (cells[0][0]->have_cell_phi || cells[0][0]->have_cell_rotation) {
+      Kokkos::View<double**,HostDevice> cdata("cell data",output_elements.size(), 1);
+      int eprog = 0;
+      for (size_t k=0; k<output_usernums.size(); k++) {
+        int usernum = output_usernums[k];
+        for (size_t e=0; e<cells[usernum].size(); e++) {
+          vector<size_t> cell_data_seed = cells[usernum][e]->cell_data_seed;
+          for (int p=0; p<cells[usernum][e]->numElem; p++) {
+            cdata(eprog,0) = cell_data_seed[p];
+            eprog++;
           }
         }
-        submesh->setCellFieldData("mesh_data_seed", blockID, myElements, cdata);
-      }
-    
-      
-      if(isTD) {
-        submesh->writeToExodus(soln[0][m].first);
-      }
-      else {
-        submesh->writeToExodus(filename);
       }
+      output_mesh->setCellFieldData("mesh_data_seed", blockID, output_elements, cdata);
     }
     
+    output_mesh->writeToExodus(time);
   }
-
   
   ///////////////////////////////////////////////////////////////////////////////////////
   // Write the solution to a file at a specific time
@@ -2438,21 +3451,21 @@ public:
   matrix_RCP getProjectionMatrix() {
     
     // Compute the mass matrix on a reference element
-    matrix_RCP mass = Teuchos::rcp( new Epetra_CrsMatrix(Copy, *overlapped_map, -1) );
+    // The sparsity pattern is the subgrid graph, so each element row is summed in at once
+    matrix_RCP mass = Teuchos::rcp( new Epetra_CrsMatrix(Copy, *overlapped_graph) );
     matrix_RCP glmass = Teuchos::rcp( new Epetra_CrsMatrix(Copy, *owned_map, -1) );
     int usernum = 0;
     for (size_t e=0; e<cells[usernum].size(); e++) {
       int numElem = cells[usernum][e]->numElem;
-      vector<vector<int> > GIDs = cells[usernum][e]->GIDs;
+      vector<vector<int> > & GIDs = cells[usernum][e]->GIDs;
       Kokkos::View<double***,AssemblyDevice> localmass = cells[usernum][e]->getMass();
+      vector<double> vals(localmass.dimension(2));
       for (int c=0; c<numElem; c++) {
         for( size_t row=0; row<GIDs[c].size(); row++ ) {
-          int rowIndex = GIDs[c][row];
           for( size_t col=0; col<GIDs[c].size(); col++ ) {
-            int colIndex = GIDs[c][col];
-            double val = localmass(c,row,col);
-            mass->InsertGlobalValues(rowIndex, 1, &val, &colIndex);
+            vals[col] = localmass(c,row,col);
           }
+          mass->SumIntoGlobalValues(GIDs[c][row], GIDs[c].size(), &vals[0], &GIDs[c][0]);
         }
       }
     }
@@ -2680,6 +3693,16 @@ public:
     return cells[0][cellnum]->GIDs;
   }
   
+  ////////////////////////////////////////////////////////////////////////////////
+  // Free the stored forward states of a macro step (the adjoint sweep is done with it)
+  ////////////////////////////////////////////////////////////////////////////////
+  
+  void releaseStates(const double & time) {
+    if (store_subgrid_states) {
+      state_history->release(time);
+    }
+  }
+  
   ////////////////////////////////////////////////////////////////////////////////
   // Update the subgrid parameters (will be depracated)
   ////////////////////////////////////////////////////////////////////////////////
@@ -2690,7 +3713,22 @@ public:
       wkset[b]->paramnames = paramnames;
     }
     physics_RCP->updateParameters(params, paramnames);
+    // (the response cache does not need to be cleared: its signatures include the parameter values)
     
+    // the macro-scale calls this before every solve (and objective evaluation), usually
+    // with the same values, so the factors and the condensed responses are only
+    // discarded if the values changed
+    vector<double> newvals;
+    for (size_t i=0; i<params.size(); i++) {
+      for (size_t j=0; j<params[i]->size(); j++) {
+        newvals.push_back((*params[i])[j].val());
+      }
+    }
+    if (newvals != last_paramvals) {
+      this->clearStoredFactors();
+      condensed.clear();
+      last_paramvals = newvals;
+    }
   }
   
   ////////////////////////////////////////////////////////////////////////////////
@@ -2770,6 +3808,11 @@ public:
   // ========================================================================================
   
   void updateMeshData(Kokkos::View<double**,HostDevice> & rotation_data) {
+    if (!response_cache.is_null()) {
+      response_cache->clear();
+    }
+    this->clearStoredFactors();
+    condensed.clear();
     for (size_t b=0; b<cells.size(); b++) {
       for (size_t e=0; e<cells[b].size(); e++) {
         int numElem = cells[b][e]->numElem;
@@ -2795,6 +3838,21 @@ public:
   int nummacroVars, subgridverbose, numrefine;
   topo_RCP cellTopo, macro_cellTopo;
   vector<basis_RCP> basis_pointers;
+  int history_window;
+  
+  // block-diagonal system for the batched forward solves
+  int batch_size, batch_blocks;
+  bool batch_factored;
+  Teuchos::RCP<Epetra_Map> batch_map;
+  matrix_RCP batch_J, batch_M;
+  vector_RCP batch_res, batch_du, batch_dres, batch_dsol, batch_dprev;
+  Epetra_LinearProblem batch_LinSys;
+  Teuchos::RCP<Amesos_BaseSolver> batch_solver;
+  
+  // reference sub-mesh shared by all of the macro-elements
+  DRV ref_subnodes;
+  vector<vector<int> > ref_connectivity;
+  Kokkos::View<int****,HostDevice> ref_sideinfo;
   
   vector<vector<int> > useBasis;
   
@@ -2821,7 +3879,34 @@ public:
   double sub_NLtol, lintol;
   int sub_maxNLiter, liniter;
   
-  Amesos_BaseSolver * AmSolver;
+  Teuchos::RCP<Amesos_BaseSolver> AmSolver;
+  
+  // factorization reuse
+  string factor_reuse;
+  double refactor_ratio, factor_contraction;
+  bool have_numeric_factor, factor_isAdjoint;
+  int factor_usernum; // macro-element of the factors in AmSolver (-1 if none)
+  vector<double> last_paramvals; // parameter values the stored factors (and condensed responses) were computed with
+  struct StoredFactor {
+    matrix_RCP J, M;
+    Teuchos::RCP<Epetra_LinearProblem> LinSys;
+    Teuchos::RCP<Amesos_BaseSolver> solver;
+    double alpha;
+    bool isAdjoint;
+  };
+  vector<StoredFactor> stored_factors; // one per macro-element
+  
+  // static condensation
+  bool use_condensation;
+  double condensation_tol;
+  struct CondensedResponse {
+    CondensedResponse() : verified(false) {};
+    Kokkos::View<double***,AssemblyDevice> lambda;
+    vector<AD> res;
+    vector_RCP u, d_u;
+    bool verified;
+  };
+  vector<CondensedResponse> condensed; // one per macro-element
   Teuchos::RCP<Amesos2::Solver<Epetra_CrsMatrix,Epetra_MultiVector> > Am2Solver;
   Teuchos::RCP<Epetra_MultiVector> LA_rhs, LA_lhs;
   
@@ -2844,12 +3929,19 @@ public:
   vector<Kokkos::View<int****,HostDevice> > macrosideinfo;
   int num_macro_time_steps;
   double macro_deltat;
-  bool write_subgrid_state;
+  bool write_subgrid_state, store_subgrid_states;
+  Teuchos::RCP<SubGridStateHistory> state_history;
+  
+  // aggregated output
+  Teuchos::RCP<panzer_stk::STK_Interface> output_mesh;
+  vector<int> output_usernums;
+  vector<size_t> output_elements;
   
   // Collection of users
   vector<vector<Teuchos::RCP<cell> > > cells;
   
   bool have_mesh_data, have_rotations, have_rotation_phi, compute_mesh_data;
+  bool position_dependent; // a subgrid function depends on the coordinates (see getCacheSignature)
   bool have_multiple_data_files;
   string mesh_data_tag, mesh_data_pts_tag;
   int number_mesh_data_files, numSeeds;
@@ -2865,6 +3957,14 @@ public:
   Teuchos::RCP<Teuchos::Time> sgfemFluxWksetTimer = Teuchos::TimeMonitor::getNewCounter("MILO::subgridFEM::updateFlux - update workset");
   Teuchos::RCP<Teuchos::Time> sgfemFluxCellTimer = Teuchos::TimeMonitor::getNewCounter("MILO::subgridFEM::updateFlux - cell computation");
   Teuchos::RCP<Teuchos::Time> sgfemSolnStorageTimer = Teuchos::TimeMonitor::getNewCounter("MILO::subgridFEM::solutionStorage()");
+  Teuchos::RCP<Teuchos::Time> sgfemBatchSolverTimer = Teuchos::TimeMonitor::getNewCounter("MILO::subgridFEM::subgridBatchSolver()");
+  Teuchos::RCP<Teuchos::Time> sgfemBatchSetupTimer = Teuchos::TimeMonitor::getNewCounter("MILO::subgridFEM::subgridBatchSolver - setup batch system");
+  Teuchos::RCP<Teuchos::Time> sgfemBatchNonlinearSolverTimer = Teuchos::TimeMonitor::getNewCounter("MILO::subgridFEM::batchNonlinearSolver()");
+  Teuchos::RCP<Teuchos::Time> sgfemFactorTimer = Teuchos::TimeMonitor::getNewCounter("MILO::subgridFEM::numeric factorization");
+  Teuchos::RCP<Teuchos::Time> sgfemCondensedTimer = Teuchos::TimeMonitor::getNewCounter("MILO::subgridFEM::subgridSolver - static condensation");
+  Teuchos::RCP<Teuchos::Time> sgfemCacheTimer = Teuchos::TimeMonitor::getNewCounter("MILO::subgridFEM::subgridSolver - response cache");
+  Teuchos::RCP<Teuchos::Time> sgfemOutputTimer = Teuchos::TimeMonitor::getNewCounter("MILO::subgridFEM::aggregated output");
+  Teuchos::RCP<Teuchos::Time> sgfemIndicatorTimer = Teuchos::TimeMonitor::getNewCounter("MILO::subgridFEM::computeResidualIndicator()");
   Teuchos::RCP<Teuchos::Time> sgfemComputeAuxBasisTimer = Teuchos::TimeMonitor::getNewCounter("MILO::subgridFEM::addMacro - compute aux basis functions");
   Teuchos::RCP<Teuchos::Time> sgfemSubMeshTimer = Teuchos::TimeMonitor::getNewCounter("MILO::subgridFEM::addMacro - create subgrid meshes");
   Teuchos::RCP<Teuchos::Time> sgfemLinearAlgebraSetupTimer = Teuchos::TimeMonitor::getNewCounter("MILO::subgridFEM::addMacro - setup linear algebra");
@@ -16,6 +16,8 @@
 #include "preferences.hpp"
 #include "subgridModel.hpp"
 #include "subgridFEM.hpp"
+#include "subgridROM.hpp"
+#include "threadSupport.hpp"
 
 using namespace std;
 using namespace Intrepid2;
@@ -36,19 +38,14 @@ vector<Teuchos::RCP<SubGridModel> > subgridGenerator(const Teuchos::RCP<Epetra_M
     int  num_macro_time_steps = settings->sublist("Solver").get("numSteps",1);
     double finaltime = settings->sublist("Solver").get<double>("finaltime",1.0);
     double macro_deltat = finaltime/num_macro_time_steps;
+    
+    vector<Teuchos::RCP<Teuchos::ParameterList> > model_pls;
+    vector<string> model_usage;
     if (nummodels == 1) { 
       Teuchos::RCP<Teuchos::ParameterList> subgrid_pl = rcp(new Teuchos::ParameterList("Subgrid"));
       subgrid_pl->setParameters(settings->sublist("Subgrid"));
-      string subgrid_model_type = subgrid_pl->get<string>("Subgrid Model","FEM");
-      int macro_block = subgrid_pl->get<int>("Macro Block",0);
-      std::vector<string> macro_blocknames;
-      macromesh->getElementBlockNames(macro_blocknames);
-      topo_RCP macro_topo = macromesh->getCellTopology(macro_blocknames[macro_block]);
-      if (subgrid_model_type == "FEM") {
-        subgridModels.push_back(Teuchos::rcp( new SubGridFEM(Comm, subgrid_pl, macro_topo, num_macro_time_steps, macro_deltat) ) );
-      }
-      subgridModels[subgridModels.size()-1]->macro_block = macro_block;
-      subgridModels[subgridModels.size()-1]->usage = "1.0";
+      model_pls.push_back(subgrid_pl);
+      model_usage.push_back("1.0");
     }
     else {
       for (int j=0; j<nummodels; j++) {
@@ -57,16 +54,6 @@ vector<Teuchos::RCP<SubGridModel> > subgridGenerator(const Teuchos::RCP<Epetra_M
         if (settings->sublist("Subgrid").isSublist("Model" + ss.str())) {
           Teuchos::RCP<Teuchos::ParameterList> subgrid_pl = rcp(new Teuchos::ParameterList("Subgrid"));
           subgrid_pl->setParameters(settings->sublist("Subgrid").sublist("Model" + ss.str()));
-          string subgrid_model_type = subgrid_pl->get<string>("Subgrid Model","FEM");
-          int macro_block = subgrid_pl->get<int>("Macro Block",0);
-          std::vector<string> macro_blocknames;
-          macromesh->getElementBlockNames(macro_blocknames);
-          topo_RCP macro_topo = macromesh->getCellTopology(macro_blocknames[macro_block]);
-          
-          if (subgrid_model_type == "FEM") {
-            subgridModels.push_back(Teuchos::rcp( new SubGridFEM(Comm, subgrid_pl, macro_topo, num_macro_time_steps, macro_deltat ) ) );
-          }
-          subgridModels[subgridModels.size()-1]->macro_block = macro_block;
           string usage;
           if (j==0) {// to enable default behavior
             usage = subgrid_pl->get<string>("usage","1.0");
@@ -74,10 +61,81 @@ vector<Teuchos::RCP<SubGridModel> > subgridGenerator(const Teuchos::RCP<Epetra_M
           else {
             usage = subgrid_pl->get<string>("usage","0.0");
           }
-          subgridModels[subgridModels.size()-1]->usage = usage;
+          model_pls.push_back(subgrid_pl);
+          model_usage.push_back(usage);
+        }
+      }
+    }
+    
+    ////////////////////////////////////////////////////////////////////////////////
+    // A subgrid history window drops the old macro time steps, so it can not be used
+    // with anything that reads them later: the adjoint, the subgrid solution output,
+    // load balancing and dedicated subgrid ranks (the last two move the histories)
+    ////////////////////////////////////////////////////////////////////////////////
+    
+    string analysis_type = settings->sublist("Analysis").get<string>("analysis type","forward");
+    bool have_adjoint = (analysis_type == "forward+adjoint" || analysis_type == "Sampling" ||
+                         analysis_type == "ROL" || analysis_type == "ROL_SIMOPT");
+    bool write_solution = settings->sublist("Postprocess").get<bool>("write solution",true);
+    bool load_balance = settings->sublist("Subgrid").get<double>("Load balancing threshold",0.0) > 0.0;
+    bool subgrid_ranks = settings->sublist("Analysis").get<bool>("multiscale split comm",false);
+    for (size_t j=0; j<model_pls.size(); j++) {
+      int history_window = model_pls[j]->sublist("Solver").get<int>("Subgrid history window",0);
+      if (history_window > 0) {
+        TEUCHOS_TEST_FOR_EXCEPTION(have_adjoint,std::runtime_error,"Error: a subgrid history window can not be used with an adjoint (" + analysis_type + ") analysis");
+        TEUCHOS_TEST_FOR_EXCEPTION(write_solution,std::runtime_error,"Error: a subgrid history window can not be used when the solution is written (set Postprocess: write solution to false)");
+        TEUCHOS_TEST_FOR_EXCEPTION(load_balance,std::runtime_error,"Error: a subgrid history window can not be used with subgrid load balancing");
+        TEUCHOS_TEST_FOR_EXCEPTION(subgrid_ranks,std::runtime_error,"Error: a subgrid history window can not be used with dedicated subgrid ranks (multiscale split comm)");
+      }
+    }
+    
+    ////////////////////////////////////////////////////////////////////////////////
+    // The subgrid problems on each rank can be solved concurrently.
+    // Each thread gets its own copy of every subgrid model, so the worksets,
+    // physics, function managers, solvers and timers are never shared between threads.
+    // The copies for thread t > 0 also get their own duplicate of the communicator.
+    // The copies for thread t are stored after the models for threads 0,...,t-1.
+    ////////////////////////////////////////////////////////////////////////////////
+    
+    int numthreads = settings->sublist("Subgrid").get<int>("Number of threads",1);
+    bool subgrid_static = settings->sublist("Subgrid").get<bool>("Static Subgrids",true);
+    TEUCHOS_TEST_FOR_EXCEPTION(numthreads > 1 && !subgrid_static,std::runtime_error,"Error: threaded subgrid solves require static subgrid models");
+    if (numthreads > 1) {
+      string reason;
+      if (!threadedSolvesSupported(reason)) {
+        if (Comm->MyPID() == 0) {
+          cout << "**** Warning: " << reason << ", so the subgrid problems will be solved by one thread" << endl;
+        }
+        numthreads = 1;
+      }
+    }
+    
+    for (int t=0; t<numthreads; t++) {
+      Teuchos::RCP<Epetra_MpiComm> thread_comm = Comm;
+      if (t > 0) { // concurrent collectives must be on different communicators
+        MPI_Comm dupcomm;
+        MPI_Comm_dup(Comm->Comm(), &dupcomm);
+        thread_comm = Teuchos::rcp(new Epetra_MpiComm(dupcomm));
+      }
+      for (size_t j=0; j<model_pls.size(); j++) {
+        Teuchos::RCP<Teuchos::ParameterList> subgrid_pl = rcp(new Teuchos::ParameterList("Subgrid"));
+        subgrid_pl->setParameters(*(model_pls[j]));
+        string subgrid_model_type = subgrid_pl->get<string>("Subgrid Model","FEM");
+        int macro_block = subgrid_pl->get<int>("Macro Block",0);
+        std::vector<string> macro_blocknames;
+        macromesh->getElementBlockNames(macro_blocknames);
+        topo_RCP macro_topo = macromesh->getCellTopology(macro_blocknames[macro_block]);
+        
+        if (subgrid_model_type == "FEM") {
+          subgridModels.push_back(Teuchos::rcp( new SubGridFEM(thread_comm, subgrid_pl, macro_topo, num_macro_time_steps, macro_deltat ) ) );
+        }
+        else if (subgrid_model_type == "ROM") {
+          subgridModels.push_back(Teuchos::rcp( new SubGridROM(thread_comm, subgrid_pl, macro_topo, num_macro_time_steps, macro_deltat ) ) );
         }
+        subgridModels[subgridModels.size()-1]->macro_block = macro_block;
+        subgridModels[subgridModels.size()-1]->usage = model_usage[j];
+        subgridModels[subgridModels.size()-1]->thread_id = t;
       }
-      
     }
   }
   
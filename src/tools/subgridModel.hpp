@@ -14,6 +14,8 @@
 
 #include "trilinos.hpp"
 #include "preferences.hpp"
+#include "subgridSolutionHistory.hpp"
+#include "subgridResponseCache.hpp"
 
 class SubGridModel {
 public:
@@ -42,6 +44,17 @@ public:
                              const int & usernum,
                              Kokkos::View<double**,AssemblyDevice> subgradient, const bool & store_adjPrev) = 0;
   
+  // forward subgrid problems of several macro-elements solved together
+  virtual bool useBatchSolver(const bool & isAdjoint, const bool & compute_sens,
+                              const bool & compute_disc_sens, const bool & compute_aux_sens) = 0;
+  
+  virtual void subgridBatchSolver(Kokkos::View<double***,AssemblyDevice> gl_u,
+                                  const vector<vector<double> > & paramvals,
+                                  const vector<int> & paramtypes, const vector<string> & paramnames,
+                                  const double & time, const bool & isTransient,
+                                  const int & num_active_params, workset & macrowkset,
+                                  const vector<int> & usernums, const vector<int> & macroelemindices) = 0;
+  
   virtual Kokkos::View<double**,AssemblyDevice> computeError(const double & time,
                                                              const int & usernum) = 0;
   
@@ -55,6 +68,10 @@ public:
   virtual void writeSolution(const string & filename) = 0;
 
   virtual void writeSolution(const string & filename, const int & usernum, const int & timeindex) = 0;
+  
+  virtual void setupOutput(const string & filename, const vector<int> & usernums) = 0;
+  
+  virtual void writeOutputStep(const double & time) = 0;
 
   virtual void addSensors(const Kokkos::View<double**,HostDevice> sensor_points,
                           const double & sensor_loc_tol,
@@ -76,12 +93,22 @@ public:
   
   virtual vector<vector<int> > getCellGIDs(const int & cellnum) = 0;
   
+  // newvec is swapped into the history (it comes back holding other storage)
   virtual void solutionStorage(vector_RCP & newvec,
                                const double & time, const bool & isAdjoint,
                                const int & usernum)= 0;
   
+  // residual of this model at a state projected from a coarser model (adaptive refinement)
+  virtual double computeResidualIndicator(const vector_RCP & sub_u, const vector_RCP & sub_u_prev,
+                                          Kokkos::View<double***,AssemblyDevice> gl_u,
+                                          const int & macroelemindex, const double & time,
+                                          const bool & isTransient, const int & usernum) = 0;
+  
   virtual void updateParameters(vector<Teuchos::RCP<vector<AD> > > & params, const vector<string> & paramnames) = 0;
   
+  // free the stored forward states of the macro step ending at time (after the adjoint used them)
+  virtual void releaseStates(const double & time) = 0;
+  
   virtual Kokkos::View<double**,AssemblyDevice> getCellFields(const int & usernum, const double & time) = 0;
   
   virtual void addMeshData() = 0;
@@ -97,7 +124,7 @@ public:
   vector<int> macro_usebasis;
   vector<vector<int> > macro_offsets;
   vector<string> macro_paramnames, macro_disc_paramnames;
-  int macro_block;
+  int macro_block, thread_id;
   double cost_estimate;
   
   Teuchos::RCP<Epetra_Map> owned_map;
@@ -105,14 +132,17 @@ public:
   Teuchos::RCP<Epetra_Export> exporter;
   Teuchos::RCP<Epetra_Import> importer;
   
-  vector<vector<pair<double, vector_RCP> > > soln;
+  vector<SubGridSolutionHistory> soln;
   vector<vector<pair<double, vector_RCP> > > solndot;
-  vector<vector<pair<double, vector_RCP> > > adjsoln;
+  vector<SubGridSolutionHistory> adjsoln;
+  
+  Teuchos::RCP<SubGridResponseCache> response_cache; // null unless the cache is enabled
   
   vector<Teuchos::RCP<vector<AD> > > paramvals_AD;
 
   string usage;
   Kokkos::View<AD**,AssemblyDevice> paramvals_KVAD;
+  Kokkos::View<AD**,AssemblyDevice> macro_paramvals_KVAD; // shared with the macro-scale (thread copies keep their own paramvals_KVAD)
   
   
 };
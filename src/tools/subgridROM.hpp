@@ -0,0 +1,443 @@
+/***********************************************************************
+ Multiscale/Multiphysics Interfaces for Large-scale Optimization (MILO)
+
+ Copyright 2018 National Technology & Engineering Solutions of Sandia,
+ LLC (NTESS). Under the terms of Contract DE-NA0003525 with NTESS, the
+ U.S. Government retains certain rights in this software.”
+
+ Questions? Contact Tim Wildey (tmwilde@sandia.gov) and/or
+ Bart van Bloemen Waanders (bartv@sandia.gov)
+ ************************************************************************/
+
+#ifndef SUBGRIDROM_H
+#define SUBGRIDROM_H
+
+#include "trilinos.hpp"
+#include "preferences.hpp"
+#include "subgridFEM.hpp"
+
+// Reduced-order (POD) subgrid model.
+// The subgrid problems are solved with the full FEM model until enough solution
+// snapshots have been collected.  A POD basis is then computed from the snapshots
+// and every later Newton correction (and the sensitivities) is computed from the
+// Galerkin projection of the subgrid system onto this basis.
+// With hyper-reduction, the residual and Jacobian of the forward problem are only
+// assembled on the sub-cells that contain the DEIM sample points.
+// One basis is built for each subgrid model on each processor, so the subgrid
+// problems must not be distributed.
+
+class SubGridROM : public SubGridFEM {
+public:
+
+  SubGridROM() {} ;
+
+  ~SubGridROM() {};
+
+  ///////////////////////////////////////////////////////////////////////////////////////
+  ///////////////////////////////////////////////////////////////////////////////////////
+
+  SubGridROM(const Teuchos::RCP<Epetra_MpiComm> & LocalComm_,
+             Teuchos::RCP<Teuchos::ParameterList> & settings_,
+             topo_RCP & macro_cellTopo_, int & num_macro_time_steps_,
+             double & macro_deltat_) :
+  SubGridFEM(LocalComm_, settings_, macro_cellTopo_, num_macro_time_steps_, macro_deltat_) {
+
+    num_snapshots = settings->sublist("Solver").get<int>("ROM snapshots",20);
+    energy = settings->sublist("Solver").get<double>("ROM energy",0.9999);
+    max_basis_size = settings->sublist("Solver").get<int>("ROM max basis size",-1);
+    use_hyper = settings->sublist("Solver").get<bool>("ROM hyper-reduction",false);
+    num_hyper_modes = settings->sublist("Solver").get<int>("ROM hyper-reduction modes",-1); // default is twice the basis size
+
+    TEUCHOS_TEST_FOR_EXCEPTION(num_snapshots < 1,std::runtime_error,"Error: the ROM subgrid model needs at least one snapshot");
+    TEUCHOS_TEST_FOR_EXCEPTION(energy <= 0.0 || energy > 1.0,std::runtime_error,"Error: the ROM energy must be in (0,1]");
+
+    have_basis = false;
+    hyper_assembly = false;
+    basis_size = 0;
+  }
+
+  ///////////////////////////////////////////////////////////////////////////////////////
+  // Collect the forward solutions as snapshots until the basis is built
+  ///////////////////////////////////////////////////////////////////////////////////////
+
+  void solutionStorage(vector_RCP & newvec,
+                       const double & time, const bool & isAdjoint,
+                       const int & usernum) {
+    if (!isAdjoint && !have_basis) {
+      snapshots.push_back(vector<double>((*newvec)[0], (*newvec)[0] + newvec->MyLength()));
+      if ((int)snapshots.size() >= num_snapshots) {
+        this->buildBasis();
+      }
+    }
+    SubGridFEM::solutionStorage(newvec, time, isAdjoint, usernum);
+  }
+
+  ///////////////////////////////////////////////////////////////////////////////////////
+  // Only the sample cells are needed for the hyper-reduced forward problem
+  ///////////////////////////////////////////////////////////////////////////////////////
+
+  bool assembleSubCell(const int & usernum, const size_t & e, const bool & isAdjoint) {
+    if (!have_basis || !use_hyper || isAdjoint) {
+      return true;
+    }
+    if ((int)sample_cells.size() <= usernum) {
+      sample_cells.resize(usernum+1);
+    }
+    if (sample_cells[usernum].size() == 0) {
+      sample_cells[usernum] = this->findSampleCells(usernum);
+    }
+    return sample_cells[usernum][e];
+  }
+  
+  // the reduced Jacobian is projected from the full one
+  bool needSubGridJacobian(const int & usernum, const double & alpha, const bool & isAdjoint) {
+    return true;
+  }
+
+  ///////////////////////////////////////////////////////////////////////////////////////
+  // The Newton iteration is converged when the reduced residual is small
+  ///////////////////////////////////////////////////////////////////////////////////////
+
+  double subGridResidualNorm(const bool & isAdjoint) {
+    // called once per Newton iteration, right after the assembly
+    hyper_assembly = have_basis && use_hyper && !isAdjoint;
+    if (!have_basis || isAdjoint) {
+      return SubGridFEM::subGridResidualNorm(isAdjoint);
+    }
+    vector<double> rr = this->projectVector(res, 0, hyper_assembly);
+    double resnorm = 0.0;
+    for (size_t i=0; i<rr.size(); i++) {
+      resnorm = std::max(resnorm, std::abs(rr[i]));
+    }
+    return resnorm;
+  }
+
+  ///////////////////////////////////////////////////////////////////////////////////////
+  // The basis only represents the forward solutions, so the adjoint is solved in full
+  ///////////////////////////////////////////////////////////////////////////////////////
+
+  void solveNewtonCorrection(const int & usernum, const double & alpha, const bool & isAdjoint) {
+    if (!have_basis || isAdjoint) {
+      if (use_hyper && !isAdjoint) {
+        res_snapshots.push_back(vector<double>((*res)[0], (*res)[0] + res->MyLength()));
+      }
+      SubGridFEM::solveNewtonCorrection(usernum, alpha, isAdjoint);
+      return;
+    }
+
+    this->factorReducedJacobian(hyper_assembly);
+    vector<double> y = this->projectVector(res, 0, hyper_assembly);
+    this->solveReduced(y);
+
+    du_glob->PutScalar(0.0);
+    du->PutScalar(0.0);
+    this->expandVector(y, du_glob, 0);
+    du->Import(*du_glob, *(importer), Add);
+  }
+
+  ///////////////////////////////////////////////////////////////////////////////////////
+  ///////////////////////////////////////////////////////////////////////////////////////
+
+  void solveSubGridSensitivities(vector_RCP & d_sub_res, vector_RCP & d_sub_u_over,
+                                 const int & usernum, const double & alpha, const bool & isAdjoint) {
+    if (!have_basis || isAdjoint) {
+      SubGridFEM::solveSubGridSensitivities(d_sub_res, d_sub_u_over, usernum, alpha, isAdjoint);
+      return;
+    }
+
+    // J is the Jacobian from the last Newton iteration
+    this->factorReducedJacobian(hyper_assembly);
+    for (int c=0; c<d_sub_res->NumVectors(); c++) {
+      vector<double> y = this->projectVector(d_sub_res, c, hyper_assembly);
+      this->solveReduced(y);
+      this->expandVector(y, d_sub_u_over, c);
+    }
+  }
+
+  ///////////////////////////////////////////////////////////////////////////////////////
+  // The reduced solves are done one macro-element at a time
+  ///////////////////////////////////////////////////////////////////////////////////////
+
+  bool useBatchSolver(const bool & isAdjoint, const bool & compute_sens,
+                      const bool & compute_disc_sens, const bool & compute_aux_sens) {
+    return false;
+  }
+
+  ///////////////////////////////////////////////////////////////////////////////////////
+  // Compute the POD basis (and the DEIM sample points) from the snapshots
+  ///////////////////////////////////////////////////////////////////////////////////////
+
+  void buildBasis() {
+
+    Teuchos::TimeMonitor localtimer(*sgromBasisTimer);
+
+    TEUCHOS_TEST_FOR_EXCEPTION(owned_map->NumMyElements() != overlapped_map->NumMyElements(),std::runtime_error,"Error: the ROM subgrid model requires the subgrid problems to be on a single processor");
+
+    int m = snapshots[0].size();
+    vector<double> Vvals;
+    this->computePOD(snapshots, energy, max_basis_size, Vvals, basis_size);
+
+    V = Teuchos::rcp(new Epetra_MultiVector(*(owned_map),basis_size));
+    for (int j=0; j<basis_size; j++) {
+      for (int i=0; i<m; i++) {
+        (*V)[j][i] = Vvals[i + m*j];
+      }
+    }
+
+    if (use_hyper) {
+      if (res_snapshots.size() == 0) {
+        use_hyper = false;
+      }
+      else {
+        int nmodes = num_hyper_modes;
+        if (nmodes < 0) {
+          nmodes = 2*basis_size;
+        }
+        vector<double> Uvals;
+        int numres = 0;
+        this->computePOD(res_snapshots, 1.0, nmodes, Uvals, numres);
+        this->computeDEIM(Uvals, m, numres);
+      }
+    }
+
+    have_basis = true;
+    snapshots.clear();
+    res_snapshots.clear();
+
+    if (use_hyper && cells.size() > 0 && cells[0].size() > 0) {
+      vector<bool> samples = this->findSampleCells(0);
+      double numsample = 0.0;
+      for (size_t e=0; e<samples.size(); e++) {
+        if (samples[e]) {
+          numsample += 1.0;
+        }
+      }
+      cost_estimate = numsample*(cells[0][0]->numElem)*time_steps;
+    }
+
+    if (subgridverbose > 5) {
+      cout << "***** Subgrid ROM basis size: " << basis_size << endl;
+      if (use_hyper) {
+        cout << "***** Subgrid ROM sample points: " << deim_index.size() << endl;
+      }
+    }
+  }
+
+  ///////////////////////////////////////////////////////////////////////////////////////
+  // Left singular vectors holding the requested fraction of the snapshot energy
+  ///////////////////////////////////////////////////////////////////////////////////////
+
+  void computePOD(const vector<vector<double> > & snaps, const double & frac, const int & maxsize,
+                  vector<double> & basis, int & numvecs) {
+
+    int m = snaps[0].size();
+    int n = snaps.size();
+    int mn = std::min(m,n);
+    vector<double> A(m*n);
+    for (int j=0; j<n; j++) {
+      for (int i=0; i<m; i++) {
+        A[i + m*j] = snaps[j][i];
+      }
+    }
+
+    vector<double> S(mn), U(m*mn), work(1);
+    double VT = 0.0, rwork = 0.0;
+    int info = 0;
+    lapack.GESVD('S', 'N', m, n, &A[0], m, &S[0], &U[0], m, &VT, 1, &work[0], -1, &rwork, &info);
+    int lwork = (int)work[0];
+    work.resize(lwork);
+    lapack.GESVD('S', 'N', m, n, &A[0], m, &S[0], &U[0], m, &VT, 1, &work[0], lwork, &rwork, &info);
+    TEUCHOS_TEST_FOR_EXCEPTION(info != 0,std::runtime_error,"Error: the SVD of the subgrid snapshots failed");
+
+    double total = 0.0;
+    for (int k=0; k<mn; k++) {
+      total += S[k]*S[k];
+    }
+    double captured = 0.0;
+    numvecs = 0;
+    while (numvecs < mn && S[numvecs] > 1.0e-12*S[0] && captured < frac*total) {
+      captured += S[numvecs]*S[numvecs];
+      numvecs++;
+    }
+    if (maxsize > 0) {
+      numvecs = std::min(numvecs,maxsize);
+    }
+    numvecs = std::max(numvecs,1);
+    basis.assign(U.begin(), U.begin() + m*numvecs);
+  }
+
+  ///////////////////////////////////////////////////////////////////////////////////////
+  // Greedy DEIM sample points for the residual basis U and the projection
+  // E = V^T U (P^T U)^{-1} that replaces V^T in the hyper-reduced problem
+  ///////////////////////////////////////////////////////////////////////////////////////
+
+  void computeDEIM(const vector<double> & U, const int & m, const int & r) {
+
+    deim_index.clear();
+    int info = 0;
+    for (int l=0; l<r; l++) {
+      vector<double> c(l);
+      if (l > 0) {
+        vector<double> A(l*l);
+        vector<int> ipiv(l);
+        for (int a=0; a<l; a++) {
+          for (int b=0; b<l; b++) {
+            A[a + l*b] = U[deim_index[a] + m*b];
+          }
+          c[a] = U[deim_index[a] + m*l];
+        }
+        lapack.GESV(l, 1, &A[0], l, &ipiv[0], &c[0], l, &info);
+        TEUCHOS_TEST_FOR_EXCEPTION(info != 0,std::runtime_error,"Error: the DEIM interpolation matrix is singular");
+      }
+      int maxind = 0;
+      double maxval = -1.0;
+      for (int j=0; j<m; j++) {
+        double rj = U[j + m*l];
+        for (int b=0; b<l; b++) {
+          rj -= U[j + m*b]*c[b];
+        }
+        if (std::abs(rj) > maxval) {
+          maxval = std::abs(rj);
+          maxind = j;
+        }
+      }
+      deim_index.push_back(maxind);
+    }
+
+    // solve (P^T U)^T E^T = U^T V
+    int k = basis_size;
+    vector<double> At(r*r), X(r*k);
+    vector<int> ipiv(r);
+    for (int a=0; a<r; a++) {
+      for (int b=0; b<r; b++) {
+        At[b + r*a] = U[deim_index[a] + m*b];
+      }
+    }
+    for (int b=0; b<r; b++) {
+      for (int i=0; i<k; i++) {
+        double val = 0.0;
+        for (int j=0; j<m; j++) {
+          val += U[j + m*b]*(*V)[i][j];
+        }
+        X[b + r*i] = val;
+      }
+    }
+    lapack.GESV(r, k, &At[0], r, &ipiv[0], &X[0], r, &info);
+    TEUCHOS_TEST_FOR_EXCEPTION(info != 0,std::runtime_error,"Error: the DEIM interpolation matrix is singular");
+
+    E = vector<double>(k*r);
+    for (int i=0; i<k; i++) {
+      for (int l=0; l<r; l++) {
+        E[i + k*l] = X[l + r*i];
+      }
+    }
+  }
+
+  ///////////////////////////////////////////////////////////////////////////////////////
+  // Sub-cells that contribute to a sample point
+  ///////////////////////////////////////////////////////////////////////////////////////
+
+  vector<bool> findSampleCells(const int & usernum) {
+    vector<bool> is_sample(owned_map->NumMyElements(), false);
+    for (size_t k=0; k<deim_index.size(); k++) {
+      is_sample[deim_index[k]] = true;
+    }
+    vector<bool> samples(cells[usernum].size(), false);
+    for (size_t e=0; e<cells[usernum].size(); e++) {
+      vector<vector<int> > & GIDs = cells[usernum][e]->GIDs;
+      for (size_t i=0; i<GIDs.size(); i++) {
+        for (size_t j=0; j<GIDs[i].size(); j++) {
+          int lid = owned_map->LID(GIDs[i][j]);
+          if (lid >= 0 && is_sample[lid]) {
+            samples[e] = true;
+          }
+        }
+      }
+    }
+    return samples;
+  }
+
+  ///////////////////////////////////////////////////////////////////////////////////////
+  // Reduced operators
+  ///////////////////////////////////////////////////////////////////////////////////////
+
+  // V^T r, or E P^T r for the hyper-reduced problem
+  vector<double> projectVector(const vector_RCP & r, const int & col, const bool & hyper) {
+    int k = basis_size;
+    vector<double> rr(k,0.0);
+    if (hyper) {
+      for (size_t l=0; l<deim_index.size(); l++) {
+        double rval = (*r)[col][deim_index[l]];
+        for (int i=0; i<k; i++) {
+          rr[i] += E[i + k*l]*rval;
+        }
+      }
+    }
+    else {
+      int m = r->MyLength();
+      for (int i=0; i<k; i++) {
+        double val = 0.0;
+        for (int j=0; j<m; j++) {
+          val += (*V)[i][j]*(*r)[col][j];
+        }
+        rr[i] = val;
+      }
+    }
+    return rr;
+  }
+
+  // v = V y
+  void expandVector(const vector<double> & y, vector_RCP & v, const int & col) {
+    int m = v->MyLength();
+    for (int j=0; j<m; j++) {
+      double val = 0.0;
+      for (int i=0; i<basis_size; i++) {
+        val += (*V)[i][j]*y[i];
+      }
+      (*v)[col][j] = val;
+    }
+  }
+
+  void factorReducedJacobian(const bool & hyper) {
+    int k = basis_size;
+    Teuchos::RCP<Epetra_MultiVector> JV = Teuchos::rcp(new Epetra_MultiVector(*(owned_map),k));
+    J->Multiply(false, *V, *JV);
+    Jr = vector<double>(k*k);
+    for (int j=0; j<k; j++) {
+      vector<double> col = this->projectVector(JV, j, hyper);
+      for (int i=0; i<k; i++) {
+        Jr[i + k*j] = col[i];
+      }
+    }
+    Jr_pivots = vector<int>(k);
+    int info = 0;
+    lapack.GETRF(k, k, &Jr[0], k, &Jr_pivots[0], &info);
+    TEUCHOS_TEST_FOR_EXCEPTION(info != 0,std::runtime_error,"Error: the reduced subgrid Jacobian is singular");
+  }
+
+  void solveReduced(vector<double> & y) {
+    int info = 0;
+    lapack.GETRS('N', basis_size, 1, &Jr[0], basis_size, &Jr_pivots[0], &y[0], basis_size, &info);
+    TEUCHOS_TEST_FOR_EXCEPTION(info != 0,std::runtime_error,"Error: the reduced subgrid solve failed");
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  ////////////////////////////////////////////////////////////////////////////////
+
+  int num_snapshots, max_basis_size, num_hyper_modes, basis_size;
+  double energy;
+  bool use_hyper, have_basis, hyper_assembly;
+  vector<vector<double> > snapshots, res_snapshots;
+  Teuchos::RCP<Epetra_MultiVector> V;     // POD basis (owned map)
+  vector<int> deim_index;                 // DEIM sample points (local indices)
+  vector<double> E;                       // basis_size x (number of samples)
+  vector<vector<bool> > sample_cells;
+  vector<double> Jr;                      // LU factors of the reduced Jacobian
+  vector<int> Jr_pivots;
+  Teuchos::LAPACK<int,double> lapack;
+
+  Teuchos::RCP<Teuchos::Time> sgromBasisTimer = Teuchos::TimeMonitor::getNewCounter("MILO::subgridROM::buildBasis()");
+
+};
+
+#endif
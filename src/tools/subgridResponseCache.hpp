@@ -0,0 +1,156 @@
+/***********************************************************************
+ Multiscale/Multiphysics Interfaces for Large-scale Optimization (MILO)
+
+ Copyright 2018 National Technology & Engineering Solutions of Sandia,
+ LLC (NTESS). Under the terms of Contract DE-NA0003525 with NTESS, the
+ U.S. Government retains certain rights in this software.”
+
+ Questions? Contact Tim Wildey (tmwilde@sandia.gov) and/or
+ Bart van Bloemen Waanders (bartv@sandia.gov)
+ ************************************************************************/
+
+#ifndef SUBGRIDRESPONSECACHE_H
+#define SUBGRIDRESPONSECACHE_H
+
+#include "trilinos.hpp"
+#include "preferences.hpp"
+#include <unordered_map>
+#include <algorithm>
+#include <climits>
+
+// Cache of subgrid responses (the contribution to the macro residual, with its
+// derivatives, and the final subgrid solution).
+// The key is a signature of everything the subgrid solve depends on: the macro
+// solution, the parameters, the time step, the macro-element geometry and, for
+// transient problems, the previous subgrid state.  The real values are quantized
+// with the cache tolerance, so two solves whose inputs agree to within the
+// tolerance (and fall in the same bins) share an entry.  Values too large (or not
+// finite) for a bin index are rejected and the solve is not cached.
+// The oldest entries are dropped once the cache is full.
+
+class SubGridResponseCache {
+public:
+
+  SubGridResponseCache() {} ;
+
+  ~SubGridResponseCache() {};
+
+  SubGridResponseCache(Teuchos::RCP<Teuchos::ParameterList> & settings) {
+    tol = settings->sublist("Solver").get<double>("Subgrid cache tolerance",1.0e-10);
+    maxsize = settings->sublist("Solver").get<int>("Subgrid cache size",10000);
+    TEUCHOS_TEST_FOR_EXCEPTION(tol <= 0.0,std::runtime_error,"Error: the subgrid cache tolerance must be positive");
+    TEUCHOS_TEST_FOR_EXCEPTION(maxsize < 1,std::runtime_error,"Error: the subgrid cache size must be positive");
+    next = 0;
+    hits = 0.0;
+    lookups = 0.0;
+  }
+
+  ///////////////////////////////////////////////////////////////////////////////////////
+  // Build a signature
+  ///////////////////////////////////////////////////////////////////////////////////////
+
+  bool addValue(vector<long> & signature, const double & val) {
+    double bin = val/tol;
+    if (!(std::abs(bin) < (double)LLONG_MAX)) { // also catches nan
+      return false;
+    }
+    signature.push_back(llround(bin));
+    return true;
+  }
+
+  void addInt(vector<long> & signature, const long & val) {
+    signature.push_back(val);
+  }
+
+  ///////////////////////////////////////////////////////////////////////////////////////
+  // Index of the entry with this signature (-1 if there is none)
+  ///////////////////////////////////////////////////////////////////////////////////////
+
+  int find(const vector<long> & signature) {
+    lookups += 1.0;
+    std::unordered_map<size_t, vector<size_t> >::iterator it = index.find(this->hash(signature));
+    if (it != index.end()) {
+      for (size_t k=0; k<it->second.size(); k++) {
+        if (entries[it->second[k]].signature == signature) {
+          hits += 1.0;
+          return it->second[k];
+        }
+      }
+    }
+    return -1;
+  }
+
+  ///////////////////////////////////////////////////////////////////////////////////////
+  ///////////////////////////////////////////////////////////////////////////////////////
+
+  void insert(const vector<long> & signature, const vector<AD> & macro_res, const vector_RCP & u) {
+    size_t slot = entries.size();
+    if ((int)entries.size() == maxsize) {
+      slot = next;
+      this->removeFromIndex(slot);
+      next = (next+1) % entries.size();
+    }
+    else {
+      entries.push_back(CacheEntry());
+    }
+    entries[slot].signature = signature;
+    entries[slot].macro_res = macro_res;
+    entries[slot].soln.assign((*u)[0], (*u)[0] + u->MyLength());
+    index[this->hash(signature)].push_back(slot);
+  }
+
+  const vector<AD> & getResidual(const int & slot) {
+    return entries[slot].macro_res;
+  }
+
+  void getSolution(const int & slot, vector_RCP & u) {
+    vector<double> & soln = entries[slot].soln;
+    for (size_t i=0; i<soln.size(); i++) {
+      (*u)[0][i] = soln[i];
+    }
+  }
+
+  ///////////////////////////////////////////////////////////////////////////////////////
+  ///////////////////////////////////////////////////////////////////////////////////////
+
+  void clear() {
+    entries.clear();
+    index.clear();
+    next = 0;
+  }
+
+  double hits, lookups;
+
+private:
+
+  struct CacheEntry {
+    vector<long> signature;
+    vector<AD> macro_res;
+    vector<double> soln;
+  };
+
+  size_t hash(const vector<long> & signature) {
+    size_t seed = signature.size();
+    for (size_t k=0; k<signature.size(); k++) {
+      seed ^= std::hash<long>()(signature[k]) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+    }
+    return seed;
+  }
+
+  void removeFromIndex(const size_t & slot) {
+    size_t key = this->hash(entries[slot].signature);
+    vector<size_t> & slots = index[key];
+    slots.erase(std::remove(slots.begin(), slots.end(), slot), slots.end());
+    if (slots.size() == 0) {
+      index.erase(key);
+    }
+  }
+
+  double tol;
+  int maxsize;
+  size_t next;
+  vector<CacheEntry> entries;
+  std::unordered_map<size_t, vector<size_t> > index; // signature hash -> slots
+
+};
+#endif
@@ -0,0 +1,145 @@
+/***********************************************************************
+ Multiscale/Multiphysics Interfaces for Large-scale Optimization (MILO)
+
+ Copyright 2018 National Technology & Engineering Solutions of Sandia,
+ LLC (NTESS). Under the terms of Contract DE-NA0003525 with NTESS, the
+ U.S. Government retains certain rights in this software.”
+
+ Questions? Contact Tim Wildey (tmwilde@sandia.gov) and/or
+ Bart van Bloemen Waanders (bartv@sandia.gov)
+ ************************************************************************/
+
+#ifndef SUBGRIDSOLUTIONHISTORY_H
+#define SUBGRIDSOLUTIONHISTORY_H
+
+#include "trilinos.hpp"
+#include "preferences.hpp"
+#include <unordered_map>
+
+// Time history of the subgrid solution (or adjoint) for one macro-element.
+// The entries are indexed by the macro time step, so an entry is found without
+// searching the history.  With a positive window, only the most recent entries
+// are kept and the storage is reused as a ring buffer.
+// Entries are accessed in the order they were added (0 is the oldest one kept).
+
+class SubGridSolutionHistory {
+public:
+
+  SubGridSolutionHistory() {} ;
+
+  ~SubGridSolutionHistory() {};
+
+  SubGridSolutionHistory(const double & t0_, const double & deltat_, const int & window_) :
+  t0(t0_), deltat(deltat_), window(window_), head(0) {}
+
+  ///////////////////////////////////////////////////////////////////////////////////////
+  ///////////////////////////////////////////////////////////////////////////////////////
+
+  size_t size() const {
+    return entries.size();
+  }
+
+  pair<double, vector_RCP> & operator[](const size_t & k) {
+    return entries[this->getSlot(k)];
+  }
+
+  pair<double, vector_RCP> & back() {
+    return entries[this->getSlot(entries.size()-1)];
+  }
+
+  ///////////////////////////////////////////////////////////////////////////////////////
+  // Index of the entry at this time (-1 if it is not stored)
+  ///////////////////////////////////////////////////////////////////////////////////////
+
+  int find(const double & time) {
+    if (deltat > 0.0) {
+      std::unordered_map<long,size_t>::iterator it = steps.find(this->getStep(time));
+      if (it != steps.end() && abs(entries[it->second].first - time) < 1.0e-10) {
+        return (it->second + entries.size() - head) % entries.size();
+      }
+      return -1;
+    }
+    for (size_t k=0; k<entries.size(); k++) {
+      if (abs(entries[this->getSlot(k)].first - time) < 1.0e-10) {
+        return k;
+      }
+    }
+    return -1;
+  }
+
+  ///////////////////////////////////////////////////////////////////////////////////////
+  // Add an entry (the oldest one is dropped when the window is full)
+  ///////////////////////////////////////////////////////////////////////////////////////
+
+  void push_back(const pair<double, vector_RCP> & entry) {
+    size_t slot = entries.size();
+    if (window > 0 && (int)entries.size() == window) {
+      slot = head;
+      steps.erase(this->getStep(entries[slot].first));
+      entries[slot] = entry;
+      head = (head+1) % entries.size();
+    }
+    else {
+      entries.push_back(entry);
+    }
+    if (deltat > 0.0) {
+      steps[this->getStep(entry.first)] = slot;
+    }
+  }
+
+  ///////////////////////////////////////////////////////////////////////////////////////
+  // Store a vector at this time, replacing the entry for the same time if there is one.
+  // The vectors are exchanged rather than copied: on return, vec holds the storage of
+  // the replaced (or dropped) entry, or a new vector.
+  ///////////////////////////////////////////////////////////////////////////////////////
+
+  void store(const double & time, vector_RCP & vec) {
+    int k = this->find(time);
+    if (k >= 0) {
+      pair<double, vector_RCP> & entry = entries[this->getSlot(k)];
+      entry.first = time;
+      std::swap(entry.second, vec);
+    }
+    else {
+      vector_RCP spare;
+      if (window > 0 && (int)entries.size() == window) {
+        spare = entries[head].second;
+      }
+      else {
+        spare = Teuchos::rcp(new Epetra_MultiVector(vec->Map(),1));
+      }
+      this->push_back(pair<double, vector_RCP>(time, vec));
+      vec = spare;
+    }
+  }
+
+  ///////////////////////////////////////////////////////////////////////////////////////
+  ///////////////////////////////////////////////////////////////////////////////////////
+
+  void clear() {
+    entries.clear();
+    steps.clear();
+    head = 0;
+  }
+
+private:
+
+  size_t getSlot(const size_t & k) {
+    if (window > 0) {
+      return (head + k) % entries.size();
+    }
+    return k;
+  }
+
+  long getStep(const double & time) {
+    return lround((time - t0)/deltat);
+  }
+
+  double t0, deltat;
+  int window;
+  size_t head;
+  vector<pair<double, vector_RCP> > entries;
+  std::unordered_map<long,size_t> steps; // macro time step -> slot
+
+};
+#endif
@@ -0,0 +1,223 @@
+/***********************************************************************
+ Multiscale/Multiphysics Interfaces for Large-scale Optimization (MILO)
+
+ Copyright 2018 National Technology & Engineering Solutions of Sandia,
+ LLC (NTESS). Under the terms of Contract DE-NA0003525 with NTESS, the
+ U.S. Government retains certain rights in this software.”
+
+ Questions? Contact Tim Wildey (tmwilde@sandia.gov) and/or
+ Bart van Bloemen Waanders (bartv@sandia.gov)
+ ************************************************************************/
+
+#ifndef SUBGRIDSTATEHISTORY_H
+#define SUBGRIDSTATEHISTORY_H
+
+#include "trilinos.hpp"
+#include "preferences.hpp"
+
+#include <unordered_map>
+
+// Forward subgrid states (and time derivatives) for every macro-element, macro
+// time step and subgrid time step.  The states are recorded by the forward solve
+// so the subgrid adjoint and the sensitivity computations do not need to solve
+// the forward subgrid problem again.  A later macro Newton iteration at the same
+// macro time overwrites the states of the earlier one, so the states that are kept
+// correspond to the converged macro solution.
+// With compression, the states are stored in single precision.
+// As in SubGridSolutionHistory, the macro steps are indexed by the macro time step.
+// The states of a macro step are released once the adjoint sweep is done with it.
+// With a memory limit, a macro step that does not fit is not stored, and the
+// forward subgrid problem is solved again when it is needed.
+
+class SubGridStateHistory {
+public:
+
+  SubGridStateHistory() {} ;
+
+  ~SubGridStateHistory() {};
+
+  SubGridStateHistory(Teuchos::RCP<Teuchos::ParameterList> & settings, const double & t0_,
+                      const double & deltat_) : t0(t0_), deltat(deltat_) {
+    compress = settings->sublist("Solver").get<bool>("Compress subgrid states",false);
+    double maxmem = settings->sublist("Solver").get<double>("Subgrid state memory (MB)",0.0); // 0 means no limit
+    max_bytes = (size_t)(maxmem*1024.0*1024.0);
+    stored_bytes = 0;
+  }
+
+  ///////////////////////////////////////////////////////////////////////////////////////
+  ///////////////////////////////////////////////////////////////////////////////////////
+
+  void addMacro() {
+    states.push_back(vector<pair<double, vector<StoredState> > >());
+    steps.push_back(std::unordered_map<long,size_t>());
+  }
+
+  ///////////////////////////////////////////////////////////////////////////////////////
+  // Store the state after subgrid time step tstep of the macro step ending at time
+  ///////////////////////////////////////////////////////////////////////////////////////
+
+  void store(const int & usernum, const double & time, const int & tstep,
+             const vector_RCP & u, const vector_RCP & u_dot) {
+    int tindex = this->getTimeIndex(usernum, time);
+    if (tindex < 0) {
+      states[usernum].push_back(pair<double, vector<StoredState> >(time, vector<StoredState>()));
+      tindex = states[usernum].size()-1;
+      if (deltat > 0.0) {
+        steps[usernum][this->getStep(time)] = tindex;
+      }
+    }
+    vector<StoredState> & curr = states[usernum][tindex].second;
+    if (tstep > 0 && ((int)curr.size() < tstep || !curr[tstep-1].filled)) {
+      return; // the earlier subgrid steps of this macro step were not stored
+    }
+    if ((int)curr.size() <= tstep) {
+      curr.resize(tstep+1);
+    }
+    size_t newbytes = 2*u->MyLength()*(compress ? sizeof(float) : sizeof(double));
+    size_t oldbytes = this->getBytes(curr[tstep]);
+    if (max_bytes > 0 && stored_bytes - oldbytes + newbytes > max_bytes) {
+      this->releaseStep(usernum, tindex);
+      return;
+    }
+    this->pack(u, curr[tstep].u, curr[tstep].u_f);
+    this->pack(u_dot, curr[tstep].u_dot, curr[tstep].u_dot_f);
+    curr[tstep].filled = true;
+    stored_bytes += this->getBytes(curr[tstep]) - oldbytes;
+  }
+
+  ///////////////////////////////////////////////////////////////////////////////////////
+  // Are all of the subgrid steps of this macro step available
+  ///////////////////////////////////////////////////////////////////////////////////////
+
+  bool have(const int & usernum, const double & time, const int & numsteps) {
+    int tindex = this->getTimeIndex(usernum, time);
+    if (tindex < 0) {
+      return false;
+    }
+    vector<StoredState> & curr = states[usernum][tindex].second;
+    if ((int)curr.size() < numsteps) {
+      return false;
+    }
+    for (int s=0; s<numsteps; s++) {
+      if (!curr[s].filled) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  ///////////////////////////////////////////////////////////////////////////////////////
+  ///////////////////////////////////////////////////////////////////////////////////////
+
+  void retrieve(const int & usernum, const double & time, const int & tstep,
+                vector_RCP & u, vector_RCP & u_dot) {
+    int tindex = this->getTimeIndex(usernum, time);
+    TEUCHOS_TEST_FOR_EXCEPTION(tindex < 0,std::runtime_error,"Error: subgrid state is not available for the requested time");
+    StoredState & curr = states[usernum][tindex].second[tstep];
+    this->unpack(curr.u, curr.u_f, u);
+    this->unpack(curr.u_dot, curr.u_dot_f, u_dot);
+  }
+
+  ///////////////////////////////////////////////////////////////////////////////////////
+  ///////////////////////////////////////////////////////////////////////////////////////
+
+  void clear() {
+    for (size_t k=0; k<states.size(); k++) {
+      states[k].clear();
+      steps[k].clear();
+    }
+    stored_bytes = 0;
+  }
+
+  ///////////////////////////////////////////////////////////////////////////////////////
+  // Free the states of the macro step ending at time (for every macro-element)
+  ///////////////////////////////////////////////////////////////////////////////////////
+
+  void release(const double & time) {
+    for (size_t k=0; k<states.size(); k++) {
+      int tindex = this->getTimeIndex(k, time);
+      if (tindex >= 0) {
+        this->releaseStep(k, tindex);
+      }
+    }
+  }
+
+private:
+
+  struct StoredState {
+    StoredState() : filled(false) {};
+    vector<double> u, u_dot;
+    vector<float> u_f, u_dot_f;
+    bool filled;
+  };
+
+  int getTimeIndex(const int & usernum, const double & time) {
+    if (deltat > 0.0) {
+      std::unordered_map<long,size_t>::iterator it = steps[usernum].find(this->getStep(time));
+      if (it != steps[usernum].end() && abs(states[usernum][it->second].first - time) < 1.0e-13) {
+        return it->second;
+      }
+      return -1;
+    }
+    for (size_t j=0; j<states[usernum].size(); j++) {
+      if (abs(states[usernum][j].first - time) < 1.0e-13) {
+        return j;
+      }
+    }
+    return -1;
+  }
+
+  size_t getBytes(const StoredState & state) {
+    return (state.u.size() + state.u_dot.size())*sizeof(double) +
+           (state.u_f.size() + state.u_dot_f.size())*sizeof(float);
+  }
+
+  void releaseStep(const int & usernum, const int & tindex) {
+    vector<StoredState> & curr = states[usernum][tindex].second;
+    for (size_t s=0; s<curr.size(); s++) {
+      stored_bytes -= this->getBytes(curr[s]);
+    }
+    vector<StoredState>().swap(curr);
+  }
+
+  long getStep(const double & time) {
+    return lround((time - t0)/deltat);
+  }
+
+  void pack(const vector_RCP & vec, vector<double> & dvals, vector<float> & fvals) {
+    int len = vec->MyLength();
+    if (compress) {
+      fvals.resize(len);
+      for (int i=0; i<len; i++) {
+        fvals[i] = (float)(*vec)[0][i];
+      }
+    }
+    else {
+      dvals.resize(len);
+      for (int i=0; i<len; i++) {
+        dvals[i] = (*vec)[0][i];
+      }
+    }
+  }
+
+  void unpack(const vector<double> & dvals, const vector<float> & fvals, vector_RCP & vec) {
+    if (compress) {
+      for (size_t i=0; i<fvals.size(); i++) {
+        (*vec)[0][i] = (double)fvals[i];
+      }
+    }
+    else {
+      for (size_t i=0; i<dvals.size(); i++) {
+        (*vec)[0][i] = dvals[i];
+      }
+    }
+  }
+
+  bool compress;
+  double t0, deltat;
+  size_t max_bytes, stored_bytes;
+  vector<vector<pair<double, vector<StoredState> > > > states;
+  vector<std::unordered_map<long,size_t> > steps; // macro time step -> index in states (for each usernum)
+
+};
+#endif
@@ -0,0 +1,45 @@
+/***********************************************************************
+ Multiscale/Multiphysics Interfaces for Large-scale Optimization (MILO)
+ 
+ Copyright 2018 National Technology & Engineering Solutions of Sandia,
+ LLC (NTESS). Under the terms of Contract DE-NA0003525 with NTESS, the
+ U.S. Government retains certain rights in this software.”
+ 
+ Questions? Contact Tim Wildey (tmwilde@sandia.gov) and/or
+ Bart van Bloemen Waanders (bartv@sandia.gov)
+ ************************************************************************/
+
+#ifndef THREADSUPPORT_H
+#define THREADSUPPORT_H
+
+#include "trilinos.hpp"
+#include "preferences.hpp"
+
+// Can subgrid problems be solved on more than one thread?
+// The concurrent solves call MPI, copy Teuchos::RCPs and start/stop Teuchos timers.
+// Each thread only uses its own timers (every thread copy of a subgrid model creates its
+// own), but this is only safe if MPI was initialized with MPI_THREAD_MULTIPLE (see driver.cpp),
+// the reference counts of Teuchos are thread safe and the timers are not also recorded
+// in the (global) stacked timer.
+// On return, reason says why threads cannot be used.
+
+static bool threadedSolvesSupported(string & reason) {
+  int provided;
+  MPI_Query_thread(&provided);
+  if (provided < MPI_THREAD_MULTIPLE) {
+    reason = "MPI does not support concurrent calls from multiple threads";
+    return false;
+  }
+#if !defined(HAVE_TEUCHOS_THREAD_SAFE)
+  reason = "Trilinos was not configured with Trilinos_ENABLE_THREAD_SAFE";
+  return false;
+#elif defined(HAVE_TEUCHOS_ADD_TIME_MONITOR_TO_STACKED_TIMER)
+  reason = "the Teuchos timers are also recorded in the stacked timer";
+  return false;
+#else
+  reason = "";
+  return true;
+#endif
+}
+
+#endif
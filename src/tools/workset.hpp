@@ -67,6 +67,9 @@ class workset {
     numip = ref_ip.dimension(0);
     numsideip = ref_side_ip.dimension(0);
     numsides = celltopo->getSideCount();
+    cellID = -1;
+    side_cellID = -1;
+    side_index = -1;
     
     time_KV = Kokkos::View<double*,AssemblyDevice>("time",1);
     //sidetype = Kokkos::View<int*,AssemblyDevice>("side types",numElem);
@@ -356,13 +359,16 @@ class workset {
   
   ////////////////////////////////////////////////////////////////////////////////////
   // Update the nodes and the basis functions at the volumetric ip
+  // cellID_ identifies the cells the ip belong to (-1 if not known)
   ////////////////////////////////////////////////////////////////////////////////////
   
-  void update(const DRV & ip_, const DRV & jacobian, const vector<vector<double> > & orientation) {
+  void update(const DRV & ip_, const DRV & jacobian, const vector<vector<double> > & orientation,
+              const int & cellID_ = -1) {
     
     {
       Teuchos::TimeMonitor updatetimer(*worksetUpdateIPTimer);
       ip = ip_;
+      cellID = cellID_;
       
       
       for (size_t i=0; i<numElem; i++) {
@@ -444,13 +450,16 @@ class workset {
   ////////////////////////////////////////////////////////////////////////////////////
   
   void updateSide(const DRV & nodes, const DRV & ip_side_, const DRV & wts_side_,
-                  const DRV & normals_, const DRV & sidejacobian, const int & s) {
+                  const DRV & normals_, const DRV & sidejacobian, const int & s,
+                  const int & cellID_ = -1) {
     
     
     {
       Teuchos::TimeMonitor updatetimer(*worksetSideUpdateIPTimer);
       
       ip_side = ip_side_;
+      side_cellID = cellID_;
+      side_index = s;
       wts_side = wts_side_;
       normals = normals_;
       
@@ -1253,6 +1262,9 @@ class workset {
   Kokkos::View<int****,AssemblyDevice> sideinfo;
   string sidename, var;
   int currentside;
+  // the cells (and side) whose geometry is in the workset (-1 if not known)
+  // these key the cached function values
+  int cellID, side_cellID, side_index;
   Kokkos::View<AD**,AssemblyDevice> res, adjrhs;
   Kokkos::View<AD***,AssemblyDevice> flux;
   //FCAD scratch, sidescratch;
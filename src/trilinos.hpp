@@ -28,6 +28,7 @@
 #include "Teuchos_YamlParameterListCoreHelpers.hpp"
 #include "Teuchos_Time.hpp"
 #include "Teuchos_TimeMonitor.hpp"
+#include "Teuchos_LAPACK.hpp"
 
 //Epetra includes
 #include "Epetra_Map.h"
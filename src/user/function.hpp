@@ -16,6 +16,44 @@
 #include "preferences.hpp"
 #include "workset.hpp"
 #include "term.hpp"
+#include "functionKernel.hpp"
+
+// Op codes of the compiled functions
+enum FunctionOp {FUNC_COPY, FUNC_PLUS, FUNC_MINUS, FUNC_TIMES, FUNC_DIVIDE, FUNC_POWER,
+                 FUNC_SIN, FUNC_COS, FUNC_TAN, FUNC_EXP, FUNC_LOG, FUNC_ABS,
+                 FUNC_MAX, FUNC_MIN, FUNC_MEAN, FUNC_LT, FUNC_LTE, FUNC_GT, FUNC_GTE,
+                 FUNC_LOAD};
+
+// Data types of the target and the source of an instruction
+enum FunctionOpType {FUNC_AD_AD, FUNC_AD_DOUBLE, FUNC_DOUBLE_DOUBLE};
+
+// One instruction of a compiled function: target = target op source
+// (FUNC_LOAD fills the target with its own scalar data)
+// The terms are given as (function index, term index) in the same block.
+
+struct FunctionInstruction {
+  
+  FunctionInstruction() {};
+  
+  FunctionInstruction(const int & op_, const int & type_, const size_t & findex_, const size_t & tindex_,
+                      const size_t & sfindex_, const size_t & stindex_) :
+  op(op_), type(type_), findex(findex_), tindex(tindex_), sfindex(sfindex_), stindex(stindex_) {};
+  
+  int op, type;
+  size_t findex, tindex, sfindex, stindex;
+};
+
+// Dependencies of a function (bit flags)
+// Functions that do not depend on the state can reuse their values (see FunctionInterface::evaluate)
+enum FunctionDependency {FUNC_DEP_STATE = 1, FUNC_DEP_TIME = 2, FUNC_DEP_PARAMS = 4, FUNC_DEP_GEOMETRY = 8};
+
+// Values of a function and the time and parameters they were computed with
+struct FunctionCacheEntry {
+  double time;
+  vector<AD> params;
+  FDATA data;
+  FDATAd ddata;
+};
 
 class function_class {
 public:
@@ -27,6 +65,8 @@ public:
                  const string & location_) :
   function_name(name), expression(expression_), dim0(dim0_), dim1(dim1_), location(location_) {
     
+    kernel = NULL;
+    
     term newt = term(expression);
     terms.push_back(newt);
   } ;
@@ -39,6 +79,17 @@ public:
   
   size_t dim0, dim1;
   vector<term> terms;
+  vector<FunctionInstruction> program; // set by FunctionInterface::compileFunctions
+  vector<FunctionInstruction> uniform_program; // spatially constant terms (run once per evaluation)
+  int dependencies; // FunctionDependency flags (set by FunctionInterface::decomposeFunctions)
+  std::map<std::pair<int,int>, FunctionCacheEntry> cache; // by the (cell ID, side) in the workset ((-1,-1) if independent)
+  
+  // compiled kernel (NULL if the function is interpreted) and its inputs
+  FunctionKernelPtr kernel;
+  vector<FunctionInstruction> kernel_program; // loads the time and parameters
+  vector<FDATA> kernel_ad_inputs;
+  vector<FDATAd> kernel_double_inputs;
+  
   string function_name, expression, location;
   bool isScalar, isStatic, onSide;
   
@@ -11,11 +11,14 @@
 
 #include "functionInterface.hpp"
 #include "interpreter.hpp"
+#include <dlfcn.h>
 
 FunctionInterface::FunctionInterface() {
   known_vars = {"x","y","z","t","nx","ny","nz","pi","h"};
   known_ops = {"sin","cos","exp","log","tan","abs","max","min","mean"};
   verbosity = 0;
+  cache_functions = false;
+  combine_passive = true;
 }
 
 
@@ -23,6 +26,36 @@ FunctionInterface::FunctionInterface(Teuchos::RCP<Teuchos::ParameterList> & sett
   known_vars = {"x","y","z","t","nx","ny","nz","pi","h"};
   known_ops = {"sin","cos","exp","log","tan","abs","max","min","mean"};
   verbosity = settings->get<int>("verbosity",0);
+  cache_functions = settings->sublist("Solver").get<bool>("Cache function values",false);
+  combine_passive = settings->sublist("Solver").get<bool>("Combine passive operands",true);
+  string kernel_library = settings->sublist("Solver").get<string>("Function kernel library","");
+  if (kernel_library != "") {
+    this->loadKernels(kernel_library);
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////////////////
+// Load the compiled function kernels (generated by functions_to_cpp)
+//////////////////////////////////////////////////////////////////////////////////////
+
+void FunctionInterface::loadKernels(const string & filename) {
+  void * handle = dlopen(filename.c_str(), RTLD_NOW);
+  TEUCHOS_TEST_FOR_EXCEPTION(handle == NULL,std::runtime_error,"Error: could not load the function kernel library: " + filename + " (" + string(dlerror()) + ")");
+  
+  FunctionKernelList getKernels = (FunctionKernelList) dlsym(handle, MILO_FUNCTION_KERNELS);
+  TEUCHOS_TEST_FOR_EXCEPTION(getKernels == NULL,std::runtime_error,"Error: " + filename + " is not a function kernel library");
+  
+  int lib_maxderivs = 0;
+  FunctionKernel * list = NULL;
+  int numkernels = getKernels(&lib_maxderivs, &list);
+  TEUCHOS_TEST_FOR_EXCEPTION(lib_maxderivs != maxDerivs,std::runtime_error,"Error: the function kernel library was compiled with a different maxDerivs");
+  
+  for (int k=0; k<numkernels; k++) {
+    kernels.push_back(list[k]);
+  }
+  if (verbosity > 0) {
+    cout << "Loaded " << numkernels << " function kernels from " << filename << endl;
+  }
 }
 
 //////////////////////////////////////////////////////////////////////////////////////
@@ -35,19 +68,20 @@ int FunctionInterface::addFunction(const string & fname, const string & expressi
   bool found = false;
   int findex = 0;
   
-  if (functions.size() <= blocknum) {
+  while (functions.size() <= blocknum) {
     vector<function_class> blockfun;
     functions.push_back(blockfun);
+    function_index.push_back(std::map<pair<string,string>,int>());
   }
-  for (size_t k=0; k<functions[blocknum].size(); k++) {
-    if (functions[blocknum][k].function_name == fname && functions[blocknum][k].location == location) {
-      found = true;
-      findex = k;
-    }
+  std::map<pair<string,string>,int>::iterator it = function_index[blocknum].find(pair<string,string>(fname,location));
+  if (it != function_index[blocknum].end()) {
+    found = true;
+    findex = it->second;
   }
   if (!found) {
     functions[blocknum].push_back(function_class(fname, expression, dim0, dim1, location));
     findex = functions[blocknum].size()-1;
+    function_index[blocknum][pair<string,string>(fname,location)] = findex;
   }
   return findex;
   
@@ -197,6 +231,8 @@ void FunctionInterface::decomposeFunctions() {
                   functions[b][fiter].terms[k].isScalar = true;
                   functions[b][fiter].terms[k].isConstant = true; // means in does not need to be copied every time
                   have_data = true;
+                  functions[b][fiter].terms[k].scalar_ddata = Kokkos::View<double*,AssemblyDevice>("scalar double data",1);
+                  functions[b][fiter].terms[k].scalar_ddata(0) = PI;
                   // Copy the data just once
                   Kokkos::View<double***,AssemblyDevice> tdata("scalar data",functions[b][fiter].dim0,functions[b][fiter].dim1,1);
                   functions[b][fiter].terms[k].ddata = Kokkos::subview(tdata, Kokkos::ALL(), Kokkos::ALL(), 0);
@@ -514,6 +550,9 @@ void FunctionInterface::decomposeFunctions() {
       }
     }
     
+    // Replace the terms that only depend on constants by their values
+    this->foldConstants(b);
+    
     // After all of the functions have been decomposed, we can determine if we need to use arrays of ScalarT or AD
     // Only the roots should be designated as ScalarT or AD at this point
     
@@ -539,7 +578,217 @@ void FunctionInterface::decomposeFunctions() {
         //functions[k].terms[j].print();
       }
     }
+    
+    // Spatially constant terms are evaluated once (into the scalar data) and then copied to the points
+    for (size_t k=0; k<functions[b].size(); k++) {
+      for (size_t j=0; j<functions[b][k].terms.size(); j++) {
+        functions[b][k].terms[j].isUniform = isUniformTerm(b,k,j);
+        if (functions[b][k].terms[j].isUniform && !functions[b][k].terms[j].isRoot && !functions[b][k].terms[j].isFunc) {
+          if (functions[b][k].terms[j].isAD) {
+            functions[b][k].terms[j].scalar_data = Kokkos::View<AD*,AssemblyDevice>("scalar data",1);
+          }
+          else {
+            functions[b][k].terms[j].scalar_ddata = Kokkos::View<double*,AssemblyDevice>("scalar double data",1);
+          }
+        }
+      }
+      functions[b][k].dependencies = this->getDependencies(b,k,0);
+    }
+    
+    this->shareTerms(b);
+  }
+  
+  this->compileFunctions();
+}
+
+//////////////////////////////////////////////////////////////////////////////////////
+// Constant folding
+// A term that only depends on numbers and pi is replaced by a root with its value,
+// so it is not evaluated again (e.g., 2.0*pi*3.0)
+//////////////////////////////////////////////////////////////////////////////////////
+
+void FunctionInterface::foldConstants(const size_t & block) {
+  for (size_t k=0; k<functions[block].size(); k++) {
+    for (size_t j=0; j<functions[block][k].terms.size(); j++) {
+      this->foldTerm(block, k, j);
+    }
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////////////////
+// Fold a term (and its dependencies) and return true if it is a constant
+//////////////////////////////////////////////////////////////////////////////////////
+
+bool FunctionInterface::foldTerm(const size_t & block, const size_t & findex, const size_t & tindex) {
+  
+  if (functions[block][findex].terms[tindex].isRoot) {
+    return (functions[block][findex].terms[tindex].isScalar && functions[block][findex].terms[tindex].isConstant);
+  }
+  
+  double value = 0.0;
+  bool isconst = true;
+  if (functions[block][findex].terms[tindex].isFunc) {
+    int funcIndex = functions[block][findex].terms[tindex].funcIndex;
+    isconst = this->foldTerm(block, funcIndex, 0);
+    if (isconst) {
+      value = functions[block][funcIndex].terms[0].scalar_ddata(0);
+    }
+  }
+  else {
+    for (size_t k=0; k<functions[block][findex].terms[tindex].dep_list.size(); k++) {
+      int dep = functions[block][findex].terms[tindex].dep_list[k];
+      bool depconst = this->foldTerm(block, findex, dep);
+      if (!depconst || isReduction(functions[block][findex].terms[tindex].dep_ops[k])) {
+        isconst = false;
+      }
+    }
+    if (isconst) {
+      for (size_t k=0; k<functions[block][findex].terms[tindex].dep_list.size(); k++) {
+        int dep = functions[block][findex].terms[tindex].dep_list[k];
+        value = applyConstantOp(value, functions[block][findex].terms[dep].scalar_ddata(0),
+                                functions[block][findex].terms[tindex].dep_ops[k]);
+      }
+    }
   }
+  
+  if (isconst) {
+    term & cterm = functions[block][findex].terms[tindex];
+    cterm.isRoot = true;
+    cterm.isFunc = false;
+    cterm.isAD = false;
+    cterm.isScalar = true;
+    cterm.isConstant = true;
+    cterm.dep_list.clear();
+    cterm.dep_ops.clear();
+    cterm.scalar_ddata = Kokkos::View<double*,AssemblyDevice>("scalar double data",1);
+    cterm.scalar_ddata(0) = value;
+    
+    Kokkos::View<double***,AssemblyDevice> tdata("scalar data",functions[block][findex].dim0,functions[block][findex].dim1,1);
+    cterm.ddata = Kokkos::subview(tdata, Kokkos::ALL(), Kokkos::ALL(), 0);
+    for (size_t k2=0; k2<functions[block][findex].dim0; k2++) {
+      for (size_t j2=0; j2<functions[block][findex].dim1; j2++) {
+        cterm.ddata(k2,j2) = value;
+      }
+    }
+  }
+  return isconst;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////
+// Determine if a term has the same value at every point (element and ip)
+// The reductions (max, min, mean) are always evaluated at the points.
+//////////////////////////////////////////////////////////////////////////////////////
+
+bool FunctionInterface::isUniformTerm(const size_t & block, const int & findex, const int & tindex) {
+  bool is_uniform = true;
+  if (functions[block][findex].terms[tindex].isRoot) {
+    is_uniform = functions[block][findex].terms[tindex].isScalar;
+  }
+  else if (functions[block][findex].terms[tindex].isFunc) {
+    int funcIndex = functions[block][findex].terms[tindex].funcIndex;
+    is_uniform = isUniformTerm(block, funcIndex, 0) && !functions[block][funcIndex].terms[0].isAD;
+  }
+  else {
+    for (size_t k=0; k<functions[block][findex].terms[tindex].dep_list.size(); k++) {
+      bool depcheck = isUniformTerm(block, findex, functions[block][findex].terms[tindex].dep_list[k]);
+      if (!depcheck || isReduction(functions[block][findex].terms[tindex].dep_ops[k])) {
+        is_uniform = false;
+      }
+    }
+  }
+  return is_uniform;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////
+// Determine what a term depends on (FunctionDependency flags)
+// Called after constant folding, so the folded terms have no dependencies
+//////////////////////////////////////////////////////////////////////////////////////
+
+int FunctionInterface::getDependencies(const size_t & block, const size_t & findex, const size_t & tindex) {
+  int deps = 0;
+  term & cterm = functions[block][findex].terms[tindex];
+  if (cterm.isRoot) {
+    string expr = cterm.expression;
+    if (cterm.isScalar && cterm.isConstant) { // numbers and pi
+      deps = 0;
+    }
+    else if (expr == "t") {
+      deps = FUNC_DEP_TIME;
+    }
+    else if (expr == "x" || expr == "y" || expr == "z" || expr == "nx" || expr == "ny" || expr == "nz" || expr == "h") {
+      deps = FUNC_DEP_GEOMETRY;
+    }
+    else if (cterm.isScalar) { // parameters
+      deps = FUNC_DEP_PARAMS;
+    }
+    else { // variables and discretized parameters
+      deps = FUNC_DEP_STATE;
+    }
+  }
+  else if (cterm.isFunc) {
+    deps = this->getDependencies(block, cterm.funcIndex, 0);
+  }
+  else {
+    for (size_t k=0; k<cterm.dep_list.size(); k++) {
+      deps = deps | this->getDependencies(block, findex, cterm.dep_list[k]);
+    }
+  }
+  return deps;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////
+
+bool FunctionInterface::dependsOnGeometry() {
+  for (size_t b=0; b<functions.size(); b++) {
+    for (size_t k=0; k<functions[b].size(); k++) {
+      if (functions[b][k].dependencies & FUNC_DEP_GEOMETRY) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////
+// Share the data of identical terms in a block (hash-consing)
+// Terms with the same expression at the same location have the same value, so they
+// can use the same data, and compileTerm only evaluates one of them in a program.
+// The first term of a function holds its result and is never shared.
+//////////////////////////////////////////////////////////////////////////////////////
+
+void FunctionInterface::shareTerms(const size_t & block) {
+  std::map<string,pair<size_t,size_t> > shared;
+  for (size_t k=0; k<functions[block].size(); k++) {
+    for (size_t j=1; j<functions[block][k].terms.size(); j++) {
+      if (!functions[block][k].terms[j].isFunc) {
+        string key = this->getTermKey(block, k, j);
+        std::map<string,pair<size_t,size_t> >::iterator it = shared.find(key);
+        if (it == shared.end()) {
+          shared[key] = pair<size_t,size_t>(k,j);
+        }
+        else {
+          term & first = functions[block][it->second.first].terms[it->second.second];
+          functions[block][k].terms[j].data = first.data;
+          functions[block][k].terms[j].ddata = first.ddata;
+          functions[block][k].terms[j].scalar_data = first.scalar_data;
+          functions[block][k].terms[j].scalar_ddata = first.scalar_ddata;
+        }
+      }
+    }
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////////////////
+// Key that identifies the value of a term within a block
+//////////////////////////////////////////////////////////////////////////////////////
+
+string FunctionInterface::getTermKey(const size_t & block, const size_t & findex, const size_t & tindex) {
+  if (tindex == 0) {
+    return "function " + std::to_string(findex);
+  }
+  return functions[block][findex].location + " " + std::to_string(functions[block][findex].dim0) + " " +
+         std::to_string(functions[block][findex].dim1) + " " + functions[block][findex].terms[tindex].expression;
 }
 
 //////////////////////////////////////////////////////////////////////////////////////
@@ -568,202 +817,719 @@ bool FunctionInterface::isScalarTerm(const size_t & block, const int & findex, c
 }
 
 //////////////////////////////////////////////////////////////////////////////////////
-// Evaluate a function (probably will be deprecated)
+// Get the index of a function (the index returned by addFunction)
+//////////////////////////////////////////////////////////////////////////////////////
+
+int FunctionInterface::getFunctionIndex(const string & fname, const string & location,
+                                        const size_t & block) {
+  int findex = -1;
+  if (block < function_index.size()) {
+    std::map<pair<string,string>,int>::iterator it = function_index[block].find(pair<string,string>(fname,location));
+    if (it != function_index[block].end()) {
+      findex = it->second;
+    }
+  }
+  // meaning that the requested function was not registered at this location
+  TEUCHOS_TEST_FOR_EXCEPTION(findex == -1,std::runtime_error,"Error: function manager could not evaluate: " + fname + " at " + location);
+  return findex;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////
+// Evaluate a function by name (looks up the index on every call)
 //////////////////////////////////////////////////////////////////////////////////////
 
 FDATA FunctionInterface::evaluate(const string & fname, const string & location,
                                   const size_t & block) {
+  return this->evaluate(this->getFunctionIndex(fname, location, block), block);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////
+// Evaluate a function by index
+//////////////////////////////////////////////////////////////////////////////////////
+
+FDATA FunctionInterface::evaluate(const int & findex, const size_t & block) {
   Teuchos::TimeMonitor ttimer(*evaluateTimer);
   
   if (verbosity > 10) {
     cout << endl;
-    cout << "Evaluating: " << fname << " at " << location << endl;
+    cout << "Evaluating: " << functions[block][findex].function_name << " at " << functions[block][findex].location << endl;
   }
   
-  int findex = -1;
-  for (size_t i=0; i<functions[block].size(); i++) {
-    if (fname == functions[block][i].function_name && functions[block][i].location == location) {
-      evaluate(block,i,0);
-      findex = i;
+  // Functions that do not depend on the state are cached for each geometry in the workset
+  // (identified by the cell ID, and the side, that the cells pass to the workset)
+  bool usecache = false;
+  std::pair<int,int> geokey(-1,-1);
+  if (cache_functions && !(functions[block][findex].dependencies & FUNC_DEP_STATE)) {
+    usecache = true;
+    if (functions[block][findex].dependencies & FUNC_DEP_GEOMETRY) {
+      if (functions[block][findex].location == "ip") {
+        geokey = std::make_pair(wkset->cellID, -1);
+      }
+      else if (functions[block][findex].location == "side ip") {
+        geokey = std::make_pair(wkset->side_cellID, wkset->side_index);
+      }
+      if (geokey.first < 0) { // e.g., point evaluations or unknown cells
+        usecache = false;
+      }
     }
   }
   
-  if (verbosity > 10) {
-    cout << "Finished evaluating: " << fname << " at " << location << endl;
+  if (usecache) {
+    std::map<std::pair<int,int>, FunctionCacheEntry>::iterator it = functions[block][findex].cache.find(geokey);
+    if (it != functions[block][findex].cache.end() && this->isCached(block, findex, it->second)) {
+      FDATA cdata = it->second.data;
+      FDATAd cddata = it->second.ddata;
+      if (functions[block][findex].terms[0].isAD || functions[block][findex].kernel != NULL) {
+        parallel_for(RangePolicy<AssemblyDevice>(0,functions[block][findex].dim0), KOKKOS_LAMBDA (const int e ) {
+          for (int n=0; n<functions[block][findex].dim1; n++) {
+            functions[block][findex].terms[0].data(e,n) = cdata(e,n);
+          }
+        });
+      }
+      else {
+        parallel_for(RangePolicy<AssemblyDevice>(0,functions[block][findex].dim0), KOKKOS_LAMBDA (const int e ) {
+          for (int n=0; n<functions[block][findex].dim1; n++) {
+            functions[block][findex].terms[0].data(e,n) = cddata(e,n);
+          }
+        });
+      }
+      return functions[block][findex].terms[0].data;
+    }
   }
   
-  if (findex == -1) { // meaning that the requested function was not registered at this location
-    TEUCHOS_TEST_FOR_EXCEPTION(true,std::runtime_error,"Error: function manager could not evaluate: " + fname + " at " + location);
-  }
+  this->evaluateProgram(block,findex);
   
+  if (verbosity > 10) {
+    cout << "Finished evaluating: " << functions[block][findex].function_name << endl;
+  }
   
-  if (!functions[block][findex].terms[0].isAD) {
+  if (!functions[block][findex].terms[0].isAD && functions[block][findex].kernel == NULL) { // kernels fill data
     parallel_for(RangePolicy<AssemblyDevice>(0,functions[block][findex].dim0), KOKKOS_LAMBDA (const int e ) {
       for (int n=0; n<functions[block][findex].dim1; n++) {
         functions[block][findex].terms[0].data(e,n) = functions[block][findex].terms[0].ddata(e,n);
       }
     });
   }
+  
+  if (usecache) {
+    this->storeCache(block, findex, geokey);
+  }
   return functions[block][findex].terms[0].data;
   
 }
 
 //////////////////////////////////////////////////////////////////////////////////////
-// Evaluate a function
+// Are the cached values current (same time and parameters)
 //////////////////////////////////////////////////////////////////////////////////////
 
-void FunctionInterface::evaluate(const size_t & block, const size_t & findex, const size_t & tindex) {
-  
-  if (verbosity > 10) {
-    cout << "------- Evaluating: " << functions[block][findex].terms[tindex].expression << endl;
+bool FunctionInterface::isCached(const size_t & block, const size_t & findex, const FunctionCacheEntry & entry) {
+  if ((functions[block][findex].dependencies & FUNC_DEP_TIME) && entry.time != wkset->time_KV(0)) {
+    return false;
   }
-  
-  //functions[block][findex].terms[tindex].print();
-  
-  if (functions[block][findex].terms[tindex].isRoot) {
-    if (functions[block][findex].terms[tindex].isScalar && !functions[block][findex].terms[tindex].isConstant) {
-      if (functions[block][findex].terms[tindex].isAD) {
-        parallel_for(RangePolicy<AssemblyDevice>(0,functions[block][findex].dim0), KOKKOS_LAMBDA (const int e ) {
-          for (int n=0; n<functions[block][findex].dim1; n++) {
-            functions[block][findex].terms[tindex].data(e,n) = functions[block][findex].terms[tindex].scalar_data(0);
+  if (functions[block][findex].dependencies & FUNC_DEP_PARAMS) {
+    if (entry.params.size() != wkset->params_AD.size()) {
+      return false;
+    }
+    size_t p = 0;
+    for (size_t i=0; i<wkset->params_AD.dimension(0); i++) {
+      for (size_t j=0; j<wkset->params_AD.dimension(1); j++) {
+        const AD & val = wkset->params_AD(i,j);
+        if (val.val() != entry.params[p].val()) {
+          return false;
+        }
+        for (int d=0; d<val.size(); d++) { // the seeds may change (e.g., for sensitivities)
+          if (val.fastAccessDx(d) != entry.params[p].fastAccessDx(d)) {
+            return false;
           }
-        });
+        }
+        p++;
       }
-      else {
-        parallel_for(RangePolicy<AssemblyDevice>(0,functions[block][findex].dim0), KOKKOS_LAMBDA (const int e ) {
-          for (int n=0; n<functions[block][findex].dim1; n++) {
-            functions[block][findex].terms[tindex].ddata(e,n) = functions[block][findex].terms[tindex].scalar_ddata(0);
-          }
-        });
+    }
+  }
+  return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////
+// Store the values of a function (just evaluated) in its cache
+//////////////////////////////////////////////////////////////////////////////////////
+
+void FunctionInterface::storeCache(const size_t & block, const size_t & findex, const std::pair<int,int> & geokey) {
+  FunctionCacheEntry & entry = functions[block][findex].cache[geokey];
+  size_t dim0 = functions[block][findex].dim0;
+  size_t dim1 = functions[block][findex].dim1;
+  if (functions[block][findex].terms[0].isAD || functions[block][findex].kernel != NULL) {
+    if (entry.data.dimension(0) != dim0) {
+      entry.data = Kokkos::View<AD**,AssemblyDevice>("cached function data",dim0,dim1);
+    }
+    FDATA cdata = entry.data;
+    parallel_for(RangePolicy<AssemblyDevice>(0,dim0), KOKKOS_LAMBDA (const int e ) {
+      for (size_t n=0; n<dim1; n++) {
+        cdata(e,n) = functions[block][findex].terms[0].data(e,n);
       }
+    });
+  }
+  else {
+    if (entry.ddata.dimension(0) != dim0) {
+      entry.ddata = Kokkos::View<double**,AssemblyDevice>("cached function data",dim0,dim1);
     }
+    FDATAd cddata = entry.ddata;
+    parallel_for(RangePolicy<AssemblyDevice>(0,dim0), KOKKOS_LAMBDA (const int e ) {
+      for (size_t n=0; n<dim1; n++) {
+        cddata(e,n) = functions[block][findex].terms[0].ddata(e,n);
+      }
+    });
   }
-  else if (functions[block][findex].terms[tindex].isFunc) {
-    int funcIndex = functions[block][findex].terms[tindex].funcIndex;
-    evaluate(block, funcIndex, 0);
+  entry.time = wkset->time_KV(0);
+  entry.params.clear();
+  for (size_t i=0; i<wkset->params_AD.dimension(0); i++) {
+    for (size_t j=0; j<wkset->params_AD.dimension(1); j++) {
+      entry.params.push_back(wkset->params_AD(i,j));
+    }
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////////////////
+// Clear the cached values (needed if the cells or their geometry change)
+//////////////////////////////////////////////////////////////////////////////////////
+
+void FunctionInterface::clearCache() {
+  for (size_t b=0; b<functions.size(); b++) {
+    for (size_t k=0; k<functions[b].size(); k++) {
+      functions[b][k].cache.clear();
+    }
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////////////////
+// Compile the evaluation trees into flat programs
+// A program lists the operations of a function in the order the evaluation tree
+// applies them, with integer op codes.  The terms of the functions that are called
+// are inlined, so a function is evaluated with one loop over the elements.
+// The spatially constant terms go into a separate program that is run once, and each
+// term (or shared term, see shareTerms) is evaluated only once in a program.
+//////////////////////////////////////////////////////////////////////////////////////
+
+void FunctionInterface::compileFunctions() {
+  for (size_t b=0; b<functions.size(); b++) {
+    for (size_t k=0; k<functions[b].size(); k++) {
+      functions[b][k].program.clear();
+      functions[b][k].uniform_program.clear();
+      std::set<string> compiled;
+      this->compileTerm(b, k, 0, functions[b][k], compiled);
+      if (kernels.size() > 0) {
+        this->bindKernel(b, k);
+      }
+    }
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////////////////
+// Use a compiled kernel for a function (if one was generated from the same expression)
+// The kernel inlines the functions it calls, so these need to be the same as well.
+//////////////////////////////////////////////////////////////////////////////////////
+
+void FunctionInterface::bindKernel(const size_t & block, const size_t & findex) {
+  
+  function_class & fn = functions[block][findex];
+  fn.kernel = NULL;
+  fn.kernel_program.clear();
+  fn.kernel_ad_inputs.clear();
+  fn.kernel_double_inputs.clear();
+  
+  int kindex = -1;
+  for (size_t k=0; k<kernels.size(); k++) {
+    if (fn.function_name == kernels[k].name && fn.expression == kernels[k].expression) {
+      kindex = k;
+    }
+  }
+  if (kindex < 0) {
+    return;
+  }
+  FunctionKernel & kern = kernels[kindex];
+  
+  for (int c=0; c<kern.num_calls; c++) {
+    std::map<pair<string,string>,int>::iterator it = function_index[block].find(pair<string,string>(kern.calls[2*c],fn.location));
+    if (it == function_index[block].end() || functions[block][it->second].expression != kern.calls[2*c+1]) {
+      return;
+    }
+  }
+  
+  // the inputs are the roots with the same names
+  vector<FunctionInstruction> loads;
+  for (int i=0; i<kern.num_ad_inputs + kern.num_double_inputs; i++) {
+    bool isAD = (i < kern.num_ad_inputs);
+    string name = isAD ? kern.ad_inputs[i] : kern.double_inputs[i-kern.num_ad_inputs];
+    size_t rf = 0, rt = 0;
+    if (!this->findRootTerm(block, findex, name, rf, rt) || functions[block][rf].terms[rt].isAD != isAD) {
+      return;
+    }
+    term & root = functions[block][rf].terms[rt];
+    if (root.isScalar && !root.isConstant) {
+      loads.push_back(FunctionInstruction(FUNC_LOAD, isAD ? FUNC_AD_AD : FUNC_DOUBLE_DOUBLE, rf, rt, rf, rt));
+    }
+    if (isAD) {
+      fn.kernel_ad_inputs.push_back(root.data);
+    }
+    else {
+      fn.kernel_double_inputs.push_back(root.ddata);
+    }
+  }
+  
+  fn.kernel_program = loads;
+  fn.kernel = kern.evaluate;
+  if (verbosity > 10) {
+    cout << "Using the compiled kernel for: " << fn.function_name << " at " << fn.location << endl;
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////////////////
+// Find a root term by name in a function or the functions it calls
+//////////////////////////////////////////////////////////////////////////////////////
+
+bool FunctionInterface::findRootTerm(const size_t & block, const size_t & findex, const string & name,
+                                     size_t & rf, size_t & rt) {
+  for (size_t j=0; j<functions[block][findex].terms.size(); j++) {
+    term & cterm = functions[block][findex].terms[j];
+    if (cterm.isRoot && cterm.expression == name) {
+      rf = findex;
+      rt = j;
+      return true;
+    }
+  }
+  for (size_t j=0; j<functions[block][findex].terms.size(); j++) {
+    term & cterm = functions[block][findex].terms[j];
+    if (cterm.isFunc && this->findRootTerm(block, cterm.funcIndex, name, rf, rt)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////
+// Append the instructions of a term (and its dependencies) to a program
+// On return, the data (or ddata) of the term holds its value at every point
+//////////////////////////////////////////////////////////////////////////////////////
+
+void FunctionInterface::compileTerm(const size_t & block, const size_t & findex, const size_t & tindex,
+                                    function_class & fn, std::set<string> & compiled) {
+  
+  term & cterm = functions[block][findex].terms[tindex];
+  
+  if (cterm.isFunc && !cterm.isUniform) {
+    int funcIndex = cterm.funcIndex;
+    this->compileTerm(block, funcIndex, 0, fn, compiled);
     if (functions[block][findex].terms[0].isAD) {
-      functions[block][findex].terms[tindex].data = functions[block][funcIndex].terms[0].data;
+      cterm.data = functions[block][funcIndex].terms[0].data;
     }
     else {
-      functions[block][findex].terms[tindex].ddata = functions[block][funcIndex].terms[0].ddata;
+      cterm.ddata = functions[block][funcIndex].terms[0].ddata;
     }
+    return;
   }
-  else {
-    bool isAD = functions[block][findex].terms[tindex].isAD;
-    for (size_t k=0; k<functions[block][findex].terms[tindex].dep_list.size(); k++) {
+  
+  if (cterm.isRoot && (!cterm.isScalar || cterm.isConstant)) { // nothing to evaluate
+    return;
+  }
+  
+  string key = this->getTermKey(block, findex, tindex);
+  if (cterm.isFunc) { // the copy is not shared with other terms
+    key = "call " + std::to_string(findex) + " " + std::to_string(tindex);
+  }
+  if (compiled.count(key) > 0) {
+    return;
+  }
+  compiled.insert(key);
+  
+  if (cterm.isUniform) {
+    // evaluate once and copy to the points
+    this->compileUniformTerm(block, findex, tindex, fn, compiled);
+    int type = FUNC_DOUBLE_DOUBLE;
+    if (cterm.isAD) {
+      type = FUNC_AD_AD;
+    }
+    fn.program.push_back(FunctionInstruction(FUNC_LOAD, type, findex, tindex, findex, tindex));
+  }
+  else if (!this->compileMixedTerm(block, findex, tindex, fn, compiled)) {
+    bool isAD = cterm.isAD;
+    for (size_t k=0; k<cterm.dep_list.size(); k++) {
       
-      int dep = functions[block][findex].terms[tindex].dep_list[k];
-      evaluate(block, findex, dep);
+      int dep = cterm.dep_list[k];
+      this->compileTerm(block, findex, dep, fn, compiled);
       
-      bool termisAD = functions[block][findex].terms[dep].isAD;
+      int type = FUNC_DOUBLE_DOUBLE; // termisAD must also be false
       if (isAD) {
-        if (termisAD) {
-          evaluateOp(functions[block][findex].terms[tindex].data,
-                     functions[block][findex].terms[dep].data,
-                     functions[block][findex].terms[tindex].dep_ops[k]);
-          
+        if (functions[block][findex].terms[dep].isAD) {
+          type = FUNC_AD_AD;
         }
         else {
-          evaluateOp(functions[block][findex].terms[tindex].data,
-                     functions[block][findex].terms[dep].ddata,
-                     functions[block][findex].terms[tindex].dep_ops[k]);
+          type = FUNC_AD_DOUBLE;
         }
       }
-      else { // termisAD must also be false
-        evaluateOp(functions[block][findex].terms[tindex].ddata,
-                   functions[block][findex].terms[dep].ddata,
-                   functions[block][findex].terms[tindex].dep_ops[k]);
+      int op = this->getOpCode(cterm.dep_ops[k]);
+      fn.program.push_back(FunctionInstruction(op, type, findex, tindex, findex, dep));
+    }
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////////////////
+// Compile a sum or product of AD and double terms
+// The passive (double) operands are combined first, in the double data of the term,
+// so the AD arithmetic is only done for the active operands and once for the rest.
+// Returns false (and appends nothing) if the term is not a sum or product with at
+// least two passive operands, or if combine_passive is off.
+//////////////////////////////////////////////////////////////////////////////////////
+
+bool FunctionInterface::compileMixedTerm(const size_t & block, const size_t & findex, const size_t & tindex,
+                                         function_class & fn, std::set<string> & compiled) {
+  
+  term & cterm = functions[block][findex].terms[tindex];
+  if (!combine_passive || !cterm.isAD) {
+    return false;
+  }
+  
+  bool additive = true, multiplicative = true;
+  vector<size_t> passive, active;
+  for (size_t k=0; k<cterm.dep_list.size(); k++) {
+    string op = cterm.dep_ops[k];
+    if (k == 0 && op != "") { // unary operator
+      return false;
+    }
+    if (k > 0 && op != "plus" && op != "minus") {
+      additive = false;
+    }
+    if (k > 0 && op != "times" && op != "divide") {
+      multiplicative = false;
+    }
+    if (functions[block][findex].terms[cterm.dep_list[k]].isAD) {
+      active.push_back(k);
+    }
+    else {
+      passive.push_back(k);
+    }
+  }
+  if ((!additive && !multiplicative) || passive.size() < 2) {
+    return false;
+  }
+  
+  if (cterm.ddata.dimension(0) == 0) {
+    Kokkos::View<double***,AssemblyDevice> tdata("passive data",functions[block][findex].dim0,functions[block][findex].dim1,1);
+    cterm.ddata = Kokkos::subview(tdata, Kokkos::ALL(), Kokkos::ALL(), 0);
+  }
+  
+  // passive operands, relative to the first one (a - b + c = a - (b - c))
+  string firstop = cterm.dep_ops[passive[0]];
+  bool flip = (firstop == "minus" || firstop == "divide");
+  for (size_t p=0; p<passive.size(); p++) {
+    int dep = cterm.dep_list[passive[p]];
+    this->compileTerm(block, findex, dep, fn, compiled);
+    int op = FUNC_COPY;
+    if (p > 0) {
+      string pop = cterm.dep_ops[passive[p]];
+      if (flip) {
+        std::map<string,string> inverse = {{"plus","minus"}, {"minus","plus"}, {"times","divide"}, {"divide","times"}};
+        pop = inverse[pop];
       }
+      op = this->getOpCode(pop);
     }
+    fn.program.push_back(FunctionInstruction(op, FUNC_DOUBLE_DOUBLE, findex, tindex, findex, dep));
+  }
+  
+  // active operands, with the combined passive operand where the first one was
+  if (passive[0] == 0) {
+    fn.program.push_back(FunctionInstruction(FUNC_COPY, FUNC_AD_DOUBLE, findex, tindex, findex, tindex));
+  }
+  for (size_t a=0; a<active.size(); a++) {
+    int dep = cterm.dep_list[active[a]];
+    this->compileTerm(block, findex, dep, fn, compiled);
+    int op = this->getOpCode(cterm.dep_ops[active[a]]);
+    fn.program.push_back(FunctionInstruction(op, FUNC_AD_AD, findex, tindex, findex, dep));
+  }
+  if (passive[0] > 0) {
+    int op = this->getOpCode(firstop);
+    fn.program.push_back(FunctionInstruction(op, FUNC_AD_DOUBLE, findex, tindex, findex, tindex));
   }
+  return true;
 }
 
 //////////////////////////////////////////////////////////////////////////////////////
-// Evaluate an operator
+// Append the instructions of a spatially constant term to the uniform program
+// On return, the scalar data (or scalar ddata) of the term holds its value
 //////////////////////////////////////////////////////////////////////////////////////
 
-template<class T1, class T2>
-void FunctionInterface::evaluateOp(T1 data, T2 tdata, const string & op) {
+void FunctionInterface::compileUniformTerm(const size_t & block, const size_t & findex, const size_t & tindex,
+                                           function_class & fn, std::set<string> & compiled) {
+  
+  term & cterm = functions[block][findex].terms[tindex];
+  
+  if (cterm.isRoot) { // the scalar data is already set
+    return;
+  }
+  
+  if (cterm.isFunc) {
+    int funcIndex = cterm.funcIndex;
+    this->compileUniformTerm(block, funcIndex, 0, fn, compiled);
+    cterm.scalar_data = functions[block][funcIndex].terms[0].scalar_data;
+    cterm.scalar_ddata = functions[block][funcIndex].terms[0].scalar_ddata;
+    return;
+  }
+  
+  string key = "uniform " + this->getTermKey(block, findex, tindex);
+  if (compiled.count(key) > 0) {
+    return;
+  }
+  compiled.insert(key);
   
+  bool isAD = cterm.isAD;
+  for (size_t k=0; k<cterm.dep_list.size(); k++) {
+    
+    int dep = cterm.dep_list[k];
+    this->compileUniformTerm(block, findex, dep, fn, compiled);
+    
+    int type = FUNC_DOUBLE_DOUBLE;
+    if (isAD) {
+      if (functions[block][findex].terms[dep].isAD) {
+        type = FUNC_AD_AD;
+      }
+      else {
+        type = FUNC_AD_DOUBLE;
+      }
+    }
+    int op = this->getOpCode(cterm.dep_ops[k]);
+    fn.uniform_program.push_back(FunctionInstruction(op, type, findex, tindex, findex, dep));
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////////////////
+// Op code of an operator
+//////////////////////////////////////////////////////////////////////////////////////
+
+int FunctionInterface::getOpCode(const string & op) {
+  int code = -1;
   if (op == "") {
-    parallel_for(RangePolicy<AssemblyDevice>(0,data.dimension(0)), KOKKOS_LAMBDA (const int e ) {
-      for (int n=0; n<data.dimension(1); n++) {
-        data(e,n) = tdata(e,n);
+    code = FUNC_COPY;
+  }
+  else if (op == "plus") {
+    code = FUNC_PLUS;
+  }
+  else if (op == "minus") {
+    code = FUNC_MINUS;
+  }
+  else if (op == "times") {
+    code = FUNC_TIMES;
+  }
+  else if (op == "divide") {
+    code = FUNC_DIVIDE;
+  }
+  else if (op == "power") {
+    code = FUNC_POWER;
+  }
+  else if (op == "sin") {
+    code = FUNC_SIN;
+  }
+  else if (op == "cos") {
+    code = FUNC_COS;
+  }
+  else if (op == "tan") {
+    code = FUNC_TAN;
+  }
+  else if (op == "exp") {
+    code = FUNC_EXP;
+  }
+  else if (op == "log") {
+    code = FUNC_LOG;
+  }
+  else if (op == "abs") {
+    code = FUNC_ABS;
+  }
+  else if (op == "max") {
+    code = FUNC_MAX;
+  }
+  else if (op == "min") {
+    code = FUNC_MIN;
+  }
+  else if (op == "mean") {
+    code = FUNC_MEAN;
+  }
+  else if (op == "lt") {
+    code = FUNC_LT;
+  }
+  else if (op == "lte") {
+    code = FUNC_LTE;
+  }
+  else if (op == "gt") {
+    code = FUNC_GT;
+  }
+  else if (op == "gte") {
+    code = FUNC_GTE;
+  }
+  TEUCHOS_TEST_FOR_EXCEPTION(code < 0,std::runtime_error,"Error: function manager does not recognize the operator: " + op);
+  return code;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////
+// Evaluate a function (run its program)
+//////////////////////////////////////////////////////////////////////////////////////
+
+void FunctionInterface::evaluateProgram(const size_t & block, const size_t & findex) {
+  
+  if (verbosity > 10) {
+    cout << "------- Evaluating: " << functions[block][findex].function_name << " ("
+         << functions[block][findex].program.size() << " instructions)" << endl;
+  }
+  
+  if (functions[block][findex].kernel != NULL) {
+    size_t numloads = functions[block][findex].kernel_program.size();
+    parallel_for(RangePolicy<AssemblyDevice>(0,functions[block][findex].dim0), KOKKOS_LAMBDA (const int e ) {
+      for (size_t i=0; i<numloads; i++) {
+        const FunctionInstruction & inst = functions[block][findex].kernel_program[i];
+        term & target = functions[block][inst.findex].terms[inst.tindex];
+        if (inst.type == FUNC_AD_AD) {
+          for (int n=0; n<target.data.dimension(1); n++) {
+            target.data(e,n) = target.scalar_data(0);
+          }
+        }
+        else {
+          for (int n=0; n<target.ddata.dimension(1); n++) {
+            target.ddata(e,n) = target.scalar_ddata(0);
+          }
+        }
       }
     });
+    functions[block][findex].kernel(functions[block][findex].kernel_ad_inputs,
+                                    functions[block][findex].kernel_double_inputs,
+                                    functions[block][findex].terms[0].data);
+    return;
   }
-  else if (op == "plus") {
-    parallel_for(RangePolicy<AssemblyDevice>(0,data.dimension(0)), KOKKOS_LAMBDA (const int e ) {
-      for (int n=0; n<data.dimension(1); n++) {
-        data(e,n) += tdata(e,n);
+  
+  // spatially constant terms (once)
+  for (size_t i=0; i<functions[block][findex].uniform_program.size(); i++) {
+    const FunctionInstruction & inst = functions[block][findex].uniform_program[i];
+    term & target = functions[block][inst.findex].terms[inst.tindex];
+    term & source = functions[block][inst.sfindex].terms[inst.stindex];
+    if (inst.type == FUNC_AD_AD) {
+      evaluateScalarOp(target.scalar_data(0), source.scalar_data(0), inst.op);
+    }
+    else if (inst.type == FUNC_AD_DOUBLE) {
+      evaluateScalarOp(target.scalar_data(0), source.scalar_ddata(0), inst.op);
+    }
+    else {
+      evaluateScalarOp(target.scalar_ddata(0), source.scalar_ddata(0), inst.op);
+    }
+  }
+  
+  // The double instructions on contiguous data are applied to all of the points at once,
+  // the rest are applied element by element (in runs of consecutive instructions)
+  size_t numinst = functions[block][findex].program.size();
+  size_t first = 0;
+  while (first < numinst) {
+    const FunctionInstruction & finst = functions[block][findex].program[first];
+    if (this->isContiguousOp(block, findex, finst)) {
+      FDATAd target = functions[block][finst.findex].terms[finst.tindex].ddata;
+      FDATAd source = functions[block][finst.sfindex].terms[finst.stindex].ddata;
+      this->evaluateDoubleOp(target.data(), source.data(), target.dimension(0)*target.dimension(1), finst.op);
+      first++;
+      continue;
+    }
+    size_t last = first+1;
+    while (last < numinst && !this->isContiguousOp(block, findex, functions[block][findex].program[last])) {
+      last++;
+    }
+    parallel_for(RangePolicy<AssemblyDevice>(0,functions[block][findex].dim0), KOKKOS_LAMBDA (const int e ) {
+      for (size_t i=first; i<last; i++) {
+        const FunctionInstruction & inst = functions[block][findex].program[i];
+        term & target = functions[block][inst.findex].terms[inst.tindex];
+        term & source = functions[block][inst.sfindex].terms[inst.stindex];
+        if (inst.op == FUNC_LOAD) {
+          if (inst.type == FUNC_AD_AD) {
+            for (int n=0; n<target.data.dimension(1); n++) {
+              target.data(e,n) = target.scalar_data(0);
+            }
+          }
+          else {
+            for (int n=0; n<target.ddata.dimension(1); n++) {
+              target.ddata(e,n) = target.scalar_ddata(0);
+            }
+          }
+        }
+        else if (inst.type == FUNC_AD_AD) {
+          evaluateOp(target.data, source.data, e, inst.op);
+        }
+        else if (inst.type == FUNC_AD_DOUBLE) {
+          evaluateOp(target.data, source.ddata, e, inst.op);
+        }
+        else {
+          evaluateOp(target.ddata, source.ddata, e, inst.op);
+        }
       }
     });
+    first = last;
   }
-  else if (op == "minus") {
-    parallel_for(RangePolicy<AssemblyDevice>(0,data.dimension(0)), KOKKOS_LAMBDA (const int e ) {
+}
+
+//////////////////////////////////////////////////////////////////////////////////////
+// Evaluate an operator on one element (row)
+//////////////////////////////////////////////////////////////////////////////////////
+
+template<class T1, class T2>
+void FunctionInterface::evaluateOp(T1 & data, T2 & tdata, const int & e, const int & op) {
+  
+  switch (op) {
+    case FUNC_COPY:
+      for (int n=0; n<data.dimension(1); n++) {
+        data(e,n) = tdata(e,n);
+      }
+      break;
+    case FUNC_PLUS:
+      for (int n=0; n<data.dimension(1); n++) {
+        data(e,n) += tdata(e,n);
+      }
+      break;
+    case FUNC_MINUS:
       for (int n=0; n<data.dimension(1); n++) {
         data(e,n) += -tdata(e,n);
       }
-    });
-  }
-  else if (op == "times") {
-    parallel_for(RangePolicy<AssemblyDevice>(0,data.dimension(0)), KOKKOS_LAMBDA (const int e ) {
+      break;
+    case FUNC_TIMES:
       for (int n=0; n<data.dimension(1); n++) {
         data(e,n) *= tdata(e,n);
       }
-    });
-  }
-  else if (op == "divide") {
-    parallel_for(RangePolicy<AssemblyDevice>(0,data.dimension(0)), KOKKOS_LAMBDA (const int e ) {
+      break;
+    case FUNC_DIVIDE:
       for (int n=0; n<data.dimension(1); n++) {
         data(e,n) /= tdata(e,n);
       }
-    });
-  }
-  else if (op == "power") {
-    parallel_for(RangePolicy<AssemblyDevice>(0,data.dimension(0)), KOKKOS_LAMBDA (const int e ) {
+      break;
+    case FUNC_POWER:
       for (int n=0; n<data.dimension(1); n++) {
         data(e,n) = pow(data(e,n),tdata(e,n));
       }
-    });
-  }
-  else if (op == "sin") {
-    parallel_for(RangePolicy<AssemblyDevice>(0,data.dimension(0)), KOKKOS_LAMBDA (const int e ) {
+      break;
+    case FUNC_SIN:
       for (int n=0; n<data.dimension(1); n++) {
         data(e,n) = sin(tdata(e,n));
       }
-    });
-  }
-  else if (op == "cos") {
-    parallel_for(RangePolicy<AssemblyDevice>(0,data.dimension(0)), KOKKOS_LAMBDA (const int e ) {
+      break;
+    case FUNC_COS:
       for (int n=0; n<data.dimension(1); n++) {
         data(e,n) = cos(tdata(e,n));
       }
-    });
-  }
-  else if (op == "tan") {
-    parallel_for(RangePolicy<AssemblyDevice>(0,data.dimension(0)), KOKKOS_LAMBDA (const int e ) {
+      break;
+    case FUNC_TAN:
       for (int n=0; n<data.dimension(1); n++) {
         data(e,n) = tan(tdata(e,n));
       }
-    });
-  }
-  else if (op == "exp") {
-    parallel_for(RangePolicy<AssemblyDevice>(0,data.dimension(0)), KOKKOS_LAMBDA (const int e ) {
+      break;
+    case FUNC_EXP:
       for (int n=0; n<data.dimension(1); n++) {
         data(e,n) = exp(tdata(e,n));
       }
-    });
-  }
-  else if (op == "log") {
-    parallel_for(RangePolicy<AssemblyDevice>(0,data.dimension(0)), KOKKOS_LAMBDA (const int e ) {
+      break;
+    case FUNC_LOG:
       for (int n=0; n<data.dimension(1); n++) {
         data(e,n) = log(tdata(e,n));
       }
-    });
-  }
-  else if (op == "abs") {
-    parallel_for(RangePolicy<AssemblyDevice>(0,data.dimension(0)), KOKKOS_LAMBDA (const int e ) {
+      break;
+    case FUNC_ABS:
       for (int n=0; n<data.dimension(1); n++) {
         if (tdata(e,n) < 0.0) {
           data(e,n) = -tdata(e,n);
@@ -772,48 +1538,41 @@ void FunctionInterface::evaluateOp(T1 data, T2 tdata, const string & op) {
           data(e,n) = tdata(e,n);
         }
       }
-    });
-  }
-  else if (op == "max") { // maximum over rows ... usually corr. to max over element/face at ip
-    parallel_for(RangePolicy<AssemblyDevice>(0,data.dimension(0)), KOKKOS_LAMBDA (const int e ) {
+      break;
+    case FUNC_MAX: // maximum over rows ... usually corr. to max over element/face at ip
       data(e,0) = tdata(e,0);
-      for (int n=0; n<data.dimension(1); n++) {
-        if (tdata(e,n) > tdata(e,0)) {
+      for (int n=1; n<data.dimension(1); n++) {
+        if (tdata(e,n) > data(e,0)) {
           data(e,0) = tdata(e,n);
         }
       }
       for (int n=0; n<data.dimension(1); n++) { // copy max value at all ip
         data(e,n) = data(e,0);
       }
-    });
-  }
-  else if (op == "min") { // minimum over rows ... usually corr. to min over element/face at ip
-    parallel_for(RangePolicy<AssemblyDevice>(0,data.dimension(0)), KOKKOS_LAMBDA (const int e ) {
+      break;
+    case FUNC_MIN: // minimum over rows ... usually corr. to min over element/face at ip
       data(e,0) = tdata(e,0);
-      for (int n=0; n<data.dimension(1); n++) {
-        if (tdata(e,n) < tdata(e,0)) {
+      for (int n=1; n<data.dimension(1); n++) {
+        if (tdata(e,n) < data(e,0)) {
           data(e,0) = tdata(e,n);
         }
       }
       for (int n=0; n<data.dimension(1); n++) { // copy min value at all ip
         data(e,n) = data(e,0);
       }
-    });
-  }
-  else if (op == "mean") { // mean over rows ... usually corr. to mean over element/face
-    double scale = (double)data.dimension(1);
-    parallel_for(RangePolicy<AssemblyDevice>(0,data.dimension(0)), KOKKOS_LAMBDA (const int e ) {
+      break;
+    case FUNC_MEAN: { // mean over rows ... usually corr. to mean over element/face
+      double scale = (double)data.dimension(1);
       data(e,0) = tdata(e,0)/scale;
-      for (int n=0; n<data.dimension(1); n++) {
+      for (int n=1; n<data.dimension(1); n++) {
         data(e,0) += tdata(e,n)/scale;
       }
-      for (int n=0; n<data.dimension(1); n++) { // copy max value at all ip
+      for (int n=0; n<data.dimension(1); n++) { // copy mean value at all ip
         data(e,n) = data(e,0);
       }
-    });
-  }
-  else if (op == "lt") {
-    parallel_for(RangePolicy<AssemblyDevice>(0,data.dimension(0)), KOKKOS_LAMBDA (const int e ) {
+      break;
+    }
+    case FUNC_LT:
       for (int n=0; n<data.dimension(1); n++) {
         if (data(e,n) < tdata(e,n)) {
           data(e,n) = 1.0;
@@ -822,10 +1581,8 @@ void FunctionInterface::evaluateOp(T1 data, T2 tdata, const string & op) {
           data(e,n) = 0.0;
         }
       }
-    });
-  }
-  else if (op == "lte") {
-    parallel_for(RangePolicy<AssemblyDevice>(0,data.dimension(0)), KOKKOS_LAMBDA (const int e ) {
+      break;
+    case FUNC_LTE:
       for (int n=0; n<data.dimension(1); n++) {
         if (data(e,n) <= tdata(e,n)) {
           data(e,n) = 1.0;
@@ -834,10 +1591,8 @@ void FunctionInterface::evaluateOp(T1 data, T2 tdata, const string & op) {
           data(e,n) = 0.0;
         }
       }
-    });
-  }
-  else if (op == "gt") {
-    parallel_for(RangePolicy<AssemblyDevice>(0,data.dimension(0)), KOKKOS_LAMBDA (const int e ) {
+      break;
+    case FUNC_GT:
       for (int n=0; n<data.dimension(1); n++) {
         if (data(e,n) > tdata(e,n)) {
           data(e,n) = 1.0;
@@ -846,10 +1601,8 @@ void FunctionInterface::evaluateOp(T1 data, T2 tdata, const string & op) {
           data(e,n) = 0.0;
         }
       }
-    });
-  }
-  else if (op == "gte") {
-    parallel_for(RangePolicy<AssemblyDevice>(0,data.dimension(0)), KOKKOS_LAMBDA (const int e ) {
+      break;
+    case FUNC_GTE:
       for (int n=0; n<data.dimension(1); n++) {
         if (data(e,n) >= tdata(e,n)) {
           data(e,n) = 1.0;
@@ -858,7 +1611,184 @@ void FunctionInterface::evaluateOp(T1 data, T2 tdata, const string & op) {
           data(e,n) = 0.0;
         }
       }
-    });
+      break;
+  }
+  
+}
+
+//////////////////////////////////////////////////////////////////////////////////////
+// Can an instruction be applied to all of the points at once?
+// (double data stored contiguously with the same shape, and not a reduction over the rows)
+//////////////////////////////////////////////////////////////////////////////////////
+
+bool FunctionInterface::isContiguousOp(const size_t & block, const size_t & findex, const FunctionInstruction & inst) {
+  if (inst.type != FUNC_DOUBLE_DOUBLE || inst.op == FUNC_LOAD || inst.op == FUNC_MAX
+      || inst.op == FUNC_MIN || inst.op == FUNC_MEAN) {
+    return false;
+  }
+  FDATAd data = functions[block][inst.findex].terms[inst.tindex].ddata;
+  FDATAd tdata = functions[block][inst.sfindex].terms[inst.stindex].ddata;
+  return (data.dimension(0) == tdata.dimension(0) && data.dimension(1) == tdata.dimension(1)
+          && data.stride_1() == 1 && data.stride_0() == data.dimension(1)
+          && tdata.stride_1() == 1 && tdata.stride_0() == tdata.dimension(1));
+}
+
+//////////////////////////////////////////////////////////////////////////////////////
+// Evaluate an operator on contiguous double data
+// Same as evaluateOp, but on flat arrays so that the loops can be vectorized
+// (the math functions use the vector versions in libm when the compiler flags allow it,
+// e.g. -O3 -ffast-math with glibc)
+//////////////////////////////////////////////////////////////////////////////////////
+
+void FunctionInterface::evaluateDoubleOp(double * data, const double * tdata, const size_t & size, const int & op) {
+  
+  switch (op) {
+    case FUNC_COPY:
+      for (size_t i=0; i<size; i++) {
+        data[i] = tdata[i];
+      }
+      break;
+    case FUNC_PLUS:
+      for (size_t i=0; i<size; i++) {
+        data[i] += tdata[i];
+      }
+      break;
+    case FUNC_MINUS:
+      for (size_t i=0; i<size; i++) {
+        data[i] += -tdata[i];
+      }
+      break;
+    case FUNC_TIMES:
+      for (size_t i=0; i<size; i++) {
+        data[i] *= tdata[i];
+      }
+      break;
+    case FUNC_DIVIDE:
+      for (size_t i=0; i<size; i++) {
+        data[i] /= tdata[i];
+      }
+      break;
+    case FUNC_POWER:
+      for (size_t i=0; i<size; i++) {
+        data[i] = pow(data[i],tdata[i]);
+      }
+      break;
+    case FUNC_SIN:
+      for (size_t i=0; i<size; i++) {
+        data[i] = sin(tdata[i]);
+      }
+      break;
+    case FUNC_COS:
+      for (size_t i=0; i<size; i++) {
+        data[i] = cos(tdata[i]);
+      }
+      break;
+    case FUNC_TAN:
+      for (size_t i=0; i<size; i++) {
+        data[i] = tan(tdata[i]);
+      }
+      break;
+    case FUNC_EXP:
+      for (size_t i=0; i<size; i++) {
+        data[i] = exp(tdata[i]);
+      }
+      break;
+    case FUNC_LOG:
+      for (size_t i=0; i<size; i++) {
+        data[i] = log(tdata[i]);
+      }
+      break;
+    case FUNC_ABS:
+      for (size_t i=0; i<size; i++) {
+        data[i] = fabs(tdata[i]);
+      }
+      break;
+    case FUNC_LT:
+      for (size_t i=0; i<size; i++) {
+        data[i] = (data[i] < tdata[i]) ? 1.0 : 0.0;
+      }
+      break;
+    case FUNC_LTE:
+      for (size_t i=0; i<size; i++) {
+        data[i] = (data[i] <= tdata[i]) ? 1.0 : 0.0;
+      }
+      break;
+    case FUNC_GT:
+      for (size_t i=0; i<size; i++) {
+        data[i] = (data[i] > tdata[i]) ? 1.0 : 0.0;
+      }
+      break;
+    case FUNC_GTE:
+      for (size_t i=0; i<size; i++) {
+        data[i] = (data[i] >= tdata[i]) ? 1.0 : 0.0;
+      }
+      break;
+  }
+  
+}
+
+//////////////////////////////////////////////////////////////////////////////////////
+// Evaluate an operator on a spatially constant value
+// Same as evaluateOp at one point (the reductions are never spatially constant)
+//////////////////////////////////////////////////////////////////////////////////////
+
+template<class T1, class T2>
+void FunctionInterface::evaluateScalarOp(T1 & val, const T2 & tval, const int & op) {
+  
+  switch (op) {
+    case FUNC_COPY:
+      val = tval;
+      break;
+    case FUNC_PLUS:
+      val += tval;
+      break;
+    case FUNC_MINUS:
+      val += -tval;
+      break;
+    case FUNC_TIMES:
+      val *= tval;
+      break;
+    case FUNC_DIVIDE:
+      val /= tval;
+      break;
+    case FUNC_POWER:
+      val = pow(val,tval);
+      break;
+    case FUNC_SIN:
+      val = sin(tval);
+      break;
+    case FUNC_COS:
+      val = cos(tval);
+      break;
+    case FUNC_TAN:
+      val = tan(tval);
+      break;
+    case FUNC_EXP:
+      val = exp(tval);
+      break;
+    case FUNC_LOG:
+      val = log(tval);
+      break;
+    case FUNC_ABS:
+      if (tval < 0.0) {
+        val = -tval;
+      }
+      else {
+        val = tval;
+      }
+      break;
+    case FUNC_LT:
+      val = (val < tval) ? 1.0 : 0.0;
+      break;
+    case FUNC_LTE:
+      val = (val <= tval) ? 1.0 : 0.0;
+      break;
+    case FUNC_GT:
+      val = (val > tval) ? 1.0 : 0.0;
+      break;
+    case FUNC_GTE:
+      val = (val >= tval) ? 1.0 : 0.0;
+      break;
   }
   
 }
@@ -57,31 +57,119 @@ class FunctionInterface {
   //////////////////////////////////////////////////////////////////////////////////////
   
   void decomposeFunctions();
+  
+  //////////////////////////////////////////////////////////////////////////////////////
+  // Compile the evaluation trees into flat programs (called by decomposeFunctions)
+  //////////////////////////////////////////////////////////////////////////////////////
+  
+  void compileFunctions();
+  
+  void compileTerm(const size_t & block, const size_t & findex, const size_t & tindex,
+                   function_class & fn, std::set<string> & compiled);
+  
+  void compileUniformTerm(const size_t & block, const size_t & findex, const size_t & tindex,
+                          function_class & fn, std::set<string> & compiled);
+  
+  bool compileMixedTerm(const size_t & block, const size_t & findex, const size_t & tindex,
+                        function_class & fn, std::set<string> & compiled);
+  
+  int getOpCode(const string & op);
+  
+  //////////////////////////////////////////////////////////////////////////////////////
+  // Compiled function kernels (see tools/functions_to_cpp.cpp)
+  //////////////////////////////////////////////////////////////////////////////////////
+  
+  void loadKernels(const string & filename);
+  
+  void bindKernel(const size_t & block, const size_t & findex);
+  
+  bool findRootTerm(const size_t & block, const size_t & findex, const string & name,
+                    size_t & rf, size_t & rt);
 
   //////////////////////////////////////////////////////////////////////////////////////
   // Determine if a term is a ScalarT or needs to be an AD type
   //////////////////////////////////////////////////////////////////////////////////////
   
   bool isScalarTerm(const size_t & block, const int & findex, const int & tindex);
+  
+  //////////////////////////////////////////////////////////////////////////////////////
+  // Setup-time optimizations: constant folding, spatially constant terms and
+  // sharing identical terms within a block (called by decomposeFunctions)
+  //////////////////////////////////////////////////////////////////////////////////////
+  
+  void foldConstants(const size_t & block);
+  
+  bool foldTerm(const size_t & block, const size_t & findex, const size_t & tindex);
+  
+  bool isUniformTerm(const size_t & block, const int & findex, const int & tindex);
+  
+  void shareTerms(const size_t & block);
+  
+  string getTermKey(const size_t & block, const size_t & findex, const size_t & tindex);
+  
+  int getDependencies(const size_t & block, const size_t & findex, const size_t & tindex);
+  
+  //////////////////////////////////////////////////////////////////////////////////////
+  // True if any function depends on the coordinates (set by decomposeFunctions)
+  //////////////////////////////////////////////////////////////////////////////////////
+  
+  bool dependsOnGeometry();
     
   //////////////////////////////////////////////////////////////////////////////////////
-  // Evaluate a function (probably will be deprecated)
+  // Get the index of a function (the index returned by addFunction)
+  //////////////////////////////////////////////////////////////////////////////////////
+  
+  int getFunctionIndex(const string & fname, const string & location, const size_t & block);
+  
+  //////////////////////////////////////////////////////////////////////////////////////
+  // Evaluate a function by name (looks up the index on every call)
   //////////////////////////////////////////////////////////////////////////////////////
 
   FDATA evaluate(const string & fname, const string & location, const size_t & block);
   
   //////////////////////////////////////////////////////////////////////////////////////
-  // Evaluate a function
+  // Evaluate a function by index (preferred in the assembly loops)
+  //////////////////////////////////////////////////////////////////////////////////////
+
+  FDATA evaluate(const int & findex, const size_t & block);
+  
+  //////////////////////////////////////////////////////////////////////////////////////
+  // Evaluate a function (run its program)
+  //////////////////////////////////////////////////////////////////////////////////////
+  
+  void evaluateProgram(const size_t & block, const size_t & findex);
+  
+  //////////////////////////////////////////////////////////////////////////////////////
+  // Cached function values (functions that do not depend on the state)
   //////////////////////////////////////////////////////////////////////////////////////
   
-  void evaluate(const size_t & block, const size_t & findex, const size_t & tindex);
+  bool isCached(const size_t & block, const size_t & findex, const FunctionCacheEntry & entry);
+  
+  void storeCache(const size_t & block, const size_t & findex, const std::pair<int,int> & geokey);
+  
+  void clearCache();
 
   //////////////////////////////////////////////////////////////////////////////////////
-  // Evaluate an operator
+  // Evaluate an operator on one element (row)
   //////////////////////////////////////////////////////////////////////////////////////
 
   template<class T1, class T2>
-  void evaluateOp(T1 data, T2 tdata, const string & op);
+  void evaluateOp(T1 & data, T2 & tdata, const int & e, const int & op);
+  
+  //////////////////////////////////////////////////////////////////////////////////////
+  // Evaluate an operator on contiguous double data (all of the elements at once)
+  //////////////////////////////////////////////////////////////////////////////////////
+  
+  void evaluateDoubleOp(double * data, const double * tdata, const size_t & size, const int & op);
+  
+  bool isContiguousOp(const size_t & block, const size_t & findex, const FunctionInstruction & inst);
+  
+  //////////////////////////////////////////////////////////////////////////////////////
+  // Evaluate an operator on a spatially constant value
+  //////////////////////////////////////////////////////////////////////////////////////
+  
+  template<class T1, class T2>
+  void evaluateScalarOp(T1 & val, const T2 & tval, const int & op);
 
   //////////////////////////////////////////////////////////////////////////////////////
   // Print out the function information (mostly for debugging)
@@ -95,8 +183,11 @@ class FunctionInterface {
 
   size_t numBlocks;
   int verbosity;
+  bool cache_functions, combine_passive;
   vector<vector<function_class> > functions;
+  vector<std::map<pair<string,string>,int> > function_index; // (name, location) -> index in functions
   vector<string> known_vars, known_ops, variables, parameters, disc_parameters;
+  vector<FunctionKernel> kernels; // from the function kernel library (if any)
   Teuchos::RCP<workset> wkset;
   Teuchos::RCP<Teuchos::Time> decomposeTimer = Teuchos::TimeMonitor::getNewCounter("MILO::function::decompose");
   Teuchos::RCP<Teuchos::Time> evaluateTimer = Teuchos::TimeMonitor::getNewCounter("MILO::function::evaluate");
@@ -0,0 +1,48 @@
+/***********************************************************************
+ Multiscale/Multiphysics Interfaces for Large-scale Optimization (MILO)
+
+ Copyright 2018 National Technology & Engineering Solutions of Sandia,
+ LLC (NTESS). Under the terms of Contract DE-NA0003525 with NTESS, the
+ U.S. Government retains certain rights in this software.”
+
+ Questions? Contact Tim Wildey (tmwilde@sandia.gov) and/or
+ Bart van Bloemen Waanders (bartv@sandia.gov)
+ ************************************************************************/
+
+#ifndef MILO_FUNCTION_KERNEL_H
+#define MILO_FUNCTION_KERNEL_H
+
+#include "trilinos.hpp"
+#include "preferences.hpp"
+
+// Interface between the FunctionInterface and the compiled function kernels
+// The kernels are generated from an input file by functions_to_cpp (see tools/functions_to_cpp.cpp)
+// and compiled into a shared library with the same MILO headers (the AD type must match).
+
+// A kernel evaluates one function at all of the elements and points.
+// The inputs are the data of the leaves of the expression (in the order of the lists below):
+// the AD inputs are variables and parameters, the double inputs are x, y, z, t, nx, ny, nz.
+// The kernel writes the AD result.
+typedef void (*FunctionKernelPtr)(const vector<FDATA> & ad_inputs, const vector<FDATAd> & double_inputs,
+                                  FDATA result);
+
+struct FunctionKernel {
+  const char * name;                  // function name
+  const char * expression;            // expression it was generated from
+  int num_ad_inputs;
+  const char * const * ad_inputs;
+  int num_double_inputs;
+  const char * const * double_inputs;
+  int num_calls;                      // functions that were inlined
+  const char * const * calls;         // (name, expression) for each call
+  FunctionKernelPtr evaluate;
+};
+
+// Name of the function that the library exports:
+// extern "C" int milo_function_kernels(int * maxderivs, FunctionKernel ** kernels)
+// returns the number of kernels and the maxDerivs the library was compiled with
+typedef int (*FunctionKernelList)(int * maxderivs, FunctionKernel ** kernels);
+
+#define MILO_FUNCTION_KERNELS "milo_function_kernels"
+
+#endif
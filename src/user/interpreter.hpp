@@ -572,3 +572,66 @@ static bool isOperator(vector<term> & terms, size_t & index, vector<string> & op
   return found;
 }
 
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+// Is the operator a reduction over the points of an element (max, min, mean)
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static bool isReduction(const string & op) {
+  return (op == "max" || op == "min" || op == "mean");
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+// Apply an operator to constant values: returns the new value of a (a op b)
+// Used to fold the constant terms, so this needs to match FunctionInterface::evaluateOp
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static double applyConstantOp(const double & a, const double & b, const string & op) {
+  double val = b;
+  if (op == "plus") {
+    val = a + b;
+  }
+  else if (op == "minus") {
+    val = a - b;
+  }
+  else if (op == "times") {
+    val = a*b;
+  }
+  else if (op == "divide") {
+    val = a/b;
+  }
+  else if (op == "power") {
+    val = pow(a,b);
+  }
+  else if (op == "sin") {
+    val = sin(b);
+  }
+  else if (op == "cos") {
+    val = cos(b);
+  }
+  else if (op == "tan") {
+    val = tan(b);
+  }
+  else if (op == "exp") {
+    val = exp(b);
+  }
+  else if (op == "log") {
+    val = log(b);
+  }
+  else if (op == "abs") {
+    val = std::abs(b);
+  }
+  else if (op == "lt") {
+    val = (a < b) ? 1.0 : 0.0;
+  }
+  else if (op == "lte") {
+    val = (a <= b) ? 1.0 : 0.0;
+  }
+  else if (op == "gt") {
+    val = (a > b) ? 1.0 : 0.0;
+  }
+  else if (op == "gte") {
+    val = (a >= b) ? 1.0 : 0.0;
+  }
+  return val;
+}
+
@@ -29,6 +29,7 @@ public:
     isScalar = false;
     //isAD = true;
     isConstant = false;
+    isUniform = false;
     scalarIndex = 0;
     
     expression = expr;
@@ -45,6 +46,7 @@ public:
     cout << "isScalar: " << isScalar << endl;
     cout << "scalarIndex: " << scalarIndex << endl;
     cout << "isConstant: " << isConstant << endl;
+    cout << "isUniform: " << isUniform << endl;
     cout << "isRoot: " << isRoot << endl;
     cout << "isFunc: " << isFunc << endl;
     cout << "beenDecomposed: " << beenDecomposed << endl;
@@ -69,6 +71,7 @@ public:
   
   string expression;
   bool isRoot, beenDecomposed, isFunc, isScalar, isAD, isConstant;
+  bool isUniform; // same value at every point (constants, time, parameters), so it is evaluated once
   int funcIndex, scalarIndex;
   
   FDATA data;
@@ -5124,6 +5124,7 @@ public:
     vector<Kokkos::View<double***,AssemblyDevice> > ef;
     //Teuchos::RCP<workset> wkset;
     wkset->ip = ip;
+    wkset->cellID = -1;
     wkset->time = time;
     int numElem = ip.dimension(0);
     if (physics == "thermal") {